@@ -3,13 +3,36 @@
 
 import os, sys, subprocess
 from distutils.core import setup, Extension
+from distutils.command.build_ext import build_ext
+from distutils.errors import CCompilerError, DistutilsError
+from distutils import log
 
 this_dir = os.path.dirname(os.path.abspath(__file__))
 
 with open(os.path.join(this_dir, "README.rst")) as f:
 	longdescr = f.read()
 
-cmodule = Extension('_sophia', sources=["sophia/pysophia.c"], libraries=["sophia"])
+cmodule = Extension('_sophia', sources=["sophia/pysophia.c"], libraries=["sophia", "z"])
+
+class build_ext_bench(build_ext):
+    """Build the extension, and the native benchmark used by
+    tests/overhead.py, in the temporary build directory (in tests/ with
+    --inplace). It isn't installed, and is skipped if it can't be built."""
+
+    def run(self):
+        build_ext.run(self)
+        output_dir = os.path.join(this_dir, "tests") if self.inplace else self.build_temp
+        try:
+            objects = self.compiler.compile([os.path.join("tests", "bench_native.c")],
+                                            output_dir=self.build_temp,
+                                            include_dirs=self.include_dirs)
+            self.compiler.link_executable(objects, "bench_native", output_dir=output_dir,
+                                          libraries=["sophia"],
+                                          library_dirs=self.library_dirs,
+                                          runtime_library_dirs=self.rpath,
+                                          extra_postargs=os.environ.get("LDFLAGS", "").split())
+        except (CCompilerError, DistutilsError) as e:
+            log.warn("skipping the native benchmark: %s" % e)
 
 setup (
     name = 'Sophia',
@@ -19,6 +42,7 @@ setup (
     author='Michaël Meyer',
     url='https://github.com/doukremt/python-sophia.git',
     ext_modules = [cmodule],
+    cmdclass = {"build_ext": build_ext_bench},
     packages = ["sophia"],
     classifiers=(
         'Intended Audience :: Developers',
@@ -1,15 +1,31 @@
 #!/usr/bin/env python
 
-__all__ = ['Database', 'Error', 'ObjectDatabase', 'SPCMP', 'SPGC', 'SPGCF', 'SPGROW', 'SPGT', 'SPGTE', 'SPLT', 'SPLTE', 'SPMERGE', 'SPMERGEWM', 'SPPAGE', 'ThreadedDatabase', 'ThreadedObjectDatabase']
+__all__ = ['CMP_I32_BE', 'CMP_I32_LE', 'CMP_I64_BE', 'CMP_I64_LE', 'CMP_LENGTH', 'CMP_MEMCMP', 'CMP_REVERSE', 'CMP_STRUCT', 'CMP_U32_BE', 'CMP_U32_LE', 'CMP_U64_BE', 'CMP_U64_LE', 'Database', 'Error', 'ObjectDatabase', 'PSPBLOOM', 'PSPCACHE', 'PSPCMPSTATS', 'PSPCOUNT', 'PSPGROUPCOMMIT', 'PSPKEYCODEC', 'PSPTHREADED', 'PSPVALUECODEC', 'SPCMP', 'SPGC', 'SPGCF', 'SPGROW', 'SPGT', 'SPGTE', 'SPLT', 'SPLTE', 'SPMERGE', 'SPMERGEWM', 'SPPAGE', 'ShardedDatabase', 'ThreadedDatabase', 'ThreadedObjectDatabase']
 
+import sys
 from _sophia import *
-import threading
+from sophia.sharded import ShardedDatabase
+if sys.version_info >= (3, 5):
+    from sophia.aio import AsyncDatabase
+    __all__.append('AsyncDatabase')
 try:
     import cPickle as pickle
 except ImportError:
     import pickle
 
 
+def _codec_function(name, option, pair):
+    # one of the functions of a codec, which is set again with the other one of the pair
+    # when assigned, so that the database uses it
+    def fget(self):
+        return getattr(self, "_" + name)
+    def fset(self, function):
+        functions = [function if other == name else getattr(self, "_" + other) for other in pair]
+        self.setopt(option, tuple(functions))
+        setattr(self, "_" + name, function)
+    return property(fget, fset)
+
+
 class ObjectDatabase(Database):
 
     """Database model for storing arbitrary kinds of objects.
@@ -17,82 +33,51 @@ class ObjectDatabase(Database):
     `pack_key`, `unpack_key`, `pack_value`, and `unpack_value`, should be callables that, when passed
     an object as parameter, return a byte representation of it, suitable for storage. By default, all
     these functions use the :mod:`pickle` module.
-    """
     
-    def __init__(self, pack_key=pickle.dumps, unpack_key=pickle.loads,
-        pack_value=pickle.dumps, unpack_value=pickle.loads):
-        self.pack_key = pack_key
-        self.unpack_key = unpack_key
-        self.pack_value = pack_value
-        self.unpack_value = unpack_value
-        super(ObjectDatabase, self).__init__()
+    Alternatively, `key_codec` and `value_codec` can name one of the native codecs ("tuple", "msgpack",
+    or "struct", in which case a pair ("struct", format) is expected). Objects are then converted in C.
     
-    def get(self, key, default=None):
-        value = super(ObjectDatabase, self).get(self.pack_key(key), default)
-        return default if value is default else self.unpack_value(value)
+    Assigning one of the four functions afterwards sets the codec again, in place of a native one.
+    """
     
-    def set(self, key, value):
-        return super(ObjectDatabase, self).set(self.pack_key(key), self.pack_value(value))
+    pack_key = _codec_function("pack_key", PSPKEYCODEC, ("pack_key", "unpack_key"))
+    unpack_key = _codec_function("unpack_key", PSPKEYCODEC, ("pack_key", "unpack_key"))
+    pack_value = _codec_function("pack_value", PSPVALUECODEC, ("pack_value", "unpack_value"))
+    unpack_value = _codec_function("unpack_value", PSPVALUECODEC, ("pack_value", "unpack_value"))
     
-    def delete(self, key):
-        return super(ObjectDatabase, self).delete(self.pack_key(key))
+    def __init__(self, pack_key=pickle.dumps, unpack_key=pickle.loads,
+        pack_value=pickle.dumps, unpack_value=pickle.loads, key_codec=None, value_codec=None):
+        self._pack_key = pack_key
+        self._unpack_key = unpack_key
+        self._pack_value = pack_value
+        self._unpack_value = unpack_value
+        super(ObjectDatabase, self).__init__()
+        self.setopt(PSPKEYCODEC, *_codec_args(key_codec, pack_key, unpack_key))
+        self.setopt(PSPVALUECODEC, *_codec_args(value_codec, pack_value, unpack_value))
 
-    def iterkeys(self, start_key=None, order=SPGTE):
-        begin = start_key if start_key is None else self.pack_key(start_key)
-        return (self.unpack_key(k) for k in super(ObjectDatabase, self).iterkeys(begin, order))
-    
-    def itervalues(self, start_key=None, order=SPGTE):
-        begin = start_key if start_key is None else self.pack_key(start_key)
-        return (self.unpack_value(v) for v in super(ObjectDatabase, self).itervalues(begin, order))
-    
-    def iteritems(self, start_key=None, order=SPGTE):
-        begin = start_key if start_key is None else self.pack_key(start_key)
-        return ((self.unpack_key(k), self.unpack_value(v)) \
-            for k, v in super(ObjectDatabase, self).iteritems(begin, order))
+
+def _codec_args(codec, pack, unpack):
+    if codec is None:
+        return ((pack, unpack),)
+    if isinstance(codec, tuple) and codec and not callable(codec[0]):
+        return codec
+    return (codec,)
 
 
 class ThreadedDatabase(Database):
 
     """Thread-safe database model.
     
-    It should only be used if you want to use a database in a threaded environment
-    AND need to iterate over it. Otherwise, the vanilla :class:`Database` class is suitable
-    (and more efficient).
+    Its cursors release the database between chunks of records, so that other threads
+    can write to it while they are in use (see the option :const:`PSPTHREADED`). It should
+    only be used if you want to use a database in a threaded environment AND need to
+    iterate over it. Otherwise, the vanilla :class:`Database` class is suitable (and
+    more efficient).
     """
 
     def __init__(self):
-        self._lock = threading.RLock()
         super(ThreadedDatabase, self).__init__()
-    
-    def _protect(self, method, *args, **kwargs):
-        self._lock.acquire()
-        try:
-            method(*args, **kwargs)
-        finally:
-            self._lock.release()
-    
-    def _protect_iter(self, method, *args, **kwargs):
-        self._lock.acquire()
-        try:
-            for something in method(*args, **kwargs):
-                yield something
-        finally:
-            self._lock.release()
-    
-    def set(self, *args):
-        return self._protect(super(ThreadedDatabase, self).set, *args)
-    
-    def delete(self, *args):
-        return self._protect(super(ThreadedDatabase, self).delete, *args)
-
-    def iterkeys(self, **kwargs):
-        return self._protect_iter(super(ThreadedDatabase, self).iterkeys, **kwargs)
-    
-    def itervalues(self, **kwargs):
-        return self._protect_iter(super(ThreadedDatabase, self).itervalues, **kwargs)
-    
-    def iteritems(self, **kwargs):
-        return self._protect_iter(super(ThreadedDatabase, self).iteritems, **kwargs)
+        self.setopt(PSPTHREADED, True)
 
 
 class ThreadedObjectDatabase(ObjectDatabase, ThreadedDatabase):
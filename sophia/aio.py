@@ -0,0 +1,164 @@
+"""asyncio interface to a database.
+
+The operations of an :class:`AsyncDatabase` are run by a pool of native
+threads, which call libsophia without the GIL, and return awaitable futures.
+The event loop is woken up through a pipe when requests complete, and sets
+the results of all the futures completed meanwhile at once.
+"""
+
+__all__ = ['AsyncDatabase', 'AsyncCursor']
+
+import asyncio, collections
+from _sophia import Database, PSPTHREADED, SPGTE
+
+
+def _running_loop():
+    try:
+        return asyncio.get_running_loop()
+    except AttributeError:  # python < 3.7
+        return asyncio.get_event_loop()
+
+
+class AsyncDatabase(object):
+
+    """asyncio wrapper around a database.
+
+    `db` is the :class:`Database` (or :class:`ObjectDatabase`) object wrapped, a new
+    :class:`Database` by default. Its cursors release it between chunks of records
+    (see :const:`PSPTHREADED`), so that it can be written to while they are in use.
+    `threads` is the number of worker threads, started when the database is opened,
+    which must happen in the event loop the database is used from, unless `loop` is given.
+    """
+
+    def __init__(self, db=None, threads=4, loop=None):
+        self.db = Database() if db is None else db
+        self.db.setopt(PSPTHREADED, True)
+        self.threads = threads
+        self._loop = loop
+        self._fd = None
+
+    def setopt(self, *args):
+        return self.db.setopt(*args)
+
+    def open(self, path):
+        rv = self.db.open(path)
+        if self._fd is None:
+            if self._loop is None:
+                self._loop = _running_loop()
+            self._fd = self.db._async_start(self.threads)
+            self._loop.add_reader(self._fd, self._complete)
+        return rv
+
+    def close(self):
+        """Close the database, and stop the workers. The requests which
+        were still waiting for a worker fail."""
+        rv = self.db.close()
+        if self._fd is not None:
+            self._loop.remove_reader(self._fd)
+            self._fd = None
+            self.db._async_stop()
+            self._complete()
+        return rv
+
+    def is_closed(self):
+        return self.db.is_closed()
+
+    def _complete(self):
+        for future, ok, result in self.db._async_completions():
+            if future.cancelled():
+                continue
+            if ok:
+                future.set_result(result)
+            else:
+                future.set_exception(result)
+
+    def _submit(self, op, *args):
+        future = self._loop.create_future()
+        done = self.db._submit(op, future, *args)
+        if done is not None:
+            future.set_result(done[0])
+        return future
+
+    def get(self, key, default=None):
+        return self._submit("get", key, default)
+
+    def contains(self, key):
+        return self._submit("contains", key)
+
+    def set(self, key, value):
+        return self._submit("set", key, value)
+
+    def delete(self, key):
+        return self._submit("delete", key)
+
+    def begin(self):
+        return self._submit("begin")
+
+    def commit(self):
+        return self._submit("commit")
+
+    def rollback(self):
+        return self._submit("rollback")
+
+    async def get_many(self, keys, default=None, as_dict=False):
+        keys = list(keys)
+        values = await asyncio.gather(*[self.get(key, default) for key in keys])
+        if as_dict:
+            return dict(zip(keys, values))
+        return list(values)
+
+    def iterkeys(self, start_key=None, order=SPGTE, batch=1, end_key=None, end_inclusive=True,
+                 prefix=None, limit=-1, key_decoder=None, value_decoder=None, snapshot=False, *, chunk=256):
+        """Same as :meth:`Database.iterkeys()`, the records being fetched `chunk` at a time."""
+        return AsyncCursor(self, self.db.iterkeys(start_key, order, batch, end_key, end_inclusive, prefix,
+                                                  limit, key_decoder, value_decoder, snapshot), chunk)
+
+    def itervalues(self, start_key=None, order=SPGTE, batch=1, end_key=None, end_inclusive=True,
+                   prefix=None, limit=-1, key_decoder=None, value_decoder=None, snapshot=False, *, chunk=256):
+        return AsyncCursor(self, self.db.itervalues(start_key, order, batch, end_key, end_inclusive, prefix,
+                                                    limit, key_decoder, value_decoder, snapshot), chunk)
+
+    def iteritems(self, start_key=None, order=SPGTE, batch=1, end_key=None, end_inclusive=True,
+                  prefix=None, limit=-1, key_decoder=None, value_decoder=None, snapshot=False, *, chunk=256):
+        return AsyncCursor(self, self.db.iteritems(start_key, order, batch, end_key, end_inclusive, prefix,
+                                                   limit, key_decoder, value_decoder, snapshot), chunk)
+
+
+class AsyncCursor(object):
+
+    """Asynchronous iterator over a cursor, whose records are fetched by the
+    workers, `chunk` at a time."""
+
+    def __init__(self, adb, cursor, chunk):
+        self._adb = adb
+        self._cursor = cursor
+        self._chunk = chunk
+        self._records = collections.deque()
+        self._last = None
+
+    def fetchmany(self, n):
+        """Return a future of a list of up to `n` records, which is only
+        shorter than that once the cursor is exhausted. A cursor fetches
+        one chunk at a time, so concurrent calls are run one after the
+        other, in the order they were made."""
+        if self._last is None or self._last.done():
+            self._last = self._adb._submit("fetch", self._cursor, n)
+        else:
+            self._last = self._adb._loop.create_task(self._fetch_after(self._last, n))
+        return self._last
+
+    async def _fetch_after(self, previous, n):
+        await asyncio.wait([previous])
+        return await self._adb._submit("fetch", self._cursor, n)
+
+    def __aiter__(self):
+        return self
+
+    async def __anext__(self):
+        if not self._records:
+            if self._cursor is not None:
+                self._records.extend(await self.fetchmany(self._chunk))
+            if not self._records:
+                self._cursor = None
+                raise StopAsyncIteration
+        return self._records.popleft()
@@ -0,0 +1,12 @@
+"""Order-preserving encoding of tuples into keys.
+
+Tuples of None, booleans, integers, floats, byte strings and unicode strings
+are encoded into byte strings which sort in the same order as the tuples
+themselves, with the default comparison function. Keys made of several
+columns can then be stored and scanned by ranges without a custom comparison
+function.
+"""
+
+__all__ = ['pack', 'unpack', 'range']
+
+from _sophia import _keys_pack as pack, _keys_unpack as unpack, _keys_range as range
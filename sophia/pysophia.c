@@ -4,6 +4,16 @@ extern "C" {
 
 #include <sophia.h>
 #include <Python.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <stddef.h>
+#include <math.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
 
 #ifdef PSP_DEBUG
     #undef NDEBUG /* Python define NDEBUG per default */
@@ -14,6 +24,231 @@ extern "C" {
     #define PyBytes_AsStringAndSize   PyString_AsStringAndSize
 #endif
 
+/* A chained hash table of byte strings, used to keep track of records on the
+ * C side of the binding. It isn't thread-safe by itself.
+ */
+typedef struct SophiaEntry {
+    struct SophiaEntry *next;  /* next entry in the same bucket */
+    size_t hash;
+    int flags;                 /* for use by the owner of the table */
+    size_t ksize;
+    char key[];
+} SophiaEntry;
+
+typedef struct {
+    SophiaEntry **buckets;
+    size_t nbuckets;           /* always a power of 2, or 0 */
+    size_t count;
+} SophiaTable;
+
+/* FNV-1a */
+static inline uint64_t
+sophia_hash64(const char *key, size_t ksize)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    
+    while (ksize--) {
+        hash ^= (unsigned char)*key++;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static inline size_t
+sophia_hash(const char *key, size_t ksize)
+{
+    return (size_t)sophia_hash64(key, ksize);
+}
+
+static SophiaEntry *
+sophia_table_find(SophiaTable *table, const char *key, size_t ksize, size_t hash)
+{
+    SophiaEntry *entry;
+    
+    if (!table->nbuckets)
+        return NULL;
+    for (entry = table->buckets[hash & (table->nbuckets - 1)]; entry; entry = entry->next) {
+        if (entry->hash == hash && entry->ksize == ksize && memcmp(entry->key, key, ksize) == 0)
+            return entry;
+    }
+    return NULL;
+}
+
+/* Add a key which isn't in the table yet. Return the new entry, or NULL if
+ * memory is exhausted. `extra` bytes are allocated after the key, for use by
+ * the owner of the table.
+ */
+static SophiaEntry *
+sophia_table_add(SophiaTable *table, const char *key, size_t ksize, size_t hash, size_t extra)
+{
+    SophiaEntry *entry, **bucket;
+    
+    if (table->count >= table->nbuckets) {
+        size_t i, size = table->nbuckets ? table->nbuckets * 2 : 64;
+        SophiaEntry **buckets = calloc(size, sizeof(SophiaEntry *));
+        
+        if (!buckets)
+            return NULL;
+        for (i = 0; i < table->nbuckets; i++) {
+            while ((entry = table->buckets[i])) {
+                table->buckets[i] = entry->next;
+                entry->next = buckets[entry->hash & (size - 1)];
+                buckets[entry->hash & (size - 1)] = entry;
+            }
+        }
+        free(table->buckets);
+        table->buckets = buckets;
+        table->nbuckets = size;
+    }
+    
+    if (!(entry = malloc(sizeof(SophiaEntry) + ksize + extra)))
+        return NULL;
+    entry->hash = hash;
+    entry->flags = 0;
+    entry->ksize = ksize;
+    memcpy(entry->key, key, ksize);
+    
+    bucket = &table->buckets[hash & (table->nbuckets - 1)];
+    entry->next = *bucket;
+    *bucket = entry;
+    table->count++;
+    return entry;
+}
+
+static void
+sophia_table_remove(SophiaTable *table, SophiaEntry *entry)
+{
+    SophiaEntry **p = &table->buckets[entry->hash & (table->nbuckets - 1)];
+    
+    while (*p != entry)
+        p = &(*p)->next;
+    *p = entry->next;
+    free(entry);
+    table->count--;
+}
+
+/* Remove all the entries of the table, calling `fun` on each of them first,
+ * if given.
+ */
+static void
+sophia_table_clear(SophiaTable *table, void (*fun)(SophiaEntry *, void *), void *arg)
+{
+    size_t i;
+    SophiaEntry *entry;
+    
+    for (i = 0; i < table->nbuckets && table->count > 0; i++) {
+        while ((entry = table->buckets[i])) {
+            table->buckets[i] = entry->next;
+            if (fun)
+                fun(entry, arg);
+            free(entry);
+            table->count--;
+        }
+    }
+}
+
+static void
+sophia_table_free(SophiaTable *table)
+{
+    sophia_table_clear(table, NULL, NULL);
+    free(table->buckets);
+    table->buckets = NULL;
+    table->nbuckets = 0;
+}
+
+/* A write of a record (or its deletion, if `value` is NULL) waiting to be
+ * committed along with concurrent ones, in group commit mode. It lives on the
+ * stack of the writer, which is blocked until `done` is set.
+ */
+typedef struct SophiaPending {
+    struct SophiaPending *next;
+    const char *key;
+    size_t ksize;
+    const char *value;
+    size_t vsize;
+    int done;
+    int rv;                /* result of the write, and its error message */
+    char *err;
+} SophiaPending;
+
+/* A Bloom filter of the keys of a database */
+typedef struct {
+    uint64_t nbits;
+    uint32_t nhashes;
+    unsigned char *bits;   /* NULL if there is no filter */
+} SophiaBloom;
+
+/* Operations whose latency is measured, see `Database.stats()` */
+enum {
+    PSP_OP_GET, PSP_OP_SET, PSP_OP_DELETE, PSP_OP_CONTAINS, PSP_OP_BEGIN,
+    PSP_OP_COMMIT, PSP_OP_ROLLBACK, PSP_OP_CURSOR, PSP_OP_FETCH, PSP_NOPS
+};
+
+#define PSP_HIST_BUCKETS 40  /* bucket i counts latencies in [2^i, 2^(i+1)) ns */
+
+typedef struct {
+    uint64_t calls;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[PSP_HIST_BUCKETS];
+} SophiaHistogram;
+
+#define PSP_ERRMAX 256     /* maximum length of a copied error message */
+
+/* Outcome of fetching a chunk of records into the buffer of a cursor */
+typedef struct {
+    Py_ssize_t fetched;    /* number of records fetched */
+    int end;               /* 1 if the cursor is exhausted, 0 otherwise */
+    int status;            /* 0, or -1 if the cursor failed, -2 if memory is
+                            * lacking, -3 if `err` is set */
+    size_t bytes;          /* size of the keys and values fetched */
+    char err[PSP_ERRMAX];
+} SophiaFill;
+
+/* Operations run by the worker pool of `AsyncDatabase` */
+enum {
+    PSP_REQ_GET, PSP_REQ_CONTAINS, PSP_REQ_SET, PSP_REQ_DELETE, PSP_REQ_BEGIN,
+    PSP_REQ_COMMIT, PSP_REQ_ROLLBACK, PSP_REQ_FETCH
+};
+
+/* A request submitted to the worker pool. The key and the value to write
+ * are stored after the structure. The Python objects are only touched with
+ * the GIL held, on submission and on completion.
+ */
+typedef struct SophiaRequest {
+    struct SophiaRequest *next;
+    int op;
+    PyObject *token;       /* returned along with the result, owned */
+    PyObject *arg;         /* default value of a get, or cursor of a fetch */
+    Py_ssize_t n;          /* number of records to fetch */
+    char *key;
+    size_t ksize;
+    char *value;
+    size_t vsize;
+    void *result;          /* value read, allocated by libsophia */
+    size_t rsize;
+    size_t epoch;          /* cache epoch when a get was submitted */
+    uint64_t start;
+    int rv;
+    SophiaFill fill;       /* outcome of a fetch, or error message in `err` */
+} SophiaRequest;
+
+/* Kinds of codecs converting keys or values from and to Python objects */
+enum {
+    PSP_CODEC_RAW,         /* objects supporting the buffer protocol, as is */
+    PSP_CODEC_CALL,        /* python callables */
+    PSP_CODEC_TUPLE,       /* order-preserving tuples (see `sophia.keys`) */
+    PSP_CODEC_MSGPACK,     /* msgpack */
+    PSP_CODEC_STRUCT,      /* fixed records described by a struct format */
+};
+
+typedef struct {
+    int kind;
+    PyObject *pack;        /* callables, for PSP_CODEC_CALL */
+    PyObject *unpack;
+    struct SophiaKeyFormat *format; /* record layout, for PSP_CODEC_STRUCT */
+} SophiaCodec;
+
 typedef struct {
     PyObject_HEAD
     void *db;              /* pointer to the sophia database object */
@@ -21,17 +256,275 @@ typedef struct {
     size_t cursors;        /* number of cursors currently in use */
     char close_me;         /* 1 if the database should be closed after the last
                             * alive cursor is destroyed, 0 otherwise */
+    char in_txn;           /* 1 if a transaction is active, 0 otherwise */
     PyObject *cmp_fun;     /* pointer to the python custom comparison function */
+    PyObject *cmp_error;   /* first exception it raised, with its value and */
+    PyObject *cmp_error_value; /* traceback, until an operation raises it */
+    PyObject *cmp_error_tb;
+    spcmpf cmp_native;     /* native comparison function, or NULL */
+    struct SophiaKeyFormat *cmp_format; /* layout of the keys for CMP_STRUCT */
+    pthread_mutex_t lock;  /* serializes the accesses to the sophia handles */
+    char *path;            /* path of the database directory, once opened */
+    char counting;         /* 1 if the records are counted, 0 otherwise */
+    size_t records;        /* number of records in the database, if counted */
+    SophiaTable txn_keys;  /* keys written by the current transaction, and
+                            * whether they existed before, if counted */
+    SophiaCodec key_codec; /* conversion of the keys and values */
+    SophiaCodec value_codec;
+    char threaded;         /* 1 if the cursors release the database between
+                            * chunks of records, 0 otherwise */
+    size_t snapshots;      /* number of snapshot cursors currently in use */
+    SophiaTable overlay;   /* writes buffered while snapshot cursors are in
+                            * use, with the values stored after the keys */
+    double group_latency;  /* how long a write waits for others to be
+                            * committed with, in seconds, or 0 */
+    size_t group_max;      /* maximum number of writes committed together */
+    pthread_mutex_t group_lock; /* protects the queue of pending writes */
+    pthread_cond_t group_cond;
+    SophiaPending *group_head; /* writes waiting for the next commit */
+    SophiaPending **group_tail;
+    size_t group_size;
+    char group_leader;     /* 1 if a writer is collecting the next batch */
+    size_t group_commits;  /* batches committed, and writes they held */
+    size_t group_writes;
+    size_t cache_budget;   /* maximum size of the read cache, or 0 */
+    size_t cache_bytes;    /* size of the records in the read cache */
+    SophiaTable cache;     /* cached values, only accessed with the GIL held */
+    SophiaEntry **cache_ring; /* entries of the cache, in CLOCK order */
+    size_t cache_ring_size;
+    size_t cache_hand;     /* next entry considered for eviction */
+    size_t cache_epoch;    /* incremented by each write */
+    size_t cache_hits;
+    size_t cache_misses;
+    size_t cache_evictions;
+    size_t bloom_keys;     /* number of keys the Bloom filter is sized for,
+                            * or 0 if there is no filter */
+    double bloom_rate;     /* target rate of false positives */
+    SophiaBloom bloom;     /* the filter, only accessed with the GIL held */
+    size_t bloom_rejects;  /* lookups rejected by the filter */
+    size_t bloom_false_positives; /* lookups of absent keys it let through */
+    SophiaHistogram latencies[PSP_NOPS]; /* statistics, updated with the GIL held */
+    uint64_t bytes_read;   /* keys and values read from libsophia */
+    uint64_t bytes_written; /* keys and values given to libsophia */
+    size_t deferred_closes; /* closings delayed by cursors in use */
+    size_t txn_writes;     /* writes of the current transaction */
+    char cmp_stats;        /* 1 if the comparisons of libsophia are counted */
+    uint64_t comparisons;  /* comparisons of libsophia, and their estimated
+                            * time, updated atomically */
+    uint64_t comparison_ns;
+    pthread_t *pool;       /* worker threads of `AsyncDatabase`, or NULL */
+    size_t pool_size;
+    pthread_mutex_t pool_lock; /* protects the queues of requests */
+    pthread_cond_t pool_cond;
+    SophiaRequest *pool_head; /* requests waiting for a worker */
+    SophiaRequest **pool_tail;
+    SophiaRequest *pool_done; /* requests run, most recent first */
+    char pool_stop;        /* 1 if the workers should exit */
+    int pool_fd[2];        /* pipe written to when requests are done */
 } SophiaDB;
 
+/* Options handled by the binding itself, rather than by libsophia */
+enum {
+    PSPCOUNT = 0x100,      /* maintain a counter of the records */
+    PSPKEYCODEC,           /* codec of the keys */
+    PSPVALUECODEC,         /* codec of the values */
+    PSPTHREADED,           /* let other threads write while cursors are used */
+    PSPGROUPCOMMIT,        /* commit concurrent writes together */
+    PSPCACHE,              /* size of the read cache, in bytes */
+    PSPBLOOM,              /* keep a Bloom filter of the keys */
+    PSPCMPSTATS,           /* count the comparisons of libsophia */
+};
+
+/* A value of the read cache, stored after the key of its entry, whose flags
+ * are the reference bit of the CLOCK algorithm.
+ */
+typedef struct {
+    PyObject *value;       /* bytes object */
+    size_t slot;           /* position of the entry in `SophiaDB.cache_ring` */
+} SophiaCached;
+
+/* Native comparison functions, selected with `setopt(SPCMP, constant)` */
+enum {
+    CMP_MEMCMP,            /* the default one */
+    CMP_REVERSE,           /* reverse lexicographical order */
+    CMP_LENGTH,            /* length, then lexicographical order */
+    CMP_U32_BE,            /* fixed-size integers, signed or not, big or */
+    CMP_U32_LE,            /* little-endian */
+    CMP_I32_BE,
+    CMP_I32_LE,
+    CMP_U64_BE,
+    CMP_U64_LE,
+    CMP_I64_BE,
+    CMP_I64_LE,
+    CMP_STRUCT,            /* fields described by a struct format */
+};
+
+/* A field of the keys compared by CMP_STRUCT */
+typedef struct {
+    char code;             /* struct format character */
+    size_t size;
+} SophiaField;
+
+typedef struct SophiaKeyFormat {
+    int little;            /* 1 if the numbers are little-endian */
+    size_t nfields;
+    SophiaField fields[];
+} SophiaKeyFormat;
+
+/* Flags of the entries of `SophiaDB.txn_keys` and `SophiaDB.overlay` */
+#define PSP_EXISTED 1      /* the record existed before the transaction */
+#define PSP_PRESENT 2      /* the record exists in the transaction, or isn't
+                            * deleted by the buffered write */
+
+#define PSP_COUNT_FILE "pysophia.count"  /* where the counter is saved */
+#define PSP_BLOOM_FILE "pysophia.bloom"  /* where the Bloom filter is saved */
+#define PSP_BLOOM_MAGIC "PSPBLOOM1"
+#define PSP_CMP_SAMPLE 16  /* one comparison in PSP_CMP_SAMPLE is timed */
+#define PSP_CMP_FAILED 2   /* returned by a failed python comparison function */
+
+/* Kinds of objects yielded by a cursor */
+enum { PSP_KEYS, PSP_VALUES, PSP_ITEMS };
+
 typedef struct {
     PyObject_HEAD
     SophiaDB *db;          /* pointer to the database attached to this cursor */
     void *cursor;          /* pointer to the sophia cursor object */
+    int kind;              /* what the cursor yields: keys, values or items */
+    Py_ssize_t batch;      /* number of records fetched at once when iterating */
+    char *buf;             /* records fetched ahead, stored one after the other
+                            * as (key size, value size, key, value) */
+    size_t bufsize;        /* allocated size of the buffer */
+    size_t buflen;         /* number of bytes used in the buffer */
+    size_t bufpos;         /* offset of the next record in the buffer */
+    size_t nbuf;           /* number of records left in the buffer */
+    int reverse;           /* 1 if iterating in decreasing order, 0 otherwise */
+    PyObject *end;         /* key at which to stop iterating, or NULL */
+    int end_inclusive;     /* 1 if the end key should be yielded, 0 otherwise */
+    PyObject *prefix;      /* prefix of all the keys yielded, or NULL */
+    Py_ssize_t limit;      /* number of records left to yield, or -1 */
+    SophiaCodec key_codec; /* copies of the codecs of the database */
+    SophiaCodec value_codec;
+    int detach;            /* 1 if the sophia cursor is only opened while a
+                            * chunk of records is fetched, 0 otherwise */
+    int snapshot;          /* 1 if the writes are buffered while this cursor
+                            * is in use, 0 otherwise */
+    int order;             /* order in which to reopen the sophia cursor ... */
+    char *resume;          /* ... and key at which to reopen it, or NULL */
+    size_t rsize;
+    int fetching;          /* 1 while a worker of the pool fills the buffer */
 } SophiaCursor;
 
+/* A k-way merge of the cursors over the shards of a `ShardedDatabase`. The
+ * cursors, which yield items, are consumed through their buffers, and a binary
+ * heap orders those with records left on the raw key of their next record.
+ */
+typedef struct {
+    PyObject_HEAD
+    PyObject *cursors;     /* tuple of the cursors merged */
+    SophiaDB *db;          /* database whose comparison function is used */
+    Py_ssize_t *heap;      /* indexes of the cursors with records left */
+    Py_ssize_t nheap;
+    int kind;              /* what is yielded: keys, values or items */
+    int reverse;           /* 1 if the cursors iterate in decreasing order */
+    int started;           /* 1 once the cursors have been filled */
+} SophiaMerge;
+
+#define PSP_MERGE_BATCH 256        /* minimum number of records fetched at once
+                                    * by each cursor merged */
+
+/* What the workers of a parallel scan do with the records */
+enum {
+    PSP_SCAN_CHUNKS,       /* hand them over, by chunks (`parallel_scan()`) */
+    PSP_SCAN_STATS,        /* count them (`scan_stats()`) */
+    PSP_SCAN_EXPORT,       /* write them to a file (`export()`) */
+};
+
+/* Records fetched by a worker of a parallel scan, stored as in the buffer of
+ * a cursor
+ */
+typedef struct SophiaChunk {
+    struct SophiaChunk *next;
+    size_t n;              /* number of records */
+    size_t len;            /* size of the records */
+    size_t size;           /* allocated size */
+    char data[];
+} SophiaChunk;
+
+/* A range of keys, scanned by a worker thread */
+typedef struct {
+    pthread_t thread;
+    int running;           /* 1 if the thread has been started, and not joined */
+    struct SophiaScan *scan;
+    char *start;           /* first key of the range, or NULL */
+    size_t ssize;
+    char *end;             /* key at which the range ends, excluded, or NULL */
+    size_t esize;
+    char *resume;          /* key of the last record fetched, or NULL */
+    size_t rsize;
+    SophiaChunk *head;     /* chunks fetched, not consumed yet */
+    SophiaChunk **tail;
+    size_t queued;
+    int done;              /* 1 once the range is scanned, or the scan failed */
+    int failed;
+    char err[PSP_ERRMAX];
+    uint64_t records;      /* records matched, and their size */
+    uint64_t key_bytes;
+    uint64_t value_bytes;
+    FILE *out;             /* file the records are exported to */
+} SophiaScanPart;
+
+typedef struct SophiaScan {
+    PyObject_HEAD
+    SophiaDB *db;
+    int mode;
+    size_t chunk;          /* number of records fetched per locked section */
+    char *prefix;          /* prefix of the keys matched, or NULL */
+    size_t psize;
+    char *contains;        /* substring of the values matched, or NULL */
+    size_t csize;
+    SophiaCodec key_codec; /* copies of the codecs of the database */
+    SophiaCodec value_codec;
+    Py_ssize_t nparts;
+    SophiaScanPart *parts;
+    pthread_mutex_t lock;  /* protects the queues of chunks, and `stop` */
+    pthread_cond_t cond;
+    int stop;
+} SophiaScan;
+
+/* Iterator over the records of a range of a parallel scan */
+typedef struct {
+    PyObject_HEAD
+    SophiaScan *scan;
+    SophiaScanPart *part;
+    SophiaChunk *chunk;    /* chunk being consumed */
+    size_t pos;            /* offset of the next record in it */
+    size_t left;           /* number of records left in it */
+} SophiaScanIter;
+
+#define PSP_SCAN_CHUNK 1000        /* default number of records fetched at once
+                                    * by the workers of a parallel scan ... */
+#define PSP_SCAN_AHEAD 2           /* ... and number of chunks they fetch ahead */
+#define PSP_SCAN_SAMPLES 64        /* keys sampled per range to split the keys */
+#define PSP_SCAN_MAXPARTS 256      /* maximum number of ranges (and threads) */
+
+/* A value fetched by `get_buffer()`. It owns the memory allocated by libsophia
+ * for the value, and exposes it through the buffer protocol.
+ */
+typedef struct {
+    PyObject_HEAD
+    void *data;
+    Py_ssize_t size;
+} SophiaBuffer;
+
 static PyObject *SophiaError;
 
+#define PSP_CHUNK 10000    /* default number of records per bulk transaction */
+#define PSP_CHUNK_BYTES (16 << 20) /* ... and default size of their data */
+#define PSP_DETACHED_BATCH 256     /* minimum number of records fetched at once
+                                    * by the cursors of a threaded database */
+#define PSP_GROUP_MAX 1000         /* default number of writes committed together */
+#define PSP_MAX_RUNS 64    /* maximum number of runs merged by `load()` */
+
 static PyObject * sophia_db_new(PyTypeObject *, PyObject *, PyObject *);
 static void sophia_db_dealloc(SophiaDB *);
 static int sophia_db_init(SophiaDB *);
@@ -41,8 +534,14 @@ static PyObject * sophia_db_close(SophiaDB *);
 static PyObject * sophia_db_is_closed(SophiaDB *);
 static PyObject * sophia_db_set(SophiaDB *, PyObject *);
 static PyObject * sophia_db_get(SophiaDB *, PyObject *);
+static PyObject * sophia_db_get_many(SophiaDB *, PyObject *, PyObject *);
+static PyObject * sophia_db_get_buffer(SophiaDB *, PyObject *);
 static PyObject * sophia_db_contains(SophiaDB *, PyObject *);
 static PyObject * sophia_db_delete(SophiaDB *, PyObject *);
+static PyObject * sophia_db_set_many(SophiaDB *, PyObject *, PyObject *);
+static PyObject * sophia_db_load(SophiaDB *, PyObject *, PyObject *);
+static PyObject * sophia_db_dump(SophiaDB *, PyObject *, PyObject *);
+static PyObject * sophia_db_restore(SophiaDB *, PyObject *, PyObject *);
 static PyObject * sophia_db_count_records(SophiaDB *);
 static PyObject * sophia_db_begin(SophiaDB *);
 static PyObject * sophia_db_commit(SophiaDB *);
@@ -53,28 +552,80 @@ static PyObject * sophia_db_iter_items(SophiaDB *, PyObject *, PyObject *);
 
 static PyObject * sophia_cursor_new(SophiaDB *, PyTypeObject *, PyObject *, PyObject *);
 static void sophia_cursor_dealloc(SophiaCursor *);
-static PyObject * sophia_cursor_next_key(SophiaCursor *);
-static PyObject * sophia_cursor_next_value(SophiaCursor *);
-static PyObject * sophia_cursor_next_item(SophiaCursor *);
+static PyObject * sophia_cursor_next(SophiaCursor *);
+static PyObject * sophia_cursor_fetch_many(SophiaCursor *, PyObject *);
+
+static void sophia_buffer_dealloc(SophiaBuffer *);
+static Py_ssize_t sophia_buffer_length(SophiaBuffer *);
+static int sophia_buffer_get(SophiaBuffer *, Py_buffer *, int);
 
 static int sophia_db_close_internal(SophiaDB *);
+static int sophia_codec_init(SophiaCodec *, PyObject *, PyObject *);
+static int sophia_decoder_init(SophiaCodec *, PyObject *);
+static int sophia_codec_copy(SophiaCodec *, const SophiaCodec *);
+static void sophia_codec_clear(SophiaCodec *);
+static PyObject * sophia_decode(SophiaCodec *, const char *, size_t);
+static int sophia_encoded_view(SophiaCodec *, PyObject *, Py_buffer *);
+static PyObject * sophia_encoded_bytes(SophiaCodec *, PyObject *);
+static PyObject * sophia_db_count(SophiaDB *, PyObject *, PyObject *);
+static PyObject * sophia_db_cache_info(SophiaDB *);
+static PyObject * sophia_db_bloom_info(SophiaDB *);
+static PyObject * sophia_db_stats(SophiaDB *, PyObject *, PyObject *);
+static void sophia_cache_clear(SophiaDB *);
 static void sophia_cursor_dealloc_internal(SophiaCursor *);
+static inline void sophia_copy_error(void *, char *);
 static int pylong_to_uint32_t(PyObject *, uint32_t *);
 static int pyfloat_to_double(PyObject *, double *);
-static PyObject * sophia_db_set_cmp_fun(SophiaDB *, PyObject *);
+static PyObject * sophia_db_set_cmp_fun(SophiaDB *, PyObject *, PyObject *);
 static inline int sophia_compare_default(char *, size_t, char *, size_t, void *);
 static int sophia_compare_custom(char *, size_t, char *, size_t, void *);
+static int sophia_compare_python(char *, size_t, char *, size_t, void *);
+static int sophia_cmp_raise(SophiaDB *);
+static PyObject *sophia_cmp_checked(SophiaDB *, PyObject *);
+static spcmpf sophia_native_comparator(long);
+static SophiaKeyFormat * sophia_parse_key_format(const char *);
+static inline int sophia_db_compare(SophiaDB *, const char *, size_t, const char *, size_t);
+static inline int sophia_cmp_needs_gil(SophiaDB *);
+static int sophia_cmp_is_bytewise(SophiaDB *);
+static int sophia_compare_counted(char *, size_t, char *, size_t, void *);
+static void sophia_pool_stop(SophiaDB *);
+static void sophia_requests_free(SophiaRequest *);
+static PyObject * sophia_db_async_start(SophiaDB *, PyObject *);
+static PyObject * sophia_db_async_stop(SophiaDB *);
+static PyObject * sophia_db_submit(SophiaDB *, PyObject *);
+static PyObject * sophia_db_async_completions(SophiaDB *);
+static PyObject * sophia_db_shard(SophiaDB *, PyObject *);
+static PyObject * sophia_db_encode_key(SophiaDB *, PyObject *);
+static void sophia_merge_dealloc(SophiaMerge *);
+static PyObject * sophia_merge_next(SophiaMerge *);
+static PyObject * sophia_db_parallel_scan(SophiaDB *, PyObject *, PyObject *);
+static PyObject * sophia_db_scan_stats(SophiaDB *, PyObject *, PyObject *);
+static PyObject * sophia_db_export(SophiaDB *, PyObject *, PyObject *);
+static void sophia_scan_dealloc(SophiaScan *);
+static void sophia_scan_iter_dealloc(SophiaScanIter *);
+static PyObject * sophia_scan_iter_next(SophiaScanIter *);
 
 static PyMethodDef sophia_db_methods[] = {
     {"__init__", (PyCFunction)sophia_db_init, METH_NOARGS, NULL},
     {"len", (PyCFunction)sophia_db_count_records, METH_NOARGS, NULL},
+    {"count", (PyCFunction)sophia_db_count, METH_VARARGS | METH_KEYWORDS, NULL},
+    {"cache_info", (PyCFunction)sophia_db_cache_info, METH_NOARGS, NULL},
+    {"bloom_info", (PyCFunction)sophia_db_bloom_info, METH_NOARGS, NULL},
+    {"stats", (PyCFunction)sophia_db_stats, METH_VARARGS | METH_KEYWORDS, NULL},
     {"setopt", (PyCFunction)sophia_db_set_option, METH_VARARGS, NULL},
     {"open", (PyCFunction)sophia_db_open, METH_VARARGS, NULL},
     {"close", (PyCFunction)sophia_db_close, METH_NOARGS, NULL},
     {"is_closed", (PyCFunction)sophia_db_is_closed, METH_NOARGS, NULL},
     {"get", (PyCFunction)sophia_db_get, METH_VARARGS, NULL},
+    {"get_many", (PyCFunction)sophia_db_get_many, METH_VARARGS | METH_KEYWORDS, NULL},
+    {"get_buffer", (PyCFunction)sophia_db_get_buffer, METH_VARARGS, NULL},
     {"set", (PyCFunction)sophia_db_set, METH_VARARGS, NULL},
     {"delete", (PyCFunction)sophia_db_delete, METH_VARARGS, NULL},
+    {"set_many", (PyCFunction)sophia_db_set_many, METH_VARARGS | METH_KEYWORDS, NULL},
+    {"update", (PyCFunction)sophia_db_set_many, METH_VARARGS | METH_KEYWORDS, NULL},
+    {"load", (PyCFunction)sophia_db_load, METH_VARARGS | METH_KEYWORDS, NULL},
+    {"dump", (PyCFunction)sophia_db_dump, METH_VARARGS | METH_KEYWORDS, NULL},
+    {"restore", (PyCFunction)sophia_db_restore, METH_VARARGS | METH_KEYWORDS, NULL},
     {"contains", (PyCFunction)sophia_db_contains, METH_VARARGS, NULL},
     {"begin", (PyCFunction)sophia_db_begin, METH_NOARGS, NULL},
     {"commit", (PyCFunction)sophia_db_commit, METH_NOARGS, NULL},
@@ -82,6 +633,15 @@ static PyMethodDef sophia_db_methods[] = {
     {"iterkeys", (PyCFunction)sophia_db_iter_keys, METH_VARARGS | METH_KEYWORDS, NULL},
     {"itervalues", (PyCFunction)sophia_db_iter_values, METH_VARARGS | METH_KEYWORDS, NULL},
     {"iteritems", (PyCFunction)sophia_db_iter_items, METH_VARARGS | METH_KEYWORDS, NULL},
+    {"parallel_scan", (PyCFunction)sophia_db_parallel_scan, METH_VARARGS | METH_KEYWORDS, NULL},
+    {"scan_stats", (PyCFunction)sophia_db_scan_stats, METH_VARARGS | METH_KEYWORDS, NULL},
+    {"export", (PyCFunction)sophia_db_export, METH_VARARGS | METH_KEYWORDS, NULL},
+    {"_async_start", (PyCFunction)sophia_db_async_start, METH_VARARGS, NULL},
+    {"_async_stop", (PyCFunction)sophia_db_async_stop, METH_NOARGS, NULL},
+    {"_submit", (PyCFunction)sophia_db_submit, METH_VARARGS, NULL},
+    {"_async_completions", (PyCFunction)sophia_db_async_completions, METH_NOARGS, NULL},
+    {"_shard", (PyCFunction)sophia_db_shard, METH_VARARGS, NULL},
+    {"_encode_key", (PyCFunction)sophia_db_encode_key, METH_O, NULL},
     {NULL},
 };
 
@@ -127,6 +687,55 @@ static PyTypeObject SophiaDBType = {
     sophia_db_new,                 /* tp_new */
 };
 
+static PySequenceMethods sophia_buffer_as_sequence = {
+    (lenfunc)sophia_buffer_length,              /* sq_length */
+};
+
+static PyBufferProcs sophia_buffer_as_buffer = {
+#if PY_MAJOR_VERSION < 3
+    0,                                          /* bf_getreadbuffer */
+    0,                                          /* bf_getwritebuffer */
+    0,                                          /* bf_getsegcount */
+    0,                                          /* bf_getcharbuffer */
+#endif
+    (getbufferproc)sophia_buffer_get,           /* bf_getbuffer */
+    0,                                          /* bf_releasebuffer */
+};
+
+#if PY_MAJOR_VERSION < 3
+    #define PSP_TPFLAGS_BUFFER (Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_NEWBUFFER)
+#else
+    #define PSP_TPFLAGS_BUFFER Py_TPFLAGS_DEFAULT
+#endif
+
+static PyTypeObject SophiaBufferType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "sophia.Buffer",                            /* tp_name */
+    sizeof(SophiaBuffer),                       /* tp_basicsize */
+    0,                                          /* tp_itemsize */
+    (destructor)sophia_buffer_dealloc,          /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_reserved */
+    0,                                          /* tp_repr */
+    0,                                          /* tp_as_number */
+    &sophia_buffer_as_sequence,                 /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    0,                                          /* tp_getattro */
+    0,                                          /* tp_setattro */
+    &sophia_buffer_as_buffer,                   /* tp_as_buffer */
+    PSP_TPFLAGS_BUFFER,                         /* tp_flags */
+};
+
+static PyMethodDef sophia_cursor_methods[] = {
+    {"fetchmany", (PyCFunction)sophia_cursor_fetch_many, METH_VARARGS, NULL},
+    {NULL},
+};
+
 static PyTypeObject SophiaCursorKeysType = {
     PyVarObject_HEAD_INIT(NULL, 0)
     "sophia.Cursor",                             /* tp_name */
@@ -154,8 +763,8 @@ static PyTypeObject SophiaCursorKeysType = {
     0,                                          /* tp_richcompare */
     0,                                          /* tp_weaklistoffset */
     PyObject_SelfIter,                          /* tp_iter */
-    (iternextfunc)sophia_cursor_next_key,       /* tp_iternext */
-    0,                                          /* tp_methods */
+    (iternextfunc)sophia_cursor_next,           /* tp_iternext */
+    sophia_cursor_methods,                      /* tp_methods */
     0,
 };
 
@@ -186,8 +795,8 @@ static PyTypeObject SophiaCursorValuesType = {
     0,                                          /* tp_richcompare */
     0,                                          /* tp_weaklistoffset */
     PyObject_SelfIter,                          /* tp_iter */
-    (iternextfunc)sophia_cursor_next_value,     /* tp_iternext */
-    0,                                          /* tp_methods */
+    (iternextfunc)sophia_cursor_next,           /* tp_iternext */
+    sophia_cursor_methods,                      /* tp_methods */
     0,
 };
 
@@ -218,7 +827,94 @@ static PyTypeObject SophiaCursorItemsType = {
     0,                                          /* tp_richcompare */
     0,                                          /* tp_weaklistoffset */
     PyObject_SelfIter,                          /* tp_iter */
-    (iternextfunc)sophia_cursor_next_item,      /* tp_iternext */
+    (iternextfunc)sophia_cursor_next,           /* tp_iternext */
+    sophia_cursor_methods,                      /* tp_methods */
+    0,
+};
+
+static PyTypeObject SophiaMergeType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "sophia.MergedCursor",                      /* tp_name */
+    sizeof(SophiaMerge),                        /* tp_basicsize */
+    0,                                          /* tp_itemsize */
+    (destructor)sophia_merge_dealloc,           /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_reserved */
+    0,                                          /* tp_repr */
+    0,                                          /* tp_as_number */
+    0,                                          /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    0,                                          /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                         /* tp_flags */
+    0,                                          /* tp_doc */
+    0,                                          /* tp_traverse */
+    0,                                          /* tp_clear */
+    0,                                          /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    PyObject_SelfIter,                          /* tp_iter */
+    (iternextfunc)sophia_merge_next,            /* tp_iternext */
+    0,                                          /* tp_methods */
+    0,
+};
+
+static PyTypeObject SophiaScanType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "sophia.Scan",                              /* tp_name */
+    sizeof(SophiaScan),                         /* tp_basicsize */
+    0,                                          /* tp_itemsize */
+    (destructor)sophia_scan_dealloc,            /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_reserved */
+    0,                                          /* tp_repr */
+    0,                                          /* tp_as_number */
+    0,                                          /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    0,                                          /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                         /* tp_flags */
+};
+
+static PyTypeObject SophiaScanIterType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "sophia.ScanIterator",                      /* tp_name */
+    sizeof(SophiaScanIter),                     /* tp_basicsize */
+    0,                                          /* tp_itemsize */
+    (destructor)sophia_scan_iter_dealloc,       /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_reserved */
+    0,                                          /* tp_repr */
+    0,                                          /* tp_as_number */
+    0,                                          /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    0,                                          /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                         /* tp_flags */
+    0,                                          /* tp_doc */
+    0,                                          /* tp_traverse */
+    0,                                          /* tp_clear */
+    0,                                          /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    PyObject_SelfIter,                          /* tp_iter */
+    (iternextfunc)sophia_scan_iter_next,        /* tp_iternext */
     0,                                          /* tp_methods */
     0,
 };
@@ -227,6 +923,8 @@ static PyObject *
 sophia_db_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
 {
     SophiaDB *db = (SophiaDB *)type->tp_alloc(type, 0);
+    pthread_condattr_t condattr;
+    
     if (!db)
         return NULL;
     db->db = NULL;
@@ -234,636 +932,7490 @@ sophia_db_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
     if (!db->env)
         return PyErr_NoMemory();
     db->cmp_fun = NULL;
+    db->cmp_error = db->cmp_error_value = db->cmp_error_tb = NULL;
+    db->cmp_native = NULL;
+    db->cmp_format = NULL;
+    pthread_mutex_init(&db->lock, NULL);
+    db->path = NULL;
+    db->counting = 0;
+    db->records = 0;
+    memset(&db->txn_keys, 0, sizeof(SophiaTable));
+    memset(&db->key_codec, 0, sizeof(SophiaCodec));
+    memset(&db->value_codec, 0, sizeof(SophiaCodec));
+    db->threaded = 0;
+    db->snapshots = 0;
+    memset(&db->overlay, 0, sizeof(SophiaTable));
+    db->group_latency = 0;
+    db->group_max = PSP_GROUP_MAX;
+    pthread_mutex_init(&db->group_lock, NULL);
+    /* the deadlines of the batches follow the monotonic clock */
+    pthread_condattr_init(&condattr);
+    pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+    pthread_cond_init(&db->group_cond, &condattr);
+    pthread_condattr_destroy(&condattr);
+    db->group_head = NULL;
+    db->group_tail = &db->group_head;
+    db->group_size = 0;
+    db->group_leader = 0;
+    db->group_commits = db->group_writes = 0;
+    db->cache_budget = db->cache_bytes = 0;
+    memset(&db->cache, 0, sizeof(SophiaTable));
+    db->cache_ring = NULL;
+    db->cache_ring_size = db->cache_hand = db->cache_epoch = 0;
+    db->cache_hits = db->cache_misses = db->cache_evictions = 0;
+    db->bloom_keys = 0;
+    db->bloom_rate = 0.01;
+    memset(&db->bloom, 0, sizeof(SophiaBloom));
+    db->bloom_rejects = db->bloom_false_positives = 0;
+    memset(db->latencies, 0, sizeof(db->latencies));
+    db->bytes_read = db->bytes_written = 0;
+    db->deferred_closes = db->txn_writes = 0;
+    db->cmp_stats = 0;
+    db->comparisons = db->comparison_ns = 0;
+    db->pool = NULL;
+    db->pool_size = 0;
+    pthread_mutex_init(&db->pool_lock, NULL);
+    pthread_cond_init(&db->pool_cond, NULL);
+    db->pool_head = db->pool_done = NULL;
+    db->pool_tail = &db->pool_head;
+    db->pool_stop = 0;
+    db->pool_fd[0] = db->pool_fd[1] = -1;
     return (PyObject *)db;
 }
 
 static void
 sophia_db_dealloc(SophiaDB *db)
 {
+    sophia_pool_stop(db);
+    sophia_requests_free(db->pool_done);
     if (db->db)
         sophia_db_close_internal(db);
     sp_destroy(db->env);
     if (db->cmp_fun)
         Py_DECREF(db->cmp_fun);
+    Py_XDECREF(db->cmp_error);
+    Py_XDECREF(db->cmp_error_value);
+    Py_XDECREF(db->cmp_error_tb);
+    free(db->cmp_format);
+    sophia_codec_clear(&db->key_codec);
+    sophia_codec_clear(&db->value_codec);
+    pthread_mutex_destroy(&db->lock);
+    pthread_mutex_destroy(&db->group_lock);
+    pthread_cond_destroy(&db->group_cond);
+    pthread_mutex_destroy(&db->pool_lock);
+    pthread_cond_destroy(&db->pool_cond);
+    sophia_table_free(&db->txn_keys);
+    sophia_table_free(&db->overlay);
+    sophia_cache_clear(db);
+    sophia_table_free(&db->cache);
+    free(db->cache_ring);
+    free(db->bloom.bits);
+    PyMem_Free(db->path);
     Py_TYPE(db)->tp_free((PyObject *)db);
 }
 
-static int
-sophia_db_init(SophiaDB *db)
+/* Release the GIL and take the database lock around calls to libsophia.
+ * The lock is always acquired with the GIL released, so that a thread waiting
+ * for it never blocks the interpreter, nor the thread holding it when
+ * libsophia calls back a python comparison function.
+ */
+#define PSP_BEGIN_LOCKED(pdb)                                           \
+    Py_BEGIN_ALLOW_THREADS                                              \
+    pthread_mutex_lock(&(pdb)->lock);
+
+#define PSP_END_LOCKED(pdb)                                             \
+    pthread_mutex_unlock(&(pdb)->lock);                                 \
+    Py_END_ALLOW_THREADS
+
+/* Evaluate `expr` (a call to libsophia returning -1 on failure) in a locked
+ * section. The database may have been closed by another thread while we were
+ * waiting for the lock, so this is checked again once it is held. On failure,
+ * the error message is copied into `err`, as the sophia handle can't be
+ * accessed anymore once the lock is released.
+ */
+#define PSP_CALL(pdb, rv, err, expr)                                    \
+do {                                                                    \
+    PSP_BEGIN_LOCKED(pdb)                                               \
+    if (!(pdb)->db) {                                                   \
+        (rv) = -1;                                                      \
+        strcpy((err), "operation on a closed database");               \
+    }                                                                   \
+    else if (((rv) = (expr)) == -1)                                     \
+        sophia_copy_error((pdb)->db, (err));                            \
+    PSP_END_LOCKED(pdb)                                                 \
+} while (0)
+
+static inline void
+sophia_copy_error(void *handle, char *err)
 {
-    if (db->db && sophia_db_close_internal(db) == -1)
-        return -1;
-    return 0;
+    strncpy(err, sp_error(handle), PSP_ERRMAX - 1);
+    err[PSP_ERRMAX - 1] = '\0';
 }
 
-/* Open (or reopen) the underlying sophia database iff no cursors
- * are still in use.
+static inline int
+sophia_closed_error(char *err)
+{
+    strcpy(err, "operation on a closed database");
+    return -1;
+}
+
+/* Buffer a write in the overlay, with the database lock held. The new entry
+ * is added before the previous one for the same key is removed, so that the
+ * latter is kept if memory is exhausted.
  */
-static PyObject *
-sophia_db_open(SophiaDB *db, PyObject *args)
+static int
+sophia_db_buffer_write(SophiaDB *db, const char *key, size_t ksize,
+                       const char *value, size_t vsize, char *err)
 {
-    char *path;
+    int exists = 0;
+    size_t hash = sophia_hash(key, ksize);
+    SophiaEntry *old, *entry;
     
-    if (!PyArg_ParseTuple(args, "s:open", &path))
-        return NULL;
-    
-    if (db->db) {
-        int status = sophia_db_close_internal(db);
-        if (status == 0) {
-            db->close_me = 1;
-            Py_RETURN_FALSE;
-        }
-        else if (status == -1)
-            return NULL;
+    if ((old = sophia_table_find(&db->overlay, key, ksize, hash)))
+        exists = !!(old->flags & PSP_PRESENT);
+    else if (db->counting && (exists = sp_get(db->db, key, ksize, NULL, NULL)) == -1) {
+        sophia_copy_error(db->db, err);
+        return -1;
     }
     
-    if (sp_ctl(db->env, SPDIR, SPO_CREAT | SPO_RDWR, path) == -1 ||
-        (!db->cmp_fun && sp_ctl(db->env, SPCMP, sophia_compare_default, NULL) == -1))
-        return PyErr_NoMemory();
-
-    db->db = sp_open(db->env);
-    if (!db->db) {
-        PyErr_SetString(SophiaError, sp_error(db->env));
-        return NULL;
+    if (!(entry = sophia_table_add(&db->overlay, key, ksize, hash, sizeof(size_t) + vsize))) {
+        strcpy(err, "out of memory");
+        return -1;
     }
+    if (old)
+        sophia_table_remove(&db->overlay, old);
+    entry->flags = value ? PSP_PRESENT : 0;
+    memcpy(entry->key + ksize, &vsize, sizeof(size_t));
+    if (value)
+        memcpy(entry->key + ksize + sizeof(size_t), value, vsize);
     
-    db->cursors = 0;
-    db->close_me = 0;
-    
-    Py_RETURN_TRUE;
+    if (db->counting)
+        db->records += (value != NULL) - exists;
+    return 0;
 }
 
-/* Destroy the underlying sophia database iff no cursors are still in use,
- * as it would be impossible to destroy them afterwards (trying to do so results
- * in a segfault). If a cursor is still in use, mark the python database as
- * "to be closed", and effectively close it when the last remaining cursor
- * has been destroyed. A call to `Database.open()` sets the marker "to be closed"
- * to false. 
+/* Apply the writes buffered in the overlay in a single transaction, with the
+ * database lock held. This is attempted whenever a cursor is released, once
+ * the last snapshot cursor is gone, and fails as long as other cursors are
+ * in use, in which case the writes stay buffered until the next write, which
+ * attempts it again, or the database is closed.
  */
 static int
-sophia_db_close_internal(SophiaDB *db)
+sophia_db_flush_overlay(SophiaDB *db, char *err)
 {
-    if (!db->db)
-        return 1;
-    if (db->cursors > 0) {
+    size_t i, vsize;
+    SophiaEntry *entry;
+    int rv = 0;
+    
+    if (db->snapshots > 0 || db->overlay.count == 0)
         return 0;
+    if (sp_begin(db->db) == -1) {
+        sophia_copy_error(db->db, err);
+        return -1;
     }
-    if (sp_destroy(db->db) == -1) {
-        PyErr_SetString(SophiaError, sp_error(db->env));
+    for (i = 0; i < db->overlay.nbuckets && rv != -1; i++) {
+        for (entry = db->overlay.buckets[i]; entry && rv != -1; entry = entry->next) {
+            memcpy(&vsize, entry->key + entry->ksize, sizeof(size_t));
+            if (entry->flags & PSP_PRESENT)
+                rv = sp_set(db->db, entry->key, entry->ksize,
+                            entry->key + entry->ksize + sizeof(size_t), vsize);
+            else
+                rv = sp_delete(db->db, entry->key, entry->ksize);
+        }
+    }
+    if (rv == -1 || sp_commit(db->db) == -1) {
+        sophia_copy_error(db->db, err);
+        if (rv == -1)
+            sp_rollback(db->db);
         return -1;
     }
-    db->db = NULL;
-    return 1;
+    sophia_table_clear(&db->overlay, NULL, NULL);
+    return 0;
 }
 
-static PyObject *
-sophia_db_close(SophiaDB *db)
+/* Are the writes buffered in the overlay, with the database lock held? They
+ * are as long as a snapshot cursor is in use. Once the last one is gone, the
+ * buffered writes are applied before any other write, if the release of the
+ * cursor couldn't apply them, so that the overlay doesn't keep growing, and
+ * the failure is reported to the writer. Return 1 if so, 0 if not, or -1 on
+ * failure.
+ */
+static int
+sophia_db_buffering(SophiaDB *db, char *err)
 {
-    int rv = sophia_db_close_internal(db);
-    if (rv == 1)
-        Py_RETURN_TRUE;
-    else if (rv == 0) {
-        db->close_me = 1;
-        Py_RETURN_FALSE;
-    }
-    return NULL;
+    if (db->snapshots > 0)
+        return 1;
+    if (db->overlay.count == 0)
+        return 0;
+    /* the writes of a transaction follow the buffered ones */
+    if (db->in_txn)
+        return 1;
+    return sophia_db_flush_overlay(db, err);
 }
 
-static PyObject *
-sophia_db_is_closed(SophiaDB *db)
+/* Look a record up, with the database lock held, as sp_get() does. Buffered
+ * writes take precedence over the records of the database; the value of a
+ * buffered record is copied into memory allocated with malloc(), as libsophia
+ * does.
+ */
+static int
+sophia_db_get_locked(SophiaDB *db, const char *key, size_t ksize,
+                     void **value, size_t *vsize, char *err)
 {
-    if (!db->db)
-        Py_RETURN_TRUE;
-    Py_RETURN_FALSE;
+    int rv;
+    SophiaEntry *entry;
+    
+    if (db->overlay.count > 0
+        && (entry = sophia_table_find(&db->overlay, key, ksize, sophia_hash(key, ksize)))) {
+        if (!(entry->flags & PSP_PRESENT))
+            return 0;
+        if (value) {
+            memcpy(vsize, entry->key + ksize, sizeof(size_t));
+            if (!(*value = malloc(*vsize ? *vsize : 1))) {
+                strcpy(err, "out of memory");
+                return -1;
+            }
+            memcpy(*value, entry->key + ksize + sizeof(size_t), *vsize);
+        }
+        return 1;
+    }
+    if ((rv = sp_get(db->db, key, ksize, value, vsize)) == -1)
+        sophia_copy_error(db->db, err);
+    return rv;
 }
 
+/* Write a record, or delete it if `value` is NULL, with the database lock
+ * held. If the records are counted, the existence of the record is checked
+ * first. In a transaction, this is only done the first time a key is written,
+ * and the counter is updated once the transaction is committed. While
+ * snapshot cursors are in use, the write is buffered instead.
+ */
 static int
-pylong_to_uint32_t(PyObject *num, uint32_t *out)
+sophia_db_write_locked(SophiaDB *db, const char *key, size_t ksize,
+                       const char *value, size_t vsize, char *err)
 {
-    unsigned long value;
+    int rv, exists = 0;
+    SophiaEntry *entry = NULL;
     
-    value = PyLong_AsUnsignedLong(num);
-    if (PyErr_Occurred())
-        return -1;
-    if (value > UINT32_MAX) {
-        PyErr_SetString(PyExc_ValueError, "option value is out of bound");
+    if ((rv = sophia_db_buffering(db, err)) != 0)
+        return rv == -1 ? -1 : sophia_db_buffer_write(db, key, ksize, value, vsize, err);
+    
+    if (db->counting) {
+        size_t hash = sophia_hash(key, ksize);
+        
+        if (!db->in_txn || !(entry = sophia_table_find(&db->txn_keys, key, ksize, hash))) {
+            if ((exists = sp_get(db->db, key, ksize, NULL, NULL)) == -1) {
+                sophia_copy_error(db->db, err);
+                return -1;
+            }
+        }
+        if (db->in_txn && !entry) {
+            if (!(entry = sophia_table_add(&db->txn_keys, key, ksize, hash, 0))) {
+                strcpy(err, "out of memory");
+                return -1;
+            }
+            entry->flags = exists ? PSP_EXISTED | PSP_PRESENT : 0;
+        }
+    }
+    
+    if (value)
+        rv = sp_set(db->db, key, ksize, value, vsize);
+    else
+        rv = sp_delete(db->db, key, ksize);
+    if (rv == -1) {
+        sophia_copy_error(db->db, err);
         return -1;
     }
+    if (db->in_txn)
+        db->txn_writes++;
     
-    *out = (uint32_t)value;
+    if (entry)
+        entry->flags = value ? entry->flags | PSP_PRESENT : entry->flags & ~PSP_PRESENT;
+    else if (db->counting)
+        db->records += (value != NULL) - exists;
     return 0;
 }
 
+static void
+sophia_txn_count(SophiaEntry *entry, void *db)
+{
+    ((SophiaDB *)db)->records += !!(entry->flags & PSP_PRESENT) - !!(entry->flags & PSP_EXISTED);
+}
+
+/* Transactions handling, with the database lock held */
+
 static int
-pyfloat_to_double(PyObject *num, double *out)
+sophia_txn_begin(SophiaDB *db)
 {
-    if (!PyFloat_Check(num)) {
-        PyErr_SetString(PyExc_TypeError, "expected a float");
+    if (sp_begin(db->db) == -1)
         return -1;
-    }
-    *out = PyFloat_AsDouble(num);
-    if (PyErr_Occurred())
+    db->in_txn = 1;
+    db->txn_writes = 0;
+    return 0;
+}
+
+static int
+sophia_txn_commit(SophiaDB *db)
+{
+    if (sp_commit(db->db) == -1)
+        return -1;
+    sophia_table_clear(&db->txn_keys, sophia_txn_count, db);
+    db->in_txn = 0;
+    db->txn_writes = 0;
+    return 0;
+}
+
+static int
+sophia_txn_rollback(SophiaDB *db)
+{
+    if (sp_rollback(db->db) == -1)
         return -1;
+    sophia_table_clear(&db->txn_keys, NULL, NULL);
+    db->in_txn = 0;
+    db->txn_writes = 0;
     return 0;
 }
 
-/* Attach a python comparison function to the database instance.
- * Passing `None` resets the comparison function to the original
- * default one.
+/* Monotonic time, in nanoseconds */
+static inline uint64_t
+sophia_now(void)
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* Time taken by reading the clock, subtracted from the short intervals, where
+ * it isn't negligible: the median of a few empty intervals, measured once,
+ * when the module is loaded.
  */
-static PyObject *
-sophia_db_set_cmp_fun(SophiaDB *db, PyObject *fun)
+#define PSP_CLOCK_SAMPLES 101
+
+static uint64_t sophia_clock_ns = 0;
+
+static void
+sophia_calibrate_clock(void)
 {
-    int rv;
+    uint64_t start, elapsed, samples[PSP_CLOCK_SAMPLES];
+    int i, j;
     
-    if (fun == Py_None) {
-        if (!db->cmp_fun)
-            return 0;
-        Py_DECREF(db->cmp_fun);
-        db->cmp_fun = NULL;
-        rv = sp_ctl(db->env, SPCMP, sophia_compare_default, NULL);
-    }
-    else if (PyCallable_Check(fun)) {
-        if (db->cmp_fun)
-            Py_DECREF(db->cmp_fun);
-        Py_INCREF(fun);
-        db->cmp_fun = fun;
-        rv = sp_ctl(db->env, SPCMP, sophia_compare_custom, fun);
-    }
-    else {
-        PyErr_SetString(PyExc_TypeError, "expected either a callable or None");
-        return NULL;
+    /* insertion sort of the intervals */
+    for (i = 0; i < PSP_CLOCK_SAMPLES; i++) {
+        start = sophia_now();
+        elapsed = sophia_now() - start;
+        for (j = i; j > 0 && samples[j - 1] > elapsed; j--)
+            samples[j] = samples[j - 1];
+        samples[j] = elapsed;
     }
+    sophia_clock_ns = samples[PSP_CLOCK_SAMPLES / 2];
+}
+
+/* Record the latency of an operation started at `start`, with the GIL held */
+static void
+sophia_stats_record(SophiaDB *db, int op, uint64_t start)
+{
+    SophiaHistogram *hist = &db->latencies[op];
+    uint64_t ns = sophia_now() - start;
+    int bucket = 0;
     
-    if (rv == -1) {
-        PyErr_SetString(SophiaError, sp_error(db->env));
-        return NULL;
+    while (bucket < PSP_HIST_BUCKETS - 1 && (ns >> (bucket + 1)))
+        bucket++;
+    hist->calls++;
+    hist->total_ns += ns;
+    if (ns > hist->max_ns)
+        hist->max_ns = ns;
+    hist->buckets[bucket]++;
+}
+
+/* Compute the absolute time `delay` seconds from now, on the monotonic clock,
+ * for pthread_cond_timedwait() on `SophiaDB.group_cond`.
+ */
+static void
+sophia_deadline(struct timespec *ts, double delay)
+{
+    clock_gettime(CLOCK_MONOTONIC, ts);
+    ts->tv_sec += (time_t)delay;
+    ts->tv_nsec += (long)((delay - (double)(time_t)delay) * 1e9);
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
     }
-    Py_RETURN_NONE;
 }
 
-static PyObject *
-sophia_db_set_option(SophiaDB *db, PyObject *args)
+/* Write a record in group commit mode, with the GIL released. The write is
+ * queued, and the first writer to find no batch being collected leads the
+ * next one: it waits for other writes, until the batch is full or the latency
+ * has elapsed, then commits them all in a single transaction (or adds them to
+ * the transaction of the user, if any), and wakes up their writers. Every
+ * writer returns once its own write is committed, with the result of the
+ * whole batch.
+ */
+static int
+sophia_group_write(SophiaDB *db, const char *key, size_t ksize,
+                   const char *value, size_t vsize, char *err)
 {
-    int rv, option;
-    PyObject *pvalue, *pvalue2 = NULL;
-    
-    if (!PyArg_ParseTuple(args, "iO|O:setopt", &option, &pvalue, &pvalue2))
-        return NULL;
+    SophiaPending me = {NULL, key, ksize, value, vsize, 0, 0, err}, *batch, *p;
+    struct timespec deadline;
+    int rv = 0, own_txn = 0;
+    size_t n = 0;
     
-    if (option == SPCMP) {
-        return sophia_db_set_cmp_fun(db, pvalue);
-    }
-    else if (option == SPPAGE || option == SPMERGEWM) {
+    pthread_mutex_lock(&db->group_lock);
+    *db->group_tail = &me;
+    db->group_tail = &me.next;
+    db->group_size++;
     
-        uint32_t value;
-        if (pylong_to_uint32_t(pvalue, &value) == -1)
-            return NULL;
-        rv = sp_ctl(db->env, option, value);
+    if (db->group_leader) {
+        if (db->group_size >= db->group_max)
+            pthread_cond_broadcast(&db->group_cond);
+        while (!me.done)
+            pthread_cond_wait(&db->group_cond, &db->group_lock);
+        pthread_mutex_unlock(&db->group_lock);
+        return me.rv;
     }
-    else if (option == SPGC || option == SPMERGE) {
     
-        int value = PyObject_IsTrue(pvalue);
-        if (value == -1)
-            return NULL;
-        rv = sp_ctl(db->env, option, value);
-    }
-    else if (option == SPGCF) {
+    db->group_leader = 1;
+    sophia_deadline(&deadline, db->group_latency);
+    while (db->group_size < db->group_max
+           && pthread_cond_timedwait(&db->group_cond, &db->group_lock, &deadline) != ETIMEDOUT)
+        ;
+    batch = db->group_head;
+    db->group_head = NULL;
+    db->group_tail = &db->group_head;
+    db->group_size = 0;
+    db->group_leader = 0;
+    pthread_mutex_unlock(&db->group_lock);
     
-        double value;
-        if (pyfloat_to_double(pvalue, &value) == -1)
-            return NULL;
-        rv = sp_ctl(db->env, option, value);
-    }
-    else if (option == SPGROW) {
-
-        if (pvalue2 == NULL) {
-            PyErr_SetString(PyExc_ValueError, "expected a third argument");
-            return NULL;
-        }
-        
-        uint32_t new_size;
-        double resize;
-        
-        if (pylong_to_uint32_t(pvalue, &new_size) == -1 ||
-            pyfloat_to_double(pvalue2, &resize) == -1)
-            return NULL;
-        rv = sp_ctl(db->env, option, new_size, resize);
+    pthread_mutex_lock(&db->lock);
+    if (!db->db)
+        rv = sophia_closed_error(err);
+    else if ((rv = sophia_db_buffering(db, err)) == -1)
+        ;
+    else if ((own_txn = !db->in_txn && !rv) && (rv = sophia_txn_begin(db)) == -1)
+        sophia_copy_error(db->db, err);
+    for (p = batch; p && rv != -1; p = p->next, n++)
+        rv = sophia_db_write_locked(db, p->key, p->ksize, p->value, p->vsize, err);
+    if (own_txn && n > 0) {
+        if (rv == -1)
+            sophia_txn_rollback(db);
+        else if ((rv = sophia_txn_commit(db)) == -1)
+            sophia_copy_error(db->db, err);
     }
-    else {
-        PyErr_SetString(PyExc_ValueError, "unknown option");
-        return NULL;
+    if (rv != -1) {
+        db->group_commits++;
+        db->group_writes += n;
     }
+    pthread_mutex_unlock(&db->lock);
     
-    if (rv == -1) {
-        PyErr_SetString(SophiaError, sp_error(db->env));
-        return NULL;
+    /* the writers can't go away before the lock is released */
+    pthread_mutex_lock(&db->group_lock);
+    for (p = batch; p; p = p->next) {
+        p->rv = rv;
+        if (rv == -1 && p->err != err)
+            strcpy(p->err, err);
+        p->done = 1;
     }
-    Py_RETURN_NONE;
+    pthread_cond_broadcast(&db->group_cond);
+    pthread_mutex_unlock(&db->group_lock);
+    return rv;
 }
 
-#define ensure_is_opened(pdb, rv)                                       \
-do {                                                                    \
-    if (!(pdb)->db) {                                                   \
-        PyErr_SetString(SophiaError, "operation on a closed database"); \
-        return (rv);                                                    \
-    }                                                                   \
-} while (0)
+/* The read cache keeps the values of the records most recently read, as bytes
+ * objects, up to a budget in bytes. It is only accessed with the GIL held,
+ * and evicts with the CLOCK algorithm: a record is evicted once the hand has
+ * gone around the ring without it being read.
+ *
+ * Writes are performed with the GIL released, so each one invalidates the
+ * cached record afterwards, and increments an epoch, which readers compare
+ * before and after their lookup to avoid caching a value that was being
+ * replaced meanwhile.
+ */
+#define PSP_CACHE_OVERHEAD (sizeof(SophiaEntry) + sizeof(SophiaCached) + sizeof(PyBytesObject))
 
-static PyObject *
-sophia_db_set(SophiaDB *db, PyObject *args)
+static inline SophiaCached *
+sophia_cached(SophiaEntry *entry)
 {
-    char *key, *value;
-    PyObject *pkey, *pvalue;
-    Py_ssize_t ksize, vsize;
-    
-    ensure_is_opened(db, NULL);
-    
-    if (!PyArg_UnpackTuple(args, "set", 2, 2, &pkey, &pvalue)
-        || PyBytes_AsStringAndSize(pkey, &key, &ksize) == -1
-        || PyBytes_AsStringAndSize(pvalue, &value, &vsize) == -1)
-        return NULL;
-    
-    if (sp_set(db->db, key, (size_t)ksize, value, (size_t)vsize) == -1) {
-        PyErr_SetString(SophiaError, sp_error(db->db));
-        return NULL;
-    }
-    
-    Py_RETURN_NONE;
+    size_t offset = offsetof(SophiaEntry, key) + entry->ksize;
+    offset = (offset + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    return (SophiaCached *)((char *)entry + offset);
 }
 
-static PyObject *
-sophia_db_get(SophiaDB *db, PyObject *args)
+static inline size_t
+sophia_cache_cost(SophiaEntry *entry)
 {
-    char *key;
-    PyObject *pkey, *pvalue = NULL;
-    void *value;
-    Py_ssize_t ksize;
-    size_t vsize;
-    
-    ensure_is_opened(db, NULL);
+    return entry->ksize + (size_t)PyBytes_GET_SIZE(sophia_cached(entry)->value) + PSP_CACHE_OVERHEAD;
+}
+
+static void
+sophia_cache_remove(SophiaDB *db, SophiaEntry *entry)
+{
+    SophiaCached *cached = sophia_cached(entry);
+    SophiaEntry *last = db->cache_ring[db->cache.count - 1];
     
-    if (!PyArg_UnpackTuple(args, "get", 1, 2, &pkey, &pvalue)
-        || PyBytes_AsStringAndSize(pkey, &key, &ksize) == -1)
-        return NULL;
-        
-    int rv = sp_get(db->db, key, (size_t)ksize, &value, &vsize);
-    switch (rv) {
-        case 1:
-            pvalue = PyBytes_FromStringAndSize(value, (Py_ssize_t)vsize);
-            free(value);
-            return pvalue;
-        case 0:
-            if (pvalue)
-                return pvalue;
-            Py_RETURN_NONE;
-        default:
-            PyErr_SetString(SophiaError, sp_error(db->db));
-            return NULL;
-    }
+    db->cache_ring[cached->slot] = last;
+    sophia_cached(last)->slot = cached->slot;
+    db->cache_bytes -= sophia_cache_cost(entry);
+    Py_DECREF(cached->value);
+    sophia_table_remove(&db->cache, entry);
 }
 
+/* Return a borrowed reference to the cached value of a record, or NULL */
 static PyObject *
-sophia_db_contains(SophiaDB *db, PyObject *args)
+sophia_cache_find(SophiaDB *db, const char *key, size_t ksize)
 {
-    char *key;
-    PyObject *pkey;
-    Py_ssize_t ksize;
+    SophiaEntry *entry = sophia_table_find(&db->cache, key, ksize, sophia_hash(key, ksize));
     
-    ensure_is_opened(db, NULL);
-    
-    if (!PyArg_UnpackTuple(args, "get", 1, 1, &pkey)
-        || PyBytes_AsStringAndSize(pkey, &key, &ksize) == -1)
+    if (!entry) {
+        db->cache_misses++;
         return NULL;
-    
-    int rv = sp_get(db->db, key, (size_t)ksize, NULL, NULL);
-    switch (rv) {
-        case 1:
-            Py_RETURN_TRUE;
-        case 0:
-            Py_RETURN_FALSE;
-        default:
-            PyErr_SetString(SophiaError, sp_error(db->db));
-            return NULL;
     }
+    db->cache_hits++;
+    entry->flags = 1;
+    return sophia_cached(entry)->value;
 }
 
-static PyObject *
-sophia_db_delete(SophiaDB *db, PyObject *args)
+/* Cache the value read for a record, unless a write happened since `epoch`.
+ * Failing to do so isn't an error.
+ */
+static void
+sophia_cache_insert(SophiaDB *db, size_t epoch, const char *key, size_t ksize, PyObject *value)
 {
-    char *key;
-    PyObject *pkey;
-    Py_ssize_t ksize;
-    
-    ensure_is_opened(db, NULL);
+    size_t hash = sophia_hash(key, ksize);
+    SophiaEntry *entry;
+    SophiaCached *cached;
     
-    if (!PyArg_UnpackTuple(args, "delete", 1, 1, &pkey)
-        || PyBytes_AsStringAndSize(pkey, &key, &ksize) == -1)
-        return NULL;
-    
-    if (sp_delete(db->db, key, (size_t)ksize) == -1) {
-        PyErr_SetString(SophiaError, sp_error(db->db));
-        return NULL;
+    if (epoch != db->cache_epoch
+        || ksize + (size_t)PyBytes_GET_SIZE(value) + PSP_CACHE_OVERHEAD > db->cache_budget
+        || sophia_table_find(&db->cache, key, ksize, hash))
+        return;
+    if (db->cache.count == db->cache_ring_size) {
+        size_t size = db->cache_ring_size ? db->cache_ring_size * 2 : 64;
+        SophiaEntry **ring = realloc(db->cache_ring, size * sizeof(SophiaEntry *));
+        if (!ring)
+            return;
+        db->cache_ring = ring;
+        db->cache_ring_size = size;
     }
+    if (!(entry = sophia_table_add(&db->cache, key, ksize, hash, sizeof(void *) - 1 + sizeof(SophiaCached))))
+        return;
+    cached = sophia_cached(entry);
+    Py_INCREF(value);
+    cached->value = value;
+    cached->slot = db->cache.count - 1;
+    db->cache_ring[cached->slot] = entry;
+    db->cache_bytes += sophia_cache_cost(entry);
     
-    Py_RETURN_NONE;
+    while (db->cache_bytes > db->cache_budget) {
+        if (db->cache_hand >= db->cache.count)
+            db->cache_hand = 0;
+        entry = db->cache_ring[db->cache_hand];
+        if (entry->flags)
+            entry->flags = 0;
+        else {
+            /* the last entry takes the slot of the evicted one, and is
+             * considered next
+             */
+            sophia_cache_remove(db, entry);
+            db->cache_evictions++;
+            continue;
+        }
+        db->cache_hand++;
+    }
 }
 
-/* Count the number of records in the database. This is O(n) time,
- * and then absolutely inefficient, but keeping an up-to-date counter
- * of the records would require to check the existence of a record before
- * each insert or delete operation, which would be very costly at the end.
- */
-static PyObject *
-sophia_db_count_records(SophiaDB *db)
+/* Forget the cached value of a record, after it has been written */
+static void
+sophia_cache_invalidate(SophiaDB *db, const char *key, size_t ksize)
 {
-    size_t count = 0;
+    SophiaEntry *entry;
     
-    ensure_is_opened(db, NULL);
+    db->cache_epoch++;
+    if (db->cache.count > 0
+        && (entry = sophia_table_find(&db->cache, key, ksize, sophia_hash(key, ksize))))
+        sophia_cache_remove(db, entry);
+}
+
+static void
+sophia_cache_clear(SophiaDB *db)
+{
+    db->cache_epoch++;
+    while (db->cache.count > 0)
+        sophia_cache_remove(db, db->cache_ring[db->cache.count - 1]);
+    db->cache_hand = 0;
+}
+
+/* Write a record, or delete it if `value` is NULL, with the GIL released */
+static int
+sophia_db_write(SophiaDB *db, const char *key, size_t ksize,
+                const char *value, size_t vsize, char *err)
+{
+    int rv;
+    
+    if (db->group_latency > 0)
+        return sophia_group_write(db, key, ksize, value, vsize, err);
+    
+    pthread_mutex_lock(&db->lock);
+    rv = db->db ? sophia_db_write_locked(db, key, ksize, value, vsize, err)
+                : sophia_closed_error(err);
+    pthread_mutex_unlock(&db->lock);
+    return rv;
+}
+
+/* Count the records from `start` (or the first one, if NULL) to `end` (or the
+ * last one), with the database lock held.
+ */
+static int
+sophia_db_scan_count(SophiaDB *db, const char *start, size_t ssize,
+                     const char *end, size_t esize, int end_inclusive,
+                     size_t *count, char *err)
+{
+    void *cur = sp_cursor(db->db, SPGTE, start, ssize);
+    
+    if (!cur) {
+        sophia_copy_error(db->db, err);
+        return -1;
+    }
+    *count = 0;
+    while (sp_fetch(cur)) {
+        if (end) {
+            int cmp = sophia_db_compare(db, sp_key(cur), sp_keysize(cur), end, esize);
+            if (cmp > 0 || (cmp == 0 && !end_inclusive))
+                break;
+        }
+        (*count)++;
+    }
+    sp_destroy(cur);
+    return 0;
+}
+
+/* Path of a file kept by the binding in the database directory */
+static char *
+sophia_db_file(SophiaDB *db, const char *name)
+{
+    char *path = PyMem_Malloc(strlen(db->path) + strlen(name) + 2);
+    
+    if (path)
+        sprintf(path, "%s/%s", db->path, name);
+    return path;
+}
+
+/* Initialize the record counter of a database which has just been opened.
+ * It is read from the file where it was saved when the database was last
+ * closed, if any. This file is removed in any case until the database is
+ * closed again, so that a stale counter is never used after a crash, or
+ * after the database was modified while the records weren't counted.
+ */
+static int
+sophia_db_load_counter(SophiaDB *db)
+{
+    int rv = 0;
+    unsigned long long count;
+    char *path, err[PSP_ERRMAX];
+    FILE *file;
+    
+    if (!(path = sophia_db_file(db, PSP_COUNT_FILE))) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    if ((file = fopen(path, "r"))) {
+        rv = fscanf(file, "%llu", &count);
+        fclose(file);
+        unlink(path);
+    }
+    PyMem_Free(path);
+    
+    if (!db->counting)
+        return 0;
+    if (file && rv == 1) {
+        db->records = (size_t)count;
+        return 0;
+    }
+    
+    PSP_BEGIN_LOCKED(db)
+    rv = db->db ? sophia_db_scan_count(db, NULL, 0, NULL, 0, 0, &db->records, err)
+                : sophia_closed_error(err);
+    PSP_END_LOCKED(db)
+    
+    if (rv == -1)
+        PyErr_SetString(SophiaError, err);
+    return rv;
+}
+
+static void
+sophia_db_save_counter(SophiaDB *db)
+{
+    char *path = sophia_db_file(db, PSP_COUNT_FILE);
+    FILE *file;
+    
+    if (path && (file = fopen(path, "w"))) {
+        fprintf(file, "%llu\n", (unsigned long long)db->records);
+        fclose(file);
+    }
+    PyMem_Free(path);
+}
+
+/* The Bloom filter uses double hashing: the i-th bit of a key is h1 + i * h2,
+ * h2 being derived from h1 with the finalizer of MurmurHash3.
+ */
+static inline void
+sophia_bloom_hash(const char *key, size_t ksize, uint64_t *h1, uint64_t *h2)
+{
+    uint64_t h = (uint64_t)sophia_hash(key, ksize);
+    
+    *h1 = h;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    *h2 = h | 1;
+}
+
+/* Size a filter for `n` keys and a rate of false positives `rate` */
+static int
+sophia_bloom_init(SophiaBloom *bloom, size_t n, double rate)
+{
+    double bits = ceil(-(double)n * log(rate) / (M_LN2 * M_LN2));
+    
+    bloom->nbits = bits < 64 ? 64 : (uint64_t)bits;
+    bloom->nhashes = (uint32_t)(bits / (double)n * M_LN2 + 0.5);
+    if (bloom->nhashes < 1)
+        bloom->nhashes = 1;
+    if (!(bloom->bits = calloc((size_t)((bloom->nbits + 7) / 8), 1)))
+        return -1;
+    return 0;
+}
+
+static void
+sophia_bloom_add(SophiaBloom *bloom, const char *key, size_t ksize)
+{
+    uint64_t h1, h2, bit;
+    uint32_t i;
+    
+    sophia_bloom_hash(key, ksize, &h1, &h2);
+    for (i = 0; i < bloom->nhashes; i++) {
+        bit = (h1 + i * h2) % bloom->nbits;
+        bloom->bits[bit >> 3] |= (unsigned char)(1 << (bit & 7));
+    }
+}
+
+static int
+sophia_bloom_check(SophiaBloom *bloom, const char *key, size_t ksize)
+{
+    uint64_t h1, h2, bit;
+    uint32_t i;
+    
+    sophia_bloom_hash(key, ksize, &h1, &h2);
+    for (i = 0; i < bloom->nhashes; i++) {
+        bit = (h1 + i * h2) % bloom->nbits;
+        if (!(bloom->bits[bit >> 3] & (1 << (bit & 7))))
+            return 0;
+    }
+    return 1;
+}
+
+/* Is the key certainly absent, according to the Bloom filter, if any? */
+static inline int
+sophia_db_rejects(SophiaDB *db, const char *key, size_t ksize)
+{
+    if (!db->bloom.bits || sophia_bloom_check(&db->bloom, key, ksize))
+        return 0;
+    db->bloom_rejects++;
+    return 1;
+}
+
+/* Add all the keys of the database to a filter, with the database lock held */
+static int
+sophia_db_scan_keys(SophiaDB *db, SophiaBloom *bloom, char *err)
+{
+    void *cur = sp_cursor(db->db, SPGTE, NULL, 0);
+    
+    if (!cur) {
+        sophia_copy_error(db->db, err);
+        return -1;
+    }
+    while (sp_fetch(cur))
+        sophia_bloom_add(bloom, sp_key(cur), sp_keysize(cur));
+    sp_destroy(cur);
+    return 0;
+}
+
+/* Set up the Bloom filter of a database which has just been opened. As for
+ * the counter, it is read from the file where it was saved when the database
+ * was last closed, if its size is the requested one, and this file is removed
+ * in any case. Otherwise, the keys are scanned.
+ */
+static int
+sophia_db_load_bloom(SophiaDB *db)
+{
+    int rv = 0;
+    char *path, magic[sizeof(PSP_BLOOM_MAGIC)], err[PSP_ERRMAX];
+    uint64_t nbits;
+    uint32_t nhashes;
+    FILE *file;
+    SophiaBloom bloom;
+    
+    if (!(path = sophia_db_file(db, PSP_BLOOM_FILE))) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    if (db->bloom_keys && sophia_bloom_init(&bloom, db->bloom_keys, db->bloom_rate) == -1) {
+        PyMem_Free(path);
+        PyErr_NoMemory();
+        return -1;
+    }
+    if ((file = fopen(path, "rb"))) {
+        rv = db->bloom_keys
+            && fread(magic, sizeof(magic), 1, file) == 1
+            && memcmp(magic, PSP_BLOOM_MAGIC, sizeof(magic)) == 0
+            && fread(&nbits, sizeof(nbits), 1, file) == 1
+            && fread(&nhashes, sizeof(nhashes), 1, file) == 1
+            && nbits == bloom.nbits && nhashes == bloom.nhashes
+            && fread(bloom.bits, (size_t)((nbits + 7) / 8), 1, file) == 1;
+        fclose(file);
+        unlink(path);
+    }
+    PyMem_Free(path);
+    
+    if (!db->bloom_keys)
+        return 0;
+    if (!rv) {
+        memset(bloom.bits, 0, (size_t)((bloom.nbits + 7) / 8));
+        PSP_BEGIN_LOCKED(db)
+        rv = db->db ? sophia_db_scan_keys(db, &bloom, err) : sophia_closed_error(err);
+        PSP_END_LOCKED(db)
+        if (rv == -1) {
+            free(bloom.bits);
+            PyErr_SetString(SophiaError, err);
+            return -1;
+        }
+    }
+    free(db->bloom.bits);
+    db->bloom = bloom;
+    return 0;
+}
+
+static void
+sophia_db_save_bloom(SophiaDB *db)
+{
+    char *path = sophia_db_file(db, PSP_BLOOM_FILE);
+    FILE *file;
+    
+    if (path && (file = fopen(path, "wb"))) {
+        if (fwrite(PSP_BLOOM_MAGIC, sizeof(PSP_BLOOM_MAGIC), 1, file) != 1
+            || fwrite(&db->bloom.nbits, sizeof(db->bloom.nbits), 1, file) != 1
+            || fwrite(&db->bloom.nhashes, sizeof(db->bloom.nhashes), 1, file) != 1
+            || fwrite(db->bloom.bits, (size_t)((db->bloom.nbits + 7) / 8), 1, file) != 1) {
+            fclose(file);
+            unlink(path);
+        }
+        else
+            fclose(file);
+    }
+    PyMem_Free(path);
+}
+
+static int
+sophia_db_init(SophiaDB *db)
+{
+    if (db->db && sophia_db_close_internal(db) == -1)
+        return -1;
+    return 0;
+}
+
+/* Open (or reopen) the underlying sophia database iff no cursors
+ * are still in use.
+ */
+static PyObject *
+sophia_db_open(SophiaDB *db, PyObject *args)
+{
+    char *path, err[PSP_ERRMAX];
+    void *handle, *cmparg = NULL;
+    spcmpf cmp = sophia_compare_default;
+    
+    if (!PyArg_ParseTuple(args, "s:open", &path))
+        return NULL;
+    if ((db->cache_budget || db->bloom_keys) && !sophia_cmp_is_bytewise(db)) {
+        PyErr_SetString(SophiaError, "the read cache and the Bloom filter can't be used with a comparison "
+                                     "function under which keys of different bytes may be equal");
+        return NULL;
+    }
+    
+    if (db->db) {
+        int status = sophia_db_close_internal(db);
+        if (status == 0) {
+            db->close_me = 1;
+            db->deferred_closes++;
+            Py_RETURN_FALSE;
+        }
+        else if (status == -1)
+            return NULL;
+    }
+    
+    /* libsophia calls the comparator itself, unless the comparisons are
+     * counted, which costs an atomic increment per comparison */
+    if (db->cmp_stats) {
+        cmp = sophia_compare_counted;
+        cmparg = db;
+    }
+    else if (db->cmp_fun) {
+        cmp = sophia_compare_custom;
+        cmparg = db;
+    }
+    else if (db->cmp_native) {
+        cmp = db->cmp_native;
+        cmparg = db->cmp_format;
+    }
+    if (sp_ctl(db->env, SPDIR, SPO_CREAT | SPO_RDWR, path) == -1 ||
+        sp_ctl(db->env, SPCMP, cmp, cmparg) == -1)
+        return PyErr_NoMemory();
+
+    PSP_BEGIN_LOCKED(db)
+    if (!(handle = sp_open(db->env)))
+        sophia_copy_error(db->env, err);
+    db->db = handle;
+    PSP_END_LOCKED(db)
+    
+    if (!handle) {
+        PyErr_SetString(SophiaError, err);
+        return NULL;
+    }
+    
+    db->cursors = 0;
+    db->close_me = 0;
+    db->in_txn = 0;
+    
+    PyMem_Free(db->path);
+    if (!(db->path = PyMem_Malloc(strlen(path) + 1))) {
+        sophia_db_close_internal(db);
+        return PyErr_NoMemory();
+    }
+    strcpy(db->path, path);
+    
+    if (sophia_db_load_counter(db) == -1 || sophia_db_load_bloom(db) == -1) {
+        PyMem_Free(db->path);
+        db->path = NULL;
+        sophia_db_close_internal(db);
+        return NULL;
+    }
+    
+    Py_RETURN_TRUE;
+}
+
+/* Destroy the underlying sophia database iff no cursors are still in use,
+ * as it would be impossible to destroy them afterwards (trying to do so results
+ * in a segfault). If a cursor is still in use, mark the python database as
+ * "to be closed", and effectively close it when the last remaining cursor
+ * has been destroyed. A call to `Database.open()` sets the marker "to be closed"
+ * to false. 
+ */
+static int
+sophia_db_close_internal(SophiaDB *db)
+{
+    int rv;
+    char err[PSP_ERRMAX];
+    
+    if (!db->db)
+        return 1;
+    if (db->cursors > 0) {
+        return 0;
+    }
+    
+    PSP_BEGIN_LOCKED(db)
+    if (!db->db)
+        rv = 0;
+    else if (sophia_db_flush_overlay(db, err) == -1)
+        rv = -1;
+    else if ((rv = sp_destroy(db->db)) == -1)
+        sophia_copy_error(db->env, err);
+    else {
+        db->db = NULL;
+        /* a pending transaction is lost */
+        sophia_table_clear(&db->txn_keys, NULL, NULL);
+        db->in_txn = 0;
+    }
+    PSP_END_LOCKED(db)
+    
+    if (rv == 0 && db->counting && db->path)
+        sophia_db_save_counter(db);
+    if (rv == 0 && db->bloom.bits) {
+        if (db->path)
+            sophia_db_save_bloom(db);
+        free(db->bloom.bits);
+        db->bloom.bits = NULL;
+    }
+    if (rv == 0)
+        sophia_cache_clear(db);
+    
+    if (rv == -1) {
+        PyErr_SetString(SophiaError, err);
+        return -1;
+    }
+    return 1;
+}
+
+static PyObject *
+sophia_db_close(SophiaDB *db)
+{
+    int rv = sophia_db_close_internal(db);
+    if (rv == 1)
+        Py_RETURN_TRUE;
+    else if (rv == 0) {
+        db->close_me = 1;
+        db->deferred_closes++;
+        Py_RETURN_FALSE;
+    }
+    return NULL;
+}
+
+static PyObject *
+sophia_db_is_closed(SophiaDB *db)
+{
+    if (!db->db)
+        Py_RETURN_TRUE;
+    Py_RETURN_FALSE;
+}
+
+/* Keys and values can be passed as any object supporting the buffer protocol
+ * with a contiguous layout (bytes, bytearray, memoryview, array, etc.). Views
+ * are only held for the duration of a call, and must be released with
+ * PyBuffer_Release().
+ */
+static inline int
+sophia_get_view(PyObject *obj, Py_buffer *view)
+{
+    return PyObject_GetBuffer(obj, view, PyBUF_SIMPLE);
+}
+
+/* Return a bytes object with the contents of a buffer, for keys and values
+ * which must outlive the call: bytes objects are returned as is, other
+ * objects are copied, as they could be modified in the meantime.
+ */
+static PyObject *
+sophia_bytes_from_object(PyObject *obj)
+{
+    Py_buffer view;
+    PyObject *bytes;
+    
+    if (PyBytes_CheckExact(obj)) {
+        Py_INCREF(obj);
+        return obj;
+    }
+    if (sophia_get_view(obj, &view) == -1)
+        return NULL;
+    bytes = PyBytes_FromStringAndSize(view.buf, view.len);
+    PyBuffer_Release(&view);
+    return bytes;
+}
+
+static int
+pylong_to_uint32_t(PyObject *num, uint32_t *out)
+{
+    unsigned long value;
+    
+    value = PyLong_AsUnsignedLong(num);
+    if (PyErr_Occurred())
+        return -1;
+    if (value > UINT32_MAX) {
+        PyErr_SetString(PyExc_ValueError, "option value is out of bound");
+        return -1;
+    }
+    
+    *out = (uint32_t)value;
+    return 0;
+}
+
+static int
+pyfloat_to_double(PyObject *num, double *out)
+{
+    if (!PyFloat_Check(num)) {
+        PyErr_SetString(PyExc_TypeError, "expected a float");
+        return -1;
+    }
+    *out = PyFloat_AsDouble(num);
+    if (PyErr_Occurred())
+        return -1;
+    return 0;
+}
+
+/* Attach a comparison function to the database instance: either a python
+ * callable, or the constant of a native comparator (see `sophia_comparators`),
+ * followed by a struct format for CMP_STRUCT. Passing `None` resets the
+ * comparison function to the original default one. It is given to libsophia
+ * when the database is opened.
+ */
+static PyObject *
+sophia_db_set_cmp_fun(SophiaDB *db, PyObject *fun, PyObject *pformat)
+{
+    spcmpf cmp = sophia_compare_default;
+    SophiaKeyFormat *format = NULL;
+    
+    if (db->db) {
+        PyErr_SetString(SophiaError, "can't change this option while the database is opened");
+        return NULL;
+    }
+    
+    if (fun == Py_None)
+        ;
+    else if (PyCallable_Check(fun)) {
+        cmp = sophia_compare_custom;
+    }
+    else if (PyIndex_Check(fun)) {
+        const char *fmt;
+        long value = PyLong_AsLong(fun);
+        
+        if (value == -1 && PyErr_Occurred())
+            return NULL;
+        if (!(cmp = sophia_native_comparator(value))) {
+            PyErr_SetString(PyExc_ValueError, "unknown comparator");
+            return NULL;
+        }
+        if (value == CMP_STRUCT) {
+            if (!pformat) {
+                PyErr_SetString(PyExc_ValueError, "expected a key format");
+                return NULL;
+            }
+            if (!PyArg_Parse(pformat, "s", &fmt) || !(format = sophia_parse_key_format(fmt)))
+                return NULL;
+        }
+    }
+    else {
+        PyErr_SetString(PyExc_TypeError, "expected either a callable, a comparator, or None");
+        return NULL;
+    }
+    
+    if (cmp == sophia_compare_custom)
+        Py_INCREF(fun);
+    Py_XDECREF(db->cmp_fun);
+    db->cmp_fun = (cmp == sophia_compare_custom) ? fun : NULL;
+    db->cmp_native = (cmp == sophia_compare_custom || cmp == sophia_compare_default) ? NULL : cmp;
+    free(db->cmp_format);
+    db->cmp_format = format;
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+sophia_db_set_option(SophiaDB *db, PyObject *args)
+{
+    int rv, option;
+    PyObject *pvalue, *pvalue2 = NULL;
+    
+    if (!PyArg_ParseTuple(args, "iO|O:setopt", &option, &pvalue, &pvalue2))
+        return NULL;
+    
+    if (option == SPCMP) {
+        return sophia_db_set_cmp_fun(db, pvalue, pvalue2);
+    }
+    else if (option == PSPCOUNT) {
+    
+        int value = PyObject_IsTrue(pvalue);
+        if (value == -1)
+            return NULL;
+        if (db->db) {
+            PyErr_SetString(SophiaError, "can't change this option while the database is opened");
+            return NULL;
+        }
+        db->counting = (char)value;
+        Py_RETURN_NONE;
+    }
+    else if (option == PSPCMPSTATS) {
+    
+        int value = PyObject_IsTrue(pvalue);
+        if (value == -1)
+            return NULL;
+        if (db->db) {
+            PyErr_SetString(SophiaError, "can't change this option while the database is opened");
+            return NULL;
+        }
+        db->cmp_stats = (char)value;
+        Py_RETURN_NONE;
+    }
+    else if (option == PSPTHREADED) {
+    
+        int value = PyObject_IsTrue(pvalue);
+        if (value == -1)
+            return NULL;
+        if (db->db) {
+            PyErr_SetString(SophiaError, "can't change this option while the database is opened");
+            return NULL;
+        }
+        db->threaded = (char)value;
+        Py_RETURN_NONE;
+    }
+    else if (option == PSPGROUPCOMMIT) {
+    
+        double latency;
+        Py_ssize_t max = PSP_GROUP_MAX;
+        if ((latency = PyFloat_AsDouble(pvalue)) == -1.0 && PyErr_Occurred())
+            return NULL;
+        if (pvalue2 && (max = PyNumber_AsSsize_t(pvalue2, PyExc_OverflowError)) == -1 && PyErr_Occurred())
+            return NULL;
+        if (latency < 0 || max < 1) {
+            PyErr_SetString(PyExc_ValueError, "expected a latency of 0 or more, and a positive batch size");
+            return NULL;
+        }
+        if (db->db) {
+            PyErr_SetString(SophiaError, "can't change this option while the database is opened");
+            return NULL;
+        }
+        db->group_latency = latency;
+        db->group_max = (size_t)max;
+        Py_RETURN_NONE;
+    }
+    else if (option == PSPCACHE) {
+    
+        Py_ssize_t budget = PyNumber_AsSsize_t(pvalue, PyExc_OverflowError);
+        if (budget == -1 && PyErr_Occurred())
+            return NULL;
+        if (budget < 0) {
+            PyErr_SetString(PyExc_ValueError, "expected a positive size");
+            return NULL;
+        }
+        if (db->db) {
+            PyErr_SetString(SophiaError, "can't change this option while the database is opened");
+            return NULL;
+        }
+        db->cache_budget = (size_t)budget;
+        Py_RETURN_NONE;
+    }
+    else if (option == PSPBLOOM) {
+    
+        double rate = 0.01;
+        Py_ssize_t keys = PyNumber_AsSsize_t(pvalue, PyExc_OverflowError);
+        if (keys == -1 && PyErr_Occurred())
+            return NULL;
+        if (pvalue2 && (rate = PyFloat_AsDouble(pvalue2)) == -1.0 && PyErr_Occurred())
+            return NULL;
+        if (keys < 0 || !(rate > 0 && rate < 1)) {
+            PyErr_SetString(PyExc_ValueError, "expected a positive number of keys, and a rate between 0 and 1");
+            return NULL;
+        }
+        if (db->db) {
+            PyErr_SetString(SophiaError, "can't change this option while the database is opened");
+            return NULL;
+        }
+        db->bloom_keys = (size_t)keys;
+        db->bloom_rate = rate;
+        Py_RETURN_NONE;
+    }
+    else if (option == PSPKEYCODEC || option == PSPVALUECODEC) {
+    
+        if (db->db) {
+            PyErr_SetString(SophiaError, "can't change this option while the database is opened");
+            return NULL;
+        }
+        if (sophia_codec_init(option == PSPKEYCODEC ? &db->key_codec : &db->value_codec,
+                              pvalue, pvalue2) == -1)
+            return NULL;
+        Py_RETURN_NONE;
+    }
+    else if (option == SPPAGE || option == SPMERGEWM) {
+    
+        uint32_t value;
+        if (pylong_to_uint32_t(pvalue, &value) == -1)
+            return NULL;
+        rv = sp_ctl(db->env, option, value);
+    }
+    else if (option == SPGC || option == SPMERGE) {
+    
+        int value = PyObject_IsTrue(pvalue);
+        if (value == -1)
+            return NULL;
+        rv = sp_ctl(db->env, option, value);
+    }
+    else if (option == SPGCF) {
+    
+        double value;
+        if (pyfloat_to_double(pvalue, &value) == -1)
+            return NULL;
+        rv = sp_ctl(db->env, option, value);
+    }
+    else if (option == SPGROW) {
+
+        if (pvalue2 == NULL) {
+            PyErr_SetString(PyExc_ValueError, "expected a third argument");
+            return NULL;
+        }
+        
+        uint32_t new_size;
+        double resize;
+        
+        if (pylong_to_uint32_t(pvalue, &new_size) == -1 ||
+            pyfloat_to_double(pvalue2, &resize) == -1)
+            return NULL;
+        rv = sp_ctl(db->env, option, new_size, resize);
+    }
+    else {
+        PyErr_SetString(PyExc_ValueError, "unknown option");
+        return NULL;
+    }
+    
+    if (rv == -1) {
+        PyErr_SetString(SophiaError, sp_error(db->env));
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+#define ensure_is_opened(pdb, rv)                                       \
+do {                                                                    \
+    if (!(pdb)->db) {                                                   \
+        PyErr_SetString(SophiaError, "operation on a closed database"); \
+        return (rv);                                                    \
+    }                                                                   \
+} while (0)
+
+static PyObject *
+sophia_db_set(SophiaDB *db, PyObject *args)
+{
+    int rv;
+    char err[PSP_ERRMAX];
+    PyObject *pkey, *pvalue;
+    Py_buffer key, value;
+    uint64_t start;
+    
+    ensure_is_opened(db, NULL);
+    
+    if (!PyArg_UnpackTuple(args, "set", 2, 2, &pkey, &pvalue)
+        || sophia_encoded_view(&db->key_codec, pkey, &key) == -1)
+        return NULL;
+    if (sophia_encoded_view(&db->value_codec, pvalue, &value) == -1) {
+        PyBuffer_Release(&key);
+        return NULL;
+    }
+    
+    /* the filter must know the key before it can be read */
+    if (db->bloom.bits)
+        sophia_bloom_add(&db->bloom, key.buf, (size_t)key.len);
+    start = sophia_now();
+    Py_BEGIN_ALLOW_THREADS
+    rv = sophia_db_write(db, key.buf, (size_t)key.len, value.buf, (size_t)value.len, err);
+    Py_END_ALLOW_THREADS
+    sophia_stats_record(db, PSP_OP_SET, start);
+    if (rv == 0)
+        db->bytes_written += (uint64_t)(key.len + value.len);
+    if (db->cache_budget)
+        sophia_cache_invalidate(db, key.buf, (size_t)key.len);
+    PyBuffer_Release(&key);
+    PyBuffer_Release(&value);
+    if (rv == -1) {
+        PyErr_SetString(SophiaError, err);
+        return NULL;
+    }
+    
+    Py_INCREF(Py_None);
+    return sophia_cmp_checked(db, Py_None);
+}
+
+/* Decode a value held by a bytes object, which is returned as is by the raw
+ * codec, rather than copied.
+ */
+static PyObject *
+sophia_decode_bytes(SophiaCodec *codec, PyObject *bytes)
+{
+    if (codec->kind == PSP_CODEC_RAW) {
+        Py_INCREF(bytes);
+        return bytes;
+    }
+    return sophia_decode(codec, PyBytes_AS_STRING(bytes), (size_t)PyBytes_GET_SIZE(bytes));
+}
+
+static PyObject *
+sophia_db_get(SophiaDB *db, PyObject *args)
+{
+    int rv;
+    char err[PSP_ERRMAX];
+    Py_buffer key;
+    PyObject *pkey, *pvalue = NULL, *cached;
+    void *value;
+    size_t vsize, epoch;
+    uint64_t start;
+    
+    ensure_is_opened(db, NULL);
+    
+    if (!PyArg_UnpackTuple(args, "get", 1, 2, &pkey, &pvalue)
+        || sophia_encoded_view(&db->key_codec, pkey, &key) == -1)
+        return NULL;
+    
+    start = sophia_now();
+    if (db->cache_budget && (cached = sophia_cache_find(db, key.buf, (size_t)key.len))) {
+        PyBuffer_Release(&key);
+        sophia_stats_record(db, PSP_OP_GET, start);
+        return sophia_decode_bytes(&db->value_codec, cached);
+    }
+    epoch = db->cache_epoch;
+    
+    if (sophia_db_rejects(db, key.buf, (size_t)key.len))
+        rv = 0;
+    else {
+        PSP_BEGIN_LOCKED(db)
+        rv = db->db ? sophia_db_get_locked(db, key.buf, (size_t)key.len, &value, &vsize, err)
+                    : sophia_closed_error(err);
+        PSP_END_LOCKED(db)
+        if (rv == 0 && db->bloom.bits)
+            db->bloom_false_positives++;
+    }
+    sophia_stats_record(db, PSP_OP_GET, start);
+    switch (rv) {
+        case 1:
+            db->bytes_read += vsize;
+            if (db->cache_budget) {
+                if ((cached = PyBytes_FromStringAndSize(value, vsize))) {
+                    sophia_cache_insert(db, epoch, key.buf, (size_t)key.len, cached);
+                    pvalue = sophia_decode_bytes(&db->value_codec, cached);
+                    Py_DECREF(cached);
+                }
+                else
+                    pvalue = NULL;
+            }
+            else
+                pvalue = sophia_decode(&db->value_codec, value, vsize);
+            free(value);
+            break;
+        case 0:
+            if (!pvalue)
+                pvalue = Py_None;
+            Py_INCREF(pvalue);
+            break;
+        default:
+            PyErr_SetString(SophiaError, err);
+            pvalue = NULL;
+    }
+    PyBuffer_Release(&key);
+    return sophia_cmp_checked(db, pvalue);
+}
+
+/* Same as `sophia_db_get()`, but return the value as a `sophia.Buffer`
+ * object, which takes ownership of the memory allocated by libsophia,
+ * instead of copying it into a bytes object.
+ */
+static PyObject *
+sophia_db_get_buffer(SophiaDB *db, PyObject *args)
+{
+    int rv;
+    char err[PSP_ERRMAX];
+    void *value;
+    size_t vsize;
+    Py_buffer key;
+    PyObject *pkey, *pvalue = NULL;
+    SophiaBuffer *buf;
+    uint64_t start;
+    
+    ensure_is_opened(db, NULL);
+    
+    if (!PyArg_UnpackTuple(args, "get_buffer", 1, 2, &pkey, &pvalue)
+        || sophia_encoded_view(&db->key_codec, pkey, &key) == -1)
+        return NULL;
+    
+    start = sophia_now();
+    if (sophia_db_rejects(db, key.buf, (size_t)key.len))
+        rv = 0;
+    else {
+        PSP_BEGIN_LOCKED(db)
+        rv = db->db ? sophia_db_get_locked(db, key.buf, (size_t)key.len, &value, &vsize, err)
+                    : sophia_closed_error(err);
+        PSP_END_LOCKED(db)
+        if (rv == 0 && db->bloom.bits)
+            db->bloom_false_positives++;
+    }
+    PyBuffer_Release(&key);
+    sophia_stats_record(db, PSP_OP_GET, start);
+    switch (rv) {
+        case 1:
+            db->bytes_read += vsize;
+            if (!(buf = PyObject_New(SophiaBuffer, &SophiaBufferType))) {
+                free(value);
+                return NULL;
+            }
+            buf->data = value;
+            buf->size = (Py_ssize_t)vsize;
+            return sophia_cmp_checked(db, (PyObject *)buf);
+        case 0:
+            if (!pvalue)
+                pvalue = Py_None;
+            Py_INCREF(pvalue);
+            return sophia_cmp_checked(db, pvalue);
+        default:
+            PyErr_SetString(SophiaError, err);
+            return NULL;
+    }
+}
+
+static void
+sophia_buffer_dealloc(SophiaBuffer *buf)
+{
+    free(buf->data);
+    PyObject_Del(buf);
+}
+
+static Py_ssize_t
+sophia_buffer_length(SophiaBuffer *buf)
+{
+    return buf->size;
+}
+
+/* The memory is only released with the object itself, which is referenced by
+ * the views exported, so there is nothing to do when they are released.
+ */
+static int
+sophia_buffer_get(SophiaBuffer *buf, Py_buffer *view, int flags)
+{
+    return PyBuffer_FillInfo(view, (PyObject *)buf, buf->data, buf->size, 1, flags);
+}
+
+/* A record looked up by `sophia_db_get_many()` */
+typedef struct {
+    Py_buffer key;
+    void *value;           /* value returned by sp_get(), to be freed */
+    size_t vsize;
+    int found;
+    PyObject *cached;      /* value found in the read cache, or NULL */
+    int skip;              /* 1 if the record isn't looked up in the database */
+} SophiaLookup;
+
+/* Retrieve several records at once. All the lookups are done in a single
+ * locked section, so that the GIL is released only once for the whole batch.
+ * The values are returned as a list, in the order of the keys, or as a dict
+ * mapping each key to its value if `as_dict` is true.
+ */
+static PyObject *
+sophia_db_get_many(SophiaDB *db, PyObject *args, PyObject *kwargs)
+{
+    int rv = 0, as_dict = 0;
+    char err[PSP_ERRMAX];
+    PyObject *pkeys, *pdefault = Py_None, *keys, *prv = NULL;
+    SophiaLookup *lookups;
+    Py_ssize_t i, n, nviews = 0;
+    size_t epoch, false_positives = 0, bytes = 0;
+    
+    static char *keywords[] = {"keys", "default", "as_dict", NULL};
+    
+    ensure_is_opened(db, NULL);
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|Oi:get_many", keywords,
+                                     &pkeys, &pdefault, &as_dict))
+        return NULL;
+    
+    /* keep a reference to all the keys until we are done with them */
+    keys = PySequence_Fast(pkeys, "expected an iterable of keys");
+    if (!keys)
+        return NULL;
+    n = PySequence_Fast_GET_SIZE(keys);
+    
+    lookups = PyMem_Malloc((n ? n : 1) * sizeof(SophiaLookup));
+    if (!lookups) {
+        Py_DECREF(keys);
+        return PyErr_NoMemory();
+    }
+    for (i = 0; i < n; i++) {
+        lookups[i].found = lookups[i].skip = 0;
+        lookups[i].cached = NULL;
+    }
+    for (nviews = 0; nviews < n; nviews++) {
+        if (sophia_encoded_view(&db->key_codec, PySequence_Fast_GET_ITEM(keys, nviews),
+                                &lookups[nviews].key) == -1)
+            goto done;
+        if (db->cache_budget && (lookups[nviews].cached = sophia_cache_find(db,
+                lookups[nviews].key.buf, (size_t)lookups[nviews].key.len))) {
+            Py_INCREF(lookups[nviews].cached);
+            lookups[nviews].skip = 1;
+        }
+        else
+            lookups[nviews].skip = sophia_db_rejects(db, lookups[nviews].key.buf,
+                                                     (size_t)lookups[nviews].key.len);
+    }
+    epoch = db->cache_epoch;
+    
+    PSP_BEGIN_LOCKED(db)
+    if (!db->db) {
+        rv = -1;
+        strcpy(err, "operation on a closed database");
+    }
+    for (i = 0; i < n && rv != -1; i++) {
+        if (lookups[i].skip)
+            continue;
+        rv = sophia_db_get_locked(db, lookups[i].key.buf, (size_t)lookups[i].key.len,
+                                  &lookups[i].value, &lookups[i].vsize, err);
+        if (rv != -1)
+            lookups[i].found = rv;
+        if (rv == 1)
+            bytes += lookups[i].vsize;
+        if (rv == 0 && db->bloom.bits)
+            false_positives++;
+    }
+    PSP_END_LOCKED(db)
+    db->bloom_false_positives += false_positives;
+    db->bytes_read += bytes;
+    
+    if (rv == -1) {
+        PyErr_SetString(SophiaError, err);
+        goto done;
+    }
+    
+    prv = as_dict ? PyDict_New() : PyList_New(n);
+    if (!prv)
+        goto done;
+    
+    for (i = 0; i < n; i++) {
+        PyObject *pvalue;
+        
+        /* the values read are cached, and then decoded from the cache */
+        if (lookups[i].found && db->cache_budget) {
+            if (!(lookups[i].cached = PyBytes_FromStringAndSize(lookups[i].value, lookups[i].vsize))) {
+                Py_CLEAR(prv);
+                goto done;
+            }
+            sophia_cache_insert(db, epoch, lookups[i].key.buf, (size_t)lookups[i].key.len,
+                                lookups[i].cached);
+        }
+        if (lookups[i].found || lookups[i].cached) {
+            pvalue = lookups[i].cached
+                ? sophia_decode_bytes(&db->value_codec, lookups[i].cached)
+                : sophia_decode(&db->value_codec, lookups[i].value, lookups[i].vsize);
+            if (!pvalue) {
+                Py_CLEAR(prv);
+                goto done;
+            }
+        }
+        else {
+            Py_INCREF(pdefault);
+            pvalue = pdefault;
+        }
+        if (!as_dict) {
+            PyList_SET_ITEM(prv, i, pvalue);
+            continue;
+        }
+        rv = PyDict_SetItem(prv, PySequence_Fast_GET_ITEM(keys, i), pvalue);
+        Py_DECREF(pvalue);
+        if (rv == -1) {
+            Py_CLEAR(prv);
+            goto done;
+        }
+    }
+
+done:
+    for (i = 0; i < n; i++) {
+        if (lookups[i].found)
+            free(lookups[i].value);
+        Py_XDECREF(lookups[i].cached);
+    }
+    for (i = 0; i < nviews; i++)
+        PyBuffer_Release(&lookups[i].key);
+    PyMem_Free(lookups);
+    Py_DECREF(keys);
+    return sophia_cmp_checked(db, prv);
+}
+
+static PyObject *
+sophia_db_contains(SophiaDB *db, PyObject *args)
+{
+    int rv;
+    char err[PSP_ERRMAX];
+    Py_buffer key;
+    PyObject *pkey;
+    uint64_t start;
+    
+    ensure_is_opened(db, NULL);
+    
+    if (!PyArg_UnpackTuple(args, "get", 1, 1, &pkey)
+        || sophia_encoded_view(&db->key_codec, pkey, &key) == -1)
+        return NULL;
+    
+    start = sophia_now();
+    if (sophia_db_rejects(db, key.buf, (size_t)key.len))
+        rv = 0;
+    else {
+        PSP_BEGIN_LOCKED(db)
+        rv = db->db ? sophia_db_get_locked(db, key.buf, (size_t)key.len, NULL, NULL, err)
+                    : sophia_closed_error(err);
+        PSP_END_LOCKED(db)
+        if (rv == 0 && db->bloom.bits)
+            db->bloom_false_positives++;
+    }
+    PyBuffer_Release(&key);
+    sophia_stats_record(db, PSP_OP_CONTAINS, start);
+    switch (rv) {
+        case 1:
+        case 0:
+            return sophia_cmp_checked(db, PyBool_FromLong(rv));
+        default:
+            PyErr_SetString(SophiaError, err);
+            return NULL;
+    }
+}
+
+static PyObject *
+sophia_db_delete(SophiaDB *db, PyObject *args)
+{
+    int rv;
+    char err[PSP_ERRMAX];
+    Py_buffer key;
+    PyObject *pkey;
+    uint64_t start;
+    
+    ensure_is_opened(db, NULL);
+    
+    if (!PyArg_UnpackTuple(args, "delete", 1, 1, &pkey)
+        || sophia_encoded_view(&db->key_codec, pkey, &key) == -1)
+        return NULL;
+    
+    start = sophia_now();
+    Py_BEGIN_ALLOW_THREADS
+    rv = sophia_db_write(db, key.buf, (size_t)key.len, NULL, 0, err);
+    Py_END_ALLOW_THREADS
+    sophia_stats_record(db, PSP_OP_DELETE, start);
+    if (rv == 0)
+        db->bytes_written += (uint64_t)key.len;
+    if (db->cache_budget)
+        sophia_cache_invalidate(db, key.buf, (size_t)key.len);
+    PyBuffer_Release(&key);
+    if (rv == -1) {
+        PyErr_SetString(SophiaError, err);
+        return NULL;
+    }
+    
+    Py_INCREF(Py_None);
+    return sophia_cmp_checked(db, Py_None);
+}
+
+/* A record buffered by `sophia_db_set_many()` */
+typedef struct {
+    PyObject *pkey;        /* bytes objects owning the data below, or NULL */
+    PyObject *pvalue;
+    char *key;
+    Py_ssize_t ksize;
+    char *value;           /* NULL if the record should be deleted */
+    Py_ssize_t vsize;
+} SophiaRecord;
+
+/* Write a chunk of buffered records in a single locked section. Unless a
+ * transaction has been started by the user, in which case the records simply
+ * join it, the chunk is written in its own transaction. While snapshot cursors
+ * are in use, the records join the overlay, which is applied atomically.
+ */
+static int
+sophia_db_write_chunk(SophiaDB *db, SophiaRecord *records, Py_ssize_t n)
+{
+    int rv = 0, own_txn = 0;
+    char err[PSP_ERRMAX];
+    Py_ssize_t i;
+    
+    if (db->bloom.bits) {
+        for (i = 0; i < n; i++) {
+            if (records[i].value)
+                sophia_bloom_add(&db->bloom, records[i].key, (size_t)records[i].ksize);
+        }
+    }
+    
+    PSP_BEGIN_LOCKED(db)
+    if (!db->db)
+        rv = sophia_closed_error(err);
+    else if ((rv = sophia_db_buffering(db, err)) == -1)
+        ;
+    else if ((own_txn = !db->in_txn && !rv) && (rv = sophia_txn_begin(db)) == -1)
+        sophia_copy_error(db->db, err);
+    
+    for (i = 0; i < n && rv != -1; i++)
+        rv = sophia_db_write_locked(db, records[i].key, (size_t)records[i].ksize,
+                                    records[i].value, (size_t)records[i].vsize, err);
+    
+    if (db->db && own_txn && i > 0) {
+        if (rv == -1)
+            sophia_txn_rollback(db);
+        else if ((rv = sophia_txn_commit(db)) == -1)
+            sophia_copy_error(db->db, err);
+    }
+    PSP_END_LOCKED(db)
+    
+    if (db->cache_budget) {
+        for (i = 0; i < n; i++)
+            sophia_cache_invalidate(db, records[i].key, (size_t)records[i].ksize);
+    }
+    if (rv == -1) {
+        PyErr_SetString(SophiaError, err);
+        return -1;
+    }
+    for (i = 0; i < n; i++)
+        db->bytes_written += (uint64_t)(records[i].ksize + (records[i].value ? records[i].vsize : 0));
+    return 0;
+}
+
+/* Return an iterator over the (key, value) pairs of an iterable, or of a
+ * dict.
+ */
+static PyObject *
+sophia_iter_pairs(PyObject *ppairs)
+{
+    PyObject *iter;
+    
+    if (PyDict_Check(ppairs))
+        ppairs = PyObject_CallMethod(ppairs, "items", NULL);
+    else
+        Py_INCREF(ppairs);
+    if (!ppairs)
+        return NULL;
+    iter = PyObject_GetIter(ppairs);
+    Py_DECREF(ppairs);
+    return iter;
+}
+
+/* Fill a record from a (key, value) pair. A value of `None` is accepted iff
+ * `allow_delete` is true, and marks the record for deletion. Records are kept
+ * while the next pairs are read, so their keys and values are copied unless
+ * they are bytes objects (see `sophia_bytes_from_object()`). On success, the
+ * record must be cleared with `sophia_record_clear()`.
+ */
+static int
+sophia_record_from_pair(SophiaDB *db, SophiaRecord *rec, PyObject *item, int allow_delete)
+{
+    PyObject *pair, *pvalue;
+    
+    rec->pkey = rec->pvalue = NULL;
+    pair = PySequence_Fast(item, "expected (key, value) pairs");
+    if (!pair)
+        return -1;
+    if (PySequence_Fast_GET_SIZE(pair) != 2) {
+        PyErr_SetString(PyExc_ValueError, "expected (key, value) pairs");
+        goto error;
+    }
+    
+    pvalue = PySequence_Fast_GET_ITEM(pair, 1);
+    rec->value = NULL;
+    rec->vsize = 0;
+    if (!(rec->pkey = sophia_encoded_bytes(&db->key_codec, PySequence_Fast_GET_ITEM(pair, 0))))
+        goto error;
+    if ((pvalue != Py_None || !allow_delete) &&
+        !(rec->pvalue = sophia_encoded_bytes(&db->value_codec, pvalue)))
+        goto error;
+    
+    rec->key = PyBytes_AS_STRING(rec->pkey);
+    rec->ksize = PyBytes_GET_SIZE(rec->pkey);
+    if (rec->pvalue) {
+        rec->value = PyBytes_AS_STRING(rec->pvalue);
+        rec->vsize = PyBytes_GET_SIZE(rec->pvalue);
+    }
+    Py_DECREF(pair);
+    return 0;
+
+error:
+    Py_CLEAR(rec->pkey);
+    Py_DECREF(pair);
+    return -1;
+}
+
+static inline void
+sophia_record_clear(SophiaRecord *rec)
+{
+    Py_CLEAR(rec->pkey);
+    Py_CLEAR(rec->pvalue);
+}
+
+/* Write the pairs yielded by an iterator in chunks of at most `chunk`
+ * records, or `max_bytes` bytes of keys and values. If `sorted` is true, the
+ * keys are expected to come in increasing order (under the active comparison
+ * function), and a ValueError is raised otherwise. Return the number of
+ * records written, or -1 on failure.
+ */
+static Py_ssize_t
+sophia_db_write_pairs(SophiaDB *db, PyObject *iter, Py_ssize_t chunk,
+                      Py_ssize_t max_bytes, int sorted)
+{
+    Py_ssize_t bytes = 0, n = 0, written = 0, psize = 0, i;
+    Py_ssize_t size = chunk < PSP_CHUNK ? chunk : PSP_CHUNK;
+    PyObject *item, *prev = NULL;
+    SophiaRecord *records, *tmp;
+    char *pkey = NULL;
+    
+    records = PyMem_Malloc(size * sizeof(SophiaRecord));
+    if (!records) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    
+    while ((item = PyIter_Next(iter))) {
+        SophiaRecord *rec;
+        int rv;
+        
+        /* the records are only allocated as they come, up to `chunk` */
+        if (n == size) {
+            size = size > chunk / 2 ? chunk : 2 * size;
+            tmp = ((size_t)size > PY_SSIZE_T_MAX / sizeof(SophiaRecord)) ? NULL
+                : PyMem_Realloc(records, size * sizeof(SophiaRecord));
+            if (!tmp) {
+                Py_DECREF(item);
+                PyErr_NoMemory();
+                goto error;
+            }
+            records = tmp;
+        }
+        rec = &records[n];
+        rv = sophia_record_from_pair(db, rec, item, !sorted);
+        
+        Py_DECREF(item);
+        if (rv == -1)
+            goto error;
+        n++;
+        
+        if (sorted) {
+            if (prev && sophia_db_compare(db, pkey, (size_t)psize,
+                                          rec->key, (size_t)rec->ksize) > 0) {
+                PyErr_SetString(PyExc_ValueError, "keys are not sorted");
+                goto error;
+            }
+            if (PyErr_Occurred())
+                goto error;
+            /* keep the previous key alive to check the order of the next one */
+            Py_XDECREF(prev);
+            Py_INCREF(rec->pkey);
+            prev = rec->pkey;
+            pkey = rec->key;
+            psize = rec->ksize;
+        }
+        
+        bytes += rec->ksize + rec->vsize;
+        if (n < chunk && bytes < max_bytes)
+            continue;
+        
+        if (sophia_db_write_chunk(db, records, n) == -1)
+            goto error;
+        written += n;
+        for (i = 0; i < n; i++)
+            sophia_record_clear(&records[i]);
+        n = 0;
+        bytes = 0;
+    }
+    
+    if (!PyErr_Occurred() && (n == 0 || sophia_db_write_chunk(db, records, n) == 0)) {
+        written += n;
+        goto done;
+    }
+
+error:
+    written = -1;
+done:
+    for (i = 0; i < n; i++)
+        sophia_record_clear(&records[i]);
+    Py_XDECREF(prev);
+    PyMem_Free(records);
+    return written;
+}
+
+/* Write the (key, value) pairs of an iterable, or of a mapping. Pairs with a
+ * value of `None` delete the corresponding record. The records are written in
+ * transactions of at most `chunk` records, or `max_bytes` bytes of keys and
+ * values, so that the memory used is bounded whatever the size of the input.
+ * Return the number of records written. On failure, the chunks which have
+ * already been committed are kept.
+ */
+static PyObject *
+sophia_db_set_many(SophiaDB *db, PyObject *args, PyObject *kwargs)
+{
+    Py_ssize_t chunk = PSP_CHUNK, max_bytes = PSP_CHUNK_BYTES, written;
+    PyObject *ppairs, *iter;
+    
+    static char *keywords[] = {"pairs", "chunk", "max_bytes", NULL};
+    
+    ensure_is_opened(db, NULL);
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|nn:set_many", keywords,
+                                     &ppairs, &chunk, &max_bytes))
+        return NULL;
+    if (chunk < 1 || max_bytes < 1) {
+        PyErr_SetString(PyExc_ValueError, "chunk and max_bytes must be positive");
+        return NULL;
+    }
+    
+    if (!(iter = sophia_iter_pairs(ppairs)))
+        return NULL;
+    written = sophia_db_write_pairs(db, iter, chunk, max_bytes, 0);
+    Py_DECREF(iter);
+    
+    if (written == -1)
+        return NULL;
+    return sophia_cmp_checked(db, PyLong_FromSsize_t(written));
+}
+
+/* A record buffered in memory, or spilled to disk, by `sophia_db_load()` */
+typedef struct {
+    size_t ksize;
+    size_t vsize;
+    char data[];           /* the key, immediately followed by the value */
+} SophiaSortRecord;
+
+/* A sorted run of records spilled to a temporary file */
+typedef struct {
+    FILE *file;
+    SophiaSortRecord *head;        /* next record of the run, NULL at the end */
+} SophiaRun;
+
+typedef struct {
+    SophiaDB *db;
+    const char *tmpdir;            /* where to create the runs, or NULL */
+    SophiaRun runs[PSP_MAX_RUNS];
+    size_t nruns;
+    SophiaSortRecord **buf;        /* records waiting to be sorted */
+    size_t nbuf, bufsize, bytes;
+    SophiaRecord *chunk;           /* records waiting to be written */
+    SophiaSortRecord **owned;      /* ... and their storage */
+    Py_ssize_t nchunk, chunkbytes;
+    Py_ssize_t written;
+} SophiaLoader;
+
+/* Stable merge sort of an array of records under the active comparison
+ * function.
+ */
+static void
+sophia_sort_records(SophiaDB *db, SophiaSortRecord **recs,
+                    SophiaSortRecord **tmp, size_t n)
+{
+    size_t i, j, k, mid = n / 2;
+    
+    if (n < 2)
+        return;
+    sophia_sort_records(db, recs, tmp, mid);
+    sophia_sort_records(db, recs + mid, tmp, n - mid);
+    
+    memcpy(tmp, recs, mid * sizeof(SophiaSortRecord *));
+    for (i = 0, j = mid, k = 0; i < mid && j < n; k++) {
+        if (sophia_db_compare(db, recs[j]->data, recs[j]->ksize,
+                              tmp[i]->data, tmp[i]->ksize) < 0)
+            recs[k] = recs[j++];
+        else
+            recs[k] = tmp[i++];
+    }
+    while (i < mid)
+        recs[k++] = tmp[i++];
+}
+
+static FILE *
+sophia_spill_open(const char *tmpdir)
+{
+    int fd;
+    FILE *file;
+    char *path;
+    
+    if (!tmpdir)
+        return tmpfile();
+    
+    path = malloc(strlen(tmpdir) + sizeof("/pysophia-XXXXXX"));
+    if (!path)
+        return NULL;
+    sprintf(path, "%s/pysophia-XXXXXX", tmpdir);
+    fd = mkstemp(path);
+    if (fd != -1)
+        unlink(path);
+    free(path);
+    if (fd == -1 || !(file = fdopen(fd, "w+b"))) {
+        if (fd != -1)
+            close(fd);
+        return NULL;
+    }
+    return file;
+}
+
+/* Read the next record of a run into `out`. Return 1 on success, 0 at the
+ * end of the run, and -1 on failure, with errno set.
+ */
+static int
+sophia_spill_read(FILE *file, SophiaSortRecord **out)
+{
+    size_t sizes[2];
+    SophiaSortRecord *rec;
+    
+    *out = NULL;
+    if (fread(sizes, sizeof(size_t), 2, file) != 2)
+        return ferror(file) ? -1 : 0;
+    rec = malloc(sizeof(SophiaSortRecord) + sizes[0] + sizes[1]);
+    if (!rec) {
+        errno = ENOMEM;
+        return -1;
+    }
+    rec->ksize = sizes[0];
+    rec->vsize = sizes[1];
+    if (fread(rec->data, 1, rec->ksize + rec->vsize, file) != rec->ksize + rec->vsize) {
+        free(rec);
+        if (!ferror(file))
+            errno = EIO;       /* truncated run */
+        return -1;
+    }
+    *out = rec;
+    return 1;
+}
+
+static int
+sophia_spill_write(FILE *file, SophiaSortRecord *rec)
+{
+    if (fwrite(&rec->ksize, sizeof(size_t), 1, file) != 1
+        || fwrite(&rec->vsize, sizeof(size_t), 1, file) != 1
+        || fwrite(rec->data, 1, rec->ksize + rec->vsize, file) != rec->ksize + rec->vsize)
+        return -1;
+    return 0;
+}
+
+/* Hand a record over to the loader, which frees it once written. Return 1 if
+ * the chunk is complete, and must be written with `sophia_loader_flush()`.
+ * This doesn't need the GIL.
+ */
+static int
+sophia_loader_add(SophiaLoader *ld, SophiaSortRecord *rec)
+{
+    SophiaRecord *out = &ld->chunk[ld->nchunk];
+    
+    out->pkey = out->pvalue = NULL;
+    out->key = rec->data;
+    out->ksize = (Py_ssize_t)rec->ksize;
+    out->value = rec->data + rec->ksize;
+    out->vsize = (Py_ssize_t)rec->vsize;
+    ld->owned[ld->nchunk++] = rec;
+    ld->chunkbytes += out->ksize + out->vsize;
+    return ld->nchunk == PSP_CHUNK || ld->chunkbytes >= PSP_CHUNK_BYTES;
+}
+
+/* Write the records handed over to the loader into the database */
+static int
+sophia_loader_flush(SophiaLoader *ld)
+{
+    Py_ssize_t i;
+    int rv = 0;
+    
+    if (ld->nchunk > 0 && (rv = sophia_db_write_chunk(ld->db, ld->chunk, ld->nchunk)) == 0)
+        ld->written += ld->nchunk;
+    for (i = 0; i < ld->nchunk; i++)
+        free(ld->owned[i]);
+    ld->nchunk = 0;
+    ld->chunkbytes = 0;
+    return rv;
+}
+
+/* Is the head of the run `a` lower than the head of the run `b`? Ties are
+ * broken by the rank of the runs, so that the last duplicate of a key read
+ * from the input is also the last written.
+ */
+static inline int
+sophia_run_lower(SophiaLoader *ld, size_t a, size_t b)
+{
+    int cmp = sophia_db_compare(ld->db,
+        ld->runs[a].head->data, ld->runs[a].head->ksize,
+        ld->runs[b].head->data, ld->runs[b].head->ksize);
+    return cmp < 0 || (cmp == 0 && a < b);
+}
+
+static void
+sophia_heap_sift(SophiaLoader *ld, size_t *heap, size_t n, size_t i)
+{
+    for (;;) {
+        size_t min = i, l = 2 * i + 1, r = l + 1, tmp;
+        
+        if (l < n && sophia_run_lower(ld, heap[l], heap[min]))
+            min = l;
+        if (r < n && sophia_run_lower(ld, heap[r], heap[min]))
+            min = r;
+        if (min == i)
+            return;
+        tmp = heap[i];
+        heap[i] = heap[min];
+        heap[min] = tmp;
+        i = min;
+    }
+}
+
+/* Merge all the runs spilled so far, either into a new run `out`, or into
+ * the database if `out` is NULL. The merged runs are closed. The GIL is
+ * released meanwhile, unless a python comparison function needs it, and only
+ * taken back to write the chunks of records.
+ */
+static int
+sophia_loader_merge(SophiaLoader *ld, FILE *out)
+{
+    size_t heap[PSP_MAX_RUNS], n = 0, i;
+    int rv = 0, error = 0;
+    PyThreadState *tstate = NULL;
+    
+    if (!sophia_cmp_needs_gil(ld->db))
+        tstate = PyEval_SaveThread();
+    
+    for (i = 0; i < ld->nruns && rv != -1; i++) {
+        rewind(ld->runs[i].file);
+        if ((rv = sophia_spill_read(ld->runs[i].file, &ld->runs[i].head)) == 1)
+            heap[n++] = i;
+    }
+    if (rv == -1) {
+        error = errno;
+        goto done;
+    }
+    for (i = n / 2; i-- > 0; )
+        sophia_heap_sift(ld, heap, n, i);
+    
+    while (n > 0) {
+        SophiaRun *run = &ld->runs[heap[0]];
+        SophiaSortRecord *rec = run->head;
+        
+        run->head = NULL;
+        if (out) {
+            rv = sophia_spill_write(out, rec);
+            free(rec);
+            if (rv == -1) {
+                error = errno;
+                break;
+            }
+        }
+        else if (sophia_loader_add(ld, rec)) {
+            if (tstate)
+                PyEval_RestoreThread(tstate);
+            rv = sophia_loader_flush(ld);
+            if (tstate)
+                tstate = PyEval_SaveThread();
+            if (rv == -1)
+                break;
+        }
+        
+        if ((rv = sophia_spill_read(run->file, &run->head)) == -1) {
+            error = errno;
+            break;
+        }
+        if (rv == 0)
+            heap[0] = heap[--n];
+        sophia_heap_sift(ld, heap, n, 0);
+    }
+
+done:
+    for (i = 0; i < ld->nruns; i++) {
+        free(ld->runs[i].head);
+        ld->runs[i].head = NULL;
+        fclose(ld->runs[i].file);
+    }
+    ld->nruns = 0;
+    if (tstate)
+        PyEval_RestoreThread(tstate);
+    if (error) {
+        errno = error;
+        PyErr_SetFromErrno(PyExc_IOError);
+    }
+    return PyErr_Occurred() ? -1 : 0;
+}
+
+/* Sort the buffered records and spill them to a new run. When the maximum
+ * number of runs is reached, they are first merged together into one.
+ */
+static int
+sophia_loader_spill(SophiaLoader *ld)
+{
+    FILE *file;
+    size_t i;
+    int rv = 0;
+    PyThreadState *tstate = NULL;
+    SophiaSortRecord **tmp;
+    
+    if (ld->nruns == PSP_MAX_RUNS) {
+        if (!(file = sophia_spill_open(ld->tmpdir))) {
+            PyErr_SetFromErrno(PyExc_IOError);
+            return -1;
+        }
+        if (sophia_loader_merge(ld, file) == -1) {
+            fclose(file);
+            return -1;
+        }
+        ld->runs[ld->nruns].head = NULL;
+        ld->runs[ld->nruns++].file = file;
+    }
+    
+    if (!(tmp = PyMem_Malloc((ld->nbuf / 2 + 1) * sizeof(SophiaSortRecord *)))) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    if (!(file = sophia_spill_open(ld->tmpdir))) {
+        PyMem_Free(tmp);
+        PyErr_SetFromErrno(PyExc_IOError);
+        return -1;
+    }
+    
+    /* a python comparison function needs the GIL */
+    if (!sophia_cmp_needs_gil(ld->db))
+        tstate = PyEval_SaveThread();
+    sophia_sort_records(ld->db, ld->buf, tmp, ld->nbuf);
+    for (i = 0; i < ld->nbuf; i++) {
+        if (rv == 0)
+            rv = sophia_spill_write(file, ld->buf[i]);
+        free(ld->buf[i]);
+    }
+    if (tstate)
+        PyEval_RestoreThread(tstate);
+    
+    PyMem_Free(tmp);
+    ld->nbuf = 0;
+    ld->bytes = 0;
+    ld->runs[ld->nruns].head = NULL;
+    ld->runs[ld->nruns++].file = file;
+    
+    if (rv == -1)
+        PyErr_SetFromErrno(PyExc_IOError);
+    return PyErr_Occurred() ? -1 : 0;
+}
+
+static int
+sophia_loader_grow(SophiaLoader *ld)
+{
+    size_t size = ld->bufsize ? ld->bufsize * 2 : 1024;
+    SophiaSortRecord **buf = PyMem_Realloc(ld->buf, size * sizeof(SophiaSortRecord *));
+    
+    if (!buf)
+        return -1;
+    ld->buf = buf;
+    ld->bufsize = size;
+    return 0;
+}
+
+/* Read the (key, value) pairs of an iterator into the loader, spilling them
+ * to sorted runs whenever more than `max_memory` bytes are buffered.
+ */
+static int
+sophia_loader_read(SophiaLoader *ld, PyObject *iter, Py_ssize_t max_memory)
+{
+    PyObject *item;
+    
+    while ((item = PyIter_Next(iter))) {
+        SophiaRecord pair;
+        SophiaSortRecord *rec;
+        int rv = sophia_record_from_pair(ld->db, &pair, item, 0);
+        
+        Py_DECREF(item);
+        if (rv == -1)
+            return -1;
+        
+        rec = malloc(sizeof(SophiaSortRecord) + pair.ksize + pair.vsize);
+        if (!rec || (ld->nbuf == ld->bufsize && sophia_loader_grow(ld) == -1)) {
+            free(rec);
+            sophia_record_clear(&pair);
+            PyErr_NoMemory();
+            return -1;
+        }
+        rec->ksize = (size_t)pair.ksize;
+        rec->vsize = (size_t)pair.vsize;
+        memcpy(rec->data, pair.key, rec->ksize);
+        memcpy(rec->data + rec->ksize, pair.value, rec->vsize);
+        sophia_record_clear(&pair);
+        
+        ld->buf[ld->nbuf++] = rec;
+        ld->bytes += sizeof(SophiaSortRecord) + sizeof(rec) + rec->ksize + rec->vsize;
+        if (ld->bytes >= (size_t)max_memory && sophia_loader_spill(ld) == -1)
+            return -1;
+    }
+    return PyErr_Occurred() ? -1 : 0;
+}
+
+/* Load records into the database in the order of their keys, which is the
+ * fastest way to fill a database. If `sorted` is true, the keys are expected
+ * to be already sorted, and the records are streamed straight to the
+ * database. Otherwise, they are sorted first with an external merge sort, by
+ * spilling sorted runs of at most `max_memory` bytes to temporary files
+ * created in `tmpdir`, which are merged afterwards.
+ */
+static PyObject *
+sophia_db_load(SophiaDB *db, PyObject *args, PyObject *kwargs)
+{
+    int sorted = 0, rv = -1;
+    Py_ssize_t max_memory = 64 << 20, i;
+    char *tmpdir = NULL;
+    PyObject *ppairs, *iter;
+    SophiaLoader ld;
+    
+    static char *keywords[] = {"pairs", "sorted", "max_memory", "tmpdir", NULL};
+    
+    ensure_is_opened(db, NULL);
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|inz:load", keywords,
+                                     &ppairs, &sorted, &max_memory, &tmpdir))
+        return NULL;
+    if (max_memory < 1) {
+        PyErr_SetString(PyExc_ValueError, "max_memory must be positive");
+        return NULL;
+    }
+    if (!(iter = sophia_iter_pairs(ppairs)))
+        return NULL;
+    
+    if (sorted) {
+        Py_ssize_t written = sophia_db_write_pairs(db, iter, PSP_CHUNK, PSP_CHUNK_BYTES, 1);
+        Py_DECREF(iter);
+        return written == -1 ? NULL : sophia_cmp_checked(db, PyLong_FromSsize_t(written));
+    }
+    
+    memset(&ld, 0, sizeof(SophiaLoader));
+    ld.db = db;
+    ld.tmpdir = tmpdir;
+    ld.chunk = PyMem_Malloc(PSP_CHUNK * sizeof(SophiaRecord));
+    ld.owned = PyMem_Malloc(PSP_CHUNK * sizeof(SophiaSortRecord *));
+    if (!ld.chunk || !ld.owned) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    
+    if (sophia_loader_read(&ld, iter, max_memory) == -1)
+        goto done;
+    
+    if (ld.nruns == 0) {
+        /* everything fits into memory */
+        if (ld.nbuf > 0) {
+            PyThreadState *tstate = NULL;
+            SophiaSortRecord **tmp = PyMem_Malloc((ld.nbuf / 2 + 1) * sizeof(SophiaSortRecord *));
+            if (!tmp) {
+                PyErr_NoMemory();
+                goto done;
+            }
+            /* a python comparison function needs the GIL */
+            if (!sophia_cmp_needs_gil(db))
+                tstate = PyEval_SaveThread();
+            sophia_sort_records(db, ld.buf, tmp, ld.nbuf);
+            if (tstate)
+                PyEval_RestoreThread(tstate);
+            PyMem_Free(tmp);
+        }
+        if (PyErr_Occurred())
+            goto done;
+        for (i = 0; i < (Py_ssize_t)ld.nbuf; i++) {
+            SophiaSortRecord *rec = ld.buf[i];
+            ld.buf[i] = NULL;
+            if (sophia_loader_add(&ld, rec) && sophia_loader_flush(&ld) == -1)
+                goto done;
+        }
+    }
+    else if ((ld.nbuf > 0 && sophia_loader_spill(&ld) == -1)
+             || sophia_loader_merge(&ld, NULL) == -1)
+        goto done;
+    
+    rv = sophia_loader_flush(&ld);
+
+done:
+    for (i = 0; i < (Py_ssize_t)ld.nbuf; i++)
+        free(ld.buf[i]);
+    for (i = 0; i < ld.nchunk; i++)
+        free(ld.owned[i]);
+    for (i = 0; i < (Py_ssize_t)ld.nruns; i++) {
+        free(ld.runs[i].head);
+        fclose(ld.runs[i].file);
+    }
+    PyMem_Free(ld.buf);
+    PyMem_Free(ld.chunk);
+    PyMem_Free(ld.owned);
+    Py_DECREF(iter);
+    
+    if (rv == -1)
+        return NULL;
+    return sophia_cmp_checked(db, PyLong_FromSsize_t(ld.written));
+}
+
+/* Dumps.
+ *
+ * A dump holds the records of a database in the order of their keys, as
+ * stored. It starts with "SOPHDUMP", followed by its version and its flags,
+ * and is made of blocks of records. Each block starts with a header of the
+ * number of its records, their size, the size stored, and the CRC-32 of the
+ * bytes stored, which are the records, compressed with zlib if this makes
+ * them smaller. A record is the size of its key and the size of its value,
+ * followed by the key and the value. The last block holds no record, but the
+ * total number of records, as a 64-bit number. All the numbers are stored
+ * little-endian, on 32 bits unless noted otherwise.
+ */
+#define PSP_DUMP_MAGIC "SOPHDUMP"
+#define PSP_DUMP_VERSION 1
+#define PSP_DUMP_COMPRESSED 1      /* flag of the dumps with compressed blocks */
+#define PSP_DUMP_HEADER 16         /* size of the header of a dump, or a block */
+#define PSP_DUMP_BLOCK (1 << 20)   /* default size of the records of a block */
+#define PSP_DUMP_MAX_BLOCK (1 << 30)
+#define PSP_DUMP_MAX_RECORD ((size_t)1 << 31)
+
+typedef struct {
+    int level;             /* compression level, or 0 */
+    size_t block_size;
+    char *raw;             /* records of the current block */
+    size_t rawlen;
+    size_t rawsize;
+    uint32_t nraw;
+    char *out;             /* the block, as written */
+    size_t outsize;
+    char *resume;          /* key of the last record dumped, or NULL */
+    size_t rsize;
+    int end;               /* 1 once all the records have been read */
+    int fd;                /* file written to, or -1 */
+    PyObject *file;        /* object written to otherwise */
+    uint64_t records;
+    uint64_t bytes;
+    char err[PSP_ERRMAX];
+} SophiaDump;
+
+static inline void
+sophia_store_u32(char *p, uint32_t value)
+{
+    int i;
+    
+    for (i = 0; i < 4; i++)
+        p[i] = (char)(value >> (8 * i));
+}
+
+static inline uint32_t
+sophia_load_u32(const char *p)
+{
+    uint32_t value = 0;
+    int i;
+    
+    for (i = 3; i >= 0; i--)
+        value = (value << 8) | (unsigned char)p[i];
+    return value;
+}
+
+/* The path given as a str, bytes or os.PathLike object, as a bytes object.
+ * Return NULL, without an exception set, if the object is none of them.
+ */
+static PyObject *
+sophia_fs_path(PyObject *obj)
+{
+#if PY_VERSION_HEX >= 0x03060000
+    PyObject *path, *rv;
+    
+    if (!PyBytes_Check(obj) && !PyUnicode_Check(obj) && PyObject_HasAttrString(obj, "__fspath__")) {
+        if (!(path = PyOS_FSPath(obj)))
+            return NULL;
+        rv = sophia_fs_path(path);
+        Py_DECREF(path);
+        return rv;
+    }
+#endif
+    if (PyBytes_Check(obj)) {
+        Py_INCREF(obj);
+        return obj;
+    }
+    if (PyUnicode_Check(obj))
+#if PY_MAJOR_VERSION >= 3
+        return PyUnicode_EncodeFSDefault(obj);
+#else
+        return PyUnicode_AsEncodedString(obj, Py_FileSystemDefaultEncoding ?
+                                         Py_FileSystemDefaultEncoding : "utf-8", "strict");
+#endif
+    return NULL;
+}
+
+/* Read the records of the next block of a dump, after the last one dumped,
+ * with the database lock held. Return 0 on success, -1 on failure, or -2 if
+ * memory is exhausted.
+ */
+static int
+sophia_dump_fill(SophiaDB *db, SophiaDump *d)
+{
+    const char *key, *value, *last = NULL;
+    size_t ksize, vsize, lsize = 0, needed;
+    void *cur;
+    char *p;
+    int rv = 0;
+    
+    d->rawlen = 0;
+    d->nraw = 0;
+    if (!db->db)
+        return sophia_closed_error(d->err);
+    if (!(cur = sp_cursor(db->db, d->resume ? SPGT : SPGTE, d->resume, d->rsize))) {
+        sophia_copy_error(db->db, d->err);
+        return -1;
+    }
+    while (d->rawlen < d->block_size) {
+        if (!sp_fetch(cur)) {
+            d->end = 1;
+            break;
+        }
+        key = sp_key(cur);
+        ksize = sp_keysize(cur);
+        value = sp_value(cur);
+        vsize = sp_valuesize(cur);
+        if (ksize + vsize > PSP_DUMP_MAX_RECORD) {
+            strcpy(d->err, "record too large to be dumped");
+            rv = -1;
+            break;
+        }
+        needed = d->rawlen + 8 + ksize + vsize;
+        if (needed > d->rawsize) {
+            size_t size = d->rawsize * 2 > needed ? d->rawsize * 2 : needed;
+            if (!(p = realloc(d->raw, size))) {
+                rv = -2;
+                break;
+            }
+            d->raw = p;
+            d->rawsize = size;
+        }
+        p = d->raw + d->rawlen;
+        sophia_store_u32(p, (uint32_t)ksize);
+        sophia_store_u32(p + 4, (uint32_t)vsize);
+        memcpy(p + 8, key, ksize);
+        memcpy(p + 8 + ksize, value, vsize);
+        d->rawlen = needed;
+        d->nraw++;
+        last = key;
+        lsize = ksize;
+    }
+    if (rv == 0 && last) {
+        if (lsize > d->rsize || !d->resume) {
+            if (!(p = realloc(d->resume, lsize ? lsize : 1)))
+                rv = -2;
+            else
+                d->resume = p;
+        }
+        if (rv == 0) {
+            memcpy(d->resume, last, lsize);
+            d->rsize = lsize;
+        }
+    }
+    sp_destroy(cur);
+    return rv;
+}
+
+/* Build the block of the records read into `d->out`, compressing them if
+ * asked to. Return its size, or 0 if memory is exhausted.
+ */
+static size_t
+sophia_dump_pack(SophiaDump *d, uint32_t nrecords)
+{
+    size_t needed = PSP_DUMP_HEADER + (d->level ? compressBound((uLong)d->rawlen) : d->rawlen);
+    uLongf stored = 0;
+    char *p;
+    
+    if (needed > d->outsize) {
+        if (!(p = realloc(d->out, needed)))
+            return 0;
+        d->out = p;
+        d->outsize = needed;
+    }
+    stored = (uLongf)(needed - PSP_DUMP_HEADER);
+    if (!d->level
+        || compress2((Bytef *)d->out + PSP_DUMP_HEADER, &stored, (const Bytef *)d->raw,
+                     (uLong)d->rawlen, d->level) != Z_OK
+        || stored >= d->rawlen) {
+        memcpy(d->out + PSP_DUMP_HEADER, d->raw, d->rawlen);
+        stored = (uLongf)d->rawlen;
+    }
+    sophia_store_u32(d->out, nrecords);
+    sophia_store_u32(d->out + 4, (uint32_t)d->rawlen);
+    sophia_store_u32(d->out + 8, (uint32_t)stored);
+    sophia_store_u32(d->out + 12, (uint32_t)crc32(0, (const Bytef *)d->out + PSP_DUMP_HEADER, (uInt)stored));
+    return PSP_DUMP_HEADER + (size_t)stored;
+}
+
+/* Write to the file of the dump, without the GIL */
+static int
+sophia_dump_write_fd(SophiaDump *d, const char *p, size_t size)
+{
+    ssize_t n;
+    
+    while (size > 0) {
+        if ((n = write(d->fd, p, size)) == -1) {
+            if (errno == EINTR)
+                continue;
+            snprintf(d->err, PSP_ERRMAX, "failed to write the dump: %s", strerror(errno));
+            return -1;
+        }
+        p += n;
+        size -= (size_t)n;
+    }
+    return 0;
+}
+
+/* Write to the object of the dump, with the GIL */
+static int
+sophia_dump_write_file(SophiaDump *d, const char *p, size_t size)
+{
+    PyObject *bytes, *rv;
+    
+    if (!(bytes = PyBytes_FromStringAndSize(p, (Py_ssize_t)size)))
+        return -1;
+    rv = PyObject_CallMethod(d->file, "write", "O", bytes);
+    Py_DECREF(bytes);
+    Py_XDECREF(rv);
+    return rv ? 0 : -1;
+}
+
+static int
+sophia_dump_progress(PyObject *progress, uint64_t records, uint64_t bytes)
+{
+    PyObject *rv;
+    
+    if (progress == Py_None)
+        return 0;
+    rv = PyObject_CallFunction(progress, "KK", (unsigned long long)records,
+                               (unsigned long long)bytes);
+    Py_XDECREF(rv);
+    return rv ? 0 : -1;
+}
+
+static char *
+sophia_memdup(const char *p, size_t size)
+{
+    char *copy = malloc(size ? size : 1);
+    
+    if (copy)
+        memcpy(copy, p, size);
+    return copy;
+}
+
+/* Dump the records into a file, or a file object:
+ * `dump(file, compress=0, block_size=1048576, progress=None)`. The records
+ * are read by blocks of about `block_size` bytes, each in a locked section,
+ * compressed with the zlib level `compress`, if not 0, and written at once.
+ * `progress(records, bytes)` is called after each block. Return the number
+ * of records dumped.
+ */
+static PyObject *
+sophia_db_dump(SophiaDB *db, PyObject *args, PyObject *kwargs)
+{
+    static char *keywords[] = {"file", "compress", "block_size", "progress", NULL};
+    PyObject *pfile, *ppath = NULL, *progress = Py_None, *rv = NULL;
+    Py_ssize_t block_size = PSP_DUMP_BLOCK;
+    char header[PSP_DUMP_HEADER];
+    SophiaDump d;
+    size_t size;
+    int status;
+    
+    ensure_is_opened(db, NULL);
+    
+    d.level = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|inO:dump", keywords,
+                                     &pfile, &d.level, &block_size, &progress))
+        return NULL;
+    if (d.level < 0 || d.level > 9) {
+        PyErr_SetString(PyExc_ValueError, "compress must be a zlib level, from 0 to 9");
+        return NULL;
+    }
+    if (block_size < 1 || block_size > PSP_DUMP_MAX_BLOCK) {
+        PyErr_SetString(PyExc_ValueError, "block_size must be between 1 and 2**30");
+        return NULL;
+    }
+    d.block_size = (size_t)block_size;
+    d.raw = d.out = d.resume = NULL;
+    d.rawlen = d.rawsize = d.outsize = d.rsize = 0;
+    d.nraw = 0;
+    d.end = 0;
+    d.fd = -1;
+    d.file = NULL;
+    d.records = d.bytes = 0;
+    
+    if ((ppath = sophia_fs_path(pfile))) {
+        if ((d.fd = open(PyBytes_AS_STRING(ppath), O_WRONLY | O_CREAT | O_TRUNC, 0666)) == -1) {
+            PyErr_SetFromErrnoWithFilename(PyExc_IOError, PyBytes_AS_STRING(ppath));
+            goto done;
+        }
+    }
+    else if (PyErr_Occurred())
+        return NULL;
+    else
+        d.file = pfile;
+    
+    memcpy(header, PSP_DUMP_MAGIC, 8);
+    sophia_store_u32(header + 8, PSP_DUMP_VERSION);
+    sophia_store_u32(header + 12, d.level ? PSP_DUMP_COMPRESSED : 0);
+    if (d.file ? sophia_dump_write_file(&d, header, PSP_DUMP_HEADER) == -1
+               : sophia_dump_write_fd(&d, header, PSP_DUMP_HEADER) == -1)
+        goto write_error;
+    d.bytes = PSP_DUMP_HEADER;
+    
+    while (!d.end) {
+        size = 0;
+        Py_BEGIN_ALLOW_THREADS
+        pthread_mutex_lock(&db->lock);
+        status = sophia_dump_fill(db, &d);
+        pthread_mutex_unlock(&db->lock);
+        if (status == 0 && d.nraw > 0 && !(size = sophia_dump_pack(&d, d.nraw)))
+            status = -2;
+        if (status == 0 && size > 0 && !d.file)
+            status = sophia_dump_write_fd(&d, d.out, size);
+        Py_END_ALLOW_THREADS
+        
+        if (status == -2) {
+            PyErr_NoMemory();
+            goto done;
+        }
+        if (status == -1)
+            goto write_error;
+        if (size > 0 && d.file && sophia_dump_write_file(&d, d.out, size) == -1)
+            goto done;
+        d.records += d.nraw;
+        d.bytes += size;
+        if (d.nraw > 0 && sophia_dump_progress(progress, d.records, d.bytes) == -1)
+            goto done;
+    }
+    
+    /* the last block holds the number of records */
+    d.level = 0;
+    d.rawlen = 0;
+    if (d.rawsize < 8) {
+        free(d.raw);
+        if (!(d.raw = malloc(8))) {
+            PyErr_NoMemory();
+            goto done;
+        }
+        d.rawsize = 8;
+    }
+    sophia_store_u32(d.raw, (uint32_t)d.records);
+    sophia_store_u32(d.raw + 4, (uint32_t)(d.records >> 32));
+    d.rawlen = 8;
+    if (!(size = sophia_dump_pack(&d, 0))) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    if (d.file ? sophia_dump_write_file(&d, d.out, size) == -1
+               : sophia_dump_write_fd(&d, d.out, size) == -1)
+        goto write_error;
+    if (d.fd != -1) {
+        status = close(d.fd);
+        d.fd = -1;
+        if (status == -1) {
+            snprintf(d.err, PSP_ERRMAX, "failed to write the dump: %s", strerror(errno));
+            goto write_error;
+        }
+    }
+    rv = PyLong_FromUnsignedLongLong((unsigned long long)d.records);
+    goto done;
+    
+write_error:
+    if (!PyErr_Occurred())
+        PyErr_SetString(SophiaError, d.err);
+done:
+    if (d.fd != -1)
+        close(d.fd);
+    Py_XDECREF(ppath);
+    free(d.raw);
+    free(d.out);
+    free(d.resume);
+    return rv;
+}
+
+/* The contents of a dump: a file mapped into memory, or a buffer read from a
+ * file object, from the position of the file object.
+ */
+typedef struct {
+    const char *data;
+    size_t size;
+    void *map;             /* the mapping, if any ... */
+    size_t map_size;       /* ... and its size */
+    PyObject *bytes;       /* the buffer, otherwise */
+    PyObject *file;        /* the file object, if any ... */
+    long long start;       /* ... and its position, or -1 if unknown */
+} SophiaDumpSource;
+
+/* Map a file into memory, from `start`, which the mapping is aligned down
+ * to a page for.
+ */
+static int
+sophia_dump_map(SophiaDumpSource *src, int fd, const char *name, long long start)
+{
+    struct stat st;
+    off_t offset;
+    
+    if (fstat(fd, &st) == -1) {
+        PyErr_SetFromErrnoWithFilename(PyExc_IOError, name);
+        return -1;
+    }
+    if (start >= (long long)st.st_size)
+        return 0;
+    offset = (off_t)start & ~((off_t)sysconf(_SC_PAGESIZE) - 1);
+    src->map_size = (size_t)(st.st_size - offset);
+    if ((src->map = mmap(NULL, src->map_size, PROT_READ, MAP_PRIVATE, fd, offset)) == MAP_FAILED) {
+        src->map = NULL;
+        PyErr_SetFromErrnoWithFilename(PyExc_IOError, name);
+        return -1;
+    }
+#ifdef MADV_SEQUENTIAL
+    madvise(src->map, src->map_size, MADV_SEQUENTIAL);
+#endif
+    src->data = (const char *)src->map + (start - offset);
+    src->size = (size_t)(st.st_size - start);
+    return 0;
+}
+
+/* Open a dump given as a path, or a file object, which is mapped into memory
+ * from its current position if it has a file descriptor, and read otherwise.
+ */
+static int
+sophia_dump_open(SophiaDumpSource *src, PyObject *pfile)
+{
+    PyObject *ppath, *pfd, *ppos;
+    int fd, rv;
+    
+    src->data = NULL;
+    src->size = src->map_size = 0;
+    src->map = NULL;
+    src->bytes = NULL;
+    src->file = NULL;
+    src->start = -1;
+    
+    if ((ppath = sophia_fs_path(pfile))) {
+        if ((fd = open(PyBytes_AS_STRING(ppath), O_RDONLY)) == -1) {
+            PyErr_SetFromErrnoWithFilename(PyExc_IOError, PyBytes_AS_STRING(ppath));
+            Py_DECREF(ppath);
+            return -1;
+        }
+        rv = sophia_dump_map(src, fd, PyBytes_AS_STRING(ppath), 0);
+        close(fd);
+        Py_DECREF(ppath);
+        return rv;
+    }
+    if (PyErr_Occurred())
+        return -1;
+    
+    src->file = pfile;
+    if ((ppos = PyObject_CallMethod(pfile, "tell", NULL))) {
+        src->start = PyLong_AsLongLong(ppos);
+        Py_DECREF(ppos);
+        if (src->start == -1 && PyErr_Occurred())
+            return -1;
+    }
+    else
+        PyErr_Clear();
+    if (src->start >= 0 && (pfd = PyObject_CallMethod(pfile, "fileno", NULL))) {
+        fd = (int)PyLong_AsLong(pfd);
+        Py_DECREF(pfd);
+        if (fd == -1 && PyErr_Occurred())
+            return -1;
+        return sophia_dump_map(src, fd, NULL, src->start);
+    }
+    PyErr_Clear();
+    if (!(src->bytes = PyObject_CallMethod(pfile, "read", NULL)))
+        return -1;
+    if (!PyBytes_Check(src->bytes)) {
+        PyErr_SetString(PyExc_TypeError, "expected a path, or a file object opened in binary mode");
+        return -1;
+    }
+    src->data = PyBytes_AS_STRING(src->bytes);
+    src->size = (size_t)PyBytes_GET_SIZE(src->bytes);
+    return 0;
+}
+
+static void
+sophia_dump_close(SophiaDumpSource *src)
+{
+    if (src->map)
+        munmap(src->map, src->map_size);
+    Py_XDECREF(src->bytes);
+}
+
+/* Move a file object the dump was read from past its end */
+static int
+sophia_dump_seek_end(SophiaDumpSource *src, size_t end)
+{
+    PyObject *rv;
+    
+    if (!src->file || src->start < 0)
+        return 0;
+    rv = PyObject_CallMethod(src->file, "seek", "L", src->start + (long long)end);
+    Py_XDECREF(rv);
+    return rv ? 0 : -1;
+}
+
+/* Check and unpack the block of a dump at `pos`, without the GIL. The records
+ * which are not greater than `after` (unless NULL) are skipped. Return the
+ * number of bytes of the block, 0 on failure, or (size_t)-1 if memory is
+ * exhausted.
+ */
+static size_t
+sophia_restore_block(SophiaDB *db, SophiaDumpSource *src, size_t pos,
+                     char **buf, size_t *bufsize, SophiaRecord **recs, size_t *nrecs,
+                     uint32_t *count, const char *after, size_t asize, char *err)
+{
+    const char *p = src->data + pos, *data;
+    uint32_t n, raw, stored, i;
+    size_t ksize, vsize, off;
+    uLongf len;
+    void *tmp;
+    
+    if (src->size - pos < PSP_DUMP_HEADER)
+        goto truncated;
+    n = sophia_load_u32(p);
+    raw = sophia_load_u32(p + 4);
+    stored = sophia_load_u32(p + 8);
+    if (src->size - pos - PSP_DUMP_HEADER < stored)
+        goto truncated;
+    /* each record takes 8 bytes at least, so that a corrupted count of
+     * records doesn't make us allocate more than the block holds */
+    if (n > raw / 8)
+        goto corrupted;
+    data = p + PSP_DUMP_HEADER;
+    if ((uint32_t)crc32(0, (const Bytef *)data, (uInt)stored) != sophia_load_u32(p + 12)) {
+        snprintf(err, PSP_ERRMAX, "corrupted dump: bad checksum of the block at offset %zu", pos);
+        return 0;
+    }
+    if (stored > raw)
+        goto corrupted;
+    if (stored < raw) {
+        if (raw > *bufsize) {
+            if (!(tmp = realloc(*buf, raw)))
+                return (size_t)-1;
+            *buf = tmp;
+            *bufsize = raw;
+        }
+        len = (uLongf)raw;
+        if (uncompress((Bytef *)*buf, &len, (const Bytef *)data, (uLong)stored) != Z_OK || len != raw)
+            goto corrupted;
+        data = *buf;
+    }
+    
+    if (n > *nrecs) {
+        if (!(tmp = realloc(*recs, n * sizeof(SophiaRecord))))
+            return (size_t)-1;
+        *recs = tmp;
+        *nrecs = n;
+    }
+    *count = 0;
+    if (n == 0) {
+        /* the last block, stored as is */
+        if (raw != 8 || stored != 8)
+            goto corrupted;
+        return PSP_DUMP_HEADER + stored;
+    }
+    for (i = 0, off = 0; i < n; i++) {
+        if (raw - off < 8)
+            goto corrupted;
+        ksize = sophia_load_u32(data + off);
+        vsize = sophia_load_u32(data + off + 4);
+        off += 8;
+        if (raw - off < ksize + vsize)
+            goto corrupted;
+        if (!after || sophia_db_compare(db, data + off, ksize, after, asize) > 0) {
+            SophiaRecord *rec = &(*recs)[(*count)++];
+            rec->pkey = rec->pvalue = NULL;
+            rec->key = (char *)data + off;
+            rec->ksize = (Py_ssize_t)ksize;
+            rec->value = (char *)data + off + ksize;
+            rec->vsize = (Py_ssize_t)vsize;
+        }
+        off += ksize + vsize;
+    }
+    if (off != raw)
+        goto corrupted;
+    return PSP_DUMP_HEADER + stored;
+    
+truncated:
+    strcpy(err, "truncated dump");
+    return 0;
+corrupted:
+    snprintf(err, PSP_ERRMAX, "corrupted dump: bad block at offset %zu", pos);
+    return 0;
+}
+
+/* Restore the records of a dump: `restore(file, progress=None,
+ * resume=False)`. Each block is written in its own transaction, in the order
+ * of the keys. If `resume` is true, the records whose keys are not greater
+ * than the greatest key of the database are skipped, which resumes a restore
+ * into the same database after it was interrupted. `progress(records,
+ * bytes)` is called after each block. Return the number of records written.
+ */
+static PyObject *
+sophia_db_restore(SophiaDB *db, PyObject *args, PyObject *kwargs)
+{
+    static char *keywords[] = {"file", "progress", "resume", NULL};
+    PyObject *pfile, *progress = Py_None, *rv = NULL;
+    SophiaRecord *recs = NULL;
+    SophiaDumpSource src;
+    char *buf = NULL, *after = NULL, err[PSP_ERRMAX];
+    size_t bufsize = 0, nrecs = 0, asize = 0, pos, len;
+    uint64_t records = 0, written = 0, total;
+    uint32_t count;
+    int resume = 0, status = 0;
+    void *cur;
+    
+    ensure_is_opened(db, NULL);
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|Oi:restore", keywords,
+                                     &pfile, &progress, &resume))
+        return NULL;
+    if (sophia_dump_open(&src, pfile) == -1) {
+        sophia_dump_close(&src);
+        return NULL;
+    }
+    if (src.size < PSP_DUMP_HEADER || memcmp(src.data, PSP_DUMP_MAGIC, 8)) {
+        PyErr_SetString(SophiaError, "not a dump");
+        goto done;
+    }
+    if (sophia_load_u32(src.data + 8) != PSP_DUMP_VERSION) {
+        PyErr_SetString(SophiaError, "unsupported version of the dump");
+        goto done;
+    }
+    
+    if (resume) {
+        PSP_BEGIN_LOCKED(db)
+        if (!db->db)
+            status = sophia_closed_error(err);
+        else if (!(cur = sp_cursor(db->db, SPLTE, NULL, 0))) {
+            sophia_copy_error(db->db, err);
+            status = -1;
+        }
+        else {
+            if (sp_fetch(cur)) {
+                asize = sp_keysize(cur);
+                if (!(after = sophia_memdup(sp_key(cur), asize)))
+                    status = -2;
+            }
+            sp_destroy(cur);
+        }
+        PSP_END_LOCKED(db)
+        if (status == -2) {
+            PyErr_NoMemory();
+            goto done;
+        }
+        if (status == -1) {
+            PyErr_SetString(SophiaError, err);
+            goto done;
+        }
+    }
+    
+    for (pos = PSP_DUMP_HEADER;;) {
+        Py_BEGIN_ALLOW_THREADS
+        len = sophia_restore_block(db, &src, pos, &buf, &bufsize, &recs, &nrecs, &count,
+                                   after, asize, err);
+        Py_END_ALLOW_THREADS
+        if (len == (size_t)-1) {
+            PyErr_NoMemory();
+            goto done;
+        }
+        if (len == 0) {
+            PyErr_SetString(SophiaError, err);
+            goto done;
+        }
+        if (sophia_load_u32(src.data + pos) == 0)
+            break;
+        records += sophia_load_u32(src.data + pos);
+        pos += len;
+        if (count > 0 && sophia_db_write_chunk(db, recs, (Py_ssize_t)count) == -1)
+            goto done;
+        written += count;
+        if (sophia_dump_progress(progress, written, pos) == -1)
+            goto done;
+    }
+    
+    /* the last block holds the number of records of the dump */
+    total = sophia_load_u32(src.data + pos + PSP_DUMP_HEADER)
+        | (uint64_t)sophia_load_u32(src.data + pos + PSP_DUMP_HEADER + 4) << 32;
+    if (total != records) {
+        PyErr_SetString(SophiaError, "corrupted dump: wrong number of records");
+        goto done;
+    }
+    if (sophia_dump_seek_end(&src, pos + PSP_DUMP_HEADER + 8) == -1)
+        goto done;
+    rv = PyLong_FromUnsignedLongLong((unsigned long long)written);
+    
+done:
+    sophia_dump_close(&src);
+    free(buf);
+    free(recs);
+    free(after);
+    return sophia_cmp_checked(db, rv);
+}
+
+/* Count the number of records in the database. If the PSPCOUNT option is
+ * set, the counter maintained by the write operations is returned, which is
+ * O(1). Otherwise, all the records are traversed, which is O(n) time, but
+ * at least is done in C, without holding the GIL. Pending writes of the
+ * current transaction are not counted.
+ */
+static PyObject *
+sophia_db_count_records(SophiaDB *db)
+{
+    int rv;
+    size_t count = 0;
+    char err[PSP_ERRMAX];
+    
+    ensure_is_opened(db, NULL);
+    
+    if (db->counting)
+        return PyLong_FromSize_t(db->records);
+    
+    PSP_BEGIN_LOCKED(db)
+    rv = db->db ? sophia_db_scan_count(db, NULL, 0, NULL, 0, 0, &count, err)
+                : sophia_closed_error(err);
+    PSP_END_LOCKED(db)
+    
+    if (rv == -1) {
+        PyErr_SetString(SophiaError, err);
+        return NULL;
+    }
+    return sophia_cmp_checked(db, PyLong_FromSize_t(count));
+}
+
+/* Count the records whose keys lie between `start_key` and `end_key`,
+ * inclusive unless `end_inclusive` is false, under the active comparison
+ * function. Either bound can be None. The records are only counted, not
+ * copied, in a single locked section.
+ */
+static PyObject *
+sophia_db_count(SophiaDB *db, PyObject *args, PyObject *kwargs)
+{
+    static char *keywords[] = {"start_key", "end_key", "end_inclusive", NULL};
+    int rv, end_inclusive = 1;
+    size_t count = 0;
+    char err[PSP_ERRMAX];
+    PyObject *pstart = Py_None, *pend = Py_None;
+    Py_buffer start = {NULL}, end = {NULL};
+    
+    ensure_is_opened(db, NULL);
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|OOi:count", keywords,
+                                     &pstart, &pend, &end_inclusive))
+        return NULL;
+    if (pstart == Py_None && pend == Py_None && db->counting)
+        return PyLong_FromSize_t(db->records);
+    if (pstart != Py_None && sophia_encoded_view(&db->key_codec, pstart, &start) == -1)
+        return NULL;
+    if (pend != Py_None && sophia_encoded_view(&db->key_codec, pend, &end) == -1) {
+        PyBuffer_Release(&start);
+        return NULL;
+    }
+    
+    PSP_BEGIN_LOCKED(db)
+    rv = db->db ? sophia_db_scan_count(db, start.buf, (size_t)start.len, end.buf,
+                                       (size_t)end.len, end_inclusive, &count, err)
+                : sophia_closed_error(err);
+    PSP_END_LOCKED(db)
+    PyBuffer_Release(&start);
+    PyBuffer_Release(&end);
+    
+    if (rv == -1) {
+        PyErr_SetString(SophiaError, err);
+        return NULL;
+    }
+    return sophia_cmp_checked(db, PyLong_FromSize_t(count));
+}
+
+/* Return the counters of the read cache */
+static PyObject *
+sophia_db_cache_info(SophiaDB *db)
+{
+    return Py_BuildValue("{s:n,s:n,s:n,s:n,s:n,s:n}",
+        "hits", (Py_ssize_t)db->cache_hits,
+        "misses", (Py_ssize_t)db->cache_misses,
+        "evictions", (Py_ssize_t)db->cache_evictions,
+        "entries", (Py_ssize_t)db->cache.count,
+        "bytes", (Py_ssize_t)db->cache_bytes,
+        "budget", (Py_ssize_t)db->cache_budget);
+}
+
+/* Return the size and the counters of the Bloom filter */
+static PyObject *
+sophia_db_bloom_info(SophiaDB *db)
+{
+    size_t absent = db->bloom_rejects + db->bloom_false_positives;
+    
+    return Py_BuildValue("{s:K,s:I,s:n,s:n,s:n,s:d}",
+        "bits", (unsigned long long)(db->bloom.bits ? db->bloom.nbits : 0),
+        "hashes", (unsigned int)(db->bloom.bits ? db->bloom.nhashes : 0),
+        "bytes", (Py_ssize_t)(db->bloom.bits ? (db->bloom.nbits + 7) / 8 : 0),
+        "rejects", (Py_ssize_t)db->bloom_rejects,
+        "false_positives", (Py_ssize_t)db->bloom_false_positives,
+        "false_positive_rate", absent ? (double)db->bloom_false_positives / (double)absent : 0.0);
+}
+
+static const char *sophia_op_names[PSP_NOPS] = {
+    "get", "set", "delete", "contains", "begin", "commit", "rollback", "cursor", "fetch"
+};
+
+/* Upper bound of the latencies of a fraction `q` of the calls */
+static uint64_t
+sophia_percentile(SophiaHistogram *hist, double q)
+{
+    uint64_t rank = (uint64_t)ceil(q * (double)hist->calls), seen = 0;
+    int i;
+    
+    for (i = 0; i < PSP_HIST_BUCKETS; i++) {
+        if ((seen += hist->buckets[i]) >= rank && seen > 0)
+            break;
+    }
+    if (i == PSP_HIST_BUCKETS || ((uint64_t)2 << i) > hist->max_ns)
+        return hist->max_ns;
+    return (uint64_t)2 << i;
+}
+
+static PyObject *
+sophia_histogram_info(SophiaHistogram *hist)
+{
+    PyObject *pbuckets, *pbound = NULL, *pcount = NULL, *rv;
+    int i;
+    
+    /* the non-empty buckets, by the upper bound of their latencies */
+    if (!(pbuckets = PyDict_New()))
+        return NULL;
+    for (i = 0; i < PSP_HIST_BUCKETS; i++) {
+        if (!hist->buckets[i])
+            continue;
+        if (!(pbound = PyLong_FromUnsignedLongLong((unsigned long long)2 << i))
+            || !(pcount = PyLong_FromUnsignedLongLong(hist->buckets[i]))
+            || PyDict_SetItem(pbuckets, pbound, pcount) == -1) {
+            Py_XDECREF(pbound);
+            Py_XDECREF(pcount);
+            Py_DECREF(pbuckets);
+            return NULL;
+        }
+        Py_CLEAR(pbound);
+        Py_CLEAR(pcount);
+    }
+    rv = Py_BuildValue("{s:K,s:K,s:K,s:K,s:K,s:K,s:N}",
+        "calls", (unsigned long long)hist->calls,
+        "total_ns", (unsigned long long)hist->total_ns,
+        "max_ns", (unsigned long long)hist->max_ns,
+        "p50_ns", (unsigned long long)sophia_percentile(hist, 0.5),
+        "p90_ns", (unsigned long long)sophia_percentile(hist, 0.9),
+        "p99_ns", (unsigned long long)sophia_percentile(hist, 0.99),
+        "histogram", pbuckets);
+    return rv;
+}
+
+/* Return the statistics of the database, and reset the counters afterwards
+ * if `reset` is true. The number of cursors and the size of the current
+ * transaction are gauges, which aren't reset.
+ */
+static PyObject *
+sophia_db_stats(SophiaDB *db, PyObject *args, PyObject *kwargs)
+{
+    int i, reset = 0;
+    size_t txn_writes, group_commits, group_writes;
+    PyObject *rv, *pvalue;
+    
+    static char *keywords[] = {"reset", NULL};
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|i:stats", keywords, &reset))
+        return NULL;
+    
+    PSP_BEGIN_LOCKED(db)
+    txn_writes = db->in_txn ? db->txn_writes : 0;
+    group_commits = db->group_commits;
+    group_writes = db->group_writes;
+    if (reset)
+        db->group_commits = db->group_writes = 0;
+    PSP_END_LOCKED(db)
+    
+    rv = Py_BuildValue("{s:K,s:K,s:n,s:n,s:K,s:K,s:n,s:n,s:n,s:N,s:N}",
+        "bytes_read", (unsigned long long)db->bytes_read,
+        "bytes_written", (unsigned long long)db->bytes_written,
+        "cursors", (Py_ssize_t)db->cursors,
+        "deferred_closes", (Py_ssize_t)db->deferred_closes,
+        "comparisons", (unsigned long long)__atomic_load_n(&db->comparisons, __ATOMIC_RELAXED),
+        "comparison_ns", (unsigned long long)__atomic_load_n(&db->comparison_ns, __ATOMIC_RELAXED),
+        "transaction_size", (Py_ssize_t)txn_writes,
+        "group_commits", (Py_ssize_t)group_commits,
+        "group_writes", (Py_ssize_t)group_writes,
+        "cache", sophia_db_cache_info(db),
+        "bloom", sophia_db_bloom_info(db));
+    if (!rv)
+        return NULL;
+    for (i = 0; i < PSP_NOPS; i++) {
+        if (!(pvalue = sophia_histogram_info(&db->latencies[i]))
+            || PyDict_SetItemString(rv, sophia_op_names[i], pvalue) == -1) {
+            Py_XDECREF(pvalue);
+            Py_DECREF(rv);
+            return NULL;
+        }
+        Py_DECREF(pvalue);
+    }
+    
+    if (reset) {
+        memset(db->latencies, 0, sizeof(db->latencies));
+        db->bytes_read = db->bytes_written = 0;
+        db->deferred_closes = 0;
+        __atomic_store_n(&db->comparisons, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&db->comparison_ns, 0, __ATOMIC_RELAXED);
+        db->cache_hits = db->cache_misses = db->cache_evictions = 0;
+        db->bloom_rejects = db->bloom_false_positives = 0;
+    }
+    return rv;
+}
+
+static PyObject *
+sophia_db_begin(SophiaDB *db)
+{
+    int rv;
+    char err[PSP_ERRMAX];
+    uint64_t start;
+    
+    ensure_is_opened(db, NULL);
+    
+    start = sophia_now();
+    PSP_BEGIN_LOCKED(db)
+    if (!db->db)
+        rv = sophia_closed_error(err);
+    else if ((rv = sophia_db_buffering(db, err)) != 0) {
+        if (rv == 1)
+            strcpy(err, "can't start a transaction while writes are buffered for a snapshot cursor");
+        rv = -1;
+    }
+    else if ((rv = sophia_txn_begin(db)) == -1)
+        sophia_copy_error(db->db, err);
+    PSP_END_LOCKED(db)
+    sophia_stats_record(db, PSP_OP_BEGIN, start);
+    if (rv == -1) {
+        PyErr_SetString(SophiaError, err);
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+sophia_db_commit(SophiaDB *db)
+{
+    int rv;
+    char err[PSP_ERRMAX];
+    uint64_t start;
+    
+    ensure_is_opened(db, NULL);
+    
+    start = sophia_now();
+    PSP_CALL(db, rv, err, sophia_txn_commit(db));
+    sophia_stats_record(db, PSP_OP_COMMIT, start);
+    if (rv == -1) {
+        PyErr_SetString(SophiaError, err);
+        return NULL;
+    }
+    Py_INCREF(Py_None);
+    return sophia_cmp_checked(db, Py_None);
+}
+
+static PyObject *
+sophia_db_rollback(SophiaDB *db)
+{
+    int rv;
+    char err[PSP_ERRMAX];
+    uint64_t start;
+    
+    ensure_is_opened(db, NULL);
+    
+    start = sophia_now();
+    PSP_CALL(db, rv, err, sophia_txn_rollback(db));
+    sophia_stats_record(db, PSP_OP_ROLLBACK, start);
+    /* values written by the transaction may have been cached */
+    sophia_cache_clear(db);
+    if (rv == -1) {
+        PyErr_SetString(SophiaError, err);
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+sophia_db_iter_keys(SophiaDB *db, PyObject *args, PyObject *kw)
+{
+    return sophia_cmp_checked(db, sophia_cursor_new(db, &SophiaCursorKeysType, args, kw));
+}
+
+static PyObject *
+sophia_db_iter_values(SophiaDB *db, PyObject *args, PyObject *kw)
+{
+    return sophia_cmp_checked(db, sophia_cursor_new(db, &SophiaCursorValuesType, args, kw));
+}
+
+static PyObject *
+sophia_db_iter_items(SophiaDB *db, PyObject *args, PyObject *kw)
+{
+    return sophia_cmp_checked(db, sophia_cursor_new(db, &SophiaCursorItemsType, args, kw));
+}
+
+/* Compute the smallest key greater than all the keys starting with `prefix`,
+ * which is the prefix itself, stripped from its trailing 0xff bytes, and with
+ * its last byte incremented. Return its size, or 0 if there is no such key.
+ */
+static size_t
+sophia_prefix_successor(const char *prefix, size_t size, char *out)
+{
+    while (size > 0 && (unsigned char)prefix[size - 1] == 0xff)
+        size--;
+    if (size == 0)
+        return 0;
+    memcpy(out, prefix, size);
+    out[size - 1] = (char)((unsigned char)out[size - 1] + 1);
+    return size;
+}
+
+static PyObject *
+sophia_cursor_new(SophiaDB *db, PyTypeObject *cursortype,
+                     PyObject *args, PyObject *kwargs)
+{
+    SophiaCursor *pcur;
+    int order = SPGTE, end_inclusive = 1, failed = 0, detach = db->threaded, snapshot = 0;
+    void *cursor = NULL;
+    char *begin = NULL, *succ = NULL, *tmp, err[PSP_ERRMAX];
+    PyObject *pbegin = NULL, *pend = NULL, *pprefix = NULL;
+    PyObject *pkdec = Py_None, *pvdec = Py_None;
+    Py_ssize_t bsize = 0, batch = 1, limit = -1, size;
+    Py_buffer view;
+    uint64_t start;
+    
+    static char *keywords[] = {"start_key", "order", "batch", "end_key",
+        "end_inclusive", "prefix", "limit", "key_decoder", "value_decoder", "snapshot", NULL};
+    
+    ensure_is_opened(db, NULL);
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|OinOiOnOOi", keywords, &pbegin,
+            &order, &batch, &pend, &end_inclusive, &pprefix, &limit, &pkdec, &pvdec, &snapshot))
+        return NULL;
+    if (batch < 1) {
+        PyErr_SetString(PyExc_ValueError, "batch must be positive");
+        return NULL;
+    }
+    if (order != SPGT && order != SPGTE && order != SPLT && order != SPLTE) {
+        PyErr_SetString(PyExc_ValueError, "unknown order");
+        return NULL;
+    }
+    /* the keys bearing a prefix are only contiguous in byte-wise order */
+    if (pprefix && pprefix != Py_None && (db->cmp_fun || db->cmp_native)) {
+        PyErr_SetString(PyExc_ValueError, "prefix requires the default comparison function");
+        return NULL;
+    }
+    
+    /* the bounds are kept by the cursor, the start key only until it is
+     * positioned
+     */
+    pend = (pend == Py_None) ? NULL : pend;
+    pprefix = (pprefix == Py_None) ? NULL : pprefix;
+    if ((pend && !(pend = sophia_encoded_bytes(&db->key_codec, pend)))
+        || (pprefix && !(pprefix = sophia_bytes_from_object(pprefix)))) {
+        Py_XDECREF(pend);
+        return NULL;
+    }
+    if (pbegin == Py_None)
+        pbegin = NULL;
+    if (pbegin) {
+        if (sophia_encoded_view(&db->key_codec, pbegin, &view) == -1) {
+            Py_XDECREF(pend);
+            Py_XDECREF(pprefix);
+            return NULL;
+        }
+        begin = view.buf;
+        bsize = view.len;
+    }
+    
+    /* Start at the first key bearing the prefix, if no start key is given,
+     * which may be the prefix itself whatever the order. In decreasing order,
+     * this means just before the successor of the prefix.
+     */
+    if (pprefix && !begin) {
+        tmp = PyBytes_AS_STRING(pprefix);
+        size = PyBytes_GET_SIZE(pprefix);
+        if (order == SPGT || order == SPGTE) {
+            begin = tmp;
+            bsize = size;
+            order = SPGTE;
+        }
+        else {
+            if (!(succ = PyMem_Malloc(size + 1))) {
+                Py_XDECREF(pend);
+                Py_DECREF(pprefix);
+                return PyErr_NoMemory();
+            }
+            if ((bsize = (Py_ssize_t)sophia_prefix_successor(tmp, (size_t)size, succ)) > 0) {
+                begin = succ;
+                order = SPLT;
+            }
+        }
+    }
+    
+    pcur = PyObject_New(SophiaCursor, cursortype);
+    if (!pcur) {
+        PyMem_Free(succ);
+        if (pbegin)
+            PyBuffer_Release(&view);
+        Py_XDECREF(pend);
+        Py_XDECREF(pprefix);
+        return NULL;
+    }
+    
+    /* A detached cursor is only opened when its first chunk is fetched. A
+     * snapshot cursor stays open, the writes being buffered meanwhile.
+     */
+    snapshot = snapshot && limit != 0;
+    detach = detach && !snapshot;
+    start = sophia_now();
+    PSP_BEGIN_LOCKED(db)
+    if (!db->db) {
+        strcpy(err, "operation on a closed database");
+        failed = 1;
+    }
+    else if (snapshot && db->in_txn) {
+        strcpy(err, "can't open a snapshot cursor within a transaction");
+        failed = 1;
+    }
+    else if (limit != 0 && !detach && !(cursor = sp_cursor(db->db, order, begin, (size_t)bsize))) {
+        sophia_copy_error(db->db, err);
+        failed = 1;
+    }
+    else if (snapshot)
+        db->snapshots++;
+    PSP_END_LOCKED(db)
+    sophia_stats_record(db, PSP_OP_CURSOR, start);
+    
+    pcur->db = NULL;
+    pcur->cursor = NULL;
+    pcur->buf = NULL;
+    pcur->bufsize = pcur->buflen = pcur->bufpos = pcur->nbuf = 0;
+    pcur->detach = detach;
+    pcur->snapshot = snapshot && !failed;
+    pcur->order = order;
+    pcur->resume = NULL;
+    pcur->rsize = 0;
+    pcur->fetching = 0;
+    if (detach && begin && bsize > 0 && !failed) {
+        if ((pcur->resume = malloc((size_t)bsize))) {
+            memcpy(pcur->resume, begin, (size_t)bsize);
+            pcur->rsize = (size_t)bsize;
+        }
+        else {
+            strcpy(err, "out of memory");
+            failed = 1;
+        }
+    }
+    PyMem_Free(succ);
+    if (pbegin)
+        PyBuffer_Release(&view);
+    if (detach && batch < PSP_DETACHED_BATCH)
+        batch = PSP_DETACHED_BATCH;
+    pcur->batch = batch;
+    pcur->reverse = (order == SPLT || order == SPLTE);
+    pcur->end = pend;
+    pcur->end_inclusive = end_inclusive;
+    pcur->prefix = pprefix;
+    pcur->limit = limit;
+    memset(&pcur->key_codec, 0, sizeof(SophiaCodec));
+    memset(&pcur->value_codec, 0, sizeof(SophiaCodec));
+    if (cursortype == &SophiaCursorKeysType)
+        pcur->kind = PSP_KEYS;
+    else if (cursortype == &SophiaCursorValuesType)
+        pcur->kind = PSP_VALUES;
+    else
+        pcur->kind = PSP_ITEMS;
+    
+    /* a cursor with a limit of zero records is exhausted from the start */
+    if (limit == 0)
+        return (PyObject *)pcur;
+    if (failed) {
+        Py_DECREF(pcur);
+        PyErr_SetString(SophiaError, err);
+        return NULL;
+    }
+    
+    Py_INCREF(db);
+    db->cursors++;
+    pcur->db = db;
+    pcur->cursor = cursor;
+    if (sophia_codec_copy(&pcur->key_codec, &db->key_codec) == -1
+        || sophia_codec_copy(&pcur->value_codec, &db->value_codec) == -1
+        || (pkdec != Py_None && sophia_decoder_init(&pcur->key_codec, pkdec) == -1)
+        || (pvdec != Py_None && sophia_decoder_init(&pcur->value_codec, pvdec) == -1)) {
+        Py_DECREF(pcur);
+        return NULL;
+    }
+    return (PyObject *)pcur;
+}
+
+/* Destroys the underlying sophia cursor, without deallocating the Python object
+ * which encapsulates it. This function is called either when the sophia cursor
+ * has traversed all the records requested, or when the object goes out of scope. 
+ */
+static void
+sophia_cursor_dealloc_internal(SophiaCursor *cursor)
+{
+    char err[PSP_ERRMAX];
+    
+    assert(cursor->db);
+    assert(cursor->db->cursors > 0);
+    
+    /* close the cursor first, then apply the buffered writes, if possible,
+     * and only then close the database, if needed. If they can't be applied
+     * yet, the next write does it, and reports the failure.
+     */
+    PSP_BEGIN_LOCKED(cursor->db)
+    if (cursor->cursor)
+        sp_destroy(cursor->cursor);
+    if (cursor->snapshot)
+        cursor->db->snapshots--;
+    if (cursor->db->db)
+        sophia_db_flush_overlay(cursor->db, err);
+    PSP_END_LOCKED(cursor->db)
+    cursor->cursor = NULL;
+    cursor->snapshot = 0;
+    
+    cursor->db->cursors--;
+    if (cursor->db->close_me && cursor->db->cursors == 0) {
+        sophia_db_close_internal(cursor->db);
+        cursor->db->close_me = 0;
+    }
+    Py_DECREF(cursor->db);
+    cursor->db = NULL;
+}
+
+/* Destroys the Python wrapped cursor, and the underlying cursor if needed */
+static void
+sophia_cursor_dealloc(SophiaCursor *cursor)
+{
+    if (cursor->db)
+        sophia_cursor_dealloc_internal(cursor);
+    free(cursor->buf);
+    free(cursor->resume);
+    Py_XDECREF(cursor->end);
+    Py_XDECREF(cursor->prefix);
+    sophia_codec_clear(&cursor->key_codec);
+    sophia_codec_clear(&cursor->value_codec);
+    PyObject_Del(cursor);
+}
+
+/* Should we stop iterating the database with this cursor? If so, destroy
+ * the sophia cursor object, but leave intact its Python wrapper.
+ */
+static inline int
+sophia_stop_iteration(SophiaCursor *cursor)
+{
+    int rv;
+    uint64_t start;
+    
+    if (!cursor->cursor)
+        return 1;
+    
+    start = sophia_now();
+    PSP_BEGIN_LOCKED(cursor->db)
+    rv = sp_fetch(cursor->cursor);
+    PSP_END_LOCKED(cursor->db)
+    sophia_stats_record(cursor->db, PSP_OP_FETCH, start);
+    
+    if (!rv) {
+        sophia_cursor_dealloc_internal(cursor);
+        return 1;
+    }
+    return 0;
+}
+
+/* Build the object yielded for a record, depending on its kind, with the
+ * codecs of the cursor
+ */
+static PyObject *
+sophia_cursor_build(SophiaCursor *cursor, int kind, const char *key, size_t ksize,
+                    const char *value, size_t vsize)
+{
+    PyObject *rv, *pkey, *pvalue;
+    
+    if (kind == PSP_KEYS)
+        return sophia_decode(&cursor->key_codec, key, ksize);
+    if (kind == PSP_VALUES)
+        return sophia_decode(&cursor->value_codec, value, vsize);
+    
+    pkey = sophia_decode(&cursor->key_codec, key, ksize);
+    pvalue = pkey ? sophia_decode(&cursor->value_codec, value, vsize) : NULL;
+    
+    if (!(pkey && pvalue)) {
+        Py_XDECREF(pkey);
+        Py_XDECREF(pvalue);
+        return NULL;
+    }
+
+    rv = PyTuple_Pack(2, pkey, pvalue);
+    
+    Py_DECREF(pkey);
+    Py_DECREF(pvalue);
+    
+    return rv;
+}
+
+/* Check the record the sophia cursor is positioned on. Only the parts of the
+ * record yielded by the cursor are retrieved.
+ */
+static inline int
+sophia_cursor_record(SophiaCursor *cursor, const char **key, size_t *ksize,
+                     const char **value, size_t *vsize)
+{
+    *key = *value = NULL;
+    *ksize = *vsize = 0;
+    
+    if (cursor->kind != PSP_VALUES || cursor->end || cursor->prefix || cursor->detach) {
+        *key = sp_key(cursor->cursor);
+        *ksize = sp_keysize(cursor->cursor);
+        if (*key == NULL || *ksize == 0)
+            return -1;
+    }
+    if (cursor->kind != PSP_KEYS) {
+        *value = sp_value(cursor->cursor);
+        *vsize = sp_valuesize(cursor->cursor);
+        if (*value == NULL || *vsize == 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* Should the cursor yield the record with the given key, or has it gone past
+ * the end of the requested range? Keys are compared to the end key with the
+ * active comparison function, and to the prefix byte-wise, which the default
+ * comparison function is the only one to agree with.
+ */
+static inline int
+sophia_cursor_accept(SophiaCursor *cursor, const char *key, size_t ksize)
+{
+    if (cursor->limit == 0)
+        return 0;
+    if (cursor->prefix) {
+        size_t psize = (size_t)PyBytes_GET_SIZE(cursor->prefix);
+        if (ksize < psize || memcmp(key, PyBytes_AS_STRING(cursor->prefix), psize) != 0)
+            return 0;
+    }
+    if (cursor->end) {
+        int cmp = sophia_db_compare(cursor->db, key, ksize,
+            PyBytes_AS_STRING(cursor->end), (size_t)PyBytes_GET_SIZE(cursor->end));
+        if (cursor->reverse)
+            cmp = -cmp;
+        if (cmp > 0 || (cmp == 0 && !cursor->end_inclusive))
+            return 0;
+    }
+    if (cursor->limit > 0)
+        cursor->limit--;
+    return 1;
+}
+
+/* Remember the key of the last record fetched by a detached cursor, after
+ * which the sophia cursor is reopened. The record is at offset `pos` of the
+ * buffer. Return -1 if memory is lacking.
+ */
+static int
+sophia_cursor_save_position(SophiaCursor *cursor, size_t pos)
+{
+    size_t ksize;
+    char *p;
+    
+    memcpy(&ksize, cursor->buf + pos, sizeof(size_t));
+    if (ksize > cursor->rsize || !cursor->resume) {
+        if (!(p = realloc(cursor->resume, ksize)))
+            return -1;
+        cursor->resume = p;
+    }
+    memcpy(cursor->resume, cursor->buf + pos + 2 * sizeof(size_t), ksize);
+    cursor->rsize = ksize;
+    cursor->order = cursor->reverse ? SPLT : SPGT;
+    return 0;
+}
+
+/* Fetch up to `n` records ahead into the buffer of the cursor, with the
+ * database lock held, and without the GIL. The outcome is stored into `fill`,
+ * to be accounted for by `sophia_cursor_filled()`. A detached cursor opens the
+ * sophia cursor after the last record fetched, and closes it before returning,
+ * so that the database can be written to between two chunks.
+ */
+static void
+sophia_cursor_fill_locked(SophiaCursor *cursor, Py_ssize_t n, SophiaFill *fill)
+{
+    Py_ssize_t i;
+    size_t last = 0;
+    
+    fill->fetched = 0;
+    fill->end = fill->status = 0;
+    fill->bytes = 0;
+    
+    /* drop the records already consumed */
+    if (cursor->bufpos > 0) {
+        memmove(cursor->buf, cursor->buf + cursor->bufpos, cursor->buflen - cursor->bufpos);
+        cursor->buflen -= cursor->bufpos;
+        cursor->bufpos = 0;
+    }
+    
+    if (cursor->detach) {
+        if (!cursor->db->db) {
+            strcpy(fill->err, "operation on a closed database");
+            fill->status = -3;
+        }
+        else if (!(cursor->cursor = sp_cursor(cursor->db->db, cursor->order,
+                                              cursor->resume, cursor->rsize))) {
+            sophia_copy_error(cursor->db->db, fill->err);
+            fill->status = -3;
+        }
+    }
+    for (i = 0; fill->status == 0 && i < n; i++) {
+        const char *key, *value;
+        size_t ksize, vsize, needed;
+        char *p;
+        
+        if (!sp_fetch(cursor->cursor)) {
+            fill->end = 1;
+            break;
+        }
+        if (sophia_cursor_record(cursor, &key, &ksize, &value, &vsize) == -1) {
+            fill->status = -1;
+            break;
+        }
+        if (!sophia_cursor_accept(cursor, key, ksize)) {
+            fill->end = 1;
+            break;
+        }
+        
+        needed = cursor->buflen + 2 * sizeof(size_t) + ksize + vsize;
+        if (needed > cursor->bufsize) {
+            size_t size = cursor->bufsize * 2 > needed ? cursor->bufsize * 2 : needed;
+            if (!(p = realloc(cursor->buf, size))) {
+                fill->status = -2;
+                break;
+            }
+            cursor->buf = p;
+            cursor->bufsize = size;
+        }
+        
+        last = cursor->buflen;
+        p = cursor->buf + last;
+        memcpy(p, &ksize, sizeof(size_t));
+        memcpy(p + sizeof(size_t), &vsize, sizeof(size_t));
+        p += 2 * sizeof(size_t);
+        memcpy(p, key, ksize);
+        memcpy(p + ksize, value, vsize);
+        cursor->buflen = needed;
+        fill->bytes += ksize + vsize;
+    }
+    if (cursor->detach && cursor->cursor) {
+        sp_destroy(cursor->cursor);
+        cursor->cursor = NULL;
+        if (i > 0 && sophia_cursor_save_position(cursor, last) == -1)
+            fill->status = -2;
+    }
+    fill->fetched = i;
+}
+
+/* Account for the records fetched by `sophia_cursor_fill_locked()`, with the
+ * GIL held. The sophia cursor is destroyed as soon as it is exhausted. Return
+ * the number of records fetched, or -1 on failure.
+ */
+static Py_ssize_t
+sophia_cursor_filled(SophiaCursor *cursor, SophiaFill *fill, uint64_t start)
+{
+    sophia_stats_record(cursor->db, PSP_OP_FETCH, start);
+    cursor->db->bytes_read += fill->bytes;
+    
+    cursor->nbuf += fill->fetched;
+    if (fill->end)
+        sophia_cursor_dealloc_internal(cursor);
+    
+    if (fill->status == -3) {
+        PyErr_SetString(SophiaError, fill->err);
+        return -1;
+    }
+    else if (fill->status == -1) {
+        PyErr_SetString(SophiaError, "cursor failed");
+        return -1;
+    }
+    else if (fill->status == -2) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    return fill->fetched;
+}
+
+/* Fetch up to `n` records ahead into the buffer of the cursor, in a single
+ * locked section. Return the number of records fetched, or -1 on failure.
+ */
+static Py_ssize_t
+sophia_cursor_fill(SophiaCursor *cursor, Py_ssize_t n)
+{
+    SophiaFill fill;
+    uint64_t start;
+    
+    if (!cursor->db)
+        return 0;
+    
+    start = sophia_now();
+    PSP_BEGIN_LOCKED(cursor->db)
+    sophia_cursor_fill_locked(cursor, n, &fill);
+    PSP_END_LOCKED(cursor->db)
+    return sophia_cursor_filled(cursor, &fill, start);
+}
+
+/* Pop the next record from the buffer of the cursor, and build the
+ * corresponding object, of the given kind.
+ */
+static PyObject *
+sophia_cursor_pop_as(SophiaCursor *cursor, int kind)
+{
+    size_t ksize, vsize;
+    char *p = cursor->buf + cursor->bufpos;
+    
+    assert(cursor->nbuf > 0);
+    
+    memcpy(&ksize, p, sizeof(size_t));
+    memcpy(&vsize, p + sizeof(size_t), sizeof(size_t));
+    p += 2 * sizeof(size_t);
+    
+    cursor->bufpos += 2 * sizeof(size_t) + ksize + vsize;
+    cursor->nbuf--;
+    return sophia_cursor_build(cursor, kind, p, ksize, p + ksize, vsize);
+}
+
+static inline PyObject *
+sophia_cursor_pop(SophiaCursor *cursor)
+{
+    return sophia_cursor_pop_as(cursor, cursor->kind);
+}
+
+/* The buffer of a cursor can't be used while a worker of the pool fills it */
+static inline int
+sophia_cursor_check_idle(SophiaCursor *cursor)
+{
+    if (cursor->fetching) {
+        PyErr_SetString(SophiaError, "a fetch is already in progress on this cursor");
+        return -1;
+    }
+    return 0;
+}
+
+static PyObject *
+sophia_cursor_next_record(SophiaCursor *cursor)
+{
+    const char *key, *value;
+    size_t ksize, vsize;
+    
+    if (sophia_cursor_check_idle(cursor) == -1)
+        return NULL;
+    if (cursor->batch > 1) {
+        if (cursor->nbuf == 0 && sophia_cursor_fill(cursor, cursor->batch) <= 0)
+            return NULL;
+        return sophia_cursor_pop(cursor);
+    }
+    
+    if (sophia_stop_iteration(cursor))
+        return NULL;
+    
+    if (sophia_cursor_record(cursor, &key, &ksize, &value, &vsize) == -1) {
+        PyErr_SetString(SophiaError, "cursor failed");
+        return NULL;
+    }
+    if (!sophia_cursor_accept(cursor, key, ksize)) {
+        sophia_cursor_dealloc_internal(cursor);
+        return NULL;
+    }
+    cursor->db->bytes_read += ksize + vsize;
+    return sophia_cursor_build(cursor, cursor->kind, key, ksize, value, vsize);
+}
+
+/* Yield the next record, unless the python comparison function failed while
+ * it was fetched. The cursor may release the database meanwhile.
+ */
+static PyObject *
+sophia_cursor_next(SophiaCursor *cursor)
+{
+    SophiaDB *db = cursor->db;
+    PyObject *rv;
+    
+    if (!db)
+        return sophia_cursor_next_record(cursor);
+    Py_INCREF(db);
+    rv = sophia_cmp_checked(db, sophia_cursor_next_record(cursor));
+    Py_DECREF(db);
+    return rv;
+}
+
+/* Pop up to `n` records from the buffer of the cursor, as a list */
+static PyObject *
+sophia_cursor_pop_many(SophiaCursor *cursor, Py_ssize_t n)
+{
+    Py_ssize_t i;
+    PyObject *rv;
+    
+    if ((size_t)n > cursor->nbuf)
+        n = (Py_ssize_t)cursor->nbuf;
+    if (!(rv = PyList_New(n)))
+        return NULL;
+    for (i = 0; i < n; i++) {
+        PyObject *item = sophia_cursor_pop(cursor);
+        if (!item) {
+            Py_DECREF(rv);
+            return NULL;
+        }
+        PyList_SET_ITEM(rv, i, item);
+    }
+    return rv;
+}
+
+/* Return a list of (at most) the next `n` records. The records are fetched
+ * in a single locked section, with the GIL released. An empty list is
+ * returned once the cursor is exhausted.
+ */
+static PyObject *
+sophia_cursor_fetch_many(SophiaCursor *cursor, PyObject *args)
+{
+    Py_ssize_t n;
+    
+    if (!PyArg_ParseTuple(args, "n:fetchmany", &n) || sophia_cursor_check_idle(cursor) == -1)
+        return NULL;
+    if (n < 0) {
+        PyErr_SetString(PyExc_ValueError, "expected a positive number of records");
+        return NULL;
+    }
+    
+    if (cursor->nbuf < (size_t)n && cursor->db) {
+        SophiaDB *db = cursor->db;
+        int failed;
+        
+        Py_INCREF(db);
+        failed = sophia_cursor_fill(cursor, n - cursor->nbuf) == -1 || sophia_cmp_raise(db) == -1;
+        Py_DECREF(db);
+        if (failed)
+            return NULL;
+    }
+    return sophia_cursor_pop_many(cursor, n);
+}
+
+/* Worker pool of `AsyncDatabase`.
+ *
+ * Requests are queued with the GIL held, and run by native threads, which
+ * don't take the GIL (unless a python comparison function is called), as the
+ * synchronous methods do once they have released it. A request run is moved
+ * to the list of completed ones, and one byte is written to a pipe whenever
+ * this list was empty, so that the event loop wakes up and collects all the
+ * results at once, with `_async_completions()`.
+ */
+
+static SophiaRequest *
+sophia_request_new(int op, PyObject *token, PyObject *arg, const void *key, size_t ksize,
+                   const void *value, size_t vsize)
+{
+    SophiaRequest *req = malloc(sizeof(SophiaRequest) + ksize + vsize);
+    
+    if (!req) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    req->next = NULL;
+    req->op = op;
+    Py_INCREF(token);
+    req->token = token;
+    Py_XINCREF(arg);
+    req->arg = arg;
+    req->n = 0;
+    req->key = (char *)(req + 1);
+    req->ksize = ksize;
+    if (ksize)
+        memcpy(req->key, key, ksize);
+    req->value = value ? req->key + ksize : NULL;
+    req->vsize = vsize;
+    if (vsize)
+        memcpy(req->value, value, vsize);
+    req->result = NULL;
+    req->rsize = 0;
+    req->epoch = 0;
+    req->start = sophia_now();
+    req->rv = 0;
+    return req;
+}
+
+static void
+sophia_requests_free(SophiaRequest *req)
+{
+    SophiaRequest *next;
+    
+    for (; req; req = next) {
+        next = req->next;
+        Py_DECREF(req->token);
+        Py_XDECREF(req->arg);
+        free(req->result);
+        free(req);
+    }
+}
+
+/* Run a request, in a worker thread, without the GIL */
+static void
+sophia_request_run(SophiaDB *db, SophiaRequest *req)
+{
+    char *err = req->fill.err;
+    
+    switch (req->op) {
+        case PSP_REQ_GET:
+        case PSP_REQ_CONTAINS:
+            pthread_mutex_lock(&db->lock);
+            if (!db->db)
+                req->rv = sophia_closed_error(err);
+            else if (req->op == PSP_REQ_GET)
+                req->rv = sophia_db_get_locked(db, req->key, req->ksize, &req->result, &req->rsize, err);
+            else
+                req->rv = sophia_db_get_locked(db, req->key, req->ksize, NULL, NULL, err);
+            pthread_mutex_unlock(&db->lock);
+            break;
+        case PSP_REQ_SET:
+        case PSP_REQ_DELETE:
+            req->rv = sophia_db_write(db, req->key, req->ksize, req->value, req->vsize, err);
+            break;
+        case PSP_REQ_BEGIN:
+            pthread_mutex_lock(&db->lock);
+            if (!db->db)
+                req->rv = sophia_closed_error(err);
+            else if ((req->rv = sophia_db_buffering(db, err)) != 0) {
+                if (req->rv == 1)
+                    strcpy(err, "can't start a transaction while writes are buffered for a snapshot cursor");
+                req->rv = -1;
+            }
+            else if ((req->rv = sophia_txn_begin(db)) == -1)
+                sophia_copy_error(db->db, err);
+            pthread_mutex_unlock(&db->lock);
+            break;
+        case PSP_REQ_COMMIT:
+        case PSP_REQ_ROLLBACK:
+            pthread_mutex_lock(&db->lock);
+            if (!db->db)
+                req->rv = sophia_closed_error(err);
+            else if ((req->rv = (req->op == PSP_REQ_COMMIT ? sophia_txn_commit(db)
+                                                          : sophia_txn_rollback(db))) == -1)
+                sophia_copy_error(db->db, err);
+            pthread_mutex_unlock(&db->lock);
+            break;
+        case PSP_REQ_FETCH:
+            pthread_mutex_lock(&db->lock);
+            sophia_cursor_fill_locked((SophiaCursor *)req->arg, req->n, &req->fill);
+            pthread_mutex_unlock(&db->lock);
+            break;
+    }
+}
+
+/* Wake the event loop up */
+static void
+sophia_pool_notify(SophiaDB *db)
+{
+    while (write(db->pool_fd[1], "", 1) == -1 && errno == EINTR)
+        ;
+}
+
+static void *
+sophia_pool_worker(void *arg)
+{
+    SophiaDB *db = arg;
+    SophiaRequest *req;
+    int notify;
+    
+    for (;;) {
+        pthread_mutex_lock(&db->pool_lock);
+        while (!db->pool_head && !db->pool_stop)
+            pthread_cond_wait(&db->pool_cond, &db->pool_lock);
+        if (db->pool_stop) {
+            pthread_mutex_unlock(&db->pool_lock);
+            return NULL;
+        }
+        req = db->pool_head;
+        if (!(db->pool_head = req->next))
+            db->pool_tail = &db->pool_head;
+        pthread_mutex_unlock(&db->pool_lock);
+        
+        sophia_request_run(db, req);
+        
+        pthread_mutex_lock(&db->pool_lock);
+        notify = !db->pool_done;
+        req->next = db->pool_done;
+        db->pool_done = req;
+        pthread_mutex_unlock(&db->pool_lock);
+        if (notify)
+            sophia_pool_notify(db);
+    }
+}
+
+/* Stop the workers, once they are done with their current request. The
+ * requests which haven't been run yet fail, and are left to be collected.
+ */
+static void
+sophia_pool_stop(SophiaDB *db)
+{
+    size_t i;
+    SophiaRequest *req;
+    
+    if (!db->pool)
+        return;
+    
+    pthread_mutex_lock(&db->pool_lock);
+    db->pool_stop = 1;
+    pthread_cond_broadcast(&db->pool_cond);
+    pthread_mutex_unlock(&db->pool_lock);
+    Py_BEGIN_ALLOW_THREADS
+    for (i = 0; i < db->pool_size; i++)
+        pthread_join(db->pool[i], NULL);
+    Py_END_ALLOW_THREADS
+    
+    while ((req = db->pool_head)) {
+        db->pool_head = req->next;
+        req->rv = -1;
+        strcpy(req->fill.err, "the worker pool was stopped");
+        req->next = db->pool_done;
+        db->pool_done = req;
+    }
+    db->pool_tail = &db->pool_head;
+    free(db->pool);
+    db->pool = NULL;
+    db->pool_size = 0;
+    db->pool_stop = 0;
+    close(db->pool_fd[0]);
+    close(db->pool_fd[1]);
+    db->pool_fd[0] = db->pool_fd[1] = -1;
+}
+
+/* Start `n` workers, and return the file descriptor readable when requests
+ * are completed.
+ */
+static PyObject *
+sophia_db_async_start(SophiaDB *db, PyObject *args)
+{
+    Py_ssize_t n, i;
+    int fd[2], rv;
+    
+    if (!PyArg_ParseTuple(args, "n:_async_start", &n))
+        return NULL;
+    if (n < 1) {
+        PyErr_SetString(PyExc_ValueError, "expected a positive number of threads");
+        return NULL;
+    }
+    if (db->pool) {
+        PyErr_SetString(SophiaError, "the worker pool is already running");
+        return NULL;
+    }
+    
+    if (pipe(fd) == -1)
+        return PyErr_SetFromErrno(PyExc_OSError);
+    for (i = 0; i < 2; i++) {
+        fcntl(fd[i], F_SETFL, fcntl(fd[i], F_GETFL) | O_NONBLOCK);
+        fcntl(fd[i], F_SETFD, FD_CLOEXEC);
+    }
+    if (!(db->pool = malloc((size_t)n * sizeof(pthread_t)))) {
+        close(fd[0]);
+        close(fd[1]);
+        return PyErr_NoMemory();
+    }
+    db->pool_fd[0] = fd[0];
+    db->pool_fd[1] = fd[1];
+    for (i = 0; i < n; i++) {
+        if ((rv = pthread_create(&db->pool[i], NULL, sophia_pool_worker, db)) != 0) {
+            errno = rv;
+            PyErr_SetFromErrno(PyExc_OSError);
+            sophia_pool_stop(db);
+            return NULL;
+        }
+        db->pool_size++;
+    }
+    return PyLong_FromLong(fd[0]);
+}
+
+static PyObject *
+sophia_db_async_stop(SophiaDB *db)
+{
+    sophia_pool_stop(db);
+    Py_RETURN_NONE;
+}
+
+static const char *sophia_request_names[] = {
+    "get", "contains", "set", "delete", "begin", "commit", "rollback", "fetch", NULL
+};
+
+static int
+sophia_is_cursor(PyObject *obj)
+{
+    return PyObject_TypeCheck(obj, &SophiaCursorKeysType)
+        || PyObject_TypeCheck(obj, &SophiaCursorValuesType)
+        || PyObject_TypeCheck(obj, &SophiaCursorItemsType);
+}
+
+static void
+sophia_pool_push(SophiaDB *db, SophiaRequest *req)
+{
+    pthread_mutex_lock(&db->pool_lock);
+    *db->pool_tail = req;
+    db->pool_tail = &req->next;
+    pthread_cond_signal(&db->pool_cond);
+    pthread_mutex_unlock(&db->pool_lock);
+}
+
+/* Queue the request for `n` records of a cursor. Until it completes, the
+ * cursor can't be used otherwise, by another request or by iterating over it.
+ */
+static PyObject *
+sophia_submit_fetch(SophiaDB *db, PyObject *token, PyObject *pcursor, PyObject *pn, uint64_t start)
+{
+    SophiaCursor *cursor = (SophiaCursor *)pcursor;
+    SophiaRequest *req;
+    Py_ssize_t n;
+    
+    if (!pcursor || !pn || !sophia_is_cursor(pcursor) || (cursor->db && cursor->db != db)) {
+        PyErr_SetString(PyExc_TypeError, "expected a cursor of the database, and a number of records");
+        return NULL;
+    }
+    if ((n = PyNumber_AsSsize_t(pn, PyExc_OverflowError)) == -1 && PyErr_Occurred())
+        return NULL;
+    if (n < 1) {
+        PyErr_SetString(PyExc_ValueError, "expected a positive number of records");
+        return NULL;
+    }
+    if (sophia_cursor_check_idle(cursor) == -1)
+        return NULL;
+    /* exhausted, or with enough records ahead */
+    if (!cursor->db || cursor->nbuf >= (size_t)n)
+        return Py_BuildValue("(N)", sophia_cursor_pop_many(cursor, n));
+    
+    if (!(req = sophia_request_new(PSP_REQ_FETCH, token, pcursor, NULL, 0, NULL, 0)))
+        return NULL;
+    req->n = n - (Py_ssize_t)cursor->nbuf;
+    req->start = start;
+    cursor->fetching = 1;
+    sophia_pool_push(db, req);
+    Py_RETURN_NONE;
+}
+
+/* Submit a request to the worker pool: `_submit(op, token[, args])`, where
+ * `op` is one of `sophia_request_names`, and `args` those of the synchronous
+ * method (the cursor and the number of records for "fetch"). The result is
+ * returned later by `_async_completions()`, along with `token`. If the
+ * request could be answered right away, from the read cache or the Bloom
+ * filter (or the buffer of the cursor), a 1-tuple holding the result is
+ * returned instead of None.
+ */
+static PyObject *
+sophia_db_submit(SophiaDB *db, PyObject *args)
+{
+    const char *name;
+    PyObject *token, *a = NULL, *b = NULL, *rv = NULL, *cached;
+    Py_buffer key, value;
+    int op, nbuffers = 0;
+    SophiaRequest *req;
+    uint64_t start = sophia_now();
+    
+    if (!PyArg_ParseTuple(args, "sO|OO:_submit", &name, &token, &a, &b))
+        return NULL;
+    for (op = 0; sophia_request_names[op] && strcmp(sophia_request_names[op], name); op++)
+        ;
+    if (!sophia_request_names[op]) {
+        PyErr_Format(PyExc_ValueError, "unknown operation: %s", name);
+        return NULL;
+    }
+    if (!db->pool) {
+        PyErr_SetString(SophiaError, "the worker pool isn't running");
+        return NULL;
+    }
+    if (op == PSP_REQ_FETCH)
+        return sophia_submit_fetch(db, token, a, b, start);
+    
+    ensure_is_opened(db, NULL);
+    
+    if (op <= PSP_REQ_DELETE) {
+        if (!a) {
+            PyErr_Format(PyExc_TypeError, "%s() expects a key", name);
+            return NULL;
+        }
+        if (sophia_encoded_view(&db->key_codec, a, &key) == -1)
+            return NULL;
+        nbuffers++;
+    }
+    if (op == PSP_REQ_SET) {
+        if (!b) {
+            PyErr_SetString(PyExc_TypeError, "set() expects a value");
+            goto done;
+        }
+        if (sophia_encoded_view(&db->value_codec, b, &value) == -1)
+            goto done;
+        nbuffers++;
+    }
+    
+    switch (op) {
+        case PSP_REQ_GET:
+            if (db->cache_budget && (cached = sophia_cache_find(db, key.buf, (size_t)key.len))) {
+                sophia_stats_record(db, PSP_OP_GET, start);
+                rv = Py_BuildValue("(N)", sophia_decode_bytes(&db->value_codec, cached));
+                goto done;
+            }
+            /* fall through */
+        case PSP_REQ_CONTAINS:
+            if (sophia_db_rejects(db, key.buf, (size_t)key.len)) {
+                sophia_stats_record(db, op == PSP_REQ_GET ? PSP_OP_GET : PSP_OP_CONTAINS, start);
+                rv = Py_BuildValue("(O)", op == PSP_REQ_CONTAINS ? Py_False : (b ? b : Py_None));
+                goto done;
+            }
+            break;
+        case PSP_REQ_SET:
+            /* the filter must know the key before it can be read */
+            if (db->bloom.bits)
+                sophia_bloom_add(&db->bloom, key.buf, (size_t)key.len);
+            break;
+    }
+    
+    req = sophia_request_new(op, token, op == PSP_REQ_GET ? b : NULL,
+                             nbuffers > 0 ? key.buf : NULL, nbuffers > 0 ? (size_t)key.len : 0,
+                             nbuffers > 1 ? value.buf : NULL, nbuffers > 1 ? (size_t)value.len : 0);
+    if (req) {
+        req->epoch = db->cache_epoch;
+        req->start = start;
+        sophia_pool_push(db, req);
+        Py_INCREF(Py_None);
+        rv = Py_None;
+    }
+    
+done:
+    if (nbuffers > 0)
+        PyBuffer_Release(&key);
+    if (nbuffers > 1)
+        PyBuffer_Release(&value);
+    return rv;
+}
+
+/* Take the exception being raised, to be returned as a value */
+static PyObject *
+sophia_fetch_exception(void)
+{
+    PyObject *type, *value, *tb;
+    
+    PyErr_Fetch(&type, &value, &tb);
+    PyErr_NormalizeException(&type, &value, &tb);
+    Py_XDECREF(type);
+    Py_XDECREF(tb);
+    return value;
+}
+
+/* Account for a completed request, as the synchronous method would, and
+ * build the tuple `(token, ok, result)`, `result` being the exception raised
+ * if `ok` is false.
+ */
+static PyObject *
+sophia_request_complete(SophiaDB *db, SophiaRequest *req)
+{
+    PyObject *value = NULL, *cached;
+    int ok;
+    
+    switch (req->op) {
+        case PSP_REQ_GET:
+            sophia_stats_record(db, PSP_OP_GET, req->start);
+            if (req->rv == 1) {
+                db->bytes_read += req->rsize;
+                if (db->cache_budget) {
+                    if ((cached = PyBytes_FromStringAndSize(req->result, req->rsize))) {
+                        sophia_cache_insert(db, req->epoch, req->key, req->ksize, cached);
+                        value = sophia_decode_bytes(&db->value_codec, cached);
+                        Py_DECREF(cached);
+                    }
+                }
+                else
+                    value = sophia_decode(&db->value_codec, req->result, req->rsize);
+            }
+            else if (req->rv == 0) {
+                if (db->bloom.bits)
+                    db->bloom_false_positives++;
+                value = req->arg ? req->arg : Py_None;
+                Py_INCREF(value);
+            }
+            break;
+        case PSP_REQ_CONTAINS:
+            sophia_stats_record(db, PSP_OP_CONTAINS, req->start);
+            if (req->rv == 0 && db->bloom.bits)
+                db->bloom_false_positives++;
+            if (req->rv != -1)
+                value = PyBool_FromLong(req->rv);
+            break;
+        case PSP_REQ_SET:
+        case PSP_REQ_DELETE:
+            sophia_stats_record(db, req->op == PSP_REQ_SET ? PSP_OP_SET : PSP_OP_DELETE, req->start);
+            if (req->rv == 0)
+                db->bytes_written += (uint64_t)(req->ksize + req->vsize);
+            if (db->cache_budget)
+                sophia_cache_invalidate(db, req->key, req->ksize);
+            break;
+        case PSP_REQ_BEGIN:
+            sophia_stats_record(db, PSP_OP_BEGIN, req->start);
+            break;
+        case PSP_REQ_COMMIT:
+            sophia_stats_record(db, PSP_OP_COMMIT, req->start);
+            break;
+        case PSP_REQ_ROLLBACK:
+            sophia_stats_record(db, PSP_OP_ROLLBACK, req->start);
+            /* values written by the transaction may have been cached */
+            sophia_cache_clear(db);
+            break;
+        case PSP_REQ_FETCH:
+            ((SophiaCursor *)req->arg)->fetching = 0;
+            if (req->rv != -1) {
+                SophiaCursor *cursor = (SophiaCursor *)req->arg;
+                if (sophia_cursor_filled(cursor, &req->fill, req->start) != -1)
+                    value = sophia_cursor_pop_many(cursor, (Py_ssize_t)cursor->nbuf);
+            }
+            break;
+    }
+    if (req->rv == -1)
+        PyErr_SetString(SophiaError, req->fill.err);
+    else if (req->op != PSP_REQ_GET && req->op != PSP_REQ_CONTAINS && req->op != PSP_REQ_FETCH) {
+        Py_INCREF(Py_None);
+        value = Py_None;
+    }
+    if (!(ok = value != NULL) && !(value = sophia_fetch_exception()))
+        return NULL;
+    return Py_BuildValue("(OON)", req->token, ok ? Py_True : Py_False, value);
+}
+
+/* Collect the results of the requests completed since the last call, as a
+ * list of tuples `(token, ok, result)`, in the order of their completion.
+ */
+static PyObject *
+sophia_db_async_completions(SophiaDB *db)
+{
+    char buf[256];
+    ssize_t n;
+    SophiaRequest *req, *next, *done = NULL;
+    PyObject *rv, *item;
+    
+    if (!(rv = PyList_New(0)))
+        return NULL;
+    if (db->pool_fd[0] != -1) {
+        while ((n = read(db->pool_fd[0], buf, sizeof(buf))) > 0 || (n == -1 && errno == EINTR))
+            ;
+    }
+    
+    pthread_mutex_lock(&db->pool_lock);
+    req = db->pool_done;
+    db->pool_done = NULL;
+    pthread_mutex_unlock(&db->pool_lock);
+    for (; req; req = next) {
+        next = req->next;
+        req->next = done;
+        done = req;
+    }
+    
+    for (req = done; req; req = req->next) {
+        if (!(item = sophia_request_complete(db, req)) || PyList_Append(rv, item) == -1) {
+            Py_XDECREF(item);
+            Py_CLEAR(rv);
+            break;
+        }
+        Py_DECREF(item);
+    }
+    sophia_requests_free(done);
+    return rv;
+}
+
+/* Index of the shard of a `ShardedDatabase` holding a key: `_shard(key,
+ * route)`, where `route` is either the number of shards, among which the
+ * keys are spread by the hash of their encoded form, or the tuple of the
+ * encoded keys splitting their ranges, in increasing order.
+ */
+static PyObject *
+sophia_db_shard(SophiaDB *db, PyObject *args)
+{
+    PyObject *pkey, *route, *split;
+    Py_buffer key;
+    Py_ssize_t lo, hi, mid, n;
+    
+    if (!PyArg_UnpackTuple(args, "_shard", 2, 2, &pkey, &route)
+        || sophia_encoded_view(&db->key_codec, pkey, &key) == -1)
+        return NULL;
+    
+    if (PyTuple_Check(route)) {
+        /* the number of split keys lower than or equal to the key */
+        lo = 0;
+        hi = PyTuple_GET_SIZE(route);
+        while (lo < hi) {
+            mid = lo + (hi - lo) / 2;
+            split = PyTuple_GET_ITEM(route, mid);
+            if (!PyBytes_Check(split)) {
+                PyBuffer_Release(&key);
+                PyErr_SetString(PyExc_TypeError, "expected encoded split keys");
+                return NULL;
+            }
+            if (sophia_db_compare(db, key.buf, (size_t)key.len, PyBytes_AS_STRING(split),
+                                  (size_t)PyBytes_GET_SIZE(split)) < 0)
+                hi = mid;
+            else
+                lo = mid + 1;
+        }
+        n = lo;
+    }
+    else {
+        if ((n = PyNumber_AsSsize_t(route, PyExc_OverflowError)) < 1) {
+            PyBuffer_Release(&key);
+            if (!PyErr_Occurred())
+                PyErr_SetString(PyExc_ValueError, "expected a positive number of shards");
+            return NULL;
+        }
+        n = (Py_ssize_t)(sophia_hash64(key.buf, (size_t)key.len) % (uint64_t)n);
+    }
+    PyBuffer_Release(&key);
+    return PyLong_FromSsize_t(n);
+}
+
+/* Encode a key with the codec of the database */
+static PyObject *
+sophia_db_encode_key(SophiaDB *db, PyObject *key)
+{
+    return sophia_encoded_bytes(&db->key_codec, key);
+}
+
+/* Merge the cursors over the shards of a `ShardedDatabase`:
+ * `_merge_cursors(cursors, kind)`, the cursors yielding items, and `kind`
+ * being what is yielded, "keys", "values" or "items".
+ */
+static PyObject *
+sophia_merge_cursors(PyObject *module, PyObject *args)
+{
+    PyObject *pcursors;
+    const char *name;
+    SophiaMerge *merge;
+    SophiaCursor *cursor;
+    Py_ssize_t i, n;
+    int kind;
+    
+    if (!PyArg_ParseTuple(args, "Os:_merge_cursors", &pcursors, &name))
+        return NULL;
+    if (!strcmp(name, "keys"))
+        kind = PSP_KEYS;
+    else if (!strcmp(name, "values"))
+        kind = PSP_VALUES;
+    else if (!strcmp(name, "items"))
+        kind = PSP_ITEMS;
+    else {
+        PyErr_Format(PyExc_ValueError, "unknown kind of records: %s", name);
+        return NULL;
+    }
+    
+    if (!(merge = PyObject_New(SophiaMerge, &SophiaMergeType)))
+        return NULL;
+    merge->db = NULL;
+    merge->heap = NULL;
+    merge->nheap = 0;
+    merge->kind = kind;
+    merge->reverse = merge->started = 0;
+    if (!(merge->cursors = PySequence_Tuple(pcursors))) {
+        Py_DECREF(merge);
+        return NULL;
+    }
+    n = PyTuple_GET_SIZE(merge->cursors);
+    for (i = 0; i < n; i++) {
+        cursor = (SophiaCursor *)PyTuple_GET_ITEM(merge->cursors, i);
+        if (!PyObject_TypeCheck((PyObject *)cursor, &SophiaCursorItemsType)) {
+            PyErr_SetString(PyExc_TypeError, "expected cursors yielding items");
+            Py_DECREF(merge);
+            return NULL;
+        }
+        if (i == 0)
+            merge->reverse = cursor->reverse;
+        if (!merge->db && cursor->db) {
+            Py_INCREF(cursor->db);
+            merge->db = cursor->db;
+        }
+    }
+    if (!(merge->heap = malloc((n ? n : 1) * sizeof(Py_ssize_t)))) {
+        Py_DECREF(merge);
+        return PyErr_NoMemory();
+    }
+    return (PyObject *)merge;
+}
+
+static void
+sophia_merge_dealloc(SophiaMerge *merge)
+{
+    Py_XDECREF(merge->cursors);
+    Py_XDECREF(merge->db);
+    free(merge->heap);
+    PyObject_Del(merge);
+}
+
+/* Raw key of the next record of the i-th cursor */
+static inline void
+sophia_merge_key(SophiaMerge *merge, Py_ssize_t i, const char **key, size_t *ksize)
+{
+    SophiaCursor *cursor = (SophiaCursor *)PyTuple_GET_ITEM(merge->cursors, i);
+    char *p = cursor->buf + cursor->bufpos;
+    
+    memcpy(ksize, p, sizeof(size_t));
+    *key = p + 2 * sizeof(size_t);
+}
+
+/* Should the i-th cursor come before the j-th one? */
+static int
+sophia_merge_before(SophiaMerge *merge, Py_ssize_t i, Py_ssize_t j)
+{
+    const char *a, *b;
+    size_t asz, bsz;
+    int cmp;
+    
+    sophia_merge_key(merge, i, &a, &asz);
+    sophia_merge_key(merge, j, &b, &bsz);
+    cmp = merge->db ? sophia_db_compare(merge->db, a, asz, b, bsz)
+                    : sophia_compare_default((char *)a, asz, (char *)b, bsz, NULL);
+    if (merge->reverse)
+        cmp = -cmp;
+    return cmp < 0 || (cmp == 0 && i < j);
+}
+
+static void
+sophia_merge_sift_down(SophiaMerge *merge, Py_ssize_t pos)
+{
+    Py_ssize_t child, tmp;
+    
+    while ((child = 2 * pos + 1) < merge->nheap) {
+        if (child + 1 < merge->nheap
+            && sophia_merge_before(merge, merge->heap[child + 1], merge->heap[child]))
+            child++;
+        if (!sophia_merge_before(merge, merge->heap[child], merge->heap[pos]))
+            break;
+        tmp = merge->heap[pos];
+        merge->heap[pos] = merge->heap[child];
+        merge->heap[child] = tmp;
+        pos = child;
+    }
+}
+
+/* Make sure the i-th cursor has a record in its buffer, if it has any left.
+ * Return 1 if so, 0 if it is exhausted, -1 on failure.
+ */
+static int
+sophia_merge_refill(SophiaMerge *merge, Py_ssize_t i)
+{
+    SophiaCursor *cursor = (SophiaCursor *)PyTuple_GET_ITEM(merge->cursors, i);
+    
+    if (cursor->nbuf == 0
+        && sophia_cursor_fill(cursor, cursor->batch > PSP_MERGE_BATCH ? cursor->batch : PSP_MERGE_BATCH) == -1)
+        return -1;
+    return cursor->nbuf > 0;
+}
+
+static PyObject *
+sophia_merge_next(SophiaMerge *merge)
+{
+    Py_ssize_t i, top;
+    PyObject *item;
+    int rv;
+    
+    if (!merge->started) {
+        for (i = 0; i < PyTuple_GET_SIZE(merge->cursors); i++) {
+            if ((rv = sophia_merge_refill(merge, i)) == -1)
+                return NULL;
+            if (rv)
+                merge->heap[merge->nheap++] = i;
+        }
+        for (i = merge->nheap / 2 - 1; i >= 0; i--)
+            sophia_merge_sift_down(merge, i);
+        merge->started = 1;
+    }
+    if (merge->nheap == 0)
+        return NULL;
+    
+    top = merge->heap[0];
+    if (!(item = sophia_cursor_pop_as((SophiaCursor *)PyTuple_GET_ITEM(merge->cursors, top), merge->kind)))
+        return NULL;
+    if ((rv = sophia_merge_refill(merge, top)) == -1) {
+        Py_DECREF(item);
+        return NULL;
+    }
+    if (!rv)
+        merge->heap[0] = merge->heap[--merge->nheap];
+    sophia_merge_sift_down(merge, 0);
+    return item;
+}
+
+/* Parallel scans.
+ *
+ * The keys are split into ranges, each scanned by a native thread. libsophia
+ * is only called with the database lock held, a chunk of records at a time, a
+ * new sophia cursor being opened after the last key of the previous chunk, as
+ * for the cursors of a threaded database. The threads thus take turns copying
+ * records from libsophia, while the filtering of these copies, their export,
+ * and their decoding by the consumers, all happen concurrently.
+ */
+
+/* A key splitting the ranges of a scan */
+typedef struct {
+    char *key;
+    size_t size;
+    uint64_t rank;         /* position of the key, when sampled */
+} SophiaSplit;
+
+#define PSP_SCAN_BUFSIZE 65536     /* initial size of the chunks */
+
+static void
+sophia_splits_free(SophiaSplit *splits, size_t n)
+{
+    size_t i;
+    
+    for (i = 0; i < n; i++)
+        free(splits[i].key);
+    free(splits);
+}
+
+static const char *
+sophia_memmem(const char *haystack, size_t hsize, const char *needle, size_t nsize)
+{
+    const char *p = haystack, *last;
+    
+    if (nsize == 0)
+        return haystack;
+    if (nsize > hsize)
+        return NULL;
+    last = haystack + (hsize - nsize);
+    while (p <= last && (p = memchr(p, needle[0], (size_t)(last - p) + 1))) {
+        if (!memcmp(p, needle, nsize))
+            return p;
+        p++;
+    }
+    return NULL;
+}
+
+/* Up to 8 bytes of the keys past a common prefix, read as the digits of a
+ * number, each in the range of the bytes of two keys at its position: keys
+ * made of decimal digits are read in base 10, random bytes in base 256.
+ */
+typedef struct {
+    size_t common;         /* size of the common prefix */
+    size_t width;          /* number of digits */
+    unsigned lo[8];        /* lowest byte at each position ... */
+    unsigned radix[8];     /* ... and number of bytes in the range */
+} SophiaRadix;
+
+static inline unsigned
+sophia_key_byte(const char *key, size_t size, size_t i)
+{
+    return i < size ? (unsigned char)key[i] : 0;
+}
+
+static void
+sophia_radix_init(SophiaRadix *radix, const char *a, size_t asize, const char *b, size_t bsize)
+{
+    unsigned x, y;
+    size_t i;
+    
+    radix->common = 0;
+    while (radix->common < asize && radix->common < bsize && a[radix->common] == b[radix->common])
+        radix->common++;
+    radix->width = (asize > bsize ? asize : bsize) - radix->common;
+    if (radix->width > 8)
+        radix->width = 8;
+    for (i = 0; i < radix->width; i++) {
+        x = sophia_key_byte(a, asize, radix->common + i);
+        y = sophia_key_byte(b, bsize, radix->common + i);
+        radix->lo[i] = x < y ? x : y;
+        radix->radix[i] = (x < y ? y - x : x - y) + 1;
+    }
+}
+
+static uint64_t
+sophia_radix_value(SophiaRadix *radix, const char *key, size_t size)
+{
+    uint64_t value = 0;
+    size_t i;
+    
+    for (i = 0; i < radix->width; i++)
+        value = value * radix->radix[i] + (sophia_key_byte(key, size, radix->common + i) - radix->lo[i]);
+    return value;
+}
+
+/* The key whose digits are those of `value`, after the common prefix of `a` */
+static char *
+sophia_radix_key(SophiaRadix *radix, const char *a, uint64_t value)
+{
+    char *key = malloc(radix->common + radix->width);
+    size_t i;
+    
+    if (key) {
+        memcpy(key, a, radix->common);
+        for (i = radix->width; i > 0; i--) {
+            key[radix->common + i - 1] = (char)(radix->lo[i - 1] + value % radix->radix[i - 1]);
+            value /= radix->radix[i - 1];
+        }
+    }
+    return key;
+}
+
+/* Copy the first key the sophia cursor opened at `key` in `order` yields, if
+ * lower than `hi` (unless NULL). Return 1 if there is such a key, 0 if there
+ * is none, -1 on failure, or -2 if memory is exhausted.
+ */
+static int
+sophia_scan_edge(SophiaDB *db, int order, const char *key, size_t ksize,
+                 const char *hi, size_t hisz, char **out, size_t *osize, char *err)
+{
+    void *cur = sp_cursor(db->db, order, key, ksize);
+    int rv = 0;
+    
+    if (!cur) {
+        sophia_copy_error(db->db, err);
+        return -1;
+    }
+    if (sp_fetch(cur)
+        && (!hi || sophia_compare_default((char *)sp_key(cur), sp_keysize(cur), (char *)hi, hisz, NULL) < 0)) {
+        *osize = sp_keysize(cur);
+        rv = (*out = sophia_memdup(sp_key(cur), *osize)) ? 1 : -2;
+    }
+    sp_destroy(cur);
+    return rv;
+}
+
+/* Split the keys from `lo` (or the first one) to `hi` (or the last one,
+ * excluded) in `parts` ranges, with the database lock held. Under the default
+ * comparison function, the keys are assumed to be evenly spread between the
+ * first and the last one, and the split keys are interpolated between them,
+ * as numbers (see `SophiaRadix`).
+ * Under another one, the split keys are the quantiles of a sample of the keys,
+ * drawn in one pass over them, the lock being released every PSP_SCAN_CHUNK
+ * keys so that the database isn't blocked for the whole pass. Return the
+ * number of split keys, stored into `*splits`, to be freed by the caller, -1
+ * on failure, or -2 if memory is exhausted.
+ */
+static int
+sophia_split_rank_cmp(const void *a, const void *b)
+{
+    uint64_t x = ((const SophiaSplit *)a)->rank, y = ((const SophiaSplit *)b)->rank;
+    return x < y ? -1 : x > y;
+}
+
+static Py_ssize_t
+sophia_scan_split(SophiaDB *db, const char *lo, size_t losz, const char *hi,
+                  size_t hisz, Py_ssize_t parts, SophiaSplit **splits, char *err)
+{
+    SophiaSplit *sample, tmp;
+    SophiaRadix radix;
+    size_t i, n = 0, m = 0, size;
+    uint64_t x, y, d, k, prev, seen = 0, state = 0x9e3779b97f4a7c15ULL;
+    char *first = NULL, *last = NULL;
+    size_t fsize = 0, lsize = 0, step;
+    void *cur;
+    int rv, more = 1;
+    
+    if (!db->cmp_fun && !db->cmp_native) {
+        if (!(*splits = calloc((size_t)parts, sizeof(SophiaSplit))))
+            return -2;
+        if ((rv = sophia_scan_edge(db, SPGTE, lo, losz, hi, hisz, &first, &fsize, err)) == 1)
+            rv = sophia_scan_edge(db, hi ? SPLT : SPLTE, hi, hisz, NULL, 0, &last, &lsize, err);
+        if (rv == -1)
+            goto sophia_error;
+        if (rv == -2)
+            goto memory_error;
+        if (!first || !last) {
+            free(first);
+            return 0;
+        }
+        
+        sophia_radix_init(&radix, first, fsize, last, lsize);
+        x = prev = sophia_radix_value(&radix, first, fsize);
+        y = sophia_radix_value(&radix, last, lsize);
+        d = y > x ? y - x : 0;
+        for (k = 1; k < (uint64_t)parts; k++) {
+            uint64_t value = x + d / (uint64_t)parts * k + d % (uint64_t)parts * k / (uint64_t)parts;
+            if (value <= prev)
+                continue;
+            prev = value;
+            if (!((*splits)[n].key = sophia_radix_key(&radix, first, value)))
+                goto memory_error;
+            (*splits)[n++].size = radix.common + radix.width;
+        }
+        free(first);
+        free(last);
+        return (Py_ssize_t)n;
+    }
+    
+    /* reservoir sampling of the keys, then sorted back by rank */
+    m = (size_t)parts * PSP_SCAN_SAMPLES;
+    if (!(sample = calloc(m, sizeof(SophiaSplit))))
+        return -2;
+    *splits = sample;
+    while (more) {
+        /* resume after the last key of the previous chunk, kept in `last` */
+        if (!(cur = last ? sp_cursor(db->db, SPGT, last, lsize) : sp_cursor(db->db, SPGTE, lo, losz))) {
+            sophia_copy_error(db->db, err);
+            goto sophia_error;
+        }
+        for (step = 0; step < PSP_SCAN_CHUNK && (more = sp_fetch(cur)); step++) {
+            if (hi && sophia_db_compare(db, sp_key(cur), sp_keysize(cur), hi, hisz) >= 0) {
+                more = 0;
+                break;
+            }
+            if (n < m)
+                i = n++;
+            else {
+                state ^= state << 13;
+                state ^= state >> 7;
+                state ^= state << 17;
+                if ((i = (size_t)(state % (seen + 1))) >= m) {
+                    seen++;
+                    continue;
+                }
+                free(sample[i].key);
+                sample[i].key = NULL;
+            }
+            size = sp_keysize(cur);
+            if (!(sample[i].key = sophia_memdup(sp_key(cur), size))) {
+                sp_destroy(cur);
+                goto memory_error;
+            }
+            sample[i].size = size;
+            sample[i].rank = seen++;
+        }
+        if (more) {
+            free(last);
+            lsize = sp_keysize(cur);
+            if (!(last = sophia_memdup(sp_key(cur), lsize))) {
+                sp_destroy(cur);
+                goto memory_error;
+            }
+        }
+        sp_destroy(cur);
+        if (more) {
+            pthread_mutex_unlock(&db->lock);
+            pthread_mutex_lock(&db->lock);
+            if (!db->db) {
+                sophia_closed_error(err);
+                goto sophia_error;
+            }
+        }
+    }
+    free(last);
+    last = NULL;
+    
+    qsort(sample, n, sizeof(SophiaSplit), sophia_split_rank_cmp);
+    /* keep the quantiles at the front */
+    size = 0;
+    for (k = 1; k < (uint64_t)parts; k++) {
+        i = (size_t)(k * n / (uint64_t)parts);
+        if (i == 0 || (size > 0 && sample[size - 1].rank >= sample[i].rank))
+            continue;
+        tmp = sample[size];
+        sample[size++] = sample[i];
+        sample[i] = tmp;
+    }
+    for (i = size; i < n; i++) {
+        free(sample[i].key);
+        sample[i].key = NULL;
+    }
+    return (Py_ssize_t)size;
+    
+sophia_error:
+    free(first);
+    free(last);
+    sophia_splits_free(*splits, n);
+    *splits = NULL;
+    return -1;
+    
+memory_error:
+    free(first);
+    free(last);
+    sophia_splits_free(*splits, !db->cmp_fun && !db->cmp_native ? n : m);
+    *splits = NULL;
+    return -2;
+}
+
+static SophiaChunk *
+sophia_chunk_new(size_t size)
+{
+    SophiaChunk *chunk = malloc(sizeof(SophiaChunk) + size);
+    
+    if (chunk) {
+        chunk->next = NULL;
+        chunk->n = chunk->len = 0;
+        chunk->size = size;
+    }
+    return chunk;
+}
+
+/* Append a record to a chunk, which may be moved */
+static int
+sophia_chunk_append(SophiaChunk **pchunk, const char *key, size_t ksize,
+                    const char *value, size_t vsize)
+{
+    SophiaChunk *chunk = *pchunk;
+    size_t needed = chunk->len + 2 * sizeof(size_t) + ksize + vsize;
+    char *p;
+    
+    if (needed > chunk->size) {
+        size_t size = chunk->size * 2 > needed ? chunk->size * 2 : needed;
+        if (!(chunk = realloc(chunk, sizeof(SophiaChunk) + size)))
+            return -1;
+        chunk->size = size;
+        *pchunk = chunk;
+    }
+    p = chunk->data + chunk->len;
+    memcpy(p, &ksize, sizeof(size_t));
+    memcpy(p + sizeof(size_t), &vsize, sizeof(size_t));
+    p += 2 * sizeof(size_t);
+    memcpy(p, key, ksize);
+    memcpy(p + ksize, value, vsize);
+    chunk->len = needed;
+    chunk->n++;
+    return 0;
+}
+
+static inline int
+sophia_scan_match(SophiaScan *scan, const char *key, size_t ksize,
+                  const char *value, size_t vsize)
+{
+    return (!scan->prefix || (ksize >= scan->psize && !memcmp(key, scan->prefix, scan->psize)))
+        && (!scan->contains || sophia_memmem(value, vsize, scan->contains, scan->csize));
+}
+
+/* Copy the next `scan->chunk` records of a range into `*chunk`, with the
+ * database lock held. They are filtered afterwards, by sophia_scan_filter().
+ * Return 1 once the end of the range is reached, 0 if there are records left,
+ * or -1 on failure, the error being copied into the range.
+ */
+static int
+sophia_scan_step(SophiaScanPart *part, SophiaChunk **chunk)
+{
+    SophiaScan *scan = part->scan;
+    SophiaDB *db = scan->db;
+    const char *key, *last = NULL;
+    size_t ksize, lsize = 0, seen = 0;
+    char *p;
+    void *cur;
+    int rv = 0;
+    
+    if (!db->db)
+        return sophia_closed_error(part->err);
+    if (!(cur = part->resume ? sp_cursor(db->db, SPGT, part->resume, part->rsize)
+                             : sp_cursor(db->db, SPGTE, part->start, part->ssize))) {
+        sophia_copy_error(db->db, part->err);
+        return -1;
+    }
+    while (seen < scan->chunk) {
+        if (!sp_fetch(cur)) {
+            rv = 1;
+            break;
+        }
+        key = sp_key(cur);
+        ksize = sp_keysize(cur);
+        if (part->end && sophia_db_compare(db, key, ksize, part->end, part->esize) >= 0) {
+            rv = 1;
+            break;
+        }
+        if (sophia_chunk_append(chunk, key, ksize, sp_value(cur), sp_valuesize(cur)) == -1) {
+            strcpy(part->err, "out of memory");
+            rv = -1;
+            break;
+        }
+        last = key;
+        lsize = ksize;
+        seen++;
+    }
+    if (rv == 0 && last) {
+        if (lsize > part->rsize || !part->resume) {
+            if (!(p = realloc(part->resume, lsize ? lsize : 1))) {
+                strcpy(part->err, "out of memory");
+                rv = -1;
+            }
+            else
+                part->resume = p;
+        }
+        if (rv == 0) {
+            memcpy(part->resume, last, lsize);
+            part->rsize = lsize;
+        }
+    }
+    sp_destroy(cur);
+    return rv;
+}
+
+/* Drop the records of a chunk not matched by the scan, without the database
+ * lock, and count the others.
+ */
+static void
+sophia_scan_filter(SophiaScanPart *part, SophiaChunk *chunk)
+{
+    SophiaScan *scan = part->scan;
+    const char *p = chunk->data;
+    char *q = chunk->data;
+    size_t i, n = chunk->n, ksize, vsize, size;
+    
+    chunk->n = 0;
+    for (i = 0; i < n; i++) {
+        memcpy(&ksize, p, sizeof(size_t));
+        memcpy(&vsize, p + sizeof(size_t), sizeof(size_t));
+        size = 2 * sizeof(size_t) + ksize + vsize;
+        if (sophia_scan_match(scan, p + 2 * sizeof(size_t), ksize,
+                              p + 2 * sizeof(size_t) + ksize, vsize)) {
+            part->records++;
+            part->key_bytes += ksize;
+            part->value_bytes += vsize;
+            if (q != p)
+                memmove(q, p, size);
+            q += size;
+            chunk->n++;
+        }
+        p += size;
+    }
+    chunk->len = (size_t)(q - chunk->data);
+}
+
+/* Export the records of a chunk, each as its key size and value size (as
+ * 32-bit little-endian numbers), followed by the key and the value.
+ */
+static int
+sophia_scan_write(SophiaScanPart *part, SophiaChunk *chunk)
+{
+    const char *p = chunk->data;
+    unsigned char header[8];
+    size_t i, j, ksize, vsize;
+    
+    for (i = 0; i < chunk->n; i++) {
+        memcpy(&ksize, p, sizeof(size_t));
+        memcpy(&vsize, p + sizeof(size_t), sizeof(size_t));
+        p += 2 * sizeof(size_t);
+        if (ksize > UINT32_MAX || vsize > UINT32_MAX) {
+            strcpy(part->err, "record too large to be exported");
+            return -1;
+        }
+        for (j = 0; j < 4; j++) {
+            header[j] = (unsigned char)(ksize >> (8 * j));
+            header[4 + j] = (unsigned char)(vsize >> (8 * j));
+        }
+        if (fwrite(header, 1, sizeof(header), part->out) != sizeof(header)
+            || fwrite(p, 1, ksize + vsize, part->out) != ksize + vsize) {
+            snprintf(part->err, PSP_ERRMAX, "failed to export the records: %s", strerror(errno));
+            return -1;
+        }
+        p += ksize + vsize;
+    }
+    return 0;
+}
+
+static void *
+sophia_scan_worker(void *arg)
+{
+    SophiaScanPart *part = arg;
+    SophiaScan *scan = part->scan;
+    SophiaChunk *chunk = NULL;
+    int rv = 0;
+    
+    while (rv == 0) {
+        /* don't get more than PSP_SCAN_AHEAD chunks ahead of the consumer */
+        pthread_mutex_lock(&scan->lock);
+        while (!scan->stop && part->queued >= PSP_SCAN_AHEAD)
+            pthread_cond_wait(&scan->cond, &scan->lock);
+        rv = scan->stop;
+        pthread_mutex_unlock(&scan->lock);
+        if (rv)
+            break;
+        
+        /* the chunks are handed over to the consumer, or reused */
+        if (chunk)
+            chunk->n = chunk->len = 0;
+        else if (!(chunk = sophia_chunk_new(PSP_SCAN_BUFSIZE))) {
+            strcpy(part->err, "out of memory");
+            rv = -1;
+            break;
+        }
+        pthread_mutex_lock(&scan->db->lock);
+        rv = sophia_scan_step(part, &chunk);
+        pthread_mutex_unlock(&scan->db->lock);
+        if (rv == -1)
+            break;
+        
+        sophia_scan_filter(part, chunk);
+        if (scan->mode == PSP_SCAN_EXPORT && sophia_scan_write(part, chunk) == -1)
+            rv = -1;
+        if (scan->mode != PSP_SCAN_CHUNKS || rv == -1 || chunk->n == 0)
+            continue;
+        pthread_mutex_lock(&scan->lock);
+        *part->tail = chunk;
+        part->tail = &chunk->next;
+        part->queued++;
+        pthread_cond_broadcast(&scan->cond);
+        pthread_mutex_unlock(&scan->lock);
+        chunk = NULL;
+    }
+    free(chunk);
+    
+    pthread_mutex_lock(&scan->lock);
+    part->failed = (rv == -1);
+    part->done = 1;
+    pthread_cond_broadcast(&scan->cond);
+    pthread_mutex_unlock(&scan->lock);
+    return NULL;
+}
+
+/* Wait for the workers to be done, without the GIL, stopping them first if
+ * `stop` is true.
+ */
+static void
+sophia_scan_join(SophiaScan *scan, int stop)
+{
+    Py_ssize_t i;
+    
+    Py_BEGIN_ALLOW_THREADS
+    if (stop) {
+        pthread_mutex_lock(&scan->lock);
+        scan->stop = 1;
+        pthread_cond_broadcast(&scan->cond);
+        pthread_mutex_unlock(&scan->lock);
+    }
+    for (i = 0; i < scan->nparts; i++) {
+        if (scan->parts[i].running) {
+            pthread_join(scan->parts[i].thread, NULL);
+            scan->parts[i].running = 0;
+        }
+    }
+    Py_END_ALLOW_THREADS
+}
+
+/* Raise the error of the first range whose scan failed, if any, or else the
+ * exception of the python comparison function
+ */
+static int
+sophia_scan_check(SophiaScan *scan)
+{
+    Py_ssize_t i;
+    
+    for (i = 0; i < scan->nparts; i++) {
+        if (scan->parts[i].failed) {
+            PyErr_SetString(SophiaError, scan->parts[i].err);
+            return -1;
+        }
+    }
+    return sophia_cmp_raise(scan->db);
+}
+
+/* Take the next chunk of a range, with the lock of the scan held */
+static SophiaChunk *
+sophia_scan_take(SophiaScan *scan, SophiaScanPart *part)
+{
+    SophiaChunk *chunk = part->head;
+    
+    if (chunk) {
+        if (!(part->head = chunk->next))
+            part->tail = &part->head;
+        part->queued--;
+        pthread_cond_broadcast(&scan->cond);
+    }
+    return chunk;
+}
+
+/* Decode the record of a chunk at `*pos` into a (key, value) tuple */
+static PyObject *
+sophia_scan_item(SophiaScan *scan, SophiaChunk *chunk, size_t *pos)
+{
+    const char *p = chunk->data + *pos;
+    PyObject *pkey, *pvalue, *rv;
+    size_t ksize, vsize;
+    
+    memcpy(&ksize, p, sizeof(size_t));
+    memcpy(&vsize, p + sizeof(size_t), sizeof(size_t));
+    p += 2 * sizeof(size_t);
+    *pos += 2 * sizeof(size_t) + ksize + vsize;
+    
+    if (!(pkey = sophia_decode(&scan->key_codec, p, ksize)))
+        return NULL;
+    if (!(pvalue = sophia_decode(&scan->value_codec, p + ksize, vsize))) {
+        Py_DECREF(pkey);
+        return NULL;
+    }
+    rv = PyTuple_Pack(2, pkey, pvalue);
+    Py_DECREF(pkey);
+    Py_DECREF(pvalue);
+    return rv;
+}
+
+/* Set the bounds of a range. Under the default comparison function, they are
+ * narrowed down to the keys starting with the prefix of the scan, and the
+ * range is marked as done if this leaves no key.
+ */
+static int
+sophia_scan_bound(SophiaScan *scan, SophiaScanPart *part, SophiaSplit *lo,
+                  SophiaSplit *hi, const char *succ, size_t succsize)
+{
+    SophiaDB *db = scan->db;
+    SophiaSplit prefix = {scan->prefix, scan->psize, 0}, end = {(char *)succ, succsize, 0};
+    
+    if (scan->prefix && !db->cmp_fun && !db->cmp_native) {
+        if (!lo || sophia_compare_default(lo->key, lo->size, prefix.key, prefix.size, NULL) < 0)
+            lo = &prefix;
+        if (succ && (!hi || sophia_compare_default(hi->key, hi->size, end.key, end.size, NULL) > 0))
+            hi = &end;
+        if (hi && sophia_compare_default(lo->key, lo->size, hi->key, hi->size, NULL) >= 0)
+            part->done = 1;
+    }
+    if ((lo && !(part->start = sophia_memdup(lo->key, lo->size)))
+        || (hi && !(part->end = sophia_memdup(hi->key, hi->size)))) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    part->ssize = lo ? lo->size : 0;
+    part->esize = hi ? hi->size : 0;
+    return 0;
+}
+
+/* Start a parallel scan over `nparts` ranges of keys, split either by the
+ * `pbounds` keys given, or by sampling the keys.
+ */
+static SophiaScan *
+sophia_scan_new(SophiaDB *db, int mode, Py_ssize_t nparts, PyObject *pbounds,
+                Py_ssize_t chunk, PyObject *pprefix, PyObject *pcontains)
+{
+    SophiaScan *scan;
+    SophiaSplit *splits = NULL;
+    PyObject *seq, *pbytes;
+    Py_ssize_t i, nsplits = 0;
+    char *succ = NULL, err[PSP_ERRMAX];
+    size_t succsize = 0;
+    
+    ensure_is_opened(db, NULL);
+    
+    if (nparts < 1 || chunk < 1) {
+        PyErr_SetString(PyExc_ValueError, "parts and chunk must be positive");
+        return NULL;
+    }
+    if (nparts > PSP_SCAN_MAXPARTS) {
+        PyErr_Format(PyExc_ValueError, "a scan can't have more than %d ranges", PSP_SCAN_MAXPARTS);
+        return NULL;
+    }
+    if (!(scan = PyObject_New(SophiaScan, &SophiaScanType)))
+        return NULL;
+    Py_INCREF(db);
+    db->cursors++;
+    scan->db = db;
+    scan->mode = mode;
+    scan->chunk = (size_t)chunk;
+    scan->prefix = scan->contains = NULL;
+    scan->psize = scan->csize = 0;
+    scan->key_codec.kind = scan->value_codec.kind = PSP_CODEC_RAW;
+    scan->key_codec.pack = scan->key_codec.unpack = NULL;
+    scan->value_codec.pack = scan->value_codec.unpack = NULL;
+    scan->key_codec.format = scan->value_codec.format = NULL;
+    scan->nparts = 0;
+    scan->parts = NULL;
+    scan->stop = 0;
+    pthread_mutex_init(&scan->lock, NULL);
+    pthread_cond_init(&scan->cond, NULL);
+    
+    if (sophia_codec_copy(&scan->key_codec, &db->key_codec) == -1
+        || sophia_codec_copy(&scan->value_codec, &db->value_codec) == -1)
+        goto error;
+    if (pprefix != Py_None) {
+        if (!(pbytes = sophia_bytes_from_object(pprefix)))
+            goto error;
+        scan->psize = (size_t)PyBytes_GET_SIZE(pbytes);
+        scan->prefix = sophia_memdup(PyBytes_AS_STRING(pbytes), scan->psize);
+        Py_DECREF(pbytes);
+        if (!scan->prefix || !(succ = malloc(scan->psize + 1)))
+            goto memory_error;
+        succsize = sophia_prefix_successor(scan->prefix, scan->psize, succ);
+    }
+    if (pcontains != Py_None) {
+        if (!(pbytes = sophia_bytes_from_object(pcontains)))
+            goto error;
+        if ((scan->csize = (size_t)PyBytes_GET_SIZE(pbytes)) > 0
+            && !(scan->contains = sophia_memdup(PyBytes_AS_STRING(pbytes), scan->csize))) {
+            Py_DECREF(pbytes);
+            goto memory_error;
+        }
+        Py_DECREF(pbytes);
+    }
+    
+    if (pbounds != Py_None) {
+        if (!(seq = PySequence_Fast(pbounds, "expected a sequence of keys")))
+            goto error;
+        if (PySequence_Fast_GET_SIZE(seq) >= PSP_SCAN_MAXPARTS) {
+            Py_DECREF(seq);
+            PyErr_Format(PyExc_ValueError, "a scan can't have more than %d ranges", PSP_SCAN_MAXPARTS);
+            goto error;
+        }
+        if (!(splits = calloc((size_t)PySequence_Fast_GET_SIZE(seq) + 1, sizeof(SophiaSplit)))) {
+            Py_DECREF(seq);
+            goto memory_error;
+        }
+        for (i = 0; i < PySequence_Fast_GET_SIZE(seq); i++) {
+            if (!(pbytes = sophia_encoded_bytes(&db->key_codec, PySequence_Fast_GET_ITEM(seq, i)))) {
+                Py_DECREF(seq);
+                goto error;
+            }
+            splits[i].size = (size_t)PyBytes_GET_SIZE(pbytes);
+            splits[i].key = sophia_memdup(PyBytes_AS_STRING(pbytes), splits[i].size);
+            Py_DECREF(pbytes);
+            nsplits = i + 1;
+            if (!splits[i].key) {
+                Py_DECREF(seq);
+                goto memory_error;
+            }
+            if (i > 0 && sophia_db_compare(db, splits[i - 1].key, splits[i - 1].size,
+                                           splits[i].key, splits[i].size) >= 0) {
+                Py_DECREF(seq);
+                PyErr_SetString(PyExc_ValueError, "the boundaries must be in increasing order");
+                goto error;
+            }
+        }
+        Py_DECREF(seq);
+    }
+    else if (nparts > 1) {
+        /* under the default comparison function, only the keys starting with
+         * the prefix are split */
+        int narrow = scan->prefix && !db->cmp_fun && !db->cmp_native;
+        
+        PSP_BEGIN_LOCKED(db)
+        nsplits = !db->db ? sophia_closed_error(err)
+                          : sophia_scan_split(db, narrow ? scan->prefix : NULL, narrow ? scan->psize : 0,
+                                              narrow && succsize ? succ : NULL, succsize,
+                                              nparts, &splits, err);
+        PSP_END_LOCKED(db)
+        if (nsplits == -2)
+            goto memory_error;
+        if (nsplits == -1) {
+            nsplits = 0;
+            PyErr_SetString(SophiaError, err);
+            goto error;
+        }
+    }
+    
+    if (!(scan->parts = calloc((size_t)nsplits + 1, sizeof(SophiaScanPart))))
+        goto memory_error;
+    scan->nparts = nsplits + 1;
+    for (i = 0; i < scan->nparts; i++) {
+        SophiaScanPart *part = &scan->parts[i];
+        
+        part->scan = scan;
+        part->tail = &part->head;
+        if (sophia_scan_bound(scan, part, i > 0 ? &splits[i - 1] : NULL,
+                              i < nsplits ? &splits[i] : NULL, succsize ? succ : NULL, succsize) == -1)
+            goto error;
+    }
+    sophia_splits_free(splits, (size_t)nsplits);
+    splits = NULL;
+    free(succ);
+    succ = NULL;
+    return scan;
+    
+memory_error:
+    PyErr_NoMemory();
+error:
+    sophia_splits_free(splits, (size_t)nsplits);
+    free(succ);
+    Py_DECREF(scan);
+    return NULL;
+}
+
+/* Start the workers of a scan */
+static int
+sophia_scan_start(SophiaScan *scan)
+{
+    Py_ssize_t i;
+    
+    for (i = 0; i < scan->nparts; i++) {
+        SophiaScanPart *part = &scan->parts[i];
+        
+        if (part->done)
+            continue;
+        if (pthread_create(&part->thread, NULL, sophia_scan_worker, part)) {
+            PyErr_SetString(SophiaError, "failed to start a thread");
+            return -1;
+        }
+        part->running = 1;
+    }
+    return 0;
+}
+
+static void
+sophia_scan_dealloc(SophiaScan *scan)
+{
+    SophiaScanPart *part;
+    SophiaChunk *chunk;
+    Py_ssize_t i;
+    
+    if (scan->parts) {
+        sophia_scan_join(scan, 1);
+        for (i = 0; i < scan->nparts; i++) {
+            part = &scan->parts[i];
+            while ((chunk = part->head)) {
+                part->head = chunk->next;
+                free(chunk);
+            }
+            if (part->out)
+                fclose(part->out);
+            free(part->start);
+            free(part->end);
+            free(part->resume);
+        }
+        free(scan->parts);
+    }
+    free(scan->prefix);
+    free(scan->contains);
+    sophia_codec_clear(&scan->key_codec);
+    sophia_codec_clear(&scan->value_codec);
+    pthread_mutex_destroy(&scan->lock);
+    pthread_cond_destroy(&scan->cond);
+    
+    scan->db->cursors--;
+    if (scan->db->close_me && scan->db->cursors == 0) {
+        sophia_db_close_internal(scan->db);
+        scan->db->close_me = 0;
+    }
+    Py_DECREF(scan->db);
+    PyObject_Del(scan);
+}
+
+static void
+sophia_scan_iter_dealloc(SophiaScanIter *it)
+{
+    free(it->chunk);
+    Py_DECREF(it->scan);
+    PyObject_Del(it);
+}
+
+static PyObject *
+sophia_scan_iter_next(SophiaScanIter *it)
+{
+    SophiaScan *scan = it->scan;
+    SophiaScanPart *part = it->part;
+    SophiaChunk *chunk;
+    int failed;
+    
+    if (it->left == 0) {
+        free(it->chunk);
+        it->chunk = NULL;
+        
+        Py_BEGIN_ALLOW_THREADS
+        pthread_mutex_lock(&scan->lock);
+        while (!part->head && !part->done)
+            pthread_cond_wait(&scan->cond, &scan->lock);
+        chunk = sophia_scan_take(scan, part);
+        failed = part->failed;
+        pthread_mutex_unlock(&scan->lock);
+        Py_END_ALLOW_THREADS
+        
+        if (!chunk) {
+            if (failed)
+                PyErr_SetString(SophiaError, part->err);
+            else
+                sophia_cmp_raise(scan->db);
+            return NULL;
+        }
+        it->chunk = chunk;
+        it->pos = 0;
+        it->left = chunk->n;
+    }
+    it->left--;
+    return sophia_scan_item(scan, it->chunk, &it->pos);
+}
+
+/* Hand the chunks over to `callback(part, items)` as they are fetched,
+ * alternating between the ranges, and return the number of records.
+ */
+static PyObject *
+sophia_scan_feed(SophiaScan *scan, PyObject *callback)
+{
+    SophiaChunk *chunk;
+    PyObject *items, *item, *rv;
+    Py_ssize_t i, next = 0, found;
+    uint64_t records = 0;
+    size_t j, pos;
+    
+    for (;;) {
+        Py_BEGIN_ALLOW_THREADS
+        pthread_mutex_lock(&scan->lock);
+        for (;;) {
+            int done = 1;
+            chunk = NULL;
+            for (i = 0; i < scan->nparts && !chunk; i++) {
+                found = (next + i) % scan->nparts;
+                chunk = sophia_scan_take(scan, &scan->parts[found]);
+                done = done && scan->parts[found].done;
+            }
+            if (chunk || (done && i == scan->nparts))
+                break;
+            pthread_cond_wait(&scan->cond, &scan->lock);
+        }
+        pthread_mutex_unlock(&scan->lock);
+        Py_END_ALLOW_THREADS
+        if (!chunk)
+            break;
+        next = found + 1;
+        
+        if (!(items = PyList_New((Py_ssize_t)chunk->n))) {
+            free(chunk);
+            return NULL;
+        }
+        for (j = 0, pos = 0; j < chunk->n; j++) {
+            if (!(item = sophia_scan_item(scan, chunk, &pos))) {
+                free(chunk);
+                Py_DECREF(items);
+                return NULL;
+            }
+            PyList_SET_ITEM(items, (Py_ssize_t)j, item);
+        }
+        free(chunk);
+        rv = PyObject_CallFunction(callback, "nO", found, items);
+        Py_DECREF(items);
+        if (!rv)
+            return NULL;
+        Py_DECREF(rv);
+    }
+    
+    if (sophia_scan_check(scan) == -1)
+        return NULL;
+    for (i = 0; i < scan->nparts; i++)
+        records += scan->parts[i].records;
+    return PyLong_FromUnsignedLongLong((unsigned long long)records);
+}
+
+/* Scan ranges of keys concurrently:
+ * `parallel_scan(callback=None, parts=4, boundaries=None, chunk=1000,
+ * prefix=None, contains=None)`. The keys are split in `parts` ranges, unless
+ * `boundaries`, the keys splitting them, are given. Only the records whose
+ * keys start with `prefix`, and whose values contain `contains`, are yielded.
+ * Each range is scanned by its own thread, `chunk` records at a time. If
+ * `callback` is given, it is called with the index of the range and a list of
+ * (key, value) tuples, as the chunks are fetched, and the number of records is
+ * returned. Otherwise, the list of iterators over the ranges is returned.
+ */
+static PyObject *
+sophia_db_parallel_scan(SophiaDB *db, PyObject *args, PyObject *kwargs)
+{
+    static char *keywords[] = {"callback", "parts", "boundaries", "chunk",
+        "prefix", "contains", NULL};
+    PyObject *callback = Py_None, *pbounds = Py_None, *pprefix = Py_None;
+    PyObject *pcontains = Py_None, *rv;
+    Py_ssize_t i, nparts = 4, chunk = PSP_SCAN_CHUNK;
+    SophiaScanIter *it;
+    SophiaScan *scan;
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|OnOnOO:parallel_scan", keywords,
+            &callback, &nparts, &pbounds, &chunk, &pprefix, &pcontains))
+        return NULL;
+    if (callback != Py_None && !PyCallable_Check(callback)) {
+        PyErr_SetString(PyExc_TypeError, "callback must be callable");
+        return NULL;
+    }
+    if (!(scan = sophia_scan_new(db, PSP_SCAN_CHUNKS, nparts, pbounds, chunk, pprefix, pcontains)))
+        return NULL;
+    if (sophia_scan_start(scan) == -1) {
+        Py_DECREF(scan);
+        return NULL;
+    }
+    if (callback != Py_None) {
+        rv = sophia_scan_feed(scan, callback);
+        Py_DECREF(scan);
+        return rv;
+    }
+    
+    if (!(rv = PyList_New(scan->nparts))) {
+        Py_DECREF(scan);
+        return NULL;
+    }
+    for (i = 0; i < scan->nparts; i++) {
+        if (!(it = PyObject_New(SophiaScanIter, &SophiaScanIterType))) {
+            Py_DECREF(rv);
+            Py_DECREF(scan);
+            return NULL;
+        }
+        Py_INCREF(scan);
+        it->scan = scan;
+        it->part = &scan->parts[i];
+        it->chunk = NULL;
+        it->pos = it->left = 0;
+        PyList_SET_ITEM(rv, i, (PyObject *)it);
+    }
+    Py_DECREF(scan);
+    return rv;
+}
+
+/* Count the records, and their size, with a parallel scan:
+ * `scan_stats(parts=4, boundaries=None, prefix=None, contains=None)`. The
+ * records are only counted by the workers, not copied.
+ */
+static PyObject *
+sophia_db_scan_stats(SophiaDB *db, PyObject *args, PyObject *kwargs)
+{
+    static char *keywords[] = {"parts", "boundaries", "prefix", "contains", NULL};
+    PyObject *pbounds = Py_None, *pprefix = Py_None, *pcontains = Py_None, *rv = NULL;
+    uint64_t records = 0, key_bytes = 0, value_bytes = 0;
+    Py_ssize_t i, nparts = 4;
+    SophiaScan *scan;
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|nOOO:scan_stats", keywords,
+            &nparts, &pbounds, &pprefix, &pcontains))
+        return NULL;
+    if (!(scan = sophia_scan_new(db, PSP_SCAN_STATS, nparts, pbounds, PSP_SCAN_CHUNK,
+                                 pprefix, pcontains)))
+        return NULL;
+    if (sophia_scan_start(scan) == 0) {
+        sophia_scan_join(scan, 0);
+        if (sophia_scan_check(scan) == 0) {
+            for (i = 0; i < scan->nparts; i++) {
+                records += scan->parts[i].records;
+                key_bytes += scan->parts[i].key_bytes;
+                value_bytes += scan->parts[i].value_bytes;
+            }
+            rv = Py_BuildValue("{s:K,s:K,s:K,s:n}",
+                "records", (unsigned long long)records,
+                "key_bytes", (unsigned long long)key_bytes,
+                "value_bytes", (unsigned long long)value_bytes,
+                "parts", scan->nparts);
+        }
+    }
+    Py_DECREF(scan);
+    return rv;
+}
+
+/* Create a temporary file next to the file exported, for a range other than
+ * the first one. Its path is stored into `*tmp`, to be freed by the caller,
+ * and NULL if it couldn't be created, with an exception set.
+ */
+static FILE *
+sophia_export_tmpfile(const char *path, char **tmp)
+{
+    FILE *file;
+    int fd;
+    
+    if (!(*tmp = PyMem_Malloc(strlen(path) + sizeof(".XXXXXX")))) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    sprintf(*tmp, "%s.XXXXXX", path);
+    if ((fd = mkstemp(*tmp)) == -1) {
+        PyErr_SetFromErrnoWithFilename(PyExc_IOError, *tmp);
+        PyMem_Free(*tmp);
+        *tmp = NULL;
+        return NULL;
+    }
+    if (!(file = fdopen(fd, "wb"))) {
+        PyErr_SetFromErrnoWithFilename(PyExc_IOError, *tmp);
+        close(fd);
+        unlink(*tmp);
+        PyMem_Free(*tmp);
+        *tmp = NULL;
+    }
+    return file;
+}
+
+/* Append the files of the other ranges to the file of the first one, and
+ * remove them. This is done without the GIL.
+ */
+static int
+sophia_export_merge(SophiaScan *scan, char **paths, char *err)
+{
+    char buf[65536];
+    size_t n;
+    FILE *in;
+    Py_ssize_t i;
+    int rv = 0;
+    
+    for (i = 1; i < scan->nparts && rv == 0; i++) {
+        if (fclose(scan->parts[i].out)) {
+            scan->parts[i].out = NULL;
+            rv = -1;
+            break;
+        }
+        scan->parts[i].out = NULL;
+        if (!(in = fopen(paths[i], "rb"))) {
+            rv = -1;
+            break;
+        }
+        while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+            if (fwrite(buf, 1, n, scan->parts[0].out) != n) {
+                rv = -1;
+                break;
+            }
+        }
+        if (ferror(in))
+            rv = -1;
+        fclose(in);
+    }
+    if (fclose(scan->parts[0].out))
+        rv = -1;
+    scan->parts[0].out = NULL;
+    if (rv == -1)
+        snprintf(err, PSP_ERRMAX, "failed to export the records: %s", strerror(errno));
+    return rv;
+}
+
+/* Export the records to a file with a parallel scan: `export(path, parts=4,
+ * boundaries=None, prefix=None, contains=None)`. Each range is written to a
+ * file of its own by its worker, a temporary one but for the first range,
+ * and these files are then concatenated, so that the records are exported
+ * in the order of the keys. Return the number of records exported.
+ */
+static PyObject *
+sophia_db_export(SophiaDB *db, PyObject *args, PyObject *kwargs)
+{
+    static char *keywords[] = {"path", "parts", "boundaries", "prefix", "contains", NULL};
+    PyObject *pbounds = Py_None, *pprefix = Py_None, *pcontains = Py_None, *rv = NULL;
+    char **paths = NULL, *path, err[PSP_ERRMAX];
+    Py_ssize_t i, nparts = 4;
+    uint64_t records = 0;
+    SophiaScan *scan;
+    int failed;
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|nOOO:export", keywords,
+            &path, &nparts, &pbounds, &pprefix, &pcontains))
+        return NULL;
+    if (!(scan = sophia_scan_new(db, PSP_SCAN_EXPORT, nparts, pbounds, PSP_SCAN_CHUNK,
+                                 pprefix, pcontains)))
+        return NULL;
+    if (!(paths = PyMem_Malloc(scan->nparts * sizeof(char *)))) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    for (i = 0; i < scan->nparts; i++)
+        paths[i] = NULL;
+    for (i = 0; i < scan->nparts; i++) {
+        if (i == 0 && !(scan->parts[i].out = fopen(path, "wb"))) {
+            PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+            goto done;
+        }
+        if (i > 0 && !(scan->parts[i].out = sophia_export_tmpfile(path, &paths[i])))
+            goto done;
+        setvbuf(scan->parts[i].out, NULL, _IOFBF, 1 << 20);
+    }
+    if (sophia_scan_start(scan) == -1)
+        goto done;
+    
+    sophia_scan_join(scan, 0);
+    if (sophia_scan_check(scan) == -1)
+        goto done;
+    Py_BEGIN_ALLOW_THREADS
+    failed = sophia_export_merge(scan, paths, err);
+    Py_END_ALLOW_THREADS
+    if (failed) {
+        PyErr_SetString(SophiaError, err);
+        goto done;
+    }
+    for (i = 0; i < scan->nparts; i++)
+        records += scan->parts[i].records;
+    rv = PyLong_FromUnsignedLongLong((unsigned long long)records);
+    
+done:
+    if (paths) {
+        for (i = 0; i < scan->nparts; i++) {
+            /* only the temporary files created above are removed */
+            if (paths[i]) {
+                if (scan->parts[i].out) {
+                    fclose(scan->parts[i].out);
+                    scan->parts[i].out = NULL;
+                }
+                unlink(paths[i]);
+            }
+            PyMem_Free(paths[i]);
+        }
+        PyMem_Free(paths);
+    }
+    Py_DECREF(scan);
+    return rv;
+}
+
+static inline int
+sophia_compare_default(char *a, size_t asz, char *b, size_t bsz, void *arg)
+{
+    int cmp = memcmp(a, b, (asz < bsz ? asz : bsz));
+    return (cmp == 0 ?
+        (asz == bsz ? 0 : (asz < bsz ? -1 : 1)) :
+        (cmp < 0 ? -1 : 1)
+    );
+}
+
+/* Native comparison functions. They must define a total order on any keys,
+ * including the ones which don't have the expected layout.
+ */
+
+/* Load an integer of `size` bytes */
+static inline uint64_t
+sophia_load_uint(const unsigned char *p, size_t size, int little)
+{
+    uint64_t value = 0;
+    size_t i;
+    
+    for (i = 0; i < size; i++)
+        value = (value << 8) | p[little ? size - 1 - i : i];
+    return value;
+}
+
+static inline int
+sophia_compare_number(const char *a, const char *b, size_t size, int little, int is_signed)
+{
+    uint64_t ua = sophia_load_uint((const unsigned char *)a, size, little);
+    uint64_t ub = sophia_load_uint((const unsigned char *)b, size, little);
+    
+    if (is_signed) {
+        /* sign-extend the values */
+        int64_t sa = (int64_t)(ua << (64 - 8 * size)) >> (64 - 8 * size);
+        int64_t sb = (int64_t)(ub << (64 - 8 * size)) >> (64 - 8 * size);
+        return sa < sb ? -1 : sa > sb;
+    }
+    return ua < ub ? -1 : ua > ub;
+}
+
+/* Compare keys holding a single integer. Keys of another size sort after
+ * them, in lexicographical order.
+ */
+static inline int
+sophia_compare_int(const char *a, size_t asz, const char *b, size_t bsz,
+                   size_t size, int little, int is_signed)
+{
+    if (asz != size || bsz != size) {
+        if ((asz == size) != (bsz == size))
+            return asz == size ? -1 : 1;
+        return sophia_compare_default((char *)a, asz, (char *)b, bsz, NULL);
+    }
+    return sophia_compare_number(a, b, size, little, is_signed);
+}
+
+#define PSP_INT_COMPARATOR(name, size, little, is_signed)                   \
+static int                                                                  \
+name(char *a, size_t asz, char *b, size_t bsz, void *arg)                   \
+{                                                                           \
+    return sophia_compare_int(a, asz, b, bsz, size, little, is_signed);     \
+}
+
+PSP_INT_COMPARATOR(sophia_compare_u32_be, 4, 0, 0)
+PSP_INT_COMPARATOR(sophia_compare_u32_le, 4, 1, 0)
+PSP_INT_COMPARATOR(sophia_compare_i32_be, 4, 0, 1)
+PSP_INT_COMPARATOR(sophia_compare_i32_le, 4, 1, 1)
+PSP_INT_COMPARATOR(sophia_compare_u64_be, 8, 0, 0)
+PSP_INT_COMPARATOR(sophia_compare_u64_le, 8, 1, 0)
+PSP_INT_COMPARATOR(sophia_compare_i64_be, 8, 0, 1)
+PSP_INT_COMPARATOR(sophia_compare_i64_le, 8, 1, 1)
+
+static int
+sophia_compare_reverse(char *a, size_t asz, char *b, size_t bsz, void *arg)
+{
+    return sophia_compare_default(b, bsz, a, asz, NULL);
+}
+
+static int
+sophia_compare_length(char *a, size_t asz, char *b, size_t bsz, void *arg)
+{
+    if (asz != bsz)
+        return asz < bsz ? -1 : 1;
+    return sophia_compare_default(a, asz, b, bsz, NULL);
+}
+
+static inline int
+sophia_compare_field(const SophiaField *field, int little, const char *a, const char *b)
+{
+    switch (field->code) {
+        case 'x':
+            return 0;
+        case 'b': case 'h': case 'i': case 'l': case 'q':
+            return sophia_compare_number(a, b, field->size, little, 1);
+        case 'f': case 'd': {
+            uint64_t ua = sophia_load_uint((const unsigned char *)a, field->size, little);
+            uint64_t ub = sophia_load_uint((const unsigned char *)b, field->size, little);
+            double da, db;
+            if (field->size == 4) {
+                uint32_t ia = (uint32_t)ua, ib = (uint32_t)ub;
+                float fa, fb;
+                memcpy(&fa, &ia, 4);
+                memcpy(&fb, &ib, 4);
+                da = fa;
+                db = fb;
+            }
+            else {
+                memcpy(&da, &ua, 8);
+                memcpy(&db, &ub, 8);
+            }
+            if (da < db)
+                return -1;
+            if (da > db)
+                return 1;
+            /* NaNs sort after the numbers, and bitwise among them */
+            if (da != da || db != db)
+                return (da != da) != (db != db) ? (da != da ? 1 : -1) : (ua < ub ? -1 : ua > ub);
+            return 0;
+        }
+        case 'c': case 's':
+            return sophia_compare_default((char *)a, field->size, (char *)b, field->size, NULL);
+        default: /* unsigned integers and booleans */
+            return sophia_compare_number(a, b, field->size, little, 0);
+    }
+}
+
+/* Compare keys field by field, as described by a struct format. The bytes
+ * which follow the last field, or which don't hold a complete field, are
+ * compared lexicographically.
+ */
+static int
+sophia_compare_struct(char *a, size_t asz, char *b, size_t bsz, void *arg)
+{
+    SophiaKeyFormat *format = arg;
+    size_t i, off = 0;
+    int cmp;
+    
+    for (i = 0; i < format->nfields; i++) {
+        const SophiaField *field = &format->fields[i];
+        
+        if (off + field->size > asz || off + field->size > bsz)
+            break;
+        if ((cmp = sophia_compare_field(field, format->little, a + off, b + off)))
+            return cmp;
+        off += field->size;
+    }
+    return sophia_compare_default(a + off, asz - off, b + off, bsz - off, NULL);
+}
+
+/* Parse a struct format (see the `struct` module) describing the layout of
+ * the keys for `sophia_compare_struct()`. Only the standard sizes are
+ * supported, so the format must start with a byte order character other
+ * than '@'. Return NULL and set an exception on failure.
+ */
+static SophiaKeyFormat *
+sophia_parse_key_format(const char *fmt)
+{
+    const char *p;
+    size_t nfields = 0, count;
+    SophiaKeyFormat *format = NULL;
+    int pass;
+    
+    if (!*fmt || !strchr("<>!=", *fmt)) {
+        PyErr_SetString(PyExc_ValueError, "the key format must start with one of '<', '>', '!' or '='");
+        return NULL;
+    }
+    
+    /* count the fields, then fill them */
+    for (pass = 0; pass < 2; pass++) {
+        if (pass == 1) {
+            if (!(format = malloc(sizeof(SophiaKeyFormat) + nfields * sizeof(SophiaField)))) {
+                PyErr_NoMemory();
+                return NULL;
+            }
+            if (*fmt == '=') {
+                const uint16_t one = 1;
+                format->little = *(const char *)&one;
+            }
+            else
+                format->little = (*fmt == '<');
+            format->nfields = 0;
+        }
+        for (p = fmt + 1; *p; p++) {
+            size_t size;
+            
+            if (*p == ' ')
+                continue;
+            count = 1;
+            if (*p >= '0' && *p <= '9') {
+                count = 0;
+                while (*p >= '0' && *p <= '9')
+                    count = count * 10 + (size_t)(*p++ - '0');
+            }
+            switch (*p) {
+                case 'x': case 'c': case 'b': case 'B': case '?':
+                    size = 1;
+                    break;
+                case 'h': case 'H':
+                    size = 2;
+                    break;
+                case 'i': case 'I': case 'l': case 'L': case 'f':
+                    size = 4;
+                    break;
+                case 'q': case 'Q': case 'd':
+                    size = 8;
+                    break;
+                case 's':
+                    size = count;
+                    count = 1;
+                    break;
+                default:
+                    if (pass == 1)
+                        free(format);
+                    PyErr_Format(PyExc_ValueError, "unsupported format character: '%c'",
+                                 *p ? *p : ' ');
+                    return NULL;
+            }
+            if (pass == 0) {
+                nfields += count;
+                continue;
+            }
+            while (count--) {
+                format->fields[format->nfields].code = *p;
+                format->fields[format->nfields++].size = size;
+            }
+        }
+    }
+    return format;
+}
+
+/* Native comparators, indexed by their constant */
+static const spcmpf sophia_comparators[] = {
+    sophia_compare_default,
+    sophia_compare_reverse,
+    sophia_compare_length,
+    sophia_compare_u32_be,
+    sophia_compare_u32_le,
+    sophia_compare_i32_be,
+    sophia_compare_i32_le,
+    sophia_compare_u64_be,
+    sophia_compare_u64_le,
+    sophia_compare_i64_be,
+    sophia_compare_i64_le,
+    sophia_compare_struct,
+};
+
+static spcmpf
+sophia_native_comparator(long constant)
+{
+    if (constant < 0 || constant >= (long)(sizeof(sophia_comparators) / sizeof(spcmpf)))
+        return NULL;
+    return sophia_comparators[constant];
+}
+
+/* Compare two keys with the comparison function currently attached to the
+ * database. This can be called with or without the GIL, but is faster
+ * without it when `sophia_cmp_needs_gil()` is false.
+ */
+static inline int
+sophia_db_compare(SophiaDB *db, const char *a, size_t asz, const char *b, size_t bsz)
+{
+    if (db->cmp_fun)
+        return sophia_compare_custom((char *)a, asz, (char *)b, bsz, db);
+    if (db->cmp_native)
+        return db->cmp_native((char *)a, asz, (char *)b, bsz, db->cmp_format);
+    return sophia_compare_default((char *)a, asz, (char *)b, bsz, NULL);
+}
+
+static inline int
+sophia_cmp_needs_gil(SophiaDB *db)
+{
+    return db->cmp_fun != NULL;
+}
+
+/* Are keys equal under the comparison function only if their bytes are? The
+ * read cache and the Bloom filter, which look the keys up by their bytes,
+ * require it. A python function may not be, nor a struct layout with padding
+ * bytes, or floats (0.0 and -0.0 being equal).
+ */
+static int
+sophia_cmp_is_bytewise(SophiaDB *db)
+{
+    size_t i;
+    
+    if (db->cmp_fun)
+        return 0;
+    if (db->cmp_native == sophia_compare_struct) {
+        for (i = 0; i < db->cmp_format->nfields; i++) {
+            if (strchr("xfd", db->cmp_format->fields[i].code))
+                return 0;
+        }
+    }
+    return 1;
+}
+
+/* The comparison function given to libsophia with PSPCMPSTATS, which counts
+ * the comparisons, and times one in PSP_CMP_SAMPLE of them to estimate their
+ * total time (net of the reading of the clock). It may be called from the
+ * threads of libsophia, hence the atomic counters.
+ */
+static int
+sophia_compare_counted(char *a, size_t asz, char *b, size_t bsz, void *arg)
+{
+    SophiaDB *db = arg;
+    uint64_t start, elapsed;
+    int rv;
+    
+    if (__atomic_fetch_add(&db->comparisons, 1, __ATOMIC_RELAXED) % PSP_CMP_SAMPLE)
+        return sophia_db_compare(db, a, asz, b, bsz);
+    start = sophia_now();
+    rv = sophia_db_compare(db, a, asz, b, bsz);
+    elapsed = sophia_now() - start;
+    elapsed = elapsed > sophia_clock_ns ? elapsed - sophia_clock_ns : 0;
+    __atomic_fetch_add(&db->comparison_ns, elapsed * PSP_CMP_SAMPLE, __ATOMIC_RELAXED);
+    return rv;
+}
+
+/* Call the python comparison function of the database `arg`. libsophia calls
+ * us with the GIL released (see `PSP_BEGIN_LOCKED`), so it must be taken back
+ * first. libsophia can't be told about a failure, so the default comparison
+ * function is used instead, and the first exception is kept for the operation
+ * to raise (see `sophia_cmp_checked()`).
+ */
+static int
+sophia_compare_custom(char *a, size_t asz, char *b, size_t bsz, void *arg)
+{
+    SophiaDB *db = arg;
+    int rv;
+    PyGILState_STATE gstate = PyGILState_Ensure();
+    
+    if ((rv = sophia_compare_python(a, asz, b, bsz, db->cmp_fun)) == PSP_CMP_FAILED) {
+        if (!db->cmp_error)
+            PyErr_Fetch(&db->cmp_error, &db->cmp_error_value, &db->cmp_error_tb);
+        else
+            PyErr_Clear();
+        rv = sophia_compare_default(a, asz, b, bsz, NULL);
+    }
+    PyGILState_Release(gstate);
+    return rv;
+}
+
+/* Raise the exception of the python comparison function, if it failed since
+ * the last call, and return -1 in this case.
+ */
+static int
+sophia_cmp_raise(SophiaDB *db)
+{
+    if (!db->cmp_error)
+        return 0;
+    PyErr_Restore(db->cmp_error, db->cmp_error_value, db->cmp_error_tb);
+    db->cmp_error = db->cmp_error_value = db->cmp_error_tb = NULL;
+    return -1;
+}
+
+/* Return `result`, unless the python comparison function failed since the
+ * last call, in which case its exception is raised instead. `result` may be
+ * NULL, without an exception set, at the end of an iteration.
+ */
+static PyObject *
+sophia_cmp_checked(SophiaDB *db, PyObject *result)
+{
+    if (!db->cmp_error || (!result && PyErr_Occurred()))
+        return result;
+    Py_XDECREF(result);
+    sophia_cmp_raise(db);
+    return NULL;
+}
+
+/* Call a python comparison function, with the GIL held. Return
+ * PSP_CMP_FAILED, with an exception set, if it fails.
+ */
+static int
+sophia_compare_python(char *a, size_t asz, char *b, size_t bsz, void *cmp_fun)
+{
+    PyObject *pasz = NULL, *pbsz = NULL, *pa = NULL, *pb = NULL, *prv = NULL;
+    
+    if (   !(pasz = PyLong_FromSize_t(asz))
+        || !(pbsz = PyLong_FromSize_t(bsz))
+        || !(pa = PyBytes_FromStringAndSize(a, (Py_ssize_t)asz))
+        || !(pb = PyBytes_FromStringAndSize(b, (Py_ssize_t)bsz)))
+        goto error_args;
+    
+    prv = PyObject_CallFunctionObjArgs((PyObject *)cmp_fun,
+        pa, pasz, pb, pbsz, NULL);
+    
+    Py_DECREF(pasz);
+    Py_DECREF(pbsz);
+    Py_DECREF(pa);
+    Py_DECREF(pb);
+    
+    if (prv == NULL)
+        return PSP_CMP_FAILED;
+    
+    long rv = PyLong_AsLong(prv);
+    
+    Py_DECREF(prv);
+    if (rv == -1 && PyErr_Occurred()) {
+        PyErr_SetString(SophiaError, "custom comparison function returned garbage");
+        return PSP_CMP_FAILED;
+    }
+    
+    return (rv < 0 ? -1 : (rv > 0 ? 1 : 0));
+
+error_args:
+    Py_XDECREF(pasz);
+    Py_XDECREF(pbsz);
+    Py_XDECREF(pa);
+    Py_XDECREF(pb);
+    return PSP_CMP_FAILED;
+}
+
+/* Order-preserving encoding of tuples, exposed in `sophia.keys`. The encoded
+ * tuples compare with memcmp() in the same order as the tuples themselves,
+ * so they can be used as keys with the default comparison function. The
+ * format is that of the FoundationDB tuple layer, for the types supported.
+ */
+
+/* Type codes, in the order of the types */
+#define PSP_TUPLE_NONE   0x00
+#define PSP_TUPLE_BYTES  0x01
+#define PSP_TUPLE_STRING 0x02
+#define PSP_TUPLE_INT    0x14  /* zero, +/- the number of bytes otherwise */
+#define PSP_TUPLE_DOUBLE 0x21
+#define PSP_TUPLE_FALSE  0x26
+#define PSP_TUPLE_TRUE   0x27
+
+/* A growable output buffer */
+typedef struct {
+    char *data;
+    size_t len;
+    size_t size;
+} SophiaWriter;
+
+static int
+sophia_writer_grow(SophiaWriter *w, size_t n)
+{
+    size_t size = w->size ? w->size : 64;
+    char *data;
+    
+    while (size < w->len + n)
+        size *= 2;
+    if (!(data = PyMem_Realloc(w->data, size))) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    w->data = data;
+    w->size = size;
+    return 0;
+}
+
+static inline int
+sophia_write(SophiaWriter *w, const void *p, size_t n)
+{
+    if (w->len + n > w->size && sophia_writer_grow(w, n) == -1)
+        return -1;
+    memcpy(w->data + w->len, p, n);
+    w->len += n;
+    return 0;
+}
+
+static inline int
+sophia_write_byte(SophiaWriter *w, unsigned char c)
+{
+    return sophia_write(w, &c, 1);
+}
+
+/* Write `size` bytes of an integer, in big-endian order */
+static inline int
+sophia_write_uint(SophiaWriter *w, uint64_t value, size_t size)
+{
+    unsigned char buf[8];
+    size_t i;
+    
+    for (i = 0; i < size; i++)
+        buf[i] = (unsigned char)(value >> (8 * (size - 1 - i)));
+    return sophia_write(w, buf, size);
+}
+
+/* Write a byte string terminated by a null byte, escaping the null bytes it
+ * contains as (0x00, 0xff).
+ */
+static int
+sophia_write_escaped(SophiaWriter *w, const char *p, size_t n)
+{
+    const char *end = p + n, *zero;
+    
+    while ((zero = memchr(p, 0, (size_t)(end - p)))) {
+        if (sophia_write(w, p, (size_t)(zero - p) + 1) == -1 || sophia_write_byte(w, 0xff) == -1)
+            return -1;
+        p = zero + 1;
+    }
+    if (sophia_write(w, p, (size_t)(end - p)) == -1)
+        return -1;
+    return sophia_write_byte(w, 0);
+}
+
+static int
+sophia_tuple_encode_int(SophiaWriter *w, PyObject *item)
+{
+    int overflow, negative;
+    uint64_t mag;
+    size_t size = 0;
+    long long value = PyLong_AsLongLongAndOverflow(item, &overflow);
+    
+    if (value == -1 && PyErr_Occurred())
+        return -1;
+    if (overflow) {
+        PyObject *abs = PyNumber_Absolute(item);
+        if (!abs)
+            return -1;
+        mag = PyLong_AsUnsignedLongLong(abs);
+        Py_DECREF(abs);
+        if (mag == (uint64_t)-1 && PyErr_Occurred()) {
+            PyErr_SetString(PyExc_OverflowError, "integer is too large to be encoded");
+            return -1;
+        }
+        negative = overflow < 0;
+    }
+    else {
+        negative = value < 0;
+        mag = negative ? (uint64_t)(-(value + 1)) + 1 : (uint64_t)value;
+    }
+    
+    while (size < 8 && mag >> (8 * size))
+        size++;
+    if (!negative)
+        return sophia_write_byte(w, (unsigned char)(PSP_TUPLE_INT + size)) == -1 ? -1 :
+               sophia_write_uint(w, mag, size);
+    /* negative numbers are stored as their one's complement */
+    if (sophia_write_byte(w, (unsigned char)(PSP_TUPLE_INT - size)) == -1)
+        return -1;
+    return sophia_write_uint(w, ~mag, size);
+}
+
+static int
+sophia_tuple_encode_item(SophiaWriter *w, PyObject *item)
+{
+    if (item == Py_None)
+        return sophia_write_byte(w, PSP_TUPLE_NONE);
+    if (PyBool_Check(item))
+        return sophia_write_byte(w, item == Py_True ? PSP_TUPLE_TRUE : PSP_TUPLE_FALSE);
+#if PY_MAJOR_VERSION < 3
+    if (PyInt_Check(item) || PyLong_Check(item))
+#else
+    if (PyLong_Check(item))
+#endif
+        return sophia_tuple_encode_int(w, item);
+    if (PyFloat_Check(item)) {
+        double value = PyFloat_AS_DOUBLE(item);
+        uint64_t bits;
+        
+        /* -0.0 is equal to 0.0, so it must have the same key */
+        if (value == 0.0)
+            value = 0.0;
+        memcpy(&bits, &value, 8);
+        /* flip the sign bit of positive numbers, and all the bits of the
+         * negative ones, so that they compare as unsigned integers */
+        bits = (bits >> 63) ? ~bits : bits | ((uint64_t)1 << 63);
+        if (sophia_write_byte(w, PSP_TUPLE_DOUBLE) == -1)
+            return -1;
+        return sophia_write_uint(w, bits, 8);
+    }
+    if (PyBytes_Check(item)) {
+        if (sophia_write_byte(w, PSP_TUPLE_BYTES) == -1)
+            return -1;
+        return sophia_write_escaped(w, PyBytes_AS_STRING(item), (size_t)PyBytes_GET_SIZE(item));
+    }
+    if (PyUnicode_Check(item)) {
+        int rv;
+        PyObject *utf8 = PyUnicode_AsUTF8String(item);
+        if (!utf8)
+            return -1;
+        rv = sophia_write_byte(w, PSP_TUPLE_STRING);
+        if (rv != -1)
+            rv = sophia_write_escaped(w, PyBytes_AS_STRING(utf8), (size_t)PyBytes_GET_SIZE(utf8));
+        Py_DECREF(utf8);
+        return rv;
+    }
+    PyErr_Format(PyExc_TypeError, "can't encode objects of type %.100s in a key",
+                 Py_TYPE(item)->tp_name);
+    return -1;
+}
+
+/* Encode the items of a tuple (or of any sequence) one after the other */
+static int
+sophia_tuple_encode(SophiaWriter *w, PyObject *items)
+{
+    Py_ssize_t i, n;
+    PyObject *seq = PySequence_Fast(items, "expected a tuple");
+    
+    if (!seq)
+        return -1;
+    n = PySequence_Fast_GET_SIZE(seq);
+    for (i = 0; i < n; i++) {
+        if (sophia_tuple_encode_item(w, PySequence_Fast_GET_ITEM(seq, i)) == -1) {
+            Py_DECREF(seq);
+            return -1;
+        }
+    }
+    Py_DECREF(seq);
+    return 0;
+}
+
+/* Read a byte string written by `sophia_write_escaped()`. Return the
+ * position following it, or NULL if it isn't terminated.
+ */
+static const char *
+sophia_read_escaped(SophiaWriter *w, const char *p, const char *end)
+{
+    const char *zero;
+    
+    while ((zero = memchr(p, 0, (size_t)(end - p)))) {
+        if (sophia_write(w, p, (size_t)(zero - p)) == -1)
+            return NULL;
+        if (zero + 1 == end || (unsigned char)zero[1] != 0xff)
+            return zero + 1;
+        if (sophia_write_byte(w, 0) == -1)
+            return NULL;
+        p = zero + 2;
+    }
+    PyErr_SetString(PyExc_ValueError, "truncated key");
+    return NULL;
+}
+
+static inline uint64_t
+sophia_read_uint(const char *p, size_t size)
+{
+    return sophia_load_uint((const unsigned char *)p, size, 0);
+}
+
+static PyObject *
+sophia_int_from_uint(uint64_t mag, int negative)
+{
+    PyObject *pos, *rv;
+    
+    if (mag <= (uint64_t)LLONG_MAX) {
+#if PY_MAJOR_VERSION < 3
+        if (mag <= (uint64_t)LONG_MAX)
+            return PyInt_FromLong(negative ? -(long)mag : (long)mag);
+#endif
+        return PyLong_FromLongLong(negative ? -(long long)mag : (long long)mag);
+    }
+    if (negative && mag == (uint64_t)LLONG_MAX + 1)
+        return PyLong_FromLongLong(LLONG_MIN);
+    if (!(pos = PyLong_FromUnsignedLongLong(mag)) || !negative)
+        return pos;
+    rv = PyNumber_Negative(pos);
+    Py_DECREF(pos);
+    return rv;
+}
+
+/* Decode an encoded tuple */
+static PyObject *
+sophia_tuple_decode(const char *p, size_t n)
+{
+    const char *end = p + n;
+    PyObject *items, *item, *rv;
+    SophiaWriter w = {NULL, 0, 0};
     
-    void *cur = sp_cursor(db->db, SPGT, NULL, 0);
-    if (!cur) {
-        PyErr_SetString(SophiaError, sp_error(db->db));
+    if (!(items = PyList_New(0)))
         return NULL;
-    }
     
-    while ((sp_fetch(cur)))
-        count++;
-    sp_destroy(cur);
+    while (p < end) {
+        unsigned char code = (unsigned char)*p++;
+        
+        if (code == PSP_TUPLE_NONE) {
+            Py_INCREF(Py_None);
+            item = Py_None;
+        }
+        else if (code == PSP_TUPLE_FALSE || code == PSP_TUPLE_TRUE)
+            item = PyBool_FromLong(code == PSP_TUPLE_TRUE);
+        else if (code == PSP_TUPLE_BYTES || code == PSP_TUPLE_STRING) {
+            w.len = 0;
+            if (!(p = sophia_read_escaped(&w, p, end)))
+                goto error;
+            if (code == PSP_TUPLE_BYTES)
+                item = PyBytes_FromStringAndSize(w.data, (Py_ssize_t)w.len);
+            else
+                item = PyUnicode_DecodeUTF8(w.data, (Py_ssize_t)w.len, "strict");
+        }
+        else if (code >= PSP_TUPLE_INT - 8 && code <= PSP_TUPLE_INT + 8) {
+            size_t size = code > PSP_TUPLE_INT ? code - PSP_TUPLE_INT : PSP_TUPLE_INT - code;
+            uint64_t value;
+            
+            if ((size_t)(end - p) < size)
+                goto truncated;
+            value = sophia_read_uint(p, size);
+            p += size;
+            if (code < PSP_TUPLE_INT)
+                value = ~value & (size == 8 ? ~(uint64_t)0 : (((uint64_t)1 << (8 * size)) - 1));
+            item = sophia_int_from_uint(value, code < PSP_TUPLE_INT);
+        }
+        else if (code == PSP_TUPLE_DOUBLE) {
+            uint64_t bits;
+            double value;
+            
+            if (end - p < 8)
+                goto truncated;
+            bits = sophia_read_uint(p, 8);
+            p += 8;
+            bits = (bits >> 63) ? bits & ~((uint64_t)1 << 63) : ~bits;
+            memcpy(&value, &bits, 8);
+            item = PyFloat_FromDouble(value);
+        }
+        else {
+            PyErr_Format(PyExc_ValueError, "unknown type code in key: 0x%02x", code);
+            goto error;
+        }
+        
+        if (!item || PyList_Append(items, item) == -1) {
+            Py_XDECREF(item);
+            goto error;
+        }
+        Py_DECREF(item);
+    }
     
-    return PyLong_FromSize_t(count);
+    PyMem_Free(w.data);
+    rv = PyList_AsTuple(items);
+    Py_DECREF(items);
+    return rv;
+
+truncated:
+    PyErr_SetString(PyExc_ValueError, "truncated key");
+error:
+    PyMem_Free(w.data);
+    Py_DECREF(items);
+    return NULL;
 }
 
 static PyObject *
-sophia_db_begin(SophiaDB *db)
+sophia_keys_pack(PyObject *module, PyObject *items)
 {
-    ensure_is_opened(db, NULL);
+    PyObject *rv;
+    SophiaWriter w = {NULL, 0, 0};
     
-    if (sp_begin(db->db) == -1) {
-        PyErr_SetString(SophiaError, sp_error(db->db));
+    if (sophia_tuple_encode(&w, items) == -1) {
+        PyMem_Free(w.data);
         return NULL;
     }
-    Py_RETURN_NONE;
+    rv = PyBytes_FromStringAndSize(w.data ? w.data : "", (Py_ssize_t)w.len);
+    PyMem_Free(w.data);
+    return rv;
 }
 
 static PyObject *
-sophia_db_commit(SophiaDB *db)
+sophia_keys_unpack(PyObject *module, PyObject *key)
 {
-    ensure_is_opened(db, NULL);
+    PyObject *rv;
+    Py_buffer view;
     
-    if (sp_commit(db->db) == -1) {
-        PyErr_SetString(SophiaError, sp_error(db->db));
+    if (sophia_get_view(key, &view) == -1)
         return NULL;
-    }
-    Py_RETURN_NONE;
+    rv = sophia_tuple_decode(view.buf, (size_t)view.len);
+    PyBuffer_Release(&view);
+    return rv;
 }
 
+/* Return the bounds (start, end) of the range of keys beginning with the
+ * given items. The end bound is excluded. As no encoded item starts with
+ * 0xff, it is the encoded prefix followed by this byte.
+ */
 static PyObject *
-sophia_db_rollback(SophiaDB *db)
+sophia_keys_range(PyObject *module, PyObject *items)
 {
-    ensure_is_opened(db, NULL);
+    PyObject *start, *end, *rv;
+    SophiaWriter w = {NULL, 0, 0};
     
-    if (sp_rollback(db->db) == -1) {
-        PyErr_SetString(SophiaError, sp_error(db->db));
+    if (sophia_tuple_encode(&w, items) == -1 || sophia_write_byte(&w, 0xff) == -1) {
+        PyMem_Free(w.data);
         return NULL;
     }
-    Py_RETURN_NONE;
+    start = PyBytes_FromStringAndSize(w.data, (Py_ssize_t)w.len - 1);
+    end = PyBytes_FromStringAndSize(w.data, (Py_ssize_t)w.len);
+    PyMem_Free(w.data);
+    rv = (start && end) ? PyTuple_Pack(2, start, end) : NULL;
+    Py_XDECREF(start);
+    Py_XDECREF(end);
+    return rv;
 }
 
-static PyObject *
-sophia_db_iter_keys(SophiaDB *db, PyObject *args, PyObject *kw)
+/* Codecs converting the keys and values of a database from and to Python
+ * objects (see `SophiaCodec`).
+ */
+
+/* msgpack type codes */
+#define PSP_MP_NIL     0xc0
+#define PSP_MP_FALSE   0xc2
+#define PSP_MP_TRUE    0xc3
+#define PSP_MP_BIN8    0xc4
+#define PSP_MP_FLOAT32 0xca
+#define PSP_MP_FLOAT64 0xcb
+#define PSP_MP_UINT8   0xcc
+#define PSP_MP_INT8    0xd0
+#define PSP_MP_STR8    0xd9
+#define PSP_MP_ARRAY16 0xdc
+#define PSP_MP_MAP16   0xde
+
+/* Write a type code followed by a size, choosing the smallest of the 8 (if
+ * `code8` is non-zero), 16 and 32 bits variants, which must follow each
+ * other, or the fixed variant `fixcode` if the size is lower than `fixmax`.
+ */
+static int
+sophia_msgpack_write_header(SophiaWriter *w, size_t size, unsigned char fixcode, size_t fixmax,
+                            unsigned char code8, unsigned char code16)
 {
-    return sophia_cursor_new(db, &SophiaCursorKeysType, args, kw);
+    if (size < fixmax)
+        return sophia_write_byte(w, (unsigned char)(fixcode | size));
+    if (code8 && size <= 0xff)
+        return sophia_write_byte(w, code8) == -1 ? -1 : sophia_write_uint(w, size, 1);
+    if (size <= 0xffff)
+        return sophia_write_byte(w, code16) == -1 ? -1 : sophia_write_uint(w, size, 2);
+    if (size <= 0xffffffffU)
+        return sophia_write_byte(w, code16 + 1) == -1 ? -1 : sophia_write_uint(w, size, 4);
+    PyErr_SetString(PyExc_ValueError, "object too large to be encoded");
+    return -1;
 }
 
-static PyObject *
-sophia_db_iter_values(SophiaDB *db, PyObject *args, PyObject *kw)
+static int
+sophia_msgpack_write_int(SophiaWriter *w, PyObject *obj)
 {
-    return sophia_cursor_new(db, &SophiaCursorValuesType, args, kw);
+    int overflow, i;
+    long long value = PyLong_AsLongLongAndOverflow(obj, &overflow);
+    
+    if (value == -1 && PyErr_Occurred())
+        return -1;
+    if (overflow > 0) {
+        unsigned long long uvalue = PyLong_AsUnsignedLongLong(obj);
+        if (uvalue == (unsigned long long)-1 && PyErr_Occurred())
+            return -1;
+        return sophia_write_byte(w, PSP_MP_UINT8 + 3) == -1 ? -1 : sophia_write_uint(w, uvalue, 8);
+    }
+    if (overflow < 0) {
+        PyErr_SetString(PyExc_OverflowError, "integer is too small to be encoded");
+        return -1;
+    }
+    
+    if (value >= 0 && value < 0x80)
+        return sophia_write_byte(w, (unsigned char)value);
+    if (value < 0 && value >= -32)
+        return sophia_write_byte(w, (unsigned char)(0xe0 | (value + 32)));
+    /* the smallest of the (u)int 8, 16, 32 and 64 variants */
+    for (i = 0; i < 3; i++) {
+        int bits = 8 << i;
+        if (value >= 0 && (unsigned long long)value < (1ULL << bits))
+            break;
+        if (value < 0 && value >= -(1LL << (bits - 1)))
+            break;
+    }
+    if (sophia_write_byte(w, (unsigned char)((value >= 0 ? PSP_MP_UINT8 : PSP_MP_INT8) + i)) == -1)
+        return -1;
+    return sophia_write_uint(w, (uint64_t)value, (size_t)1 << i);
 }
 
-static PyObject *
-sophia_db_iter_items(SophiaDB *db, PyObject *args, PyObject *kw)
+static int
+sophia_msgpack_write(SophiaWriter *w, PyObject *obj)
 {
-    return sophia_cursor_new(db, &SophiaCursorItemsType, args, kw);
+    int rv = -1;
+    
+    if (obj == Py_None)
+        return sophia_write_byte(w, PSP_MP_NIL);
+    if (PyBool_Check(obj))
+        return sophia_write_byte(w, obj == Py_True ? PSP_MP_TRUE : PSP_MP_FALSE);
+#if PY_MAJOR_VERSION < 3
+    if (PyInt_Check(obj) || PyLong_Check(obj))
+#else
+    if (PyLong_Check(obj))
+#endif
+        return sophia_msgpack_write_int(w, obj);
+    if (PyFloat_Check(obj)) {
+        double value = PyFloat_AS_DOUBLE(obj);
+        uint64_t bits;
+        
+        memcpy(&bits, &value, 8);
+        return sophia_write_byte(w, PSP_MP_FLOAT64) == -1 ? -1 : sophia_write_uint(w, bits, 8);
+    }
+    if (PyBytes_Check(obj) || PyByteArray_Check(obj)) {
+        Py_buffer view;
+        if (sophia_get_view(obj, &view) == -1)
+            return -1;
+        if (sophia_msgpack_write_header(w, (size_t)view.len, 0, 0, PSP_MP_BIN8, PSP_MP_BIN8 + 1) != -1)
+            rv = sophia_write(w, view.buf, (size_t)view.len);
+        PyBuffer_Release(&view);
+        return rv;
+    }
+    if (PyUnicode_Check(obj)) {
+        PyObject *utf8 = PyUnicode_AsUTF8String(obj);
+        if (!utf8)
+            return -1;
+        if (sophia_msgpack_write_header(w, (size_t)PyBytes_GET_SIZE(utf8), 0xa0, 32,
+                                        PSP_MP_STR8, PSP_MP_STR8 + 1) != -1)
+            rv = sophia_write(w, PyBytes_AS_STRING(utf8), (size_t)PyBytes_GET_SIZE(utf8));
+        Py_DECREF(utf8);
+        return rv;
+    }
+    
+    if (Py_EnterRecursiveCall(" while encoding an object"))
+        return -1;
+    if (PyList_Check(obj) || PyTuple_Check(obj)) {
+        Py_ssize_t i, n = PySequence_Fast_GET_SIZE(obj);
+        
+        rv = sophia_msgpack_write_header(w, (size_t)n, 0x90, 16, 0, PSP_MP_ARRAY16);
+        for (i = 0; i < n && rv != -1; i++)
+            rv = sophia_msgpack_write(w, PySequence_Fast_GET_ITEM(obj, i));
+    }
+    else if (PyDict_Check(obj)) {
+        Py_ssize_t pos = 0;
+        PyObject *key, *value;
+        
+        rv = sophia_msgpack_write_header(w, (size_t)PyDict_Size(obj), 0x80, 16, 0, PSP_MP_MAP16);
+        while (rv != -1 && PyDict_Next(obj, &pos, &key, &value)) {
+            if ((rv = sophia_msgpack_write(w, key)) != -1)
+                rv = sophia_msgpack_write(w, value);
+        }
+    }
+    else
+        PyErr_Format(PyExc_TypeError, "can't encode objects of type %.100s",
+                     Py_TYPE(obj)->tp_name);
+    Py_LeaveRecursiveCall();
+    return rv;
 }
 
+/* Decode the object at `*p`, and move `*p` past it */
 static PyObject *
-sophia_cursor_new(SophiaDB *db, PyTypeObject *cursortype,
-                     PyObject *args, PyObject *kwargs)
+sophia_msgpack_read(const char **p, const char *end)
 {
-    SophiaCursor *pcur;
-    int order = SPGTE;
-    char *begin = NULL;
-    PyObject *pbegin = NULL;
-    Py_ssize_t bsize = 0;
+    unsigned char code;
+    size_t size = 0, i;
+    PyObject *rv = NULL;
     
-    static char *keywords[] = {"start_key", "order", NULL};
+#define PSP_MP_NEED(n)                                          \
+    do {                                                        \
+        if ((size_t)(end - *p) < (n)) {                         \
+            PyErr_SetString(PyExc_ValueError, "truncated data");\
+            return NULL;                                        \
+        }                                                       \
+    } while (0)
+#define PSP_MP_READ(n) (*p += (n), sophia_read_uint(*p - (n), (n)))
     
-    ensure_is_opened(db, NULL);
+    PSP_MP_NEED(1);
+    code = (unsigned char)*(*p)++;
     
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|Oi", keywords, &pbegin, &order)
-        || (pbegin && pbegin != Py_None && PyBytes_AsStringAndSize(pbegin, &begin, &bsize) == -1))
-        return NULL;
-
-    pcur = PyObject_New(SophiaCursor, cursortype);
-    if (!pcur)
-        return NULL;
+    if (code < 0x80)
+        return sophia_int_from_uint(code, 0);
+    if (code >= 0xe0)
+        return PyLong_FromLong((long)code - 0x100);
+    if (code >= 0xa0 && code < 0xc0) {
+        size = code & 0x1f;
+        goto str;
+    }
+    if (code >= 0x90 && code < 0xa0) {
+        size = code & 0x0f;
+        goto array;
+    }
+    if (code >= 0x80 && code < 0x90) {
+        size = code & 0x0f;
+        goto map;
+    }
     
-    void *cursor = sp_cursor(db->db, order, begin, (size_t)bsize);
-    if (!cursor) {
-        PyObject_Del(pcur);
-        PyErr_SetString(SophiaError, sp_error(db->db));
+    switch (code) {
+        case PSP_MP_NIL:
+            Py_RETURN_NONE;
+        case PSP_MP_FALSE:
+            Py_RETURN_FALSE;
+        case PSP_MP_TRUE:
+            Py_RETURN_TRUE;
+        case PSP_MP_BIN8: case PSP_MP_BIN8 + 1: case PSP_MP_BIN8 + 2:
+            PSP_MP_NEED((size_t)1 << (code - PSP_MP_BIN8));
+            size = (size_t)PSP_MP_READ((size_t)1 << (code - PSP_MP_BIN8));
+            PSP_MP_NEED(size);
+            *p += size;
+            return PyBytes_FromStringAndSize(*p - size, (Py_ssize_t)size);
+        case PSP_MP_FLOAT32: {
+            uint32_t bits;
+            float value;
+            PSP_MP_NEED(4);
+            bits = (uint32_t)PSP_MP_READ(4);
+            memcpy(&value, &bits, 4);
+            return PyFloat_FromDouble(value);
+        }
+        case PSP_MP_FLOAT64: {
+            uint64_t bits;
+            double value;
+            PSP_MP_NEED(8);
+            bits = PSP_MP_READ(8);
+            memcpy(&value, &bits, 8);
+            return PyFloat_FromDouble(value);
+        }
+        case PSP_MP_UINT8: case PSP_MP_UINT8 + 1: case PSP_MP_UINT8 + 2: case PSP_MP_UINT8 + 3:
+            PSP_MP_NEED((size_t)1 << (code - PSP_MP_UINT8));
+            return sophia_int_from_uint(PSP_MP_READ((size_t)1 << (code - PSP_MP_UINT8)), 0);
+        case PSP_MP_INT8: case PSP_MP_INT8 + 1: case PSP_MP_INT8 + 2: case PSP_MP_INT8 + 3: {
+            size_t n = (size_t)1 << (code - PSP_MP_INT8);
+            uint64_t value;
+            PSP_MP_NEED(n);
+            value = PSP_MP_READ(n);
+            /* sign-extend the value */
+            return PyLong_FromLongLong((int64_t)(value << (64 - 8 * n)) >> (64 - 8 * n));
+        }
+        case PSP_MP_STR8: case PSP_MP_STR8 + 1: case PSP_MP_STR8 + 2:
+            PSP_MP_NEED((size_t)1 << (code - PSP_MP_STR8));
+            size = (size_t)PSP_MP_READ((size_t)1 << (code - PSP_MP_STR8));
+            goto str;
+        case PSP_MP_ARRAY16: case PSP_MP_ARRAY16 + 1:
+            PSP_MP_NEED((size_t)2 << (code - PSP_MP_ARRAY16));
+            size = (size_t)PSP_MP_READ((size_t)2 << (code - PSP_MP_ARRAY16));
+            goto array;
+        case PSP_MP_MAP16: case PSP_MP_MAP16 + 1:
+            PSP_MP_NEED((size_t)2 << (code - PSP_MP_MAP16));
+            size = (size_t)PSP_MP_READ((size_t)2 << (code - PSP_MP_MAP16));
+            goto map;
+        default:
+            PyErr_Format(PyExc_ValueError, "unsupported type code: 0x%02x", code);
+            return NULL;
+    }
+
+str:
+    PSP_MP_NEED(size);
+    *p += size;
+    return PyUnicode_DecodeUTF8(*p - size, (Py_ssize_t)size, "strict");
+
+array:
+    /* each item takes at least one byte */
+    PSP_MP_NEED(size);
+    if (Py_EnterRecursiveCall(" while decoding an object"))
         return NULL;
+    if ((rv = PyList_New((Py_ssize_t)size))) {
+        for (i = 0; i < size; i++) {
+            PyObject *item = sophia_msgpack_read(p, end);
+            if (!item) {
+                Py_CLEAR(rv);
+                break;
+            }
+            PyList_SET_ITEM(rv, i, item);
+        }
     }
-    
-    Py_INCREF(db);
-    db->cursors++;
-    pcur->db = db;
-    pcur->cursor = cursor;
-    return (PyObject *)pcur;
-}
+    Py_LeaveRecursiveCall();
+    return rv;
 
-/* Destroys the underlying sophia cursor, without deallocating the Python object
- * which encapsulates it. This function is called either when the sophia cursor
- * has traversed all the records requested, or when the object goes out of scope. 
- */
-static void
-sophia_cursor_dealloc_internal(SophiaCursor *cursor)
-{
-    assert(cursor->cursor);
-    assert(cursor->db->cursors > 0);
-    
-    /* close the cursor first, only then the database, if needed */
-    sp_destroy(cursor->cursor);
-    cursor->cursor = NULL;
-    
-    cursor->db->cursors--;
-    if (cursor->db->close_me && cursor->db->cursors == 0) {
-        sophia_db_close_internal(cursor->db);
-        cursor->db->close_me = 0;
+map:
+    PSP_MP_NEED(2 * size);
+    if (Py_EnterRecursiveCall(" while decoding an object"))
+        return NULL;
+    if ((rv = PyDict_New())) {
+        for (i = 0; i < size; i++) {
+            PyObject *key = sophia_msgpack_read(p, end), *value = NULL;
+            if (!key || !(value = sophia_msgpack_read(p, end)) ||
+                PyDict_SetItem(rv, key, value) == -1) {
+                Py_XDECREF(key);
+                Py_XDECREF(value);
+                Py_CLEAR(rv);
+                break;
+            }
+            Py_DECREF(key);
+            Py_DECREF(value);
+        }
     }
-    Py_DECREF(cursor->db);
-    cursor->db = NULL;
+    Py_LeaveRecursiveCall();
+    return rv;
+
+#undef PSP_MP_NEED
+#undef PSP_MP_READ
 }
 
-/* Destroys the Python wrapped cursor, and the underlying cursor if needed */
-static void
-sophia_cursor_dealloc(SophiaCursor *cursor)
+static inline void
+sophia_store_uint(char *p, uint64_t value, size_t size, int little)
 {
-    if (cursor->cursor)
-        sophia_cursor_dealloc_internal(cursor);
-    PyObject_Del(cursor);
+    size_t i;
+    
+    for (i = 0; i < size; i++)
+        p[little ? i : size - 1 - i] = (char)(value >> (8 * i));
 }
 
-/* Should we stop iterating the database with this cursor? If so, destroy
- * the sophia cursor object, but leave intact its Python wrapper.
- */
-static inline int
-sophia_stop_iteration(SophiaCursor *cursor)
+/* Pack a sequence of values as described by a struct format */
+static int
+sophia_struct_write(SophiaWriter *w, SophiaKeyFormat *format, PyObject *obj)
 {
-    if (!cursor->cursor || !sp_fetch(cursor->cursor)) {
-        if (cursor->cursor)
-            sophia_cursor_dealloc_internal(cursor);
-        return 1;
+    size_t i, size = 0;
+    Py_ssize_t nvalues = 0, n;
+    char *p;
+    PyObject *seq = PySequence_Fast(obj, "expected a sequence of values");
+    
+    if (!seq)
+        return -1;
+    for (i = 0; i < format->nfields; i++) {
+        size += format->fields[i].size;
+        nvalues += format->fields[i].code != 'x';
+    }
+    if ((n = PySequence_Fast_GET_SIZE(seq)) != nvalues) {
+        PyErr_Format(PyExc_ValueError, "expected %zd values, got %zd", nvalues, n);
+        goto error;
     }
+    if (w->len + size > w->size && sophia_writer_grow(w, size) == -1)
+        goto error;
+    p = w->data + w->len;
+    memset(p, 0, size);
+    
+    for (i = 0, n = 0; i < format->nfields; p += format->fields[i++].size) {
+        const SophiaField *field = &format->fields[i];
+        PyObject *value;
+        
+        if (field->code == 'x')
+            continue;
+        value = PySequence_Fast_GET_ITEM(seq, n++);
+        
+        switch (field->code) {
+            case 'c': case 's': {
+                char *data;
+                Py_ssize_t len;
+                if (PyBytes_AsStringAndSize(value, &data, &len) == -1)
+                    goto error;
+                if (field->code == 'c' && len != 1) {
+                    PyErr_SetString(PyExc_ValueError, "expected a byte string of length 1");
+                    goto error;
+                }
+                memcpy(p, data, (size_t)len < field->size ? (size_t)len : field->size);
+                break;
+            }
+            case '?': {
+                int truth = PyObject_IsTrue(value);
+                if (truth == -1)
+                    goto error;
+                *p = (char)truth;
+                break;
+            }
+            case 'f': case 'd': {
+                double d = PyFloat_AsDouble(value);
+                uint64_t bits;
+                if (d == -1.0 && PyErr_Occurred())
+                    goto error;
+                if (field->size == 4) {
+                    float f = (float)d;
+                    uint32_t fbits;
+                    memcpy(&fbits, &f, 4);
+                    bits = fbits;
+                }
+                else
+                    memcpy(&bits, &d, 8);
+                sophia_store_uint(p, bits, field->size, format->little);
+                break;
+            }
+            case 'b': case 'h': case 'i': case 'l': case 'q': {
+                long long v = PyLong_AsLongLong(value);
+                long long max = (long long)(((uint64_t)1 << (8 * field->size - 1)) - 1);
+                if (v == -1 && PyErr_Occurred())
+                    goto error;
+                if (v > max || v < -max - 1) {
+                    PyErr_SetString(PyExc_OverflowError, "integer out of range for its field");
+                    goto error;
+                }
+                sophia_store_uint(p, (uint64_t)v, field->size, format->little);
+                break;
+            }
+            default: {
+                int overflow;
+                unsigned long long v = (unsigned long long)PyLong_AsLongLongAndOverflow(value, &overflow);
+                if (overflow > 0)
+                    v = PyLong_AsUnsignedLongLong(value);
+                if (v == (unsigned long long)-1 && PyErr_Occurred())
+                    goto error;
+                if (overflow < 0 || (!overflow && (long long)v < 0) ||
+                    (field->size < 8 && v >> (8 * field->size))) {
+                    PyErr_SetString(PyExc_OverflowError, "integer out of range for its field");
+                    goto error;
+                }
+                sophia_store_uint(p, v, field->size, format->little);
+            }
+        }
+    }
+    w->len += size;
+    Py_DECREF(seq);
     return 0;
+
+error:
+    Py_DECREF(seq);
+    return -1;
 }
 
+/* Unpack the values described by a struct format into a tuple */
 static PyObject *
-sophia_cursor_next_key(SophiaCursor *cursor)
+sophia_struct_read(SophiaKeyFormat *format, const char *p, size_t n)
 {
-    if (sophia_stop_iteration(cursor))
-        return NULL;
+    size_t i, size = 0;
+    Py_ssize_t nvalues = 0;
+    PyObject *rv;
     
-    const char *key = sp_key(cursor->cursor);
-    size_t ksize = sp_keysize(cursor->cursor);
-
-    if (key == NULL || ksize == 0) {
-        PyErr_SetString(SophiaError, "cursor failed");
+    for (i = 0; i < format->nfields; i++) {
+        size += format->fields[i].size;
+        nvalues += format->fields[i].code != 'x';
+    }
+    if (n != size) {
+        PyErr_Format(PyExc_ValueError, "expected %zu bytes, got %zu", size, n);
         return NULL;
     }
+    if (!(rv = PyTuple_New(nvalues)))
+        return NULL;
     
-    return PyBytes_FromStringAndSize(key, (Py_ssize_t)ksize);
+    for (i = 0, nvalues = 0; i < format->nfields; p += format->fields[i++].size) {
+        const SophiaField *field = &format->fields[i];
+        uint64_t bits = sophia_load_uint((const unsigned char *)p, field->size, format->little);
+        PyObject *value;
+        
+        switch (field->code) {
+            case 'x':
+                continue;
+            case 'c': case 's':
+                value = PyBytes_FromStringAndSize(p, (Py_ssize_t)field->size);
+                break;
+            case '?':
+                value = PyBool_FromLong(*p != 0);
+                break;
+            case 'f': {
+                uint32_t fbits = (uint32_t)bits;
+                float f;
+                memcpy(&f, &fbits, 4);
+                value = PyFloat_FromDouble(f);
+                break;
+            }
+            case 'd': {
+                double d;
+                memcpy(&d, &bits, 8);
+                value = PyFloat_FromDouble(d);
+                break;
+            }
+            case 'b': case 'h': case 'i': case 'l': case 'q':
+                value = PyLong_FromLongLong((int64_t)(bits << (64 - 8 * field->size)) >> (64 - 8 * field->size));
+                break;
+            default:
+                value = sophia_int_from_uint(bits, 0);
+        }
+        if (!value) {
+            Py_DECREF(rv);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(rv, nvalues++, value);
+    }
+    return rv;
 }
 
+/* Encode an object with a codec. Return a new reference to an object
+ * supporting the buffer protocol, which is the object itself for the raw
+ * codec.
+ */
 static PyObject *
-sophia_cursor_next_value(SophiaCursor *cursor)
+sophia_encode(SophiaCodec *codec, PyObject *obj)
 {
-    if (sophia_stop_iteration(cursor))
-        return NULL;
-    
-    const char *value = sp_value(cursor->cursor);
-    size_t vsize = sp_valuesize(cursor->cursor);
+    int rv;
+    PyObject *bytes;
+    SophiaWriter w = {NULL, 0, 0};
     
-    if (value == NULL || vsize == 0) {
-        PyErr_SetString(SophiaError, "cursor failed");
-        return NULL;
+    switch (codec->kind) {
+        case PSP_CODEC_RAW:
+            Py_INCREF(obj);
+            return obj;
+        case PSP_CODEC_CALL:
+            return PyObject_CallFunctionObjArgs(codec->pack, obj, NULL);
+        case PSP_CODEC_TUPLE:
+            rv = sophia_tuple_encode(&w, obj);
+            break;
+        case PSP_CODEC_MSGPACK:
+            rv = sophia_msgpack_write(&w, obj);
+            break;
+        default:
+            rv = sophia_struct_write(&w, codec->format, obj);
     }
-    
-    return PyBytes_FromStringAndSize(value, (Py_ssize_t)vsize);
+    bytes = rv == -1 ? NULL : PyBytes_FromStringAndSize(w.data ? w.data : "", (Py_ssize_t)w.len);
+    PyMem_Free(w.data);
+    return bytes;
 }
 
 static PyObject *
-sophia_cursor_next_item(SophiaCursor *cursor)
+sophia_decode(SophiaCodec *codec, const char *p, size_t n)
 {
-    size_t ksize, vsize;
-    const char *key, *value;
-    PyObject *rv, *pkey, *pvalue;
-    
-    if (sophia_stop_iteration(cursor))
-        return NULL;
-    
-    key = sp_key(cursor->cursor);
-    ksize = sp_keysize(cursor->cursor);
-    value = sp_value(cursor->cursor);
-    vsize = sp_valuesize(cursor->cursor);
-    
-    if (key == NULL || value == NULL || ksize == 0 || vsize == 0) {
-        PyErr_SetString(SophiaError, "cursor failed");
-        return NULL;
-    }
+    PyObject *bytes, *rv;
+    const char *end = p + n;
     
-    pkey = PyBytes_FromStringAndSize(key, (Py_ssize_t)ksize);
-    pvalue = PyBytes_FromStringAndSize(value, (Py_ssize_t)vsize);
-    
-    if (!(pkey && pvalue)) {
-        Py_XDECREF(pkey);
-        Py_XDECREF(pvalue);
-        return NULL;
+    switch (codec->kind) {
+        case PSP_CODEC_RAW:
+            return PyBytes_FromStringAndSize(p, (Py_ssize_t)n);
+        case PSP_CODEC_CALL:
+            if (!(bytes = PyBytes_FromStringAndSize(p, (Py_ssize_t)n)))
+                return NULL;
+            rv = PyObject_CallFunctionObjArgs(codec->unpack, bytes, NULL);
+            Py_DECREF(bytes);
+            return rv;
+        case PSP_CODEC_TUPLE:
+            return sophia_tuple_decode(p, n);
+        case PSP_CODEC_MSGPACK:
+            if ((rv = sophia_msgpack_read(&p, end)) && p != end) {
+                Py_DECREF(rv);
+                PyErr_SetString(PyExc_ValueError, "trailing data after the encoded object");
+                return NULL;
+            }
+            return rv;
+        default:
+            return sophia_struct_read(codec->format, p, n);
     }
+}
 
-    rv = PyTuple_Pack(2, pkey, pvalue);
-    
-    Py_DECREF(pkey);
-    Py_DECREF(pvalue);
+/* Get a view of the encoded form of a key or a value */
+static int
+sophia_encoded_view(SophiaCodec *codec, PyObject *obj, Py_buffer *view)
+{
+    int rv;
     
+    if (codec->kind == PSP_CODEC_RAW)
+        return sophia_get_view(obj, view);
+    if (!(obj = sophia_encode(codec, obj)))
+        return -1;
+    rv = sophia_get_view(obj, view);
+    Py_DECREF(obj);
     return rv;
 }
 
-static inline int
-sophia_compare_default(char *a, size_t asz, char *b, size_t bsz, void *arg)
+/* Same as above, but return the encoded object as bytes (see
+ * `sophia_bytes_from_object()`)
+ */
+static PyObject *
+sophia_encoded_bytes(SophiaCodec *codec, PyObject *obj)
 {
-    int cmp = memcmp(a, b, (asz < bsz ? asz : bsz));
-    return (cmp == 0 ?
-        (asz == bsz ? 0 : (asz < bsz ? -1 : 1)) :
-        (cmp < 0 ? -1 : 1)
-    );
+    PyObject *rv;
+    
+    if (codec->kind == PSP_CODEC_RAW)
+        return sophia_bytes_from_object(obj);
+    if (!(obj = sophia_encode(codec, obj)))
+        return NULL;
+    rv = sophia_bytes_from_object(obj);
+    Py_DECREF(obj);
+    return rv;
 }
 
+/* Set up a codec from the arguments of `setopt()`: either the name of a
+ * native codec, followed by a struct format for "struct", or a pair of
+ * callables (pack, unpack). None stands for the raw codec.
+ */
 static int
-sophia_compare_custom(char *a, size_t asz, char *b, size_t bsz, void *cmp_fun)
+sophia_codec_init(SophiaCodec *codec, PyObject *spec, PyObject *pformat)
 {
-    PyObject *pasz = NULL, *pbsz = NULL, *pa = NULL, *pb = NULL, *prv = NULL;
-    
-    if (   !(pasz = PyLong_FromSize_t(asz))
-        || !(pbsz = PyLong_FromSize_t(bsz))
-        || !(pa = PyBytes_FromStringAndSize(a, (Py_ssize_t)asz))
-        || !(pb = PyBytes_FromStringAndSize(b, (Py_ssize_t)bsz)))
-        goto error_args;
-    
-    prv = PyObject_CallFunctionObjArgs((PyObject *)cmp_fun,
-        pa, pasz, pb, pbsz, NULL);
-    
-    Py_DECREF(pasz);
-    Py_DECREF(pbsz);
-    Py_DECREF(pa);
-    Py_DECREF(pb);
+    const char *name, *fmt;
+    SophiaCodec new = {PSP_CODEC_RAW, NULL, NULL, NULL};
     
-    if (prv == NULL) {
-        PyErr_SetString(SophiaError, "failed to call custom comparison function");
-        goto error_call;
+    if (spec == Py_None)
+        ;
+    else if (PyTuple_Check(spec)) {
+        if (!PyArg_ParseTuple(spec, "OO:codec", &new.pack, &new.unpack))
+            return -1;
+        if (!PyCallable_Check(new.pack) || !PyCallable_Check(new.unpack)) {
+            PyErr_SetString(PyExc_TypeError, "expected a pair of callables");
+            return -1;
+        }
+        new.kind = PSP_CODEC_CALL;
+        Py_INCREF(new.pack);
+        Py_INCREF(new.unpack);
     }
-    
-    long rv = PyLong_AsLong(prv);
-    
-    if (PyErr_Occurred()) {
-        PyErr_SetString(SophiaError, "custom comparison function returned garbage");
-        goto error_call;
+    else {
+        if (!PyArg_Parse(spec, "s", &name))
+            return -1;
+        if (strcmp(name, "raw") == 0)
+            ;
+        else if (strcmp(name, "tuple") == 0)
+            new.kind = PSP_CODEC_TUPLE;
+        else if (strcmp(name, "msgpack") == 0)
+            new.kind = PSP_CODEC_MSGPACK;
+        else if (strcmp(name, "struct") == 0) {
+            if (!pformat) {
+                PyErr_SetString(PyExc_ValueError, "expected a struct format");
+                return -1;
+            }
+            if (!PyArg_Parse(pformat, "s", &fmt) || !(new.format = sophia_parse_key_format(fmt)))
+                return -1;
+            new.kind = PSP_CODEC_STRUCT;
+        }
+        else {
+            PyErr_Format(PyExc_ValueError, "unknown codec: %.100s", name);
+            return -1;
+        }
     }
     
-    Py_DECREF(prv);
-    
-    return (rv < 0 ? -1 : (rv > 0 ? 1 : 0));
+    sophia_codec_clear(codec);
+    *codec = new;
+    return 0;
+}
 
-/* Fall back to using the default comparison function */
+/* Set up a codec from the `key_decoder` or `value_decoder` argument of a
+ * cursor, which overrides the codec of the database for decoding only: a
+ * callable, or anything `sophia_codec_init()` accepts, the struct format
+ * being given as the second item of a pair.
+ */
+static int
+sophia_decoder_init(SophiaCodec *codec, PyObject *spec)
+{
+    if (PyCallable_Check(spec)) {
+        sophia_codec_clear(codec);
+        Py_INCREF(spec);
+        codec->unpack = spec;
+        codec->kind = PSP_CODEC_CALL;
+        return 0;
+    }
+    if (PyTuple_Check(spec) && PyTuple_GET_SIZE(spec) == 2
+        && !PyCallable_Check(PyTuple_GET_ITEM(spec, 0)))
+        return sophia_codec_init(codec, PyTuple_GET_ITEM(spec, 0), PyTuple_GET_ITEM(spec, 1));
+    return sophia_codec_init(codec, spec, NULL);
+}
 
-error_args:
-    Py_XDECREF(pasz);
-    Py_XDECREF(pbsz);
-    Py_XDECREF(pa);
-    Py_XDECREF(pb);
-    return sophia_compare_default(a, asz, b, bsz, NULL);
+static int
+sophia_codec_copy(SophiaCodec *dst, const SophiaCodec *src)
+{
+    *dst = *src;
+    if (src->format) {
+        size_t size = sizeof(SophiaKeyFormat) + src->format->nfields * sizeof(SophiaField);
+        if (!(dst->format = malloc(size))) {
+            dst->kind = PSP_CODEC_RAW;
+            PyErr_NoMemory();
+            return -1;
+        }
+        memcpy(dst->format, src->format, size);
+    }
+    Py_XINCREF(dst->pack);
+    Py_XINCREF(dst->unpack);
+    return 0;
+}
 
-error_call:
-    Py_XDECREF(prv);
-    return sophia_compare_default(a, asz, b, bsz, NULL);
+static void
+sophia_codec_clear(SophiaCodec *codec)
+{
+    Py_CLEAR(codec->pack);
+    Py_CLEAR(codec->unpack);
+    free(codec->format);
+    codec->format = NULL;
+    codec->kind = PSP_CODEC_RAW;
 }
 
+static PyMethodDef sophia_module_methods[] = {
+    {"_keys_pack", (PyCFunction)sophia_keys_pack, METH_O, NULL},
+    {"_keys_unpack", (PyCFunction)sophia_keys_unpack, METH_O, NULL},
+    {"_keys_range", (PyCFunction)sophia_keys_range, METH_O, NULL},
+    {"_merge_cursors", (PyCFunction)sophia_merge_cursors, METH_VARARGS, NULL},
+    {NULL},
+};
+
 #if PY_MAJOR_VERSION >= 3
 
 static struct PyModuleDef _sophiamodule = {
-   PyModuleDef_HEAD_INIT, "_sophia", NULL, -1, NULL
+   PyModuleDef_HEAD_INIT, "_sophia", NULL, -1, sophia_module_methods
 };
 
 #define PSP_NOTHING NULL
@@ -879,12 +8431,34 @@ init_sophia(void)
 #endif
 {
     static char *sophia_constant_names[] = {"SPGT", "SPGTE", "SPLT", "SPLTE",
-        "SPCMP", "SPPAGE", "SPMERGEWM", "SPGC", "SPMERGE", "SPGCF", "SPGROW", NULL};
+        "SPCMP", "SPPAGE", "SPMERGEWM", "SPGC", "SPMERGE", "SPGCF", "SPGROW", "PSPCOUNT", "PSPKEYCODEC", "PSPVALUECODEC",
+        "PSPTHREADED", "PSPGROUPCOMMIT", "PSPCACHE",
+        "PSPBLOOM", "PSPCMPSTATS",
+        "CMP_MEMCMP", "CMP_REVERSE", "CMP_LENGTH", "CMP_U32_BE", "CMP_U32_LE",
+        "CMP_I32_BE", "CMP_I32_LE", "CMP_U64_BE", "CMP_U64_LE", "CMP_I64_BE",
+        "CMP_I64_LE", "CMP_STRUCT", NULL};
     
     static int sophia_constant_values[] = {SPGT, SPGTE, SPLT, SPLTE,
-        SPCMP, SPPAGE, SPMERGEWM, SPGC, SPMERGE, SPGCF, SPGROW, 0};
+        SPCMP, SPPAGE, SPMERGEWM, SPGC, SPMERGE, SPGCF, SPGROW, PSPCOUNT, PSPKEYCODEC, PSPVALUECODEC,
+        PSPTHREADED, PSPGROUPCOMMIT, PSPCACHE,
+        PSPBLOOM, PSPCMPSTATS,
+        CMP_MEMCMP, CMP_REVERSE, CMP_LENGTH, CMP_U32_BE, CMP_U32_LE,
+        CMP_I32_BE, CMP_I32_LE, CMP_U64_BE, CMP_U64_LE, CMP_I64_BE,
+        CMP_I64_LE, CMP_STRUCT, 0};
+    
+#if PY_VERSION_HEX < 0x03070000
+    PyEval_InitThreads();
+#endif
+    sophia_calibrate_clock();
     
-    if (PyType_Ready(&SophiaDBType) == -1)
+    if (PyType_Ready(&SophiaDBType) == -1
+        || PyType_Ready(&SophiaBufferType) == -1
+        || PyType_Ready(&SophiaCursorKeysType) == -1
+        || PyType_Ready(&SophiaCursorValuesType) == -1
+        || PyType_Ready(&SophiaCursorItemsType) == -1
+        || PyType_Ready(&SophiaMergeType) == -1
+        || PyType_Ready(&SophiaScanType) == -1
+        || PyType_Ready(&SophiaScanIterType) == -1)
         return PSP_NOTHING;
     SophiaError = PyErr_NewException("sophia.Error", NULL, NULL);
     if (!SophiaError)
@@ -893,7 +8467,7 @@ init_sophia(void)
 #if PY_MAJOR_VERSION >= 3
     PyObject *module = PyModule_Create(&_sophiamodule);
 #else
-    PyObject *module = Py_InitModule("_sophia", NULL);
+    PyObject *module = Py_InitModule("_sophia", sophia_module_methods);
 #endif
     if (!module)
         return PSP_NOTHING;
@@ -0,0 +1,268 @@
+"""Databases partitioned across several sophia environments.
+
+Each shard is a :class:`Database` of its own, with its own directory, which
+can be on its own disk. The keys are spread among the shards by hash, or by
+range, and cursors merge the records of all the shards in C, in the order of
+the comparison function.
+"""
+
+__all__ = ['ShardedDatabase']
+
+import os, sys, threading, itertools, binascii
+from _sophia import Database, SPGTE, _merge_cursors
+try:
+    import queue
+except ImportError:
+    import Queue as queue
+
+# file saved in the directory of each shard, describing how the keys were
+# spread when the database was created
+LAYOUT_FILE = "pysophia.shards"
+
+
+class _Pool(object):
+
+    """Threads running calls to the shards concurrently. They are started
+    when first needed, and stopped when the database is closed. The methods
+    of the shards release the GIL while they wait for libsophia, so that the
+    shards are written to in parallel."""
+
+    def __init__(self, size):
+        self.size = size
+        self.threads = []
+        self.tasks = queue.Queue()
+        self.lock = threading.Lock()
+
+    def _work(self):
+        while True:
+            task = self.tasks.get()
+            if task is None:
+                return
+            task()
+
+    def run(self, calls):
+        """Run the (function, args) calls, the first one in the calling
+        thread, and return their results."""
+        results = [None] * len(calls)
+        errors = []
+        done = threading.Semaphore(0)
+
+        def run(i):
+            fun, args = calls[i]
+            try:
+                results[i] = fun(*args)
+            except BaseException:
+                errors.append(sys.exc_info()[1])
+
+        def task(i):
+            return lambda: (run(i), done.release())
+
+        with self.lock:
+            while len(self.threads) < min(self.size, len(calls) - 1):
+                thread = threading.Thread(target=self._work)
+                thread.daemon = True
+                thread.start()
+                self.threads.append(thread)
+        for i in range(1, len(calls)):
+            self.tasks.put(task(i))
+        if calls:
+            run(0)
+        for i in range(1, len(calls)):
+            done.acquire()
+        if errors:
+            raise errors[0]
+        return results
+
+    def stop(self):
+        with self.lock:
+            threads, self.threads = self.threads, []
+        for thread in threads:
+            self.tasks.put(None)
+        for thread in threads:
+            thread.join()
+
+
+def _read_layout(path):
+    try:
+        with open(os.path.join(path, LAYOUT_FILE)) as f:
+            return f.read()
+    except (IOError, OSError):
+        return None
+
+
+class ShardedDatabase(object):
+
+    """Database partitioned across `shards` databases.
+
+    By default, the keys are spread by the hash of their encoded form. If `split_keys`
+    is given, the shards hold ranges of keys instead: the first one the keys lower than
+    the first split key, and so on, the number of shards following from the number of
+    split keys. `factory` is called to create each shard, e.g. :class:`ObjectDatabase`.
+    The same shards, and split keys, must be used each time the database is opened,
+    which is checked against a file saved in the directory of each shard.
+    """
+
+    def __init__(self, shards=4, split_keys=None, factory=Database):
+        if split_keys is not None:
+            split_keys = list(split_keys)
+            shards = len(split_keys) + 1
+        if shards < 1:
+            raise ValueError("expected at least one shard")
+        self.shards = [factory() for i in range(shards)]
+        self.split_keys = split_keys
+        self._route = shards
+        self._pool = _Pool(shards - 1)
+
+    def setopt(self, *args):
+        for shard in self.shards:
+            shard.setopt(*args)
+
+    def open(self, path):
+        """Open the shards, in the directories of the list `path`, or in
+        subdirectories of `path` otherwise."""
+        if isinstance(path, (list, tuple)):
+            if len(path) != len(self.shards):
+                raise ValueError("expected %d paths" % len(self.shards))
+            paths = path
+        else:
+            if not os.path.isdir(path):
+                os.makedirs(path)
+            paths = [os.path.join(path, "shard%d" % i) for i in range(len(self.shards))]
+        if self.split_keys is not None:
+            route = tuple(self.shards[0]._encode_key(key) for key in self.split_keys)
+            if any(self.shards[0]._shard(key, route) != i + 1 for i, key in enumerate(self.split_keys)):
+                raise ValueError("the split keys must be in increasing order")
+            self._route = route
+        layouts = [self._layout(i) for i in range(len(self.shards))]
+        for p, layout in zip(paths, layouts):
+            saved = _read_layout(p)
+            if saved is not None and saved != layout:
+                raise ValueError("%s holds a shard of a database split differently" % p)
+        # the shards already opened are closed if another one can't be
+        opened = []
+        try:
+            for shard, p, layout in zip(self.shards, paths, layouts):
+                opened.append(shard.open(p))
+                if _read_layout(p) is None:
+                    with open(os.path.join(p, LAYOUT_FILE), "w") as f:
+                        f.write(layout)
+        except BaseException:
+            error = sys.exc_info()
+            for shard in self.shards[:len(opened)]:
+                try:
+                    shard.close()
+                except Exception:
+                    pass
+            raise error[1]
+        return all(opened)
+
+    def _layout(self, i):
+        """Description of the i-th shard, as saved in its directory: its
+        index, the number of shards, and the split keys, in hexadecimal."""
+        lines = ["%d %d" % (i, len(self.shards))]
+        if self.split_keys is not None:
+            lines.extend(binascii.hexlify(key).decode("ascii") for key in self._route)
+        return "\n".join(lines) + "\n"
+
+    def close(self):
+        rv = all([shard.close() for shard in self.shards])
+        self._pool.stop()
+        return rv
+
+    def is_closed(self):
+        return all(shard.is_closed() for shard in self.shards)
+
+    def shard(self, key):
+        """Return the shard holding a key."""
+        return self.shards[self.shards[0]._shard(key, self._route)]
+
+    def _group(self, items, key=lambda item: item):
+        groups = [[] for shard in self.shards]
+        route, find = self._route, self.shards[0]._shard
+        for item in items:
+            groups[find(key(item), route)].append(item)
+        return groups
+
+    def get(self, key, default=None):
+        return self.shard(key).get(key, default)
+
+    def get_buffer(self, key, default=None):
+        return self.shard(key).get_buffer(key, default)
+
+    def contains(self, key):
+        return self.shard(key).contains(key)
+
+    def set(self, key, value):
+        self.shard(key).set(key, value)
+
+    def delete(self, key):
+        self.shard(key).delete(key)
+
+    def get_many(self, keys, default=None, as_dict=False):
+        """Same as :meth:`Database.get_many()`, the shards being read in parallel."""
+        keys = list(keys)
+        groups = self._group(range(len(keys)), lambda i: keys[i])
+        values = [default] * len(keys)
+
+        def lookup(shard, indexes):
+            for i, value in zip(indexes, shard.get_many([keys[i] for i in indexes], default)):
+                values[i] = value
+
+        self._pool.run([(lookup, (shard, indexes)) for shard, indexes in zip(self.shards, groups) if indexes])
+        if as_dict:
+            return dict(zip(keys, values))
+        return values
+
+    def set_many(self, pairs, chunk=10000, max_bytes=16777216):
+        """Same as :meth:`Database.set_many()`, the shards being written to in
+        parallel, a chunk of records per shard at a time."""
+        if isinstance(pairs, dict):
+            pairs = pairs.items()
+        pairs = iter(pairs)
+        written = 0
+        while True:
+            batch = list(itertools.islice(pairs, chunk * len(self.shards)))
+            if not batch:
+                return written
+            groups = self._group(batch, lambda pair: pair[0])
+            written += sum(self._pool.run([(shard.set_many, (group, chunk, max_bytes))
+                                     for shard, group in zip(self.shards, groups) if group]))
+
+    update = set_many
+
+    def len(self):
+        return sum(self._pool.run([(shard.len, ()) for shard in self.shards]))
+
+    def count(self, *args, **kwargs):
+        def count(shard):
+            return shard.count(*args, **kwargs)
+        return sum(self._pool.run([(count, (shard,)) for shard in self.shards]))
+
+    def stats(self, reset=False):
+        """Return the list of the statistics of the shards."""
+        return [shard.stats(reset=reset) for shard in self.shards]
+
+    def _merged(self, kind, start_key, order, batch, end_key, end_inclusive, prefix,
+                limit, key_decoder, value_decoder, snapshot):
+        merged = _merge_cursors([shard.iteritems(start_key, order, batch, end_key, end_inclusive, prefix,
+                                                 limit, key_decoder, value_decoder, snapshot)
+                                 for shard in self.shards], kind)
+        if limit >= 0:
+            return itertools.islice(merged, limit)
+        return merged
+
+    def iterkeys(self, start_key=None, order=SPGTE, batch=1, end_key=None, end_inclusive=True,
+                 prefix=None, limit=-1, key_decoder=None, value_decoder=None, snapshot=False):
+        """Same as :meth:`Database.iterkeys()`, over all the shards."""
+        return self._merged("keys", start_key, order, batch, end_key, end_inclusive, prefix,
+                            limit, key_decoder, value_decoder, snapshot)
+
+    def itervalues(self, start_key=None, order=SPGTE, batch=1, end_key=None, end_inclusive=True,
+                   prefix=None, limit=-1, key_decoder=None, value_decoder=None, snapshot=False):
+        return self._merged("values", start_key, order, batch, end_key, end_inclusive, prefix,
+                            limit, key_decoder, value_decoder, snapshot)
+
+    def iteritems(self, start_key=None, order=SPGTE, batch=1, end_key=None, end_inclusive=True,
+                  prefix=None, limit=-1, key_decoder=None, value_decoder=None, snapshot=False):
+        return self._merged("items", start_key, order, batch, end_key, end_inclusive, prefix,
+                            limit, key_decoder, value_decoder, snapshot)
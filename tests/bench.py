@@ -1,111 +1,403 @@
-import sophia, shutil, sys, tempfile
-import timeit, random, threading
+"""YCSB-style benchmark of the binding.
 
-if sys.version_info.major < 3:
-    def get_rand_k():
-        return str(random.randint(0, 10000000))
+The records are loaded first, then each workload runs, in the order of the
+YCSB documentation (D and E insert records, so they come last), once per
+number of threads: a warmup, followed by repeated measured runs. The
+throughput and the latency percentiles of each operation are printed, and
+optionally written as JSON, which can be compared against a previous run to
+detect regressions:
+
+    python tests/bench.py --records 100000 --output new.json --baseline old.json
+
+Workloads:
+
+* A - 50% reads, 50% updates
+* B - 95% reads, 5% updates
+* C - 100% reads
+* D - 95% reads of the latest records, 5% inserts
+* E - 95% short scans, 5% inserts
+* F - 50% reads, 50% read-modify-writes
+* G - 100% updates, committed together by the concurrent writers (the
+  database being reopened with PSPGROUPCOMMIT, see --group-commit)
+"""
+
+import sophia, shutil, sys, os, tempfile, json
+import time, random, threading, itertools, argparse
+
+if hasattr(time, "perf_counter"):
+    clock = time.perf_counter
 else:
-    def get_rand_k():
-        return str(random.randint(0, 10000000)).encode()
+    clock = time.time
+
+WORKLOADS = {
+    "A": {"read": 0.5, "update": 0.5},
+    "B": {"read": 0.95, "update": 0.05},
+    "C": {"read": 1.0},
+    "D": {"read": 0.95, "insert": 0.05},
+    "E": {"scan": 0.95, "insert": 0.05},
+    "F": {"read": 0.5, "rmw": 0.5},
+    "G": {"update": 1.0},
+}
+
+# reads of workload D are biased towards the records inserted last
+LATEST = "D"
+
+# workloads run with group commit
+GROUP_COMMIT = "G"
+
+def fnv64(n):
+    h = 0xcbf29ce484222325
+    for i in range(8):
+        h = ((h ^ (n & 0xff)) * 0x100000001b3) & 0xffffffffffffffff
+        n >>= 8
+    return h
+
+def zeta(n, theta):
+    """Sum of 1 / i^theta for i in [1, n], approximated past a million."""
+    m = min(n, 1000000)
+    z = sum(1.0 / (i + 1) ** theta for i in range(m))
+    if n > m:
+        z += (n ** (1 - theta) - m ** (1 - theta)) / (1 - theta)
+    return z
+
+class Zipfian(object):
+    """Items in [0, n), the first ones being the most popular (see the paper
+    "Quickly generating billion-record synthetic databases", Gray et al.)."""
+
+    def __init__(self, n, theta=0.99):
+        self.n = n
+        self.theta = theta
+        self.zetan = zeta(n, theta)
+        self.alpha = 1.0 / (1 - theta)
+        self.eta = (1 - (2.0 / n) ** (1 - theta)) / (1 - zeta(2, theta) / self.zetan)
+
+    def next(self, rng):
+        u = rng.random()
+        uz = u * self.zetan
+        if uz < 1:
+            return 0
+        if uz < 1 + 0.5 ** self.theta:
+            return 1
+        return min(self.n - 1, int(self.n * (self.eta * u - self.eta + 1) ** self.alpha))
+
+class Sizes(object):
+    """Distribution of sizes, given as "constant:N" or "uniform:MIN-MAX"."""
+
+    def __init__(self, spec):
+        kind, _, arg = spec.partition(":")
+        if kind == "constant":
+            self.lo = self.hi = int(arg)
+        elif kind == "uniform":
+            lo, _, hi = arg.partition("-")
+            self.lo, self.hi = int(lo), int(hi)
+        else:
+            raise ValueError("unknown size distribution: %r" % spec)
+        if not 0 < self.lo <= self.hi:
+            raise ValueError("invalid sizes: %r" % spec)
+
+    def mean(self):
+        return (self.lo + self.hi) / 2.0
+
+    def of(self, n):
+        """Deterministic size of the n-th item."""
+        if self.lo == self.hi:
+            return self.lo
+        return self.lo + fnv64(n) % (self.hi - self.lo + 1)
+
+    def draw(self, rng):
+        return rng.randint(self.lo, self.hi)
+
+class Dataset(object):
+
+    def __init__(self, args):
+        self.key_sizes = Sizes(args.key_size)
+        self.value_sizes = Sizes(args.value_size)
+        self.distribution = args.distribution
+        self.scan_length = args.scan_length
+        self.pool = os.urandom(max(1 << 20, 2 * self.value_sizes.hi))
+        self.inserted = 0
+        self.counter = None
+        self.zipfian = None
+
+    def key(self, n):
+        """Key of the n-th record. Keys are ordered by insertion, and padded
+        to their size, but never shorter than their digits."""
+        key = "user%016d" % n
+        size = self.key_sizes.of(n)
+        if size > len(key):
+            key += "x" * (size - len(key))
+        return key.encode()
 
-def get_rand_p():
-    return get_rand_k(), get_rand_k()
+    def value(self, rng):
+        size = self.value_sizes.draw(rng)
+        start = rng.randint(0, len(self.pool) - size)
+        return self.pool[start:start + size]
 
-class Thread(threading.Thread):
+    def reset(self, records):
+        self.inserted = records
+        self.counter = itertools.count(records)
+        if self.distribution == "zipfian":
+            self.zipfian = Zipfian(records)
 
-    def __init__(self, db, n):
+    def insert_key(self):
+        n = next(self.counter)
+        return n, self.key(n)
+
+    def existing(self, rng, latest=False):
+        """Index of an existing record. Popular items are scattered over the
+        key space, except for the latest distribution."""
+        count = max(self.inserted, 1)
+        if self.zipfian is None:
+            return rng.randrange(count)
+        z = self.zipfian.next(rng)
+        if latest:
+            return max(count - 1 - z, 0)
+        return fnv64(z) % count
+
+def percentile(sorted_values, q):
+    if not sorted_values:
+        return 0.0
+    return sorted_values[min(len(sorted_values) - 1, int(q * len(sorted_values)))]
+
+class Worker(threading.Thread):
+
+    def __init__(self, db, data, workload, n, seed):
         self.db = db
+        self.data = data
+        self.workload = workload
         self.n = n
-        super(Thread, self).__init__()
-    
+        self.rng = random.Random(seed)
+        self.latencies = dict((op, []) for op in WORKLOADS[workload])
+        self.error = None
+        super(Worker, self).__init__()
+
+    def choose(self):
+        u = self.rng.random()
+        for op, p in self.mix:
+            u -= p
+            if u < 0:
+                return op
+        return self.mix[-1][0]
+
     def run(self):
-        for i in range(self.n):
-            self.db.set(*get_rand_p())
+        self.mix = sorted(WORKLOADS[self.workload].items())
+        db, data, rng = self.db, self.data, self.rng
+        latest = self.workload == LATEST
+        try:
+            for i in range(self.n):
+                op = self.choose()
+                if op == "insert":
+                    n, key = data.insert_key()
+                    value = data.value(rng)
+                    start = clock()
+                    db.set(key, value)
+                    elapsed = clock() - start
+                    data.inserted = max(data.inserted, n + 1)
+                else:
+                    key = data.key(data.existing(rng, latest))
+                    start = clock()
+                    if op == "read":
+                        db.get(key)
+                    elif op == "update":
+                        db.set(key, data.value(rng))
+                    elif op == "rmw":
+                        db.get(key)
+                        db.set(key, data.value(rng))
+                    else:
+                        length = rng.randint(1, data.scan_length)
+                        for pair in db.iteritems(start_key=key, limit=length, batch=length):
+                            pass
+                    elapsed = clock() - start
+                self.latencies[op].append(elapsed)
+        except Exception as e:
+            self.error = e
 
-def sophia_write_batch(path, n):
-    db = sophia.Database()
-    db.open(path)
-    db.begin()
-    for i in range(n):
-        db.set(*get_rand_p())
-    db.commit()
-    db.close()
+def run_workload(db, data, workload, threads, n, seed):
+    workers = [Worker(db, data, workload, n // threads, seed + i) for i in range(threads)]
+    start = clock()
+    for w in workers:
+        w.start()
+    for w in workers:
+        w.join()
+    elapsed = clock() - start
+    for w in workers:
+        if w.error is not None:
+            raise w.error
+    latencies = dict((op, []) for op in WORKLOADS[workload])
+    for w in workers:
+        for op, values in w.latencies.items():
+            latencies[op].extend(values)
+    return elapsed, latencies
 
-def sophia_write_single(path, n):
-    db = sophia.Database()
-    db.open(path)
-    for i in range(n):
-        db.set(*get_rand_p())
-    db.close()
+def load(db, data, records, chunk=10000):
+    rng = random.Random(0)
+    start = clock()
+    for first in range(0, records, chunk):
+        db.set_many((data.key(n), data.value(rng))
+                    for n in range(first, min(first + chunk, records)))
+    return clock() - start
 
-def sophia_threaded_write_single(path, n):
-    db = sophia.ThreadedDatabase()
-    db.open(path)
-    t1 = Thread(db, n // 2)
-    t2 = Thread(db, n // 2)
-    t1.start()
-    t2.start()
-    t1.join()
-    t2.join()
-    db.close()
-
-def sophia_threaded_write_batch(path, n):
-    db = sophia.ThreadedDatabase()
-    db.open(path)
-    t1 = Thread(db, n // 2)
-    t2 = Thread(db, n // 2)
-    db.begin()
-    t1.start()
-    t2.start()
-    t1.join()
-    t2.join()
-    db.commit()
-    db.close()
-
-def sophia_search(path, n):
-    db = sophia.Database()
-    db.open(path)
-    for i in range(n):
-        db.get(get_rand_k())
-    db.close()
+def summarize(runs, latencies, ops):
+    throughputs = sorted(ops / elapsed for elapsed in runs)
+    result = {
+        "throughput": throughputs[len(throughputs) // 2],
+        "throughput_min": throughputs[0],
+        "throughput_max": throughputs[-1],
+        "operations": {},
+    }
+    for op, values in sorted(latencies.items()):
+        values.sort()
+        result["operations"][op] = {
+            "count": len(values),
+            "p50_us": percentile(values, 0.5) * 1e6,
+            "p99_us": percentile(values, 0.99) * 1e6,
+            "p999_us": percentile(values, 0.999) * 1e6,
+        }
+    return result
 
-def sophia_iterate(path):
+def open_db(path, group_commit=0):
+    """The database is always threaded, whatever the number of threads, so
+    that the scans of a workload are run the same way by one or many threads,
+    and other threads can write while they are in progress."""
     db = sophia.Database()
+    db.setopt(sophia.PSPTHREADED, True)
+    if group_commit:
+        db.setopt(sophia.PSPGROUPCOMMIT, group_commit)
     db.open(path)
-    for pair in db.iteritems():
-        pass
-    db.close()
-
-template = """\
-Results for %d records:
-* random batch write: %fs
-* random atomic write: %fs
-* random threaded batch write (2 threads): %fs
-* random threaded atomic write (2 threads): %fs
-* random read: %fs
-* iteration over the whole database: %fs"""
+    return db
+
+def records_for_ram(multiple, data):
+    """Number of records whose keys and values are `multiple` times the
+    physical memory."""
+    ram = os.sysconf("SC_PAGE_SIZE") * os.sysconf("SC_PHYS_PAGES")
+    record = data.key_sizes.mean() + data.value_sizes.mean()
+    return int(ram * multiple / record)
+
+def benchmark(args):
+    data = Dataset(args)
+    if args.ram_multiple:
+        sizes = [records_for_ram(args.ram_multiple, data)]
+    else:
+        sizes = [int(n) for n in args.records.split(",")]
+    thread_counts = [int(n) for n in args.threads.split(",")]
+    results = []
+
+    for records in sizes:
+        path = tempfile.mkdtemp(dir=args.path)
+        try:
+            db = open_db(path)
+            data.reset(records)
+            elapsed = load(db, data, records)
+            print("Loaded %d records in %.2fs" % (records, elapsed))
+            grouped = False
+            for workload in args.workloads:
+                if (workload in GROUP_COMMIT) != grouped:
+                    grouped = not grouped
+                    db.close()
+                    db = open_db(path, args.group_commit if grouped else 0)
+                for threads in thread_counts:
+                    warmup = int(args.operations * args.warmup)
+                    if warmup:
+                        run_workload(db, data, workload, threads, warmup, args.seed)
+                    db.stats(reset=True)
+                    runs, latencies = [], dict((op, []) for op in WORKLOADS[workload])
+                    for i in range(args.repeat):
+                        elapsed, lat = run_workload(db, data, workload, threads,
+                                                    args.operations, args.seed + 1000 * (i + 1))
+                        runs.append(elapsed)
+                        for op, values in lat.items():
+                            latencies[op].extend(values)
+                    result = summarize(runs, latencies, args.operations - args.operations % threads)
+                    result.update(records=records, workload=workload, threads=threads,
+                                  stats=db.stats(reset=True))
+                    results.append(result)
+                    report(result)
+            db.close()
+        finally:
+            shutil.rmtree(path)
+    return results
+
+def report(result):
+    print("workload %s, %d records, %d threads: %.0f ops/s (%.0f-%.0f)" % (
+        result["workload"], result["records"], result["threads"],
+        result["throughput"], result["throughput_min"], result["throughput_max"]))
+    for op, lat in sorted(result["operations"].items()):
+        print("  %-6s p50 %9.1fus  p99 %9.1fus  p999 %9.1fus  (%d)" % (
+            op, lat["p50_us"], lat["p99_us"], lat["p999_us"], lat["count"]))
+
+def compare(results, baseline, tolerance):
+    """Return the regressions of the throughput, or of the p99 latencies,
+    beyond `tolerance`, relative to the baseline."""
+    index = dict(((r["records"], r["workload"], r["threads"]), r) for r in baseline["results"])
+    regressions = []
+    for r in results:
+        old = index.get((r["records"], r["workload"], r["threads"]))
+        if old is None:
+            continue
+        name = "%s/%d/%d" % (r["workload"], r["records"], r["threads"])
+        if r["throughput"] < old["throughput"] * (1 - tolerance):
+            regressions.append("%s: throughput %.0f -> %.0f ops/s" % (
+                name, old["throughput"], r["throughput"]))
+        for op, lat in r["operations"].items():
+            before = old["operations"].get(op)
+            if before and lat["p99_us"] > before["p99_us"] * (1 + tolerance):
+                regressions.append("%s: %s p99 %.1f -> %.1fus" % (
+                    name, op, before["p99_us"], lat["p99_us"]))
+    return regressions
 
 def main():
-    if len(sys.argv) < 2 or not sys.argv[1].isdigit():
-        sys.stderr.write("Usage: %s NUMBER_OF_RECORDS\n" % sys.argv[0])
-        sys.exit(1)
-    n = int(sys.argv[1])
-    sp_path = tempfile.mkdtemp()
-    
-    sp_pwrite = timeit.timeit(lambda: sophia_write_batch(sp_path, n), number=1)
-    shutil.rmtree(sp_path)
-    sp_swrite = timeit.timeit(lambda: sophia_write_single(sp_path, n), number=1)
-    shutil.rmtree(sp_path)
-
-    sp_tpwrite = timeit.timeit(lambda: sophia_threaded_write_batch(sp_path, n), number=1)
-    shutil.rmtree(sp_path)
-    sp_tswrite = timeit.timeit(lambda: sophia_threaded_write_single(sp_path, n), number=1)
-    
-    sp_read = timeit.timeit(lambda: sophia_search(sp_path, n), number=1)
-    sp_iterate = timeit.timeit(lambda: sophia_iterate(sp_path), number=1)
-    shutil.rmtree(sp_path)
-    
-    print(template % (n, sp_pwrite, sp_swrite, sp_tpwrite, sp_tswrite, sp_read, sp_iterate))
+    parser = argparse.ArgumentParser(description="YCSB-style benchmark of sophia.")
+    parser.add_argument("--records", default="100000",
+                        help="comma-separated numbers of records to load (default: %(default)s)")
+    parser.add_argument("--ram-multiple", type=float, default=0,
+                        help="load this many times the physical memory instead")
+    parser.add_argument("--operations", type=int, default=100000,
+                        help="operations per run (default: %(default)s)")
+    parser.add_argument("--workloads", default="ABCFDEG",
+                        help="workloads to run, in order (default: %(default)s)")
+    parser.add_argument("--distribution", choices=("zipfian", "uniform"), default="zipfian")
+    parser.add_argument("--key-size", default="constant:20",
+                        help="constant:N or uniform:MIN-MAX (default: %(default)s)")
+    parser.add_argument("--value-size", default="constant:1000",
+                        help="constant:N or uniform:MIN-MAX (default: %(default)s)")
+    parser.add_argument("--scan-length", type=int, default=100,
+                        help="maximum length of the scans (default: %(default)s)")
+    parser.add_argument("--group-commit", type=float, default=0.001,
+                        help="maximum latency of group commit, in seconds (default: %(default)s)")
+    parser.add_argument("--threads", default="1,2,4,8",
+                        help="comma-separated numbers of threads (default: %(default)s)")
+    parser.add_argument("--warmup", type=float, default=0.1,
+                        help="warmup, as a fraction of the operations (default: %(default)s)")
+    parser.add_argument("--repeat", type=int, default=3,
+                        help="measured runs (default: %(default)s)")
+    parser.add_argument("--seed", type=int, default=42)
+    parser.add_argument("--path", default=None,
+                        help="directory of the databases (default: a temporary directory)")
+    parser.add_argument("--output", help="write the results to this JSON file")
+    parser.add_argument("--baseline", help="compare the results against this JSON file")
+    parser.add_argument("--tolerance", type=float, default=0.1,
+                        help="relative regression tolerated (default: %(default)s)")
+    args = parser.parse_args()
+
+    unknown = set(args.workloads) - set(WORKLOADS)
+    if unknown:
+        parser.error("unknown workloads: %s" % ", ".join(sorted(unknown)))
+    if args.repeat < 1 or args.operations < 1:
+        parser.error("expected positive operations and runs")
+    if args.group_commit <= 0:
+        parser.error("expected a positive group commit latency")
+
+    results = benchmark(args)
+    if args.output:
+        with open(args.output, "w") as f:
+            json.dump({"args": vars(args), "results": results}, f, indent=2, sort_keys=True)
+    if args.baseline:
+        with open(args.baseline) as f:
+            regressions = compare(results, json.load(f), args.tolerance)
+        for line in regressions:
+            print("REGRESSION %s" % line)
+        if regressions:
+            sys.exit(1)
 
 if __name__ == "__main__":
     main()
@@ -0,0 +1,234 @@
+/* Native benchmark of libsophia, without the binding.
+ *
+ * It runs the workloads of `tests/overhead.py` directly against libsophia,
+ * with the same keys and values, so that the cost of each operation can be
+ * split between libsophia and the binding. It is built by `setup.py
+ * build_ext`, and prints one JSON object per operation:
+ *
+ *     bench_native PATH RECORDS KEY_SIZE VALUE_SIZE
+ *
+ * For each operation, `ns` is the time per call (per record for the
+ * cursor), `comparisons` the number of comparisons per call, `compare_ns`
+ * the time of a comparison, and `copy_ns` the time the binding spends per
+ * call copying the data it returns into objects of its own.
+ */
+
+#include <sophia.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+static uint64_t comparisons = 0;
+
+static uint64_t
+bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* The default comparison function of the binding, counting its calls */
+static int
+bench_compare(char *a, size_t asz, char *b, size_t bsz, void *arg)
+{
+    int cmp = memcmp(a, b, (asz < bsz ? asz : bsz));
+
+    comparisons++;
+    return (cmp == 0 ?
+        (asz == bsz ? 0 : (asz < bsz ? -1 : 1)) :
+        (cmp < 0 ? -1 : 1)
+    );
+}
+
+/* Same keys as `tests/overhead.py`: the index, zero-padded to the size */
+static void
+bench_key(char *key, size_t ksize, size_t i)
+{
+    char digits[32];
+    size_t n = (size_t)snprintf(digits, sizeof(digits), "%zu", i);
+
+    memset(key, '0', ksize);
+    memcpy(key + (ksize > n ? ksize - n : 0), digits, n < ksize ? n : ksize);
+}
+
+/* The records are written and read in a shuffled order */
+static size_t *
+bench_order(size_t n)
+{
+    size_t i, j, tmp, *order = malloc((n ? n : 1) * sizeof(size_t));
+    uint64_t state = 42;
+
+    if (!order)
+        return NULL;
+    for (i = 0; i < n; i++)
+        order[i] = i;
+    for (i = n; i > 1; i--) {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        j = (size_t)((state >> 33) % i);
+        tmp = order[i - 1];
+        order[i - 1] = order[j];
+        order[j] = tmp;
+    }
+    return order;
+}
+
+static void
+bench_report(const char *op, size_t calls, uint64_t ns, uint64_t cmps,
+             double compare_ns, double copy_ns)
+{
+    printf("{\"op\": \"%s\", \"calls\": %zu, \"ns\": %.1f, \"comparisons\": %.2f, "
+           "\"compare_ns\": %.2f, \"copy_ns\": %.1f}\n",
+           op, calls, calls ? (double)ns / calls : 0.0, calls ? (double)cmps / calls : 0.0,
+           compare_ns, copy_ns);
+}
+
+/* Time of a comparison */
+static double
+bench_compare_ns(size_t ksize)
+{
+    char *a = malloc(ksize), *b = malloc(ksize);
+    size_t i, rounds = 1000000;
+    uint64_t start;
+    volatile int sink = 0;
+    spcmpf cmp = bench_compare;
+
+    if (!a || !b)
+        exit(1);
+    bench_key(a, ksize, 123456);
+    bench_key(b, ksize, 123457);
+    start = bench_now();
+    for (i = 0; i < rounds; i++)
+        sink += cmp(a, ksize, b, ksize, NULL);
+    free(a);
+    free(b);
+    return (double)(bench_now() - start) / rounds;
+}
+
+/* Time of the copy of `size` bytes into a new buffer, as the binding does
+ * to build a bytes object
+ */
+static double
+bench_copy_ns(const char *src, size_t size)
+{
+    size_t i, rounds = 100000;
+    uint64_t start = bench_now();
+
+    for (i = 0; i < rounds; i++) {
+        char *volatile p = malloc(size ? size : 1);
+        if (!p)
+            exit(1);
+        memcpy(p, src, size);
+        free(p);
+    }
+    return (double)(bench_now() - start) / rounds;
+}
+
+int
+main(int argc, char **argv)
+{
+    void *env, *db, *cur;
+    char *key, *value, *missing;
+    void *v;
+    size_t i, n, ksize, vsize, got, fetched = 0, *order;
+    uint64_t start;
+    double compare_ns, value_copy_ns;
+
+    if (argc != 5) {
+        fprintf(stderr, "Usage: %s PATH RECORDS KEY_SIZE VALUE_SIZE\n", argv[0]);
+        return 1;
+    }
+    n = strtoul(argv[2], NULL, 10);
+    ksize = strtoul(argv[3], NULL, 10);
+    vsize = strtoul(argv[4], NULL, 10);
+    if (!ksize || !vsize || !(key = malloc(ksize + 1)) || !(missing = malloc(ksize + 1))
+        || !(value = malloc(vsize)) || !(order = bench_order(n)))
+        return 1;
+    memset(value, 'v', vsize);
+
+    if (!(env = sp_env())
+        || sp_ctl(env, SPDIR, SPO_CREAT | SPO_RDWR, argv[1]) == -1
+        || sp_ctl(env, SPCMP, bench_compare, NULL) == -1
+        || !(db = sp_open(env))) {
+        fprintf(stderr, "%s\n", env ? sp_error(env) : "out of memory");
+        return 1;
+    }
+    compare_ns = bench_compare_ns(ksize);
+    value_copy_ns = bench_copy_ns(value, vsize);
+
+    comparisons = 0;
+    start = bench_now();
+    for (i = 0; i < n; i++) {
+        bench_key(key, ksize, order[i]);
+        if (sp_set(db, key, ksize, value, vsize) == -1)
+            goto error;
+    }
+    bench_report("set", n, bench_now() - start, comparisons, compare_ns, 0);
+
+    comparisons = 0;
+    start = bench_now();
+    for (i = 0; i < n; i++) {
+        bench_key(key, ksize, order[i]);
+        if (sp_get(db, key, ksize, &v, &got) != 1)
+            goto error;
+        free(v);
+    }
+    bench_report("get", n, bench_now() - start, comparisons, compare_ns, value_copy_ns);
+
+    /* the keys of the misses are those of the records, followed by a byte */
+    comparisons = 0;
+    start = bench_now();
+    for (i = 0; i < n; i++) {
+        bench_key(missing, ksize, order[i]);
+        missing[ksize] = 'x';
+        if (sp_get(db, missing, ksize + 1, &v, &got) != 0)
+            goto error;
+    }
+    bench_report("get_missing", n, bench_now() - start, comparisons, compare_ns, 0);
+
+    comparisons = 0;
+    start = bench_now();
+    for (i = 0; i < n; i++) {
+        bench_key(key, ksize, order[i]);
+        if (sp_get(db, key, ksize, NULL, NULL) != 1)
+            goto error;
+    }
+    bench_report("contains", n, bench_now() - start, comparisons, compare_ns, 0);
+
+    comparisons = 0;
+    start = bench_now();
+    if (!(cur = sp_cursor(db, SPGTE, NULL, 0)))
+        goto error;
+    while (sp_fetch(cur)) {
+        if (!sp_key(cur) || !sp_keysize(cur) || !sp_value(cur) || !sp_valuesize(cur))
+            goto error;
+        fetched++;
+    }
+    sp_destroy(cur);
+    bench_report("cursor", fetched, bench_now() - start, comparisons, compare_ns,
+                 bench_copy_ns(key, ksize) + value_copy_ns);
+
+    comparisons = 0;
+    start = bench_now();
+    for (i = 0; i < n; i++) {
+        bench_key(key, ksize, order[i]);
+        if (sp_delete(db, key, ksize) == -1)
+            goto error;
+    }
+    bench_report("delete", n, bench_now() - start, comparisons, compare_ns, 0);
+
+    sp_destroy(db);
+    sp_destroy(env);
+    free(order);
+    free(key);
+    free(missing);
+    free(value);
+    return 0;
+
+error:
+    fprintf(stderr, "%s\n", sp_error(db));
+    return 1;
+}
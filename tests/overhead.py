@@ -0,0 +1,211 @@
+"""Split the cost of each operation between libsophia and the binding.
+
+The same workloads run directly against libsophia, with the native benchmark
+built by `setup.py build_ext` (tests/bench_native.c), and through
+`sophia.Database`. Per call (per record for the cursor), the time is broken
+down into:
+
+* libsophia  - the native time, comparisons excluded
+* comparator - the comparisons made through the binding (counted by
+               `stats()`, with PSPCMPSTATS), at the native cost of a
+               comparison
+* locking    - releasing the GIL, taking the database lock, the checks of
+               the binding around the call to libsophia, and the counting
+               of the comparisons
+* copy       - copying the records read into objects of the binding
+* allocation - allocating (and freeing) the objects returned
+* call       - the rest: calling the method, parsing and encoding its
+               arguments, decoding the result, and iterating for the cursor
+
+The copies and the comparisons are timed by the native benchmark, the
+allocations by building the same objects from Python. The estimate of the
+comparison time of `stats()` is kept in the JSON output, but isn't used: a
+native comparison takes less time than reading the clock. The results can be
+written as JSON, and compared against a baseline.
+"""
+
+import sophia, shutil, sys, os, tempfile, json, subprocess
+import time, argparse
+
+if hasattr(time, "perf_counter"):
+    clock = time.perf_counter
+else:
+    clock = time.time
+
+OPERATIONS = ("set", "get", "get_missing", "contains", "cursor", "delete")
+
+# operations of `Database.stats()` timing the calls of each workload
+STATS = {"get_missing": ("get",), "cursor": ("cursor", "fetch")}
+
+def shuffled(n):
+    """The order of the records in the native benchmark."""
+    order = list(range(n))
+    state = 42
+    for i in range(n, 1, -1):
+        state = (state * 6364136223846793005 + 1442695040888963407) & 0xffffffffffffffff
+        j = (state >> 33) % i
+        order[i - 1], order[j] = order[j], order[i - 1]
+    return order
+
+def native_path():
+    here = os.path.dirname(os.path.abspath(__file__))
+    return os.path.join(here, "bench_native")
+
+def run_native(binary, records, key_size, value_size):
+    path = tempfile.mkdtemp()
+    try:
+        out = subprocess.check_output([binary, path, str(records), str(key_size), str(value_size)])
+    finally:
+        shutil.rmtree(path)
+    results = {}
+    for line in out.decode().splitlines():
+        result = json.loads(line)
+        results[result.pop("op")] = result
+    return results
+
+def timed(fun, items):
+    start = clock()
+    for item in items:
+        fun(item)
+    return clock() - start
+
+def allocation_ns(sizes, rounds=100000):
+    """Time of building, then freeing, bytes objects of the given sizes (and
+    their tuple, if there are several). Slicing a bytes object from its
+    second byte copies it into a new one, while slicing it from the first
+    returns it as is."""
+    sources = [b"x" * (size + 1) for size in sizes]
+    if len(sources) == 1:
+        src = sources[0]
+        build = lambda _: src[1:]
+        empty = lambda _: src[0:]
+    else:
+        k, v = sources
+        build = lambda _: (k[1:], v[1:])
+        empty = lambda _: (k[0:], v[0:])
+    items = [None] * rounds
+    return max(timed(build, items) - timed(empty, items), 0.0) * 1e9 / rounds
+
+def run_binding(records, key_size, value_size):
+    keys = [("%0*d" % (key_size, i)).encode() for i in shuffled(records)]
+    missing = [key + b"x" for key in keys]
+    value = b"v" * value_size
+    path = tempfile.mkdtemp()
+    results = {}
+
+    def phase(op, fun, items, calls=None):
+        db.stats(reset=True)
+        elapsed = timed(fun, items) - timed(lambda item: None, items)
+        stats = db.stats(reset=True)
+        calls = calls or len(items)
+        in_c = sum(stats[name]["total_ns"] for name in STATS.get(op, (op,)))
+        results[op] = {
+            "calls": calls,
+            "ns": elapsed * 1e9 / calls,
+            "in_c_ns": float(in_c) / calls,
+            "comparisons": float(stats["comparisons"]) / calls,
+            "comparison_ns": float(stats["comparison_ns"]) / calls,
+        }
+
+    try:
+        db = sophia.Database()
+        db.setopt(sophia.PSPCMPSTATS, True)
+        db.open(path)
+        phase("set", lambda key: db.set(key, value), keys)
+        phase("get", db.get, keys)
+        phase("get_missing", db.get, missing)
+        phase("contains", db.contains, keys)
+        phase("cursor", lambda _: [None for _ in db.iteritems()], [None], records)
+        phase("delete", db.delete, keys)
+        db.close()
+    finally:
+        shutil.rmtree(path)
+    results["get"]["allocation_ns"] = allocation_ns([value_size])
+    results["cursor"]["allocation_ns"] = allocation_ns([key_size, value_size])
+    return results
+
+def fastest(runs):
+    """Keep the fastest run of each operation."""
+    return dict((op, min((run[op] for run in runs), key=lambda row: row["ns"]))
+                for op in runs[0])
+
+def breakdown(native, binding):
+    rows = {}
+    for op in OPERATIONS:
+        n, b = native[op], binding[op]
+        native_cmp = n["comparisons"] * n["compare_ns"]
+        comparator = b["comparisons"] * n["compare_ns"]
+        copy = n["copy_ns"]
+        allocation = max(b.get("allocation_ns", 0.0) - copy, 0.0)
+        rows[op] = {
+            "total": b["ns"],
+            "libsophia": n["ns"] - native_cmp,
+            "comparator": comparator,
+            "locking": b["in_c_ns"] - (n["ns"] - native_cmp) - comparator,
+            "copy": copy,
+            "allocation": allocation,
+            "call": b["ns"] - b["in_c_ns"] - copy - allocation,
+            "native_comparator": native_cmp,
+            "overhead": b["ns"] - n["ns"],
+        }
+    return rows
+
+COLUMNS = ("total", "libsophia", "comparator", "locking", "copy", "allocation", "call")
+
+def report(rows):
+    print("%-12s" % "ns/call" + "".join("%12s" % c for c in COLUMNS))
+    for op in OPERATIONS:
+        print("%-12s" % op + "".join("%12.1f" % rows[op][c] for c in COLUMNS))
+    print("comparator time of libsophia alone, per call: " + ", ".join(
+        "%s %.1f" % (op, rows[op]["native_comparator"]) for op in OPERATIONS))
+
+def compare(rows, baseline, tolerance):
+    """Return the operations whose overhead, the time of the binding beyond
+    that of libsophia, grew beyond `tolerance`."""
+    regressions = []
+    for op, row in sorted(rows.items()):
+        old = baseline["breakdown"].get(op)
+        if old and row["overhead"] > max(old["overhead"], 0) * (1 + tolerance):
+            regressions.append("%s: overhead %.1f -> %.1fns" % (op, old["overhead"], row["overhead"]))
+    return regressions
+
+def main():
+    parser = argparse.ArgumentParser(description="Overhead of the binding over libsophia.")
+    parser.add_argument("--records", type=int, default=100000)
+    parser.add_argument("--key-size", type=int, default=16)
+    parser.add_argument("--value-size", type=int, default=100)
+    parser.add_argument("--repeat", type=int, default=3,
+                        help="runs, of which the fastest is kept (default: %(default)s)")
+    parser.add_argument("--native", default=native_path(),
+                        help="path of the native benchmark (default: %(default)s)")
+    parser.add_argument("--output", help="write the results to this JSON file")
+    parser.add_argument("--baseline", help="compare the results against this JSON file")
+    parser.add_argument("--tolerance", type=float, default=0.1,
+                        help="relative regression tolerated (default: %(default)s)")
+    args = parser.parse_args()
+    if args.records < 1 or args.key_size < len(str(args.records)) or args.value_size < 1 \
+            or args.repeat < 1:
+        parser.error("expected records, and keys long enough to hold their number")
+    if not os.path.exists(args.native):
+        parser.error("%s not found, build it with `python setup.py build_ext --inplace`" % args.native)
+
+    native = fastest([run_native(args.native, args.records, args.key_size, args.value_size)
+                      for i in range(args.repeat)])
+    binding = fastest([run_binding(args.records, args.key_size, args.value_size)
+                       for i in range(args.repeat)])
+    rows = breakdown(native, binding)
+    report(rows)
+    if args.output:
+        with open(args.output, "w") as f:
+            json.dump({"args": vars(args), "native": native, "binding": binding,
+                       "breakdown": rows}, f, indent=2, sort_keys=True)
+    if args.baseline:
+        with open(args.baseline) as f:
+            regressions = compare(rows, json.load(f), args.tolerance)
+        for line in regressions:
+            print("REGRESSION %s" % line)
+        if regressions:
+            sys.exit(1)
+
+if __name__ == "__main__":
+    main()
@@ -1,4 +1,4 @@
-import sys, sophia, tempfile, shutil
+import os, sys, sophia, tempfile, shutil, threading, struct, zlib, math
 
 if sys.version_info.minor < 3:
     b = lambda s: s
@@ -33,11 +33,988 @@ def test_iter_while_closed(path):
         del cur
         assert db.is_closed()
 
+def test_threaded_access(path):
+    db = sophia.Database()
+    db.setopt(sophia.SPCMP, lambda a, asz, b, bsz: (a > b) - (a < b))
+    db.open(path)
+    def worker(n):
+        for i in range(200):
+            key = b("%d-%d" % (n, i))
+            db.set(key, key)
+            assert db.get(key) == key
+    threads = [threading.Thread(target=worker, args=(n,)) for n in range(4)]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    assert db.len() == 800
+    assert list(db.iterkeys()) == sorted(db.iterkeys())
+    db.close()
+
+def test_get_many(path):
+    db = sophia.Database()
+    db.open(path)
+    db.set(b("a"), b("1"))
+    db.set(b("c"), b("3"))
+    keys = [b("a"), b("b"), b("c")]
+    assert db.get_many(keys) == [b("1"), None, b("3")]
+    assert db.get_many(iter(keys), b("0")) == [b("1"), b("0"), b("3")]
+    assert db.get_many(keys, as_dict=True) == {b("a"): b("1"), b("b"): None, b("c"): b("3")}
+    assert db.get_many([]) == []
+    try:
+        db.get_many([b("a"), 42])
+    except TypeError:
+        pass
+    else:
+        raise Exception
+    db.close()
+
+def test_set_many(path):
+    db = sophia.Database()
+    db.open(path)
+    pairs = [(b("%03d" % i), b(str(i))) for i in range(100)]
+    assert db.set_many(iter(pairs), chunk=7) == 100
+    assert list(db.iteritems()) == pairs
+    assert db.set_many([(b("000"), None), [b("001"), b("x")]], max_bytes=1) == 2
+    assert not db.contains(b("000"))
+    assert db.get(b("001")) == b("x")
+    assert db.update({b("002"): None}) == 1
+    assert db.len() == 98
+    # the records of a chunk are only allocated as they come
+    assert db.set_many(((b("%05d" % i), b("")) for i in range(25000)), chunk=sys.maxsize) == 25000
+    assert db.len() == 25098
+    for bad in ([b("k")], [(b("k"), 1)], 42):
+        try:
+            db.set_many(bad)
+        except (TypeError, ValueError):
+            pass
+        else:
+            raise Exception
+    db.close()
+
+def test_load(path):
+    import random
+    db = sophia.Database()
+    db.open(path)
+    keys = [b("%05d" % i) for i in range(3000)]
+    pairs = [(k, k) for k in keys] + [(keys[0], b("last"))]
+    random.shuffle(pairs)
+    pairs.append((keys[1], b("last")))
+    # a tiny memory budget forces several levels of spilled runs
+    assert db.load(pairs, max_memory=1024, tmpdir=path) == 3002
+    assert list(db.iterkeys()) == keys
+    assert db.get(keys[1]) == b("last")
+    db.close()
+    db.open(tempfile.mkdtemp(dir=path))
+    assert db.load(((k, k) for k in keys), sorted=True) == 3000
+    assert db.len() == 3000
+    try:
+        db.load([(b("b"), b("")), (b("a"), b(""))], sorted=True)
+    except ValueError:
+        pass
+    else:
+        raise Exception
+    db.close()
+    # the merge writes several chunks, and keeps the GIL for a python comparison function
+    many = [(b("%06d" % i), b("")) for i in range(25000)]
+    random.shuffle(many)
+    db.open(tempfile.mkdtemp(dir=path))
+    assert db.load(many, max_memory=1 << 16, tmpdir=path) == 25000
+    assert list(db.iterkeys()) == sorted(k for k, v in many)
+    db.close()
+    db = sophia.Database()
+    db.setopt(sophia.SPCMP, lambda a, asz, b, bsz: (b > a) - (b < a))
+    db.open(tempfile.mkdtemp(dir=path))
+    assert db.load(pairs, max_memory=1024, tmpdir=path) == 3002
+    assert list(db.iterkeys()) == keys[::-1]
+    db.close()
+
+def test_fetch_many(path):
+    db = sophia.Database()
+    db.open(path)
+    pairs = [(b("%03d" % i), b(str(i))) for i in range(100)]
+    db.set_many(pairs)
+    cur = db.iteritems()
+    assert cur.fetchmany(10) == pairs[:10]
+    assert next(cur) == pairs[10]
+    assert cur.fetchmany(1000) == pairs[11:]
+    assert cur.fetchmany(10) == []
+    assert db.close()
+    db.open(path)
+    for batch in (1, 7, 1000):
+        assert list(db.iterkeys(batch=batch)) == [k for k, v in pairs]
+        assert list(db.itervalues(b("050"), sophia.SPLTE, batch)) == [v for k, v in pairs[50::-1]]
+        cur = db.iteritems(batch=batch)
+        assert next(cur) == pairs[0]
+        assert cur.fetchmany(5) == pairs[1:6]
+        assert list(cur) == pairs[6:]
+    db.close()
+
+def test_bounded_iter(path):
+    db = sophia.Database()
+    db.open(path)
+    keys = [b(k) for k in ("th", "thinker", "thinking", "think", "thought", "ti")] + [b"t\xff"]
+    db.set_many((k, b("v")) for k in keys)
+    keys.sort()
+    for batch in (1, 3):
+        assert list(db.iterkeys(prefix=b("think"), batch=batch)) == [b("think"), b("thinker"), b("thinking")]
+        assert list(db.iterkeys(prefix=b("think"), order=sophia.SPGT, batch=batch)) == [b("think"), b("thinker"), b("thinking")]
+        assert list(db.iterkeys(b("think"), sophia.SPGT, prefix=b("think"), batch=batch)) == [b("thinker"), b("thinking")]
+        assert list(db.iterkeys(prefix=b("thi"), order=sophia.SPLTE, batch=batch)) == [b("thinking"), b("thinker"), b("think")]
+        assert list(db.iterkeys(prefix=b"t\xff", order=sophia.SPLT, batch=batch)) == [b"t\xff"]
+        assert list(db.iterkeys(end_key=b("think"), batch=batch)) == keys[:2]
+        assert list(db.iterkeys(end_key=b("think"), end_inclusive=False, batch=batch)) == keys[:1]
+        assert list(db.iterkeys(b("ti"), sophia.SPLTE, end_key=b("thinking"), batch=batch)) == [b("ti"), b("thought"), b("thinking")]
+        assert list(db.itervalues(limit=2, batch=batch)) == [b("v"), b("v")]
+        assert list(db.iteritems(limit=0, batch=batch)) == []
+    # cursors are closed as soon as the range is exhausted
+    cur = db.iterkeys(end_key=b("th"))
+    assert next(cur) == b("th")
+    assert list(cur) == []
+    assert db.close()
+    db.close()
+
+def test_count(path):
+    db = sophia.Database()
+    db.setopt(sophia.PSPCOUNT, True)
+    db.open(path)
+    db.set_many((b("%03d" % i), b("v")) for i in range(100))
+    db.set(b("000"), b("w"))
+    db.delete(b("001"))
+    db.delete(b("missing"))
+    assert db.len() == 99
+    db.begin()
+    db.set(b("100"), b("v"))
+    db.delete(b("100"))
+    db.delete(b("002"))
+    db.set(b("002"), b("v"))
+    db.delete(b("003"))
+    db.rollback()
+    assert db.len() == 99
+    db.begin()
+    db.set(b("100"), b("v"))
+    db.delete(b("002"))
+    db.delete(b("003"))
+    db.commit()
+    assert db.len() == 98
+    assert db.count(b("010"), b("019")) == 10
+    assert db.count(b("010"), b("019"), end_inclusive=False) == 9
+    assert db.count(end_key=b("005")) == 3
+    assert db.count(b("095")) == 6
+    db.close()
+    db.open(path)
+    assert db.len() == 98
+    db.close()
+    # the counter isn't trusted after the database was modified without it
+    db = sophia.Database()
+    db.open(path)
+    db.delete(b("004"))
+    db.close()
+    db = sophia.Database()
+    db.setopt(sophia.PSPCOUNT, True)
+    db.open(path)
+    assert db.len() == db.count() == 97
+    db.close()
+
+def test_get_buffer(path):
+    db = sophia.Database()
+    db.open(path)
+    value = b("x") * 100000
+    db.set(b("key"), value)
+    buf = db.get_buffer(b("key"))
+    assert len(buf) == len(value)
+    view = memoryview(buf)
+    del buf
+    assert view.tobytes() == value
+    assert bytearray(db.get_buffer(b("key"))) == bytearray(value)
+    assert db.get_buffer(b("missing")) is None
+    assert db.get_buffer(b("missing"), 42) == 42
+    db.close()
+
+def test_buffer_args(path):
+    db = sophia.Database()
+    db.open(path)
+    key, value = bytearray(b("key")), bytearray(b("value"))
+    db.set(key, memoryview(value))
+    key[:] = b("kez")
+    db.set(key, bytearray([1, 2]))
+    assert db.get(b("key")) == b("value")
+    assert db.get(memoryview(b("kez"))) == b("\x01\x02")
+    assert db.contains(bytearray(b("key")))
+    assert db.get_many([bytearray(b("key")), b("kez")]) == [b("value"), b("\x01\x02")]
+    # the records of batch operations are copied, so buffers can be reused
+    buf = bytearray(b("k0"))
+    def pairs():
+        for i in range(5):
+            buf[1:] = b(str(i))
+            yield buf, buf
+    assert db.set_many(pairs(), chunk=3) == 5
+    assert db.get(b("k3")) == b("k3")
+    assert list(db.iterkeys(bytearray(b("k1")), end_key=bytearray(b("k2")))) == [b("k1"), b("k2")]
+    assert list(db.iterkeys(prefix=memoryview(b("k")), order=sophia.SPLTE)) == [b("kez"), b("key")] + [b("k%d" % i) for i in range(4, -1, -1)]
+    assert db.count(bytearray(b("k1")), memoryview(b("k3"))) == 3
+    db.delete(bytearray(b("key")))
+    assert not db.contains(b("key"))
+    try:
+        db.set(u"key", b("value"))
+    except TypeError:
+        pass
+    else:
+        assert False
+    db.close()
+
+def test_native_comparators(path):
+    nums = [0, 1, 255, 256, 2**31, 2**32 - 1]
+    for cmp, fmt in ((sophia.CMP_U32_BE, ">I"), (sophia.CMP_U32_LE, "<I"), (sophia.CMP_U64_LE, "<Q")):
+        db = sophia.Database()
+        db.setopt(sophia.SPCMP, cmp)
+        db.open(tempfile.mkdtemp(dir=path))
+        db.set_many((struct.pack(fmt, n), b("")) for n in reversed(nums))
+        assert [struct.unpack(fmt, k)[0] for k in db.iterkeys()] == nums
+        db.close()
+    db = sophia.Database()
+    db.setopt(sophia.SPCMP, sophia.CMP_I64_BE)
+    db.open(tempfile.mkdtemp(dir=path))
+    db.set_many((struct.pack(">q", n), b("")) for n in (5, -1, -2**63, 2**63 - 1, 0))
+    db.set(b("short"), b(""))
+    assert [struct.unpack(">q", k)[0] for k in db.iterkeys(end_key=struct.pack(">q", 2**63 - 1))] == [-2**63, -1, 0, 5, 2**63 - 1]
+    try:
+        db.iterkeys(prefix=b("sh"))
+    except ValueError:
+        pass
+    else:
+        assert False
+    db.close()
+    db = sophia.Database()
+    db.setopt(sophia.SPCMP, sophia.CMP_REVERSE)
+    db.open(tempfile.mkdtemp(dir=path))
+    db.set_many((k, b("")) for k in (b("a"), b("b"), b("ab")))
+    assert list(db.iterkeys()) == [b("b"), b("ab"), b("a")]
+    db.close()
+    db = sophia.Database()
+    db.setopt(sophia.SPCMP, sophia.CMP_LENGTH)
+    db.open(tempfile.mkdtemp(dir=path))
+    db.set_many((k, b("")) for k in (b("bb"), b("a"), b("ab"), b("c")))
+    assert list(db.iterkeys()) == [b("a"), b("c"), b("ab"), b("bb")]
+    db.close()
+    db = sophia.Database()
+    db.setopt(sophia.SPCMP, sophia.CMP_STRUCT, ">h2sI")
+    db.open(tempfile.mkdtemp(dir=path))
+    keys = [struct.pack(">h2sI", *k) for k in ((-1, b("zz"), 1), (1, b("aa"), 2), (1, b("aa"), 10), (1, b("ab"), 0))]
+    keys.append(keys[-1] + b("tail"))
+    assert db.load((k, b("")) for k in reversed(keys)) == len(keys)
+    assert list(db.iterkeys()) == keys
+    db.close()
+    # bad options
+    for args in ((sophia.CMP_STRUCT,), (sophia.CMP_STRUCT, "I"), (sophia.CMP_STRUCT, ">Iz"), (1000,)):
+        try:
+            db.setopt(sophia.SPCMP, *args)
+        except ValueError:
+            pass
+        else:
+            assert False
+    db.setopt(sophia.SPCMP, None)
+
+def test_failing_comparator(path):
+    failure = []
+    def compare(a, asz, b, bsz):
+        if failure:
+            if failure[0] is None:
+                return "garbage"
+            raise failure[0]
+        return (a > b) - (a < b)
+    db = sophia.Database()
+    db.setopt(sophia.SPCMP, compare)
+    db.open(path)
+    db.set_many((b("k%d" % i), b("")) for i in range(10))
+    operations = (lambda: db.get(b("k1")), lambda: db.set(b("k1"), b("")),
+                  lambda: list(db.iterkeys(end_key=b("k5"))), lambda: db.count(b("k2"), b("k4")))
+    for exc, expected in ((ZeroDivisionError, ZeroDivisionError), (None, sophia.Error)):
+        for operation in operations:
+            failure[:] = [exc]
+            try:
+                operation()
+            except expected:
+                pass
+            else:
+                assert False
+            # the exception is only raised once
+            del failure[:]
+            operation()
+    db.close()
+
+def test_tuple_keys(path):
+    from sophia import keys
+    import random
+    tuples = [(), (None,), (b(""),), (b("a"), 1), (b("a\x00"),), (b("a\x00b"),), (u"a",), (u"\xe9t\xe9",),
+              (-2**64 + 1,), (-2**63,), (-256,), (-255,), (-1,), (0,), (1,), (1, None), (1, -1),
+              (1, 0, b("x")), (1, 0, u"x"), (255,), (256,), (2**63,), (2**64 - 1,),
+              (-1e300,), (-0.5,), (0.0,), (0.5,), (float("inf"),), (False,), (True,)]
+    for t in tuples:
+        assert keys.unpack(keys.pack(t)) == t
+    shuffled = list(tuples)
+    random.shuffle(shuffled)
+    assert sorted(shuffled, key=keys.pack) == tuples
+    assert keys.pack([1, u"a"]) == keys.pack((1, u"a"))
+    assert keys.pack((-0.0,)) == keys.pack((0.0,))
+    assert math.copysign(1, keys.unpack(keys.pack((-0.0,)))[0]) == 1
+    for bad in ((2**64,), (object(),)):
+        try:
+            keys.pack(bad)
+        except (TypeError, OverflowError):
+            pass
+        else:
+            assert False
+    db = sophia.Database()
+    db.open(path)
+    db.set_many((keys.pack((tenant, ts, u"n%d" % ts)), b("")) for tenant in (-1, 1, 2) for ts in range(-3, 3))
+    start, end = keys.range((1,))
+    assert [keys.unpack(k)[1] for k in db.iterkeys(start, end_key=end, end_inclusive=False)] == list(range(-3, 3))
+    assert [keys.unpack(k) for k in db.iterkeys(prefix=keys.pack((2, -3)))] == [(2, -3, u"n-3")]
+    db.close()
+
+def test_codecs(path):
+    db = sophia.ObjectDatabase()
+    db.open(tempfile.mkdtemp(dir=path))
+    db.set((1, u"a"), {"x": [1.5]})
+    assert db.get((1, u"a")) == {"x": [1.5]}
+    assert db.get((2,), 42) == 42
+    assert list(db.iterkeys()) == [(1, u"a")]
+    db.close()
+    # the functions can be replaced, until the database is opened
+    db = sophia.ObjectDatabase(key_codec="tuple")
+    db.pack_key = lambda k: k.encode("utf-8")
+    db.unpack_key = lambda k: k.decode("utf-8")
+    db.open(tempfile.mkdtemp(dir=path))
+    db.set(u"\xe9", 1)
+    assert list(db.iteritems()) == [(u"\xe9", 1)]
+    assert list(db.iterkeys(key_decoder="raw")) == [u"\xe9".encode("utf-8")]
+    unpack_key = db.unpack_key
+    try:
+        db.unpack_key = repr
+    except sophia.Error:
+        pass
+    else:
+        assert False
+    assert db.unpack_key is unpack_key
+    db.close()
+    db = sophia.ObjectDatabase(key_codec="tuple", value_codec="msgpack")
+    db.open(tempfile.mkdtemp(dir=path))
+    values = [True, False, 0, -1, -33, 127, 128, 2**40, -2**40, 2**64 - 1, 1.25, u"\xe9t\xe9", b("\x00"),
+              u"x" * 40, b("y") * 300, [1, [2, {u"k": u"v"}]], {u"a": None, 1: b("b")}, list(range(20))]
+    db.set_many(((i, u"v"), v) for i, v in enumerate(values))
+    assert [db.get((i, u"v")) for i in range(len(values))] == values
+    assert list(db.itervalues()) == values  # None values delete records in set_many()
+    db.set((0, u"v"), None)
+    assert db.get((0, u"v"), 42) is None
+    assert next(db.iteritems()) == ((0, u"v"), None)
+    assert db.get_many([(1, u"v"), (100,)], u"?") == [False, u"?"]
+    assert db.count((3,), (5,), end_inclusive=False) == 2
+    assert list(db.iterkeys((17,), sophia.SPLTE, limit=2)) == [(16, u"v"), (15, u"v")]
+    db.set_many([((0, u"v"), None)])
+    assert not db.contains((0, u"v"))
+    db.delete((1, u"v"))
+    assert db.len() == len(values) - 2
+    try:
+        db.set((1,), object())
+    except TypeError:
+        pass
+    else:
+        assert False
+    db.close()
+    db = sophia.ObjectDatabase(key_codec=("struct", ">I"), value_codec=("struct", "<hxd3s?"))
+    db.open(tempfile.mkdtemp(dir=path))
+    db.load([((2,), (-2, 0.5, b("ab"), True)), ((1,), (1, 1.0, b("abcd"), False))])
+    assert list(db.iteritems()) == [((1,), (1, 1.0, b("abc"), False)), ((2,), (-2, 0.5, b("ab\x00"), True))]
+    for bad in ((1, 1.0, b("a")), (2**15, 1.0, b("a"), True)):
+        try:
+            db.set((3,), bad)
+        except (ValueError, OverflowError):
+            pass
+        else:
+            assert False
+    db.close()
+    db = sophia.Database()
+    db.setopt(sophia.PSPVALUECODEC, "msgpack")
+    try:
+        db.setopt(sophia.PSPKEYCODEC, "bogus")
+    except ValueError:
+        pass
+    else:
+        assert False
+    db.open(tempfile.mkdtemp(dir=path))
+    db.set(b("k"), [1, 2])
+    assert db.get(b("k")) == [1, 2]
+    assert bytearray(db.get_buffer(b("k"))) == bytearray([0x92, 1, 2])
+    db.close()
+
+def test_cursor_decoders(path):
+    from sophia import keys
+    db = sophia.Database()
+    db.open(path)
+    db.set_many((keys.pack((i,)), struct.pack(">h", -i)) for i in range(5))
+    assert list(db.iterkeys(key_decoder="tuple")) == [(i,) for i in range(5)]
+    assert list(db.itervalues(value_decoder=("struct", ">h"), limit=2)) == [(0,), (-1,)]
+    assert db.iteritems(keys.pack((3,)), key_decoder=keys.unpack, value_decoder=len).fetchmany(5) \
+        == [((3,), 2), ((4,), 2)]
+    try:
+        db.iterkeys(key_decoder="bogus")
+    except ValueError:
+        pass
+    else:
+        assert False
+    db.close()
+    db = sophia.ObjectDatabase(key_codec="tuple", value_codec="raw")
+    db.open(path)
+    assert list(db.iterkeys((3,), key_decoder="raw")) == [keys.pack((i,)) for i in (3, 4)]
+    assert db.get((1,)) == struct.pack(">h", -1)
+    db.close()
+
+def test_threaded_cursors(path):
+    db = sophia.ThreadedDatabase()
+    db.open(path)
+    keys = [b("%04d" % i) for i in range(1000)]
+    db.set_many((k, k) for k in keys)
+    cursor = db.iterkeys()
+    assert next(cursor) == keys[0]
+    db.set(b("0500x"), b("x"))  # would fail if the cursor held the database
+    db.delete(keys[999])
+    def writer():
+        for k in keys[:100]:
+            db.set(k + b("y"), k)
+    t = threading.Thread(target=writer)
+    t.start()
+    rest = list(cursor)
+    t.join()
+    assert rest[:299] == keys[1:300]
+    assert b("0500x") in rest and keys[999] not in rest
+    assert list(db.itervalues(keys[900], sophia.SPLT, end_key=keys[600])) == keys[600:900][::-1]
+    assert db.iteritems(keys[300], prefix=b("03")).fetchmany(200) == [(k, k) for k in keys[300:400]]
+    db.close()
+
+def test_snapshot_cursors(path):
+    db = sophia.Database()
+    db.setopt(sophia.PSPCOUNT, True)
+    db.open(path)
+    keys = [b("%03d" % i) for i in range(100)]
+    db.set_many((k, k) for k in keys)
+    cursor = db.iteritems(snapshot=True)
+    assert next(cursor) == (keys[0], keys[0])
+    db.set(keys[1], b("new"))
+    db.set(b("050x"), b("x"))
+    db.delete(keys[2])
+    db.set_many([(keys[3], None), (b("zzz"), b("z"))])
+    assert db.get(keys[1]) == b("new") and db.get(keys[2]) is None
+    assert db.get_many([keys[3], b("zzz")]) == [None, b("z")]
+    assert not db.contains(keys[3]) and bytearray(db.get_buffer(b("050x"))) == bytearray(b("x"))
+    assert db.len() == 100
+    try:
+        db.begin()
+    except sophia.Error:
+        pass
+    else:
+        assert False
+    other = db.iterkeys(keys[98], snapshot=True)
+    assert list(cursor) == [(k, k) for k in keys[1:]]
+    assert list(other) == keys[98:]
+    assert db.get(keys[1]) == b("new")
+    assert list(db.iterkeys(keys[49], limit=3)) == [keys[49], keys[50], b("050x")]
+    assert db.len() == 100
+    db.begin()
+    try:
+        db.iterkeys(snapshot=True)
+    except sophia.Error:
+        pass
+    else:
+        assert False
+    db.commit()
+    # the buffered writes can't be applied while another cursor is in use,
+    # and the next write reports it, before applying them
+    cursor, other = db.iterkeys(snapshot=True), db.iterkeys()
+    next(other)
+    db.set(b("buffered"), b("x"))
+    del cursor
+    try:
+        db.set(keys[1], b("y"))
+    except sophia.Error:
+        pass
+    else:
+        assert False
+    del other
+    db.delete(b("buffered"))
+    assert db.get(keys[1]) == b("new") and db.get(b("buffered")) is None and db.len() == 100
+    cursor = db.iterkeys(snapshot=True)
+    db.set(b("last"), b("x"))
+    assert db.close() is False
+    del cursor
+    assert db.is_closed()
+    db.open(path)
+    assert db.get(b("last")) == b("x") and db.len() == 101
+    db.close()
+
+def test_group_commit(path):
+    assert "PSPGROUPCOMMIT" in sophia.__all__
+    db = sophia.Database()
+    db.setopt(sophia.PSPCOUNT, True)
+    db.setopt(sophia.PSPGROUPCOMMIT, 0.005, 16)
+    db.open(path)
+    def worker(n):
+        for i in range(100):
+            key = b("%d-%d" % (n, i))
+            db.set(key, key)
+            if i % 10 == 0:
+                db.delete(key)
+    threads = [threading.Thread(target=worker, args=(n,)) for n in range(8)]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    assert db.len() == 720 and db.count() == 720
+    assert db.get(b("3-7")) == b("3-7") and not db.contains(b("3-10"))
+    # the writes were actually committed together
+    stats = db.stats()
+    assert stats["group_writes"] == 880 and stats["group_commits"] < 880 / 2
+    cursor = db.iterkeys()
+    try:
+        db.set(b("a"), b("1"))
+    except sophia.Error:
+        pass
+    else:
+        assert False
+    del cursor
+    for args in ((-1.0,), (0.01, 0)):
+        try:
+            db.setopt(sophia.PSPGROUPCOMMIT, *args)
+        except ValueError:
+            pass
+        else:
+            assert False
+    db.close()
+
+def test_read_cache(path):
+    db = sophia.Database()
+    db.setopt(sophia.PSPCACHE, 4096)
+    db.open(path)
+    db.set_many((b("%03d" % i), b("v%d" % i)) for i in range(200))
+    value = db.get(b("001"))
+    assert db.get(b("001")) is value
+    assert db.get_many([b("001"), b("002"), b("zzz")]) == [value, b("v2"), None]
+    info = db.cache_info()
+    assert info["hits"] == 2 and info["misses"] == 3 and info["entries"] == 2
+    db.set(b("001"), b("new"))
+    assert db.get(b("001")) == b("new")
+    db.delete(b("002"))
+    assert db.get(b("002")) is None and not db.contains(b("002"))
+    db.set_many([(b("001"), b("newer"))])
+    assert db.get_many([b("001")]) == [b("newer")]
+    db.begin()
+    db.set(b("003"), b("txn"))
+    db.get(b("003"))  # may be cached, whether it sees the transaction or not
+    db.rollback()
+    assert db.get(b("003")) == b("v3")
+    for i in range(200):
+        db.get(b("%03d" % i))
+    info = db.cache_info()
+    assert info["evictions"] > 0 and info["bytes"] <= 4096 and info["entries"] > 0
+    assert [db.get(b("%03d" % i)) for i in range(3, 200)] == [b("v%d" % i) for i in range(3, 200)]
+    db.close()
+    assert db.cache_info()["entries"] == 0
+    db = sophia.ObjectDatabase(key_codec="tuple", value_codec="msgpack")
+    db.setopt(sophia.PSPCACHE, 1 << 20)
+    db.open(path)
+    db.set((1,), [1, 2])
+    first = db.get((1,))
+    first.append(3)
+    assert db.get((1,)) == [1, 2] and db.cache_info()["hits"] == 1
+    db.close()
+    check_bytewise_only(path, sophia.PSPCACHE, 4096)
+
+def check_bytewise_only(path, *option):
+    """Check that an option keyed on the bytes of the keys is refused with
+    comparison functions under which keys of different bytes may be equal."""
+    for args in ((lambda a, asz, b, bsz: (a > b) - (a < b),), (sophia.CMP_STRUCT, ">d")):
+        db = sophia.Database()
+        db.setopt(option[0], *option[1:])
+        db.setopt(sophia.SPCMP, *args)
+        try:
+            db.open(path)
+        except sophia.Error:
+            pass
+        else:
+            assert 0
+    db.setopt(sophia.SPCMP, sophia.CMP_STRUCT, ">I")
+    db.open(os.path.join(path, "struct"))
+    db.close()
+
+def test_bloom_filter(path):
+    db = sophia.Database()
+    db.setopt(sophia.PSPBLOOM, 1000, 0.01)
+    db.open(path)
+    db.set_many((b("%03d" % i), b("v%d" % i)) for i in range(100))
+    db.set(b("new"), b("value"))
+    assert db.get(b("new")) == b("value") and db.contains(b("050"))
+    assert db.get_many([b("001"), b("absent")]) == [b("v1"), None]
+    for i in range(1000):
+        assert db.get(b("x%d" % i)) is None
+    info = db.bloom_info()
+    assert info["bits"] > 0 and info["hashes"] > 0
+    assert info["rejects"] + info["false_positives"] == 1001 and info["false_positive_rate"] < 0.05
+    db.delete(b("new"))
+    assert db.get(b("new")) is None
+    db.close()
+    assert os.path.exists(os.path.join(path, "pysophia.bloom"))
+    db.open(path)
+    assert db.get(b("new")) is None and db.get(b("099")) == b("v99")
+    db.close()
+    os.unlink(os.path.join(path, "pysophia.bloom"))
+    db = sophia.Database()
+    db.setopt(sophia.PSPBLOOM, 1000)
+    db.open(path)
+    assert [db.get(b("%03d" % i)) for i in range(100)] == [b("v%d" % i) for i in range(100)]
+    assert db.get(b("absent")) is None and db.bloom_info()["rejects"] + db.bloom_info()["false_positives"] == 1
+    try:
+        db.setopt(sophia.PSPBLOOM, 10)
+    except sophia.Error:
+        pass
+    else:
+        assert 0
+    db.close()
+    check_bytewise_only(path, sophia.PSPBLOOM, 1000)
+
+def test_stats(path):
+    db = sophia.Database()
+    db.setopt(sophia.PSPCMPSTATS, True)
+    db.open(path)
+    for i in range(100):
+        db.set(b("%03d" % i), b("value"))
+    db.get(b("001"))
+    db.get(b("absent"))
+    db.delete(b("002"))
+    assert db.contains(b("003"))
+    db.begin()
+    db.set(b("x"), b("y"))
+    db.set(b("z"), b("y"))
+    stats = db.stats()
+    assert stats["transaction_size"] == 2
+    db.commit()
+    cur = db.iteritems(batch=10)
+    stats = db.stats()
+    assert stats["cursors"] == 1
+    assert db.close() is False
+    assert sum(1 for _ in cur) == 101
+    del cur
+    db.open(path)
+    stats = db.stats()
+    assert stats["set"]["calls"] == 102 and stats["get"]["calls"] == 2
+    assert stats["delete"]["calls"] == 1 and stats["contains"]["calls"] == 1
+    assert stats["begin"]["calls"] == stats["commit"]["calls"] == 1
+    assert stats["cursor"]["calls"] == 1 and stats["fetch"]["calls"] >= 11
+    assert sum(stats["set"]["histogram"].values()) == 102
+    assert stats["set"]["p50_ns"] <= stats["set"]["p99_ns"] <= stats["set"]["max_ns"]
+    assert stats["bytes_written"] == 100 * 8 + 2 * 2 + 3
+    assert stats["bytes_read"] == 5 + 99 * 8 + 2 * 2
+    assert stats["deferred_closes"] == 1 and stats["cursors"] == 0
+    assert stats["comparisons"] > 0 and stats["transaction_size"] == 0
+    assert "hits" in stats["cache"] and "rejects" in stats["bloom"]
+    stats = db.stats(reset=True)
+    stats = db.stats()
+    assert stats["set"]["calls"] == 0 and stats["bytes_read"] == 0 and stats["comparisons"] == 0
+    db.close()
+    # the comparisons are only counted on demand
+    db = sophia.Database()
+    db.open(path)
+    list(db.iterkeys(b("050")))
+    db.set(b("050"), b(""))
+    assert db.stats()["comparisons"] == 0
+    db.close()
+
+def test_async_database(path):
+    if sys.version_info < (3, 5):
+        return
+    import asyncio
+    loop = asyncio.new_event_loop()
+    run = loop.run_until_complete
+    db = sophia.AsyncDatabase(threads=3, loop=loop)
+    db.setopt(sophia.PSPCACHE, 1 << 20)
+    db.open(path)
+    run(asyncio.gather(*[db.set(b("%03d" % i), b("v%d" % i)) for i in range(100)]))
+    assert run(db.get(b("050"))) == b("v50") and run(db.get(b("050"))) == b("v50")
+    assert run(db.get(b("absent"), b("default"))) == b("default")
+    assert run(db.contains(b("001"))) and not run(db.contains(b("absent")))
+    assert run(db.get_many([b("001"), b("absent"), b("099")])) == [b("v1"), None, b("v99")]
+    assert run(db.get_many([b("002")], as_dict=True)) == {b("002"): b("v2")}
+    run(db.delete(b("050")))
+    assert run(db.get(b("050"))) is None
+    run(db.begin())
+    run(db.set(b("x"), b("y")))
+    run(db.rollback())
+    assert run(db.get(b("x"))) is None
+    cur = db.iteritems(chunk=7, start_key=b("090"))
+    items = []
+    while True:
+        try:
+            items.append(run(cur.__anext__()))
+        except StopAsyncIteration:
+            break
+    assert items == [(b("%03d" % i), b("v%d" % i)) for i in range(90, 100)]
+    cur = db.iterkeys(b("005"), sophia.SPLT, chunk=2)
+    assert run(cur.fetchmany(10)) == [b("004"), b("003"), b("002"), b("001"), b("000")]
+    cur = db.iterkeys()
+    assert run(cur.fetchmany(1000)) == [b("%03d" % i) for i in range(100) if i != 50]
+    assert run(cur.fetchmany(10)) == []
+    assert db.db.stats()["get"]["calls"] == 9
+    # concurrent fetches on a cursor are run one after the other
+    cur = db.iterkeys()
+    chunks = run(asyncio.gather(*[cur.fetchmany(13) for i in range(9)]))
+    assert [key for chunk in chunks for key in chunk] == [b("%03d" % i) for i in range(100) if i != 50]
+    cursor, fetched = db.db.iterkeys(), loop.create_future()
+    assert db.db._submit("fetch", fetched, cursor, 10) is None
+    try:
+        db.db._submit("fetch", loop.create_future(), cursor, 10)
+    except sophia.Error:
+        pass
+    else:
+        assert 0
+    assert len(run(fetched)) == 10
+    del cursor
+    try:
+        run(db.set(1, b("not a key")))
+    except TypeError:
+        pass
+    else:
+        assert 0
+    pending = [db.get(b("%03d" % i)) for i in range(99)]
+    assert db.close()
+    for future in pending:
+        assert future.done()
+        # the requests still waiting for a worker failed
+        assert future.exception() is None or isinstance(future.exception(), sophia.Error)
+    try:
+        run(db.get(b("001")))
+    except sophia.Error:
+        pass
+    else:
+        assert 0
+    db = sophia.AsyncDatabase(sophia.ObjectDatabase(key_codec="tuple", value_codec="msgpack"), loop=loop)
+    db.open(path)
+    run(db.set((1, "a"), {"x": [1, 2]}))
+    assert run(db.get((1, "a"))) == {"x": [1, 2]}
+    db.close()
+    loop.close()
+
+def test_sharded_database(path):
+    db = sophia.ShardedDatabase(shards=3)
+    db.open(path)
+    assert len(set(id(db.shard(b("%03d" % i))) for i in range(100))) == 3
+    assert db.set_many((b("%03d" % i), b("v%d" % i)) for i in range(100)) == 100
+    assert sorted(shard.len() for shard in db.shards)[0] > 0 and db.len() == 100
+    assert db.get(b("007")) == b("v7") and db.contains(b("099")) and db.get(b("absent")) is None
+    assert db.get_many([b("050"), b("absent"), b("001")]) == [b("v50"), None, b("v1")]
+    db.delete(b("050"))
+    db.set(b("100"), b("v100"))
+    expected = [b("%03d" % i) for i in range(101) if i != 50]
+    assert list(db.iterkeys()) == expected
+    assert list(db.iterkeys(order=sophia.SPLTE)) == expected[::-1]
+    assert list(db.itervalues(start_key=b("098"))) == [b("v98"), b("v99"), b("v100")]
+    assert list(db.iteritems(start_key=b("010"), end_key=b("013"), limit=2)) == [(b("010"), b("v10")), (b("011"), b("v11"))]
+    assert db.count(start_key=b("090")) == 11
+    assert list(db.iterkeys(b("098"), sophia.SPGT)) == [b("099"), b("100")]
+    # the threads reading from the shards are reused, and stopped on close
+    threads = threading.active_count()
+    db.get_many([b("001"), b("002"), b("003")])
+    assert db.len() == 100 and threading.active_count() == threads
+    assert db.close()
+    assert threading.active_count() == threads - 2
+    db.open(path)
+    assert list(db.iterkeys()) == expected
+    db.close()
+    # the shards must be opened the way they were created
+    for db in (sophia.ShardedDatabase(shards=2), sophia.ShardedDatabase(split_keys=[b("1"), b("2")])):
+        try:
+            db.open(path)
+        except ValueError:
+            pass
+        else:
+            assert 0
+        assert db.is_closed()
+    # the shards already opened are closed when another one fails to be
+    with open(os.path.join(path, "file"), "w") as f:
+        f.write("not a directory")
+    db = sophia.ShardedDatabase(shards=2)
+    try:
+        db.open([os.path.join(path, "ok"), os.path.join(path, "file")])
+    except (sophia.Error, EnvironmentError):
+        pass
+    else:
+        assert 0
+    assert db.is_closed()
+    db = sophia.ShardedDatabase(split_keys=[(10,), (20,)], factory=lambda: sophia.ObjectDatabase(key_codec="tuple", value_codec="msgpack"))
+    db.open([os.path.join(path, name) for name in ("a", "b", "c")])
+    db.update(((i,), [i]) for i in range(30))
+    assert [shard.len() for shard in db.shards] == [10, 10, 10]
+    assert db.get_many([(5,), (25,)], as_dict=True) == {(5,): [5], (25,): [25]}
+    assert list(db.iterkeys(start_key=(8,), limit=4)) == [(8,), (9,), (10,), (11,)]
+    db.close()
+    try:
+        sophia.ShardedDatabase(split_keys=[b("b"), b("a")]).open(os.path.join(path, "x"))
+    except ValueError:
+        pass
+    else:
+        assert 0
+
+def test_parallel_scan(path):
+    db = sophia.Database()
+    db.open(path)
+    db.set_many((b("k%04d" % i), b("v%d" % i)) for i in range(2000))
+    iterators = db.parallel_scan(parts=4, chunk=7)
+    assert len(iterators) == 4 and min(len(list(it)) for it in db.parallel_scan(parts=4)) > 0
+    assert list(item for it in iterators for item in it) == list(db.iteritems())
+    chunks = {}
+    assert db.parallel_scan(lambda part, items: chunks.setdefault(part, []).extend(items), parts=3, chunk=100) == 2000
+    assert list(item for part in sorted(chunks) for item in chunks[part]) == list(db.iteritems())
+    iterators = db.parallel_scan(boundaries=[b("k0500"), b("k1500")], prefix=b("k1"), contains=b("9"))
+    assert list(len(list(it)) for it in iterators) == [0, 95, 176]
+    stats = db.scan_stats(parts=8, prefix=b("k01"))
+    assert stats["records"] == 100 and stats["key_bytes"] == 500 and stats["value_bytes"] == 400
+    assert db.scan_stats()["records"] == 2000
+    out = os.path.join(path, "export")
+    # files next to the one exported are left alone
+    with open(out + ".1", "wb") as f:
+        f.write(b("keep"))
+    assert db.export(out, parts=5, contains=b("99")) == 38
+    assert sorted(name for name in os.listdir(path) if name.startswith("export")) == ["export", "export.1"]
+    with open(out + ".1", "rb") as f:
+        assert f.read() == b("keep")
+    with open(out, "rb") as f:
+        data = f.read()
+    assert data[:16] == struct.pack("<II", 5, 3) + b("k0099v99")
+    try:
+        db.parallel_scan(boundaries=[b("b"), b("a")])
+    except ValueError:
+        pass
+    else:
+        assert 0
+    # the database is only closed once the scan is over
+    iterators = db.parallel_scan(parts=2)
+    assert not db.close()
+    assert len(list(iterators[1])) > 0 and not db.is_closed()
+    del iterators
+    assert db.is_closed()
+    db = sophia.Database()
+    db.setopt(sophia.SPCMP, lambda a, a_size, b, b_size: (a > b) - (a < b))
+    db.open(path)
+    assert db.scan_stats(parts=3)["records"] == 2000
+    assert list(key for it in db.parallel_scan(parts=3, chunk=50) for key, value in it) == list(db.iterkeys())
+    # the keys are sampled over several chunks, past the first one
+    assert min(len(list(it)) for it in db.parallel_scan(parts=4)) > 200
+    try:
+        db.scan_stats(parts=257)
+    except ValueError:
+        pass
+    else:
+        assert 0
+    db.close()
+
+def test_dump_restore(path):
+    db = sophia.Database()
+    db.open(os.path.join(path, "db"))
+    db.set_many((b("k%05d" % i), b("value %d" % i) * 10) for i in range(5000))
+    dump, packed = os.path.join(path, "dump"), os.path.join(path, "packed")
+    progress = []
+    assert db.dump(dump, block_size=4096, progress=lambda records, size: progress.append(records)) == 5000
+    assert len(progress) > 10 and progress[-1] == 5000
+    assert db.dump(packed, compress=6) == 5000
+    assert os.path.getsize(packed) < os.path.getsize(dump) / 4
+    with open(dump, "rb") as f:
+        assert f.read(16) == b("SOPHDUMP") + struct.pack("<II", 1, 0)
+    for i, source in enumerate((dump, packed)):
+        copy = sophia.Database()
+        copy.open(os.path.join(path, "copy%d" % i))
+        with open(source, "rb") as f:
+            assert copy.restore(f) == 5000
+        assert list(copy.iteritems()) == list(db.iteritems())
+        copy.close()
+    # an interrupted restore is resumed
+    copy = sophia.Database()
+    copy.open(os.path.join(path, "resumed"))
+    def interrupt(records, size):
+        if records > 1000:
+            raise KeyboardInterrupt
+    try:
+        copy.restore(dump, progress=interrupt)
+    except KeyboardInterrupt:
+        pass
+    else:
+        assert 0
+    done = copy.count()
+    assert 1000 < done < 5000
+    assert copy.restore(dump, resume=True) == 5000 - done
+    assert list(copy.iteritems()) == list(db.iteritems())
+    copy.close()
+    # dumps are read from the position of the file, which is left after them
+    concatenated = os.path.join(path, "concatenated")
+    with open(concatenated, "wb") as f:
+        f.write(b("x") * 5000)
+        db.dump(f)
+        db.dump(f, compress=1)
+    copy = sophia.Database()
+    copy.open(os.path.join(path, "concatenated-copy"))
+    with open(concatenated, "rb") as f:
+        f.seek(5000)
+        assert copy.restore(f) == 5000 and copy.restore(f) == 5000
+        assert f.read() == b("")
+    copy.close()
+    if sys.version_info >= (3, 6):
+        import pathlib
+        copy.open(os.path.join(path, "pathlike"))
+        assert copy.restore(pathlib.Path(dump)) == 5000
+        copy.close()
+    with open(dump, "rb") as f:
+        data = f.read()
+    corrupted = data[:100] + bytes(bytearray([ord(data[100:101]) ^ 1])) + data[101:]
+    # a block claiming more records than it can hold
+    block = struct.pack("<Q", 1)
+    oversized = data[:16] + struct.pack("<IIII", 0xffffffff, 8, 8, zlib.crc32(block) & 0xffffffff) + block
+    for bad in (corrupted, oversized, data[:-1], b("not a dump")):
+        with open(dump, "wb") as f:
+            f.write(bad)
+        try:
+            db.restore(dump)
+        except sophia.Error:
+            pass
+        else:
+            assert 0
+    db.close()
+
 if __name__ == "__main__":
     path = tempfile.mkdtemp()
     try:
         test_operation_while_closed(path)
         test_iter_while_closed(path)
+        test_threaded_access(tempfile.mkdtemp(dir=path))
+        test_get_many(tempfile.mkdtemp(dir=path))
+        test_set_many(tempfile.mkdtemp(dir=path))
+        test_load(tempfile.mkdtemp(dir=path))
+        test_fetch_many(tempfile.mkdtemp(dir=path))
+        test_bounded_iter(tempfile.mkdtemp(dir=path))
+        test_count(tempfile.mkdtemp(dir=path))
+        test_get_buffer(tempfile.mkdtemp(dir=path))
+        test_buffer_args(tempfile.mkdtemp(dir=path))
+        test_native_comparators(tempfile.mkdtemp(dir=path))
+        test_failing_comparator(tempfile.mkdtemp(dir=path))
+        test_tuple_keys(tempfile.mkdtemp(dir=path))
+        test_codecs(tempfile.mkdtemp(dir=path))
+        test_cursor_decoders(tempfile.mkdtemp(dir=path))
+        test_threaded_cursors(tempfile.mkdtemp(dir=path))
+        test_snapshot_cursors(tempfile.mkdtemp(dir=path))
+        test_group_commit(tempfile.mkdtemp(dir=path))
+        test_read_cache(tempfile.mkdtemp(dir=path))
+        test_bloom_filter(tempfile.mkdtemp(dir=path))
+        test_stats(tempfile.mkdtemp(dir=path))
+        test_async_database(tempfile.mkdtemp(dir=path))
+        test_sharded_database(tempfile.mkdtemp(dir=path))
+        test_parallel_scan(tempfile.mkdtemp(dir=path))
+        test_dump_restore(tempfile.mkdtemp(dir=path))
     finally:
         try: shutil.rmtree(path)
         except: pass